@@ -96,3 +96,19 @@ FLUIDSYNTHBUILDDIR=build-fluidsynth
 FLUIDSYNTHLIB=$(FLUIDSYNTHBUILDDIR)/src/libfluidsynth.a
 
 INIHHOME=$(realpath external/inih)
+
+# Offline renderer for the host machine
+HOSTBUILDDIR=build-host
+HOST_MT32EMUBUILDDIR=$(HOSTBUILDDIR)/munt
+HOST_MT32EMULIB=$(HOST_MT32EMUBUILDDIR)/libmt32emu.a
+HOST_FLUIDSYNTHBUILDDIR=$(HOSTBUILDDIR)/fluidsynth
+HOST_FLUIDSYNTHLIB=$(HOST_FLUIDSYNTHBUILDDIR)/src/libfluidsynth.a
+HOST_RENDERER=mt32pi-render
+HOST_ALLOCBENCH=mt32pi-allocbench
+HOST_CONVBENCH=mt32pi-convbench
+HOST_DISPATCHBENCH=mt32pi-dispatchbench
+HOST_MERGETEST=mt32pi-mergetest
+HOST_MIDIBENCH=mt32pi-midibench
+HOST_ONSETBENCH=mt32pi-onsetbench
+HOST_RINGBENCH=mt32pi-ringbench
+HOST_SYSEXBENCH=mt32pi-sysexbench
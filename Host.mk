@@ -0,0 +1,195 @@
+#
+# Build offline renderer and benchmarks for the host machine
+#
+
+include Config.mk
+
+HOSTSRCS	:=	src/config.cpp \
+			src/lcd/ui.cpp \
+			src/midimonitor.cpp \
+			src/midiparser.cpp \
+			src/rommanager.cpp \
+			src/smfplayer.cpp \
+			src/soundfontmanager.cpp \
+			src/synth/layeredsynth.cpp \
+			src/synth/mt32snapshot.cpp \
+			src/synth/mt32synth.cpp \
+			src/synth/mt32sysexcache.cpp \
+			src/synth/soundfontloader.cpp \
+			src/synth/soundfontpagecache.cpp \
+			src/synth/soundfontsynth.cpp \
+			src/zoneallocator.cpp \
+			host/src/circle.cpp \
+			host/src/fatfs.cpp \
+			host/src/main.cpp
+
+HOSTOBJS	:=	$(HOSTSRCS:%.cpp=$(HOSTBUILDDIR)/%.o) \
+			$(HOSTBUILDDIR)/ini.o
+
+ALLOCBENCHSRCS	:=	src/zoneallocator.cpp \
+			host/src/circle.cpp \
+			host/src/fatfs.cpp \
+			host/src/allocbench.cpp
+
+ALLOCBENCHOBJS	:=	$(ALLOCBENCHSRCS:%.cpp=$(HOSTBUILDDIR)/%.o)
+
+CONVBENCHSRCS	:=	src/sampleconverter.cpp \
+			host/src/circle.cpp \
+			host/src/fatfs.cpp \
+			host/src/convbench.cpp
+
+CONVBENCHOBJS	:=	$(CONVBENCHSRCS:%.cpp=$(HOSTBUILDDIR)/%.o)
+
+MIDIBENCHSRCS	:=	src/midimerger.cpp \
+			src/midiparser.cpp \
+			src/midirecorder.cpp \
+			host/src/circle.cpp \
+			host/src/fatfs.cpp \
+			host/src/midibench.cpp
+
+MIDIBENCHOBJS	:=	$(MIDIBENCHSRCS:%.cpp=$(HOSTBUILDDIR)/%.o)
+
+DISPATCHBENCHSRCS	:=	src/config.cpp \
+			src/lcd/ui.cpp \
+			src/midimonitor.cpp \
+			src/rommanager.cpp \
+			src/soundfontmanager.cpp \
+			src/synth/mt32snapshot.cpp \
+			src/synth/mt32synth.cpp \
+			src/synth/mt32sysexcache.cpp \
+			src/synth/soundfontloader.cpp \
+			src/synth/soundfontpagecache.cpp \
+			src/synth/soundfontsynth.cpp \
+			src/zoneallocator.cpp \
+			host/src/circle.cpp \
+			host/src/fatfs.cpp \
+			host/src/dispatchbench.cpp
+
+DISPATCHBENCHOBJS	:=	$(DISPATCHBENCHSRCS:%.cpp=$(HOSTBUILDDIR)/%.o) \
+			$(HOSTBUILDDIR)/ini.o
+
+MERGETESTSRCS	:=	src/midimerger.cpp \
+			src/midiparser.cpp \
+			host/src/circle.cpp \
+			host/src/fatfs.cpp \
+			host/src/mergetest.cpp
+
+MERGETESTOBJS	:=	$(MERGETESTSRCS:%.cpp=$(HOSTBUILDDIR)/%.o)
+
+ONSETBENCHSRCS	:=	src/config.cpp \
+			src/lcd/ui.cpp \
+			src/midimonitor.cpp \
+			src/rommanager.cpp \
+			src/soundfontmanager.cpp \
+			src/synth/mt32snapshot.cpp \
+			src/synth/mt32synth.cpp \
+			src/synth/mt32sysexcache.cpp \
+			src/synth/soundfontloader.cpp \
+			src/synth/soundfontpagecache.cpp \
+			src/synth/soundfontsynth.cpp \
+			src/zoneallocator.cpp \
+			host/src/circle.cpp \
+			host/src/fatfs.cpp \
+			host/src/onsetbench.cpp
+
+ONSETBENCHOBJS	:=	$(ONSETBENCHSRCS:%.cpp=$(HOSTBUILDDIR)/%.o) \
+			$(HOSTBUILDDIR)/ini.o
+
+RINGBENCHSRCS	:=	host/src/circle.cpp \
+			host/src/fatfs.cpp \
+			host/src/ringbench.cpp
+
+RINGBENCHOBJS	:=	$(RINGBENCHSRCS:%.cpp=$(HOSTBUILDDIR)/%.o)
+
+SYSEXBENCHSRCS	:=	src/config.cpp \
+			src/lcd/ui.cpp \
+			src/midimonitor.cpp \
+			src/rommanager.cpp \
+			src/synth/mt32snapshot.cpp \
+			src/synth/mt32synth.cpp \
+			src/synth/mt32sysexcache.cpp \
+			host/src/circle.cpp \
+			host/src/fatfs.cpp \
+			host/src/sysexbench.cpp
+
+SYSEXBENCHOBJS	:=	$(SYSEXBENCHSRCS:%.cpp=$(HOSTBUILDDIR)/%.o) \
+			$(HOSTBUILDDIR)/ini.o
+
+HOSTCC		?=	cc
+HOSTCXX		?=	c++
+
+# NDEBUG must not be defined; some assert() calls in the synth code have side effects
+HOSTCPPFLAGS	:=	-D AARCH=64 \
+			-I host/include \
+			-I include \
+			-I . \
+			-I $(INIHHOME) \
+			-I $(HOST_MT32EMUBUILDDIR)/include \
+			-I $(HOST_FLUIDSYNTHBUILDDIR)/include \
+			-I $(FLUIDSYNTHHOME)/include \
+			-MMD -MP
+
+HOSTCFLAGS	:=	-O2 -g -Wall
+HOSTCXXFLAGS	:=	-std=gnu++17 -O2 -g -Wall -Wextra -Wno-unused-parameter
+
+# Paths opened by FluidSynth via fopen() are translated to the host's volumes
+HOSTLDFLAGS	:=	-Wl,--wrap=fopen -pthread
+# The renderer wraps FluidSynth's allocation functions to record them for mt32pi-allocbench
+RENDERERLDFLAGS	:=	-Wl,--wrap=fluid_alloc -Wl,--wrap=fluid_realloc -Wl,--wrap=fluid_free
+
+HOSTLIBS	:=	$(HOST_MT32EMULIB) $(HOST_FLUIDSYNTHLIB) -lm
+
+all: $(HOST_RENDERER) $(HOST_ALLOCBENCH) $(HOST_CONVBENCH) $(HOST_DISPATCHBENCH) $(HOST_MERGETEST) $(HOST_MIDIBENCH) $(HOST_ONSETBENCH) $(HOST_RINGBENCH) $(HOST_SYSEXBENCH)
+
+$(HOST_RENDERER): $(HOSTOBJS)
+	@echo "  LD    $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) $(RENDERERLDFLAGS) -o $@ $^ $(HOSTLIBS)
+
+$(HOST_ALLOCBENCH): $(ALLOCBENCHOBJS)
+	@echo "  LD    $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $^
+
+$(HOST_CONVBENCH): $(CONVBENCHOBJS)
+	@echo "  LD    $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $^
+
+$(HOST_MIDIBENCH): $(MIDIBENCHOBJS)
+	@echo "  LD    $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $^
+
+$(HOST_DISPATCHBENCH): $(DISPATCHBENCHOBJS)
+	@echo "  LD    $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $^ $(HOSTLIBS)
+
+$(HOST_MERGETEST): $(MERGETESTOBJS)
+	@echo "  LD    $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $^
+
+$(HOST_ONSETBENCH): $(ONSETBENCHOBJS)
+	@echo "  LD    $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $^ $(HOSTLIBS)
+
+$(HOST_RINGBENCH): $(RINGBENCHOBJS)
+	@echo "  LD    $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $^
+
+$(HOST_SYSEXBENCH): $(SYSEXBENCHOBJS)
+	@echo "  LD    $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $^ $(HOST_MT32EMULIB) -lm
+
+$(HOSTBUILDDIR)/%.o: %.cpp
+	@echo "  CPP   $<"
+	@mkdir -p $(dir $@)
+	@$(HOSTCXX) $(HOSTCPPFLAGS) $(HOSTCXXFLAGS) -c -o $@ $<
+
+$(HOSTBUILDDIR)/ini.o: $(INIHHOME)/ini.c
+	@echo "  CC    $<"
+	@mkdir -p $(dir $@)
+	@$(HOSTCC) $(HOSTCPPFLAGS) $(HOSTCFLAGS) -c -o $@ $<
+
+clean:
+	@$(RM) -r $(HOSTBUILDDIR)/src $(HOSTBUILDDIR)/host $(HOSTBUILDDIR)/ini.o $(HOSTBUILDDIR)/ini.d $(HOST_RENDERER) $(HOST_ALLOCBENCH) $(HOST_CONVBENCH) $(HOST_DISPATCHBENCH) $(HOST_MERGETEST) $(HOST_MIDIBENCH) $(HOST_ONSETBENCH) $(HOST_RINGBENCH) $(HOST_SYSEXBENCH)
+
+.PHONY: all clean
+
+-include $(HOSTOBJS:.o=.d) $(ALLOCBENCHOBJS:.o=.d) $(CONVBENCHOBJS:.o=.d) $(DISPATCHBENCHOBJS:.o=.d) $(MERGETESTOBJS:.o=.d) $(MIDIBENCHOBJS:.o=.d) $(ONSETBENCHOBJS:.o=.d) $(RINGBENCHOBJS:.o=.d) $(SYSEXBENCHOBJS:.o=.d)
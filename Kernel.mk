@@ -18,8 +18,11 @@ OBJS		:=	src/config.o \
 			src/lcd/drivers/ssd1306.o \
 			src/lcd/ui.o \
 			src/main.o \
+			src/midicoalescer.o \
+			src/midimerger.o \
 			src/midimonitor.o \
 			src/midiparser.o \
+			src/midirecorder.o \
 			src/mt32pi.o \
 			src/net/applemidi.o \
 			src/net/ftpdaemon.o \
@@ -27,9 +30,17 @@ OBJS		:=	src/config.o \
 			src/net/udpmidi.o \
 			src/pisound.o \
 			src/power.o \
+			src/renderprofiler.o \
 			src/rommanager.o \
+			src/sampleconverter.o \
+			src/smfplayer.o \
 			src/soundfontmanager.o \
+			src/synth/layeredsynth.o \
+			src/synth/mt32snapshot.o \
 			src/synth/mt32synth.o \
+			src/synth/mt32sysexcache.o \
+			src/synth/soundfontloader.o \
+			src/synth/soundfontpagecache.o \
 			src/synth/soundfontsynth.o \
 			src/zoneallocator.o
 
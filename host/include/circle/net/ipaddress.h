@@ -0,0 +1,44 @@
+//
+// ipaddress.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host replacement for Circle's <circle/net/ipaddress.h>
+
+#ifndef _circle_net_ipaddress_h
+#define _circle_net_ipaddress_h
+
+#include <circle/types.h>
+
+class CIPAddress
+{
+public:
+	CIPAddress() : m_nAddress(0) {}
+	CIPAddress(u32 nAddress) : m_nAddress(nAddress) {}
+
+	void Set(u32 nAddress) { m_nAddress = nAddress; }
+	void Set(const u8* pAddress) { m_nAddress = pAddress[0] | pAddress[1] << 8 | pAddress[2] << 16 | static_cast<u32>(pAddress[3]) << 24; }
+	u32 Get() const { return m_nAddress; }
+
+private:
+	u32 m_nAddress;
+};
+
+#endif
@@ -0,0 +1,44 @@
+//
+// synchronizationevent.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host replacement for Circle's <circle/sched/synchronizationevent.h>
+
+#ifndef _circle_sched_synchronizationevent_h
+#define _circle_sched_synchronizationevent_h
+
+#include <circle/types.h>
+
+class CSynchronizationEvent
+{
+public:
+	CSynchronizationEvent(boolean bState = FALSE) : m_bState(bState) {}
+
+	boolean GetState() { return __atomic_load_n(&m_bState, __ATOMIC_ACQUIRE); }
+	void Clear() { __atomic_store_n(&m_bState, FALSE, __ATOMIC_RELEASE); }
+	void Set() { __atomic_store_n(&m_bState, TRUE, __ATOMIC_RELEASE); }
+	void Wait();
+
+private:
+	boolean m_bState;
+};
+
+#endif
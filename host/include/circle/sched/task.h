@@ -0,0 +1,49 @@
+//
+// task.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host replacement for Circle's <circle/sched/task.h>
+// Each task runs on a thread of its own, started by the next CScheduler::Yield() once the task has been fully
+// constructed; tasks must outlive the program, as they do on the Pi
+
+#ifndef _circle_sched_task_h
+#define _circle_sched_task_h
+
+#include <circle/types.h>
+
+#define TASK_STACK_SIZE 0x8000
+
+class CTask
+{
+public:
+	CTask(unsigned nStackSize = TASK_STACK_SIZE, boolean bCreateSuspended = FALSE);
+	virtual ~CTask() {}
+
+	virtual void Run() = 0;
+
+	void Start();
+	void SetName(const char* pName) {}
+
+	// Called by CScheduler::Yield()
+	static void StartPendingTasks();
+};
+
+#endif
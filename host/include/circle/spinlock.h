@@ -0,0 +1,51 @@
+//
+// spinlock.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host replacement for Circle's <circle/spinlock.h>; the execution level is ignored
+
+#ifndef _circle_spinlock_h
+#define _circle_spinlock_h
+
+#include <circle/types.h>
+
+#define TASK_LEVEL 0
+#define IRQ_LEVEL  1
+#define FIQ_LEVEL  2
+
+class CSpinLock
+{
+public:
+	CSpinLock(unsigned nTargetLevel = IRQ_LEVEL) : m_bLocked(false) {}
+
+	void Acquire()
+	{
+		while (__atomic_exchange_n(&m_bLocked, true, __ATOMIC_ACQUIRE))
+			;
+	}
+
+	void Release() { __atomic_store_n(&m_bLocked, false, __ATOMIC_RELEASE); }
+
+private:
+	bool m_bLocked;
+};
+
+#endif
@@ -0,0 +1,58 @@
+//
+// string.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host replacement for Circle's <circle/string.h>
+// Like Circle's, the object only holds a pointer to its buffer, so it may be moved with memcpy() (see Utility::Swap())
+
+#ifndef _circle_string_h
+#define _circle_string_h
+
+#include <stdarg.h>
+
+#include <circle/types.h>
+
+class CString
+{
+public:
+	CString();
+	CString(const char* pString);
+	CString(const CString& String);
+	~CString();
+
+	operator const char*() const { return m_pBuffer ? m_pBuffer : ""; }
+	const char* operator=(const char* pString);
+	const CString& operator=(const CString& String);
+
+	size_t GetLength() const { return m_nLength; }
+
+	void Append(const char* pString);
+	void Format(const char* pFormat, ...);
+	void FormatV(const char* pFormat, va_list Args);
+
+private:
+	void Assign(const char* pString, size_t nLength);
+
+	char* m_pBuffer;
+	size_t m_nLength;
+};
+
+#endif
@@ -0,0 +1,135 @@
+//
+// ff.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host replacement for the FatFs API as used by mt32-pi
+// Drives are mapped onto host directories when mounted; paths without a drive refer to the first drive ("SD:")
+
+#ifndef _fatfs_ff_h
+#define _fatfs_ff_h
+
+#include <stdio.h>
+
+#include <circle/types.h>
+
+typedef unsigned int UINT;
+typedef u8 BYTE;
+typedef u16 WORD;
+typedef u32 DWORD;
+typedef u64 QWORD;
+typedef char TCHAR;
+typedef u64 FSIZE_t;
+
+typedef enum
+{
+	FR_OK = 0,
+	FR_DISK_ERR,
+	FR_INT_ERR,
+	FR_NOT_READY,
+	FR_NO_FILE,
+	FR_NO_PATH,
+	FR_INVALID_NAME,
+	FR_DENIED,
+	FR_EXIST,
+	FR_INVALID_OBJECT,
+	FR_WRITE_PROTECTED,
+	FR_INVALID_DRIVE,
+	FR_NOT_ENABLED,
+	FR_NO_FILESYSTEM,
+	FR_MKFS_ABORTED,
+	FR_TIMEOUT,
+	FR_LOCKED,
+	FR_NOT_ENOUGH_CORE,
+	FR_TOO_MANY_OPEN_FILES,
+	FR_INVALID_PARAMETER,
+} FRESULT;
+
+#define FF_LFN_BUF	255
+#define FF_SFN_BUF	12
+#define FF_MAX_PATH	1024
+
+// Filesystem object; pHostPath is the directory that the drive is mapped onto
+struct FATFS
+{
+	const char* pHostPath;
+};
+
+struct FIL
+{
+	FILE* pFile;
+	FSIZE_t fptr;
+	FSIZE_t objsize;
+};
+
+struct DIR
+{
+	void* pHandle;
+	char HostPath[FF_MAX_PATH];
+	char Pattern[FF_LFN_BUF + 1];
+};
+
+struct FILINFO
+{
+	FSIZE_t fsize;
+	WORD fdate;
+	WORD ftime;
+	BYTE fattrib;
+	TCHAR altname[FF_SFN_BUF + 1];
+	TCHAR fname[FF_LFN_BUF + 1];
+};
+
+// File access mode and open method flags
+#define FA_READ			0x01
+#define FA_WRITE		0x02
+#define FA_OPEN_EXISTING	0x00
+#define FA_CREATE_NEW		0x04
+#define FA_CREATE_ALWAYS	0x08
+#define FA_OPEN_ALWAYS		0x10
+#define FA_OPEN_APPEND		0x30
+
+// File attribute bits
+#define AM_RDO	0x01
+#define AM_HID	0x02
+#define AM_SYS	0x04
+#define AM_DIR	0x10
+#define AM_ARC	0x20
+
+FRESULT f_mount(FATFS* pFileSystem, const TCHAR* pPath, BYTE nOptions);
+FRESULT f_open(FIL* pFile, const TCHAR* pPath, BYTE nMode);
+FRESULT f_close(FIL* pFile);
+FRESULT f_read(FIL* pFile, void* pBuffer, UINT nBytesToRead, UINT* pBytesRead);
+FRESULT f_write(FIL* pFile, const void* pBuffer, UINT nBytesToWrite, UINT* pBytesWritten);
+FRESULT f_lseek(FIL* pFile, FSIZE_t nOffset);
+FRESULT f_stat(const TCHAR* pPath, FILINFO* pFileInfo);
+FRESULT f_mkdir(const TCHAR* pPath);
+FRESULT f_findfirst(DIR* pDir, FILINFO* pFileInfo, const TCHAR* pPath, const TCHAR* pPattern);
+FRESULT f_findnext(DIR* pDir, FILINFO* pFileInfo);
+FRESULT f_closedir(DIR* pDir);
+
+#define f_unmount(path)	f_mount(0, path, 0)
+#define f_size(fp)	((fp)->objsize)
+#define f_tell(fp)	((fp)->fptr)
+#define f_eof(fp)	((fp)->fptr == (fp)->objsize)
+
+// Translates a FatFs path into a host path; returns false if the drive isn't mounted
+bool HostTranslatePath(const TCHAR* pPath, char* pOutHostPath, size_t nOutSize);
+
+#endif
@@ -0,0 +1,499 @@
+//
+// allocbench.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Trace replay benchmark for the zone allocator.
+// Replays a trace of FluidSynth's allocations, as recorded by mt32pi-render --alloc-trace, with and without the small
+// allocation arena in front of the zone allocator, and reports the operations per second and the fragmentation of the
+// heap at the point where the most memory is in use and at the end of the trace. Without a trace, a synthetic one is
+// generated that mimics repeatedly loading and unloading SoundFonts. Every allocation is tagged with its id, so that
+// overlapping blocks and reallocations that lose their contents are also caught.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <circle/logger.h>
+#include <circle/memory.h>
+
+#include "utility.h"
+#include "zoneallocator.h"
+
+LOGMODULE("allocbench");
+
+namespace
+{
+	constexpr size_t DefaultHeapMegabytes = 1024;
+	constexpr unsigned int DefaultArenaKilobytes = CZoneAllocator::DefaultSlabArenaSize / KILOBYTE;
+	constexpr unsigned int DefaultLoads = 8;
+	constexpr unsigned int DefaultRuns = 5;
+
+	struct TOptions
+	{
+		const char* pTracePath       = nullptr;
+		size_t nHeapMegabytes        = DefaultHeapMegabytes;
+		unsigned int nArenaKilobytes = DefaultArenaKilobytes;
+		unsigned int nLoads          = DefaultLoads;
+		unsigned int nRuns           = DefaultRuns;
+		bool bVerbose                = false;
+	};
+
+	enum class TOperationType : u8
+	{
+		Alloc,
+		Realloc,
+		Free
+	};
+
+	struct TOperation
+	{
+		TOperationType Type;
+		u32 nID;
+		u32 nSize;
+	};
+
+	struct TTrace
+	{
+		std::vector<TOperation> Operations;
+		u32 nIDCount = 0;
+
+		// Index of the operation after which the most requested bytes are live
+		size_t nPeakIndex = 0;
+		size_t nPeakBytes = 0;
+	};
+
+	struct TResult
+	{
+		u64 nNanos = UINT64_MAX;
+		size_t nFailures = 0;
+		size_t nErrors = 0;
+		CZoneAllocator::TStats PeakStats;
+		CZoneAllocator::TStats EndStats;
+	};
+
+	void PrintUsage(const char* pProgramName)
+	{
+		fprintf(stderr,
+			"Usage: %s [options] [trace]\n"
+			"\n"
+			"Replays an allocation trace recorded by mt32pi-render --alloc-trace through the\n"
+			"zone allocator, with and without the small allocation arena, and reports the\n"
+			"speed and heap fragmentation. Without a trace, a synthetic one is generated.\n"
+			"\n"
+			"  -a, --arena <kilobytes>  Small allocation arena size (default: %d)\n"
+			"  -m, --heap <megabytes>   Memory available to the allocator (default: %d)\n"
+			"  -l, --loads <n>          SoundFont loads in the synthetic trace (default: %d)\n"
+			"  -r, --runs <n>           Replays of each configuration; the fastest is reported (default: %d)\n"
+			"  -v, --verbose            Show debug messages\n",
+			pProgramName, DefaultArenaKilobytes, static_cast<int>(DefaultHeapMegabytes), DefaultLoads, DefaultRuns);
+	}
+
+	bool ParseArguments(int argc, char** argv, TOptions& Options)
+	{
+		static const option LongOptions[] = {
+			{"arena",   required_argument, nullptr, 'a'},
+			{"heap",    required_argument, nullptr, 'm'},
+			{"loads",   required_argument, nullptr, 'l'},
+			{"runs",    required_argument, nullptr, 'r'},
+			{"verbose", no_argument,       nullptr, 'v'},
+			{nullptr,   0,                 nullptr, 0},
+		};
+
+		int nOption;
+		while ((nOption = getopt_long(argc, argv, "a:m:l:r:v", LongOptions, nullptr)) != -1)
+		{
+			switch (nOption)
+			{
+				case 'a': Options.nArenaKilobytes = atoi(optarg); break;
+				case 'm': Options.nHeapMegabytes  = atoi(optarg); break;
+				case 'l': Options.nLoads          = atoi(optarg); break;
+				case 'r': Options.nRuns           = atoi(optarg); break;
+				case 'v': Options.bVerbose        = true; break;
+				default:  return false;
+			}
+		}
+
+		if (optind < argc)
+			Options.pTracePath = argv[optind++];
+
+		return optind == argc && Options.nArenaKilobytes > 0 && Options.nRuns > 0;
+	}
+
+	u64 GetThreadCPUNanos()
+	{
+		timespec Time;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &Time);
+		return static_cast<u64>(Time.tv_sec) * 1000000000 + Time.tv_nsec;
+	}
+
+	bool LoadTrace(const char* pPath, TTrace& Trace)
+	{
+		FILE* pFile = fopen(pPath, "r");
+		if (!pFile)
+		{
+			LOGERR("Couldn't open '%s'", pPath);
+			return false;
+		}
+
+		char Line[64];
+		size_t nLine = 0;
+		bool bResult = true;
+
+		while (fgets(Line, sizeof(Line), pFile))
+		{
+			++nLine;
+
+			char Type = 0;
+			unsigned int nID = 0;
+			unsigned long nSize = 0;
+			const int nFields = sscanf(Line, "%c %u %lu", &Type, &nID, &nSize);
+
+			TOperation Operation = {TOperationType::Alloc, nID, static_cast<u32>(nSize)};
+			if (Type == 'a' && nFields == 3)
+				Operation.Type = TOperationType::Alloc;
+			else if (Type == 'r' && nFields == 3)
+				Operation.Type = TOperationType::Realloc;
+			else if (Type == 'f' && nFields == 2)
+				Operation.Type = TOperationType::Free;
+			else
+			{
+				LOGERR("%s:%zu: invalid operation", pPath, nLine);
+				bResult = false;
+				break;
+			}
+
+			Trace.Operations.push_back(Operation);
+			Trace.nIDCount = Utility::Max(Trace.nIDCount, nID + 1);
+		}
+
+		fclose(pFile);
+		return bResult;
+	}
+
+	// Mimics FluidSynth loading a SoundFont: small preset, zone, generator/modulator and sample header structures, lists
+	// that grow by reallocation, short-lived parsing buffers and large sample data blocks. While it's loaded, voices come
+	// and go, and a few allocations outlive each SoundFont, as the synth's own state would.
+	void GenerateTrace(unsigned int nLoads, TTrace& Trace)
+	{
+		u32 nRandom = 0x12345678;
+		auto Random = [&](u32 nMin, u32 nMax)
+		{
+			nRandom = nRandom * 1664525 + 1013904223;
+			return nMin + (nRandom >> 8) % (nMax - nMin + 1);
+		};
+
+		auto Alloc = [&](u32 nSize)
+		{
+			Trace.Operations.push_back({TOperationType::Alloc, Trace.nIDCount, nSize});
+			return Trace.nIDCount++;
+		};
+
+		auto Free = [&](u32 nID)
+		{
+			Trace.Operations.push_back({TOperationType::Free, nID, 0});
+		};
+
+		std::vector<u32> Loaded;
+		std::vector<u32> Temporary;
+
+		for (unsigned int nLoad = 0; nLoad < nLoads; ++nLoad)
+		{
+			Loaded.clear();
+
+			const u32 nPresets = Random(64, 256);
+			const u32 nSamples = Random(100, 1000);
+
+			// Generator/modulator list, grown by doubling as the file is parsed
+			u32 nListID = Alloc(64);
+			u32 nListSize = 64;
+
+			for (u32 nPreset = 0; nPreset < nPresets; ++nPreset)
+			{
+				Loaded.push_back(Alloc(Random(96, 160)));
+
+				const u32 nZones = Random(1, 12);
+				for (u32 nZone = 0; nZone < nZones; ++nZone)
+				{
+					Loaded.push_back(Alloc(Random(80, 128)));
+
+					const u32 nModulators = Random(0, 10);
+					for (u32 i = 0; i < nModulators; ++i)
+						Loaded.push_back(Alloc(Random(32, 48)));
+
+					for (u32 i = 0; i < 3; ++i)
+						Loaded.push_back(Alloc(16));
+
+					if (Random(0, 3) == 0)
+						Temporary.push_back(Alloc(Random(16, 4096)));
+
+					if (nListSize < 256 * KILOBYTE && Random(0, 15) == 0)
+					{
+						nListSize *= 2;
+						Trace.Operations.push_back({TOperationType::Realloc, nListID, nListSize});
+					}
+				}
+
+				while (Temporary.size() > 8)
+				{
+					Free(Temporary.front());
+					Temporary.erase(Temporary.begin());
+				}
+			}
+
+			for (u32 nSample = 0; nSample < nSamples; ++nSample)
+			{
+				Loaded.push_back(Alloc(Random(112, 144)));
+
+				// Mostly short one-shots, some long loops
+				Loaded.push_back(Alloc(Random(0, 7) ? Random(1 * KILOBYTE, 64 * KILOBYTE) : Random(64 * KILOBYTE, 1 * MEGABYTE)));
+			}
+
+			for (u32 nID : Temporary)
+				Free(nID);
+			Temporary.clear();
+
+			Free(nListID);
+
+			// Voices and events while playing
+			std::vector<u32> Voices;
+			for (u32 i = 0; i < 20000; ++i)
+			{
+				if (Voices.size() < 64 && Random(0, 1))
+					Voices.push_back(Alloc(Random(24, 64)));
+				else if (!Voices.empty())
+				{
+					const size_t nIndex = Random(0, Voices.size() - 1);
+					Free(Voices[nIndex]);
+					Voices[nIndex] = Voices.back();
+					Voices.pop_back();
+				}
+			}
+
+			// Some allocations outlive the SoundFont
+			for (u32 nID : Voices)
+			{
+				if (Random(0, 3))
+					Free(nID);
+			}
+
+			// Unload in an order unrelated to the one it was loaded in
+			for (size_t i = Loaded.size(); i > 1; --i)
+				std::swap(Loaded[i - 1], Loaded[Random(0, i - 1)]);
+
+			for (u32 nID : Loaded)
+				Free(nID);
+		}
+	}
+
+	bool CheckTrace(TTrace& Trace)
+	{
+		std::vector<u32> Sizes(Trace.nIDCount, 0);
+		size_t nLiveBytes = 0;
+
+		for (size_t i = 0; i < Trace.Operations.size(); ++i)
+		{
+			const TOperation& Operation = Trace.Operations[i];
+			u32& nSize = Sizes[Operation.nID];
+
+			if (Operation.Type == TOperationType::Alloc ? nSize != 0 : nSize == 0)
+			{
+				LOGERR("Operation %zu uses allocation %u out of order", i, Operation.nID);
+				return false;
+			}
+
+			if (!Operation.nSize && Operation.Type != TOperationType::Free)
+			{
+				LOGERR("Operation %zu has a size of 0", i);
+				return false;
+			}
+
+			nLiveBytes -= nSize;
+			nSize = Operation.nSize;
+			nLiveBytes += nSize;
+
+			if (nLiveBytes > Trace.nPeakBytes)
+			{
+				Trace.nPeakBytes = nLiveBytes;
+				Trace.nPeakIndex = i;
+			}
+		}
+
+		return true;
+	}
+
+	// Blocks are at least 16 bytes, so the tag always fits
+	void Tag(void* pPtr, u32 nID)
+	{
+		memcpy(pPtr, &nID, sizeof(nID));
+	}
+
+	bool CheckTag(const void* pPtr, u32 nID)
+	{
+		u32 nTag;
+		memcpy(&nTag, pPtr, sizeof(nTag));
+		return nTag == nID;
+	}
+
+	bool Replay(const TTrace& Trace, size_t nHeapSize, size_t nArenaSize, TResult& Result)
+	{
+		CMemorySystem Memory(nHeapSize);
+		CZoneAllocator Allocator;
+		if (!Allocator.Initialize(nArenaSize))
+			return false;
+
+		std::vector<void*> Pointers(Trace.nIDCount, nullptr);
+		Result.nFailures = 0;
+		Result.nErrors = 0;
+
+		u64 nNanos = 0;
+		u64 nStartNanos = GetThreadCPUNanos();
+
+		for (size_t i = 0; i < Trace.Operations.size(); ++i)
+		{
+			const TOperation& Operation = Trace.Operations[i];
+			void*& pPtr = Pointers[Operation.nID];
+
+			switch (Operation.Type)
+			{
+				case TOperationType::Alloc:
+					pPtr = Allocator.Alloc(Operation.nSize, TZoneTag::FluidSynth);
+					if (pPtr)
+						Tag(pPtr, Operation.nID);
+					else
+						++Result.nFailures;
+					break;
+
+				case TOperationType::Realloc:
+				{
+					if (!pPtr)
+						break;
+
+					void* const pNewPtr = Allocator.Realloc(pPtr, Operation.nSize, TZoneTag::FluidSynth);
+					if (!pNewPtr)
+					{
+						++Result.nFailures;
+						break;
+					}
+
+					if (!CheckTag(pNewPtr, Operation.nID))
+						++Result.nErrors;
+					pPtr = pNewPtr;
+					break;
+				}
+
+				case TOperationType::Free:
+					if (!pPtr)
+						break;
+
+					if (!CheckTag(pPtr, Operation.nID))
+						++Result.nErrors;
+					Allocator.Free(pPtr);
+					pPtr = nullptr;
+					break;
+			}
+
+			if (i == Trace.nPeakIndex)
+			{
+				nNanos += GetThreadCPUNanos() - nStartNanos;
+				Allocator.GetStats(Result.PeakStats);
+				nStartNanos = GetThreadCPUNanos();
+			}
+		}
+
+		nNanos += GetThreadCPUNanos() - nStartNanos;
+		Allocator.GetStats(Result.EndStats);
+		Result.nNanos = Utility::Min(Result.nNanos, nNanos);
+
+		return true;
+	}
+
+	void PrintResult(const char* pName, const TTrace& Trace, const TResult& Result)
+	{
+		const double nOpsPerSecond = Result.nNanos ? Trace.Operations.size() * 1000000000.0 / Result.nNanos : 0.0;
+
+		printf("%-22s %8.2f M %8zu %8zu %8zu KB %4u%% %8zu KB %4u%%\n", pName, nOpsPerSecond / 1000000, Result.nFailures, Result.nErrors,
+			Result.PeakStats.nLargestFreeBlock / KILOBYTE, Result.PeakStats.nFragmentation,
+			Result.EndStats.nLargestFreeBlock / KILOBYTE, Result.EndStats.nFragmentation);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	TOptions Options;
+	if (!ParseArguments(argc, argv, Options))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	CLogger Logger(Options.bVerbose ? LogDebug : LogWarning);
+
+	TTrace Trace;
+	if (Options.pTracePath)
+	{
+		if (!LoadTrace(Options.pTracePath, Trace))
+			return EXIT_FAILURE;
+	}
+	else
+		GenerateTrace(Options.nLoads, Trace);
+
+	if (!CheckTrace(Trace))
+		return EXIT_FAILURE;
+
+	const size_t nHeapSize = Options.nHeapMegabytes * MEGABYTE;
+	const size_t nArenaSize = static_cast<size_t>(Options.nArenaKilobytes) * KILOBYTE;
+
+	TResult ArenaResult;
+	TResult ZoneResult;
+	for (unsigned int nRun = 0; nRun < Options.nRuns; ++nRun)
+	{
+		if (!Replay(Trace, nHeapSize, nArenaSize, ArenaResult) || !Replay(Trace, nHeapSize, 0, ZoneResult))
+			return EXIT_FAILURE;
+	}
+
+	char ArenaName[32];
+	snprintf(ArenaName, sizeof(ArenaName), "%u KB small arena", Options.nArenaKilobytes);
+
+	printf("Trace:             %s\n", Options.pTracePath ? Options.pTracePath : "synthetic");
+	printf("Operations:        %zu (%u allocations)\n", Trace.Operations.size(), Trace.nIDCount);
+	printf("Peak requested:    %zu KB\n", Trace.nPeakBytes / KILOBYTE);
+	printf("Heap:              %zu MB\n", Options.nHeapMegabytes);
+	printf("\n");
+	printf("%-22s %10s %8s %8s %17s %17s\n", "", "", "", "", "at peak", "at end");
+	printf("%-22s %10s %8s %8s %11s %5s %11s %5s\n", "", "ops/s", "failed", "errors", "largest", "frag", "largest", "frag");
+	PrintResult(ArenaName, Trace, ArenaResult);
+	PrintResult("zone only", Trace, ZoneResult);
+	printf("\n");
+
+	if (ArenaResult.nErrors || ZoneResult.nErrors)
+	{
+		LOGERR("Allocations were overwritten or lost their contents");
+		return EXIT_FAILURE;
+	}
+
+	printf("Times are CPU time; fragmentation is the free space outside the largest free block\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,297 @@
+//
+// circle.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <circle/logger.h>
+#include <circle/machineinfo.h>
+#include <circle/memory.h>
+#include <circle/sched/scheduler.h>
+#include <circle/sched/synchronizationevent.h>
+#include <circle/sched/task.h>
+#include <circle/string.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+
+//
+// CLogger
+//
+CLogger* CLogger::s_pThis = nullptr;
+
+CLogger::CLogger(unsigned nLogLevel)
+	: m_nLogLevel(nLogLevel)
+{
+	s_pThis = this;
+}
+
+CLogger::~CLogger()
+{
+	s_pThis = nullptr;
+}
+
+void CLogger::Write(const char* pSource, TLogSeverity Severity, const char* pMessage, ...)
+{
+	if (Severity > m_nLogLevel)
+		return;
+
+	static const char* const SeverityPrefixes[] = {"!!! ", "*** ", "** ", "", ""};
+
+	va_list Args;
+	va_start(Args, pMessage);
+	fprintf(stderr, "%s%s: ", SeverityPrefixes[Severity], pSource);
+	vfprintf(stderr, pMessage, Args);
+	fputc('\n', stderr);
+	va_end(Args);
+}
+
+//
+// CTimer
+//
+unsigned CTimer::GetClockTicks()
+{
+	return static_cast<unsigned>(GetClockTicks64());
+}
+
+u64 CTimer::GetClockTicks64()
+{
+	timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return static_cast<u64>(Time.tv_sec) * 1000000 + Time.tv_nsec / 1000;
+}
+
+void CTimer::SimpleMsDelay(unsigned nMilliSeconds)
+{
+	SimpleusDelay(nMilliSeconds * 1000);
+}
+
+void CTimer::SimpleusDelay(unsigned nMicroSeconds)
+{
+	const timespec Delay = {static_cast<time_t>(nMicroSeconds / 1000000), static_cast<long>(nMicroSeconds % 1000000) * 1000};
+	nanosleep(&Delay, nullptr);
+}
+
+//
+// CMachineInfo
+//
+CMachineInfo* CMachineInfo::Get()
+{
+	static CMachineInfo MachineInfo;
+	return &MachineInfo;
+}
+
+//
+// CMemorySystem
+//
+CMemorySystem* CMemorySystem::s_pThis = nullptr;
+
+CMemorySystem::CMemorySystem(size_t nHeapSize)
+	: m_nHeapFree(nHeapSize)
+{
+	s_pThis = this;
+}
+
+CMemorySystem::~CMemorySystem()
+{
+	s_pThis = nullptr;
+}
+
+size_t CMemorySystem::GetHeapFreeSpace(int nType) const
+{
+	return nType == HEAP_HIGH ? 0 : m_nHeapFree;
+}
+
+void* CMemorySystem::HeapAllocate(size_t nSize, int nType)
+{
+	if (nType == HEAP_HIGH || nSize > m_nHeapFree)
+		return nullptr;
+
+	// Circle's heap returns 16-byte aligned blocks
+	void* pBlock = aligned_alloc(16, (nSize + 15) & ~static_cast<size_t>(15));
+	if (pBlock)
+		m_nHeapFree -= nSize;
+
+	return pBlock;
+}
+
+void CMemorySystem::HeapFree(void* pBlock)
+{
+	free(pBlock);
+}
+
+//
+// CTask/CScheduler/CSynchronizationEvent
+//
+namespace
+{
+	std::mutex PendingTasksLock;
+	std::vector<CTask*> PendingTasks;
+	thread_local CTask* pCurrentTask = nullptr;
+}
+
+CTask::CTask(unsigned nStackSize, boolean bCreateSuspended)
+{
+	if (!bCreateSuspended)
+		Start();
+}
+
+void CTask::Start()
+{
+	std::lock_guard<std::mutex> Lock(PendingTasksLock);
+	PendingTasks.push_back(this);
+}
+
+void CTask::StartPendingTasks()
+{
+	std::vector<CTask*> Tasks;
+	{
+		std::lock_guard<std::mutex> Lock(PendingTasksLock);
+		Tasks.swap(PendingTasks);
+	}
+
+	for (CTask* pTask : Tasks)
+		std::thread([pTask] {
+			pCurrentTask = pTask;
+			pTask->Run();
+		}).detach();
+}
+
+CScheduler* CScheduler::Get()
+{
+	static CScheduler Scheduler;
+	return &Scheduler;
+}
+
+void CScheduler::Yield()
+{
+	CTask::StartPendingTasks();
+	sched_yield();
+}
+
+void CScheduler::MsSleep(unsigned nMilliSeconds)
+{
+	CTimer::SimpleMsDelay(nMilliSeconds);
+}
+
+CTask* CScheduler::GetCurrentTask()
+{
+	return pCurrentTask;
+}
+
+void CSynchronizationEvent::Wait()
+{
+	// Tasks have threads of their own; don't spin while idle
+	const timespec Interval = {0, 100000};
+	while (!GetState())
+		nanosleep(&Interval, nullptr);
+}
+
+//
+// CString
+//
+CString::CString()
+	: m_pBuffer(nullptr),
+	  m_nLength(0)
+{
+}
+
+CString::CString(const char* pString)
+	: CString()
+{
+	Assign(pString, strlen(pString));
+}
+
+CString::CString(const CString& String)
+	: CString()
+{
+	Assign(String, String.m_nLength);
+}
+
+CString::~CString()
+{
+	free(m_pBuffer);
+}
+
+const char* CString::operator=(const char* pString)
+{
+	Assign(pString, strlen(pString));
+	return *this;
+}
+
+const CString& CString::operator=(const CString& String)
+{
+	if (&String != this)
+		Assign(String, String.m_nLength);
+
+	return *this;
+}
+
+void CString::Append(const char* pString)
+{
+	const size_t nAppendLength = strlen(pString);
+	char* pNewBuffer = static_cast<char*>(malloc(m_nLength + nAppendLength + 1));
+
+	memcpy(pNewBuffer, *this, m_nLength);
+	memcpy(pNewBuffer + m_nLength, pString, nAppendLength + 1);
+
+	free(m_pBuffer);
+	m_pBuffer = pNewBuffer;
+	m_nLength += nAppendLength;
+}
+
+void CString::Format(const char* pFormat, ...)
+{
+	va_list Args;
+	va_start(Args, pFormat);
+	FormatV(pFormat, Args);
+	va_end(Args);
+}
+
+void CString::FormatV(const char* pFormat, va_list Args)
+{
+	char* pNewBuffer = nullptr;
+	const int nLength = vasprintf(&pNewBuffer, pFormat, Args);
+	if (nLength < 0)
+		return;
+
+	free(m_pBuffer);
+	m_pBuffer = pNewBuffer;
+	m_nLength = nLength;
+}
+
+void CString::Assign(const char* pString, size_t nLength)
+{
+	// Copy first, in case pString points into our own buffer
+	char* pNewBuffer = static_cast<char*>(malloc(nLength + 1));
+	memcpy(pNewBuffer, pString, nLength);
+	pNewBuffer[nLength] = '\0';
+
+	free(m_pBuffer);
+	m_pBuffer = pNewBuffer;
+	m_nLength = nLength;
+}
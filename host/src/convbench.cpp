@@ -0,0 +1,316 @@
+//
+// convbench.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Bit-exactness test and benchmark for the audio sample converter.
+// Every output format, channel order and dither combination is run through the vectorized and scalar paths side by
+// side, over a sequence of calls of varying length so that vector tails and the dither state carried between calls are
+// covered, and the outputs are compared byte for byte. The scalar path is also checked against the expected value of
+// each sample. On aarch64 the vectorized path uses NEON; elsewhere it's the scalar code as vectorized by the compiler,
+// so the two paths are the same code and their times differ only by noise. Each path is timed over several interleaved
+// rounds and the best round is reported, to keep noise from showing up as a difference between them.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include <circle/logger.h>
+
+#include "sampleconverter.h"
+#include "utility.h"
+
+LOGMODULE("convbench");
+
+namespace
+{
+	constexpr size_t MaxCallFrames = 1024;
+
+	// Same as the kernel's default chunk size
+	constexpr size_t BenchmarkFrames = 256;
+
+	constexpr unsigned int DefaultCalls = 100000;
+	constexpr unsigned int DefaultIterations = 100000;
+	constexpr unsigned int BenchmarkRounds = 5;
+
+	constexpr float SampleMax = (1 << 23) - 1;
+
+	struct TOptions
+	{
+		unsigned int nCalls      = DefaultCalls;
+		unsigned int nIterations = DefaultIterations;
+		bool bVerbose            = false;
+	};
+
+	struct TCase
+	{
+		CSampleConverter::TFormat Format;
+		bool bReversedStereo;
+		bool bDither;
+	};
+
+	void PrintUsage(const char* pProgramName)
+	{
+		fprintf(stderr,
+			"Usage: %s [options]\n"
+			"\n"
+			"Checks that the vectorized sample converter is bit-exact with the scalar\n"
+			"reference for every output format, and compares their speed.\n"
+			"\n"
+			"  -n, --calls <n>          Conversions compared per case (default: %d)\n"
+			"  -i, --iterations <n>     Conversions of %zu frames timed per round (default: %d)\n"
+			"  -v, --verbose            Show debug messages\n",
+			pProgramName, DefaultCalls, BenchmarkFrames, DefaultIterations);
+	}
+
+	bool ParseArguments(int argc, char** argv, TOptions& Options)
+	{
+		static const option LongOptions[] = {
+			{"calls",      required_argument, nullptr, 'n'},
+			{"iterations", required_argument, nullptr, 'i'},
+			{"verbose",    no_argument,       nullptr, 'v'},
+			{nullptr,      0,                 nullptr, 0},
+		};
+
+		int nOption;
+		while ((nOption = getopt_long(argc, argv, "n:i:v", LongOptions, nullptr)) != -1)
+		{
+			switch (nOption)
+			{
+				case 'n': Options.nCalls      = atoi(optarg); break;
+				case 'i': Options.nIterations = atoi(optarg); break;
+				case 'v': Options.bVerbose    = true; break;
+				default:  return false;
+			}
+		}
+
+		return optind == argc && Options.nCalls > 0 && Options.nIterations > 0;
+	}
+
+	const char* GetCaseName(const TCase& Case)
+	{
+		static char Name[64];
+		snprintf(Name, sizeof(Name), "%s%s%s", Case.Format == CSampleConverter::TFormat::I2S32 ? "I2S 32-bit" : "packed 24-bit", Case.bReversedStereo ? ", reversed" : "", Case.bDither ? ", dither" : "");
+		return Name;
+	}
+
+	u64 GetThreadCPUNanos()
+	{
+		timespec Time;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &Time);
+		return static_cast<u64>(Time.tv_sec) * 1000000000 + Time.tv_nsec;
+	}
+
+	// Mostly audio-like values, with some beyond full scale and exact edge values to exercise saturation and rounding
+	void GenerateSamples(float* pSamples, size_t nSamples, u32& nRandom)
+	{
+		static const float EdgeValues[] = { 0.0f, -0.0f, 1.0f, -1.0f, 1.0f / SampleMax, -1.0f / SampleMax, 0.5f / SampleMax, 1.5f, -1.5f, 1e9f, -1e9f };
+
+		for (size_t i = 0; i < nSamples; ++i)
+		{
+			nRandom = nRandom * 1664525 + 1013904223;
+			const u32 nType = (nRandom >> 24) % 16;
+
+			if (nType == 0)
+				pSamples[i] = EdgeValues[(nRandom >> 8) % Utility::ArraySize(EdgeValues)];
+			else if (nType == 1)
+				pSamples[i] = static_cast<float>(static_cast<s32>(nRandom) >> 8) / (1 << 21);
+			else
+				pSamples[i] = static_cast<float>(static_cast<s32>(nRandom) >> 8) / (1 << 23);
+		}
+	}
+
+	s32 ReadSample(const u8* pBuffer, size_t nIndex, CSampleConverter::TFormat Format)
+	{
+		if (Format == CSampleConverter::TFormat::I2S32)
+		{
+			s32 nSample;
+			memcpy(&nSample, pBuffer + nIndex * sizeof(s32), sizeof(s32));
+			return nSample;
+		}
+
+		const u8* const pSample = pBuffer + nIndex * 3;
+		return static_cast<s32>(static_cast<u32>(pSample[0]) << 8 | static_cast<u32>(pSample[1]) << 16 | static_cast<u32>(pSample[2]) << 24) >> 8;
+	}
+
+	// Returns the number of calls whose output differed between the two paths or from the expected values
+	size_t CheckCase(const TCase& Case, unsigned int nCalls)
+	{
+		CSampleConverter Vector(Case.Format, Case.bReversedStereo, Case.bDither);
+		CSampleConverter Scalar(Case.Format, Case.bReversedStereo, Case.bDither);
+		const size_t nBytesPerSample = Vector.GetBytesPerSample();
+
+		std::vector<float> Input(MaxCallFrames * 2);
+		std::vector<u8> VectorOutput(MaxCallFrames * 2 * nBytesPerSample);
+		std::vector<u8> ScalarOutput(MaxCallFrames * 2 * nBytesPerSample);
+
+		u32 nRandom = 0x12345678;
+		size_t nFailures = 0;
+
+		for (unsigned int nCall = 0; nCall < nCalls; ++nCall)
+		{
+			// Short calls cover every tail length; longer ones the vector loop
+			nRandom = nRandom * 1664525 + 1013904223;
+			const size_t nFrames = nCall % 2 ? (nRandom >> 8) % 20 : (nRandom >> 8) % (MaxCallFrames + 1);
+			const size_t nSamples = nFrames * 2;
+
+			GenerateSamples(Input.data(), nSamples, nRandom);
+
+			// Fill with a pattern so that writes past the end are caught
+			memset(VectorOutput.data(), 0xA5, VectorOutput.size());
+			memset(ScalarOutput.data(), 0xA5, ScalarOutput.size());
+
+			Vector.Convert(Input.data(), VectorOutput.data(), nFrames);
+			Scalar.ConvertScalar(Input.data(), ScalarOutput.data(), nFrames);
+
+			bool bFailed = VectorOutput != ScalarOutput;
+			for (size_t i = nSamples * nBytesPerSample; i < VectorOutput.size(); ++i)
+				bFailed |= VectorOutput[i] != 0xA5;
+
+			// Each sample must be the saturated input, from the other channel if reversed; dither rounds down after adding
+			// less than 1 LSB either way
+			for (size_t i = 0; i < nSamples && !bFailed; ++i)
+			{
+				const float nScaled = Utility::Clamp(Input[Case.bReversedStereo ? i ^ 1 : i], -1.0f, 1.0f) * SampleMax;
+				const s32 nOutput = ReadSample(ScalarOutput.data(), i, Case.Format);
+
+				if (Case.bDither)
+				{
+					const s32 nFloor = static_cast<s32>(floorf(nScaled));
+					bFailed = nOutput < nFloor - 1 || nOutput > nFloor + 1;
+				}
+				else
+					bFailed = nOutput != static_cast<s32>(nScaled);
+			}
+
+			if (bFailed)
+			{
+				if (!nFailures)
+					LOGERR("%s: output mismatch in call %u (%zu frames)", GetCaseName(Case), nCall, nFrames);
+				++nFailures;
+			}
+		}
+
+		return nFailures;
+	}
+
+	// Returns CPU nanoseconds per frame
+	double BenchmarkRound(CSampleConverter& Converter, unsigned int nIterations, bool bScalar)
+	{
+
+		float Input[BenchmarkFrames * 2];
+		u32 Output[BenchmarkFrames * 2];
+		u32 nRandom = 0x12345678;
+		GenerateSamples(Input, BenchmarkFrames * 2, nRandom);
+
+		const u64 nStartNanos = GetThreadCPUNanos();
+
+		for (unsigned int i = 0; i < nIterations; ++i)
+		{
+			if (bScalar)
+				Converter.ConvertScalar(Input, Output, BenchmarkFrames);
+			else
+				Converter.Convert(Input, Output, BenchmarkFrames);
+
+			// Keep the compiler from hoisting the conversion out of the loop
+			asm volatile("" : : "r"(Output) : "memory");
+		}
+
+		return static_cast<double>(GetThreadCPUNanos() - nStartNanos) / nIterations / BenchmarkFrames;
+	}
+
+	// Returns the best CPU nanoseconds per frame of each path
+	void BenchmarkCase(const TCase& Case, unsigned int nIterations, double& nOutVectorNanos, double& nOutScalarNanos)
+	{
+		CSampleConverter Vector(Case.Format, Case.bReversedStereo, Case.bDither);
+		CSampleConverter Scalar(Case.Format, Case.bReversedStereo, Case.bDither);
+
+		for (unsigned int nRound = 0; nRound < BenchmarkRounds; ++nRound)
+		{
+			const double nVectorNanos = BenchmarkRound(Vector, nIterations, false);
+			const double nScalarNanos = BenchmarkRound(Scalar, nIterations, true);
+
+			nOutVectorNanos = nRound ? Utility::Min(nOutVectorNanos, nVectorNanos) : nVectorNanos;
+			nOutScalarNanos = nRound ? Utility::Min(nOutScalarNanos, nScalarNanos) : nScalarNanos;
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	TOptions Options;
+	if (!ParseArguments(argc, argv, Options))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	CLogger Logger(Options.bVerbose ? LogDebug : LogWarning);
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	constexpr bool bVectorPath = true;
+	printf("Vectorized path:   NEON\n");
+#else
+	constexpr bool bVectorPath = false;
+	printf("Vectorized path:   none; scalar code as vectorized by the compiler\n");
+#endif
+	printf("Compared:          %u calls of 0-%zu frames per case\n", Options.nCalls, MaxCallFrames);
+	printf("Timed:             best of %u rounds of %u calls of %zu frames\n", BenchmarkRounds, Options.nIterations, BenchmarkFrames);
+	printf("\n");
+	printf("%-34s %10s %10s %10s %8s\n", "", "mismatches", "vector", "scalar", "speedup");
+
+	size_t nTotalFailures = 0;
+
+	for (int nFormat = 0; nFormat < 2; ++nFormat)
+	{
+		for (int nCase = 0; nCase < 4; ++nCase)
+		{
+			const TCase Case = {nFormat ? CSampleConverter::TFormat::I2S32 : CSampleConverter::TFormat::Packed24, (nCase & 1) != 0, (nCase & 2) != 0};
+
+			const size_t nFailures = CheckCase(Case, Options.nCalls);
+			double nVectorNanos, nScalarNanos;
+			BenchmarkCase(Case, Options.nIterations, nVectorNanos, nScalarNanos);
+
+			// Both columns time the same code without a vectorized path, so a ratio would only show noise
+			printf("%-34s %10zu %7.2f ns %7.2f ns ", GetCaseName(Case), nFailures, nVectorNanos, nScalarNanos);
+			if (bVectorPath)
+				printf("%7.2fx\n", nVectorNanos > 0 ? nScalarNanos / nVectorNanos : 0.0);
+			else
+				printf("%8s\n", "-");
+			nTotalFailures += nFailures;
+		}
+	}
+
+	printf("\n");
+
+	if (nTotalFailures)
+	{
+		LOGERR("Vectorized and scalar output differ");
+		return EXIT_FAILURE;
+	}
+
+	printf("Vectorized and scalar output are identical; times are CPU time per frame\n");
+	return EXIT_SUCCESS;
+}
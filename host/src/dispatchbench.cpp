@@ -0,0 +1,309 @@
+//
+// dispatchbench.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Benchmark for short message dispatch to the synths.
+// A dense stream of drum rolls, controller sweeps and pitch bends is passed to each synth one message at a time and in
+// batches, as the MIDI merger passes them on, and the CPU time spent handing the messages over is compared. A block is
+// rendered between groups of messages so that the synths' queues are drained as they would be by the audio core; the
+// render time isn't counted.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include <circle/logger.h>
+#include <circle/memory.h>
+#include <fatfs/ff.h>
+
+#include "config.h"
+#include "midimerger.h"
+#include "synth/mt32synth.h"
+#include "synth/soundfontsynth.h"
+#include "zoneallocator.h"
+
+LOGMODULE("dispatchbench");
+
+namespace
+{
+	constexpr size_t HeapMegabytes = 1024;
+	constexpr size_t MaxBlockFrames = 4096;
+
+	constexpr unsigned int DefaultMessages = 500000;
+	constexpr unsigned int DefaultBlockMessages = 256;
+	constexpr unsigned int DefaultBatchSize = CMIDIMerger::ShortMessageBatchSize;
+
+	struct TOptions
+	{
+		const char* pSDPath          = "sdcard";
+		const char* pConfigPath      = "mt32-pi.cfg";
+		const char* pSynth           = nullptr;
+		unsigned int nMessages       = DefaultMessages;
+		unsigned int nBlockMessages  = DefaultBlockMessages;
+		unsigned int nBatchSize      = DefaultBatchSize;
+		bool bVerbose                = false;
+	};
+
+	void PrintUsage(const char* pProgramName)
+	{
+		fprintf(stderr,
+			"Usage: %s [options]\n"
+			"\n"
+			"Measures how many MIDI short messages per second each synth accepts when they\n"
+			"are passed on one at a time and in batches.\n"
+			"\n"
+			"  -d, --sd <dir>           Directory standing in for the SD card (default: sdcard)\n"
+			"  -c, --config <path>      Config file, relative to the SD card (default: mt32-pi.cfg)\n"
+			"  -s, --synth <synth>      mt32 or soundfont (default: both)\n"
+			"  -n, --messages <n>       Messages passed to each synth (default: %d)\n"
+			"  -p, --per-block <n>      Messages between rendered blocks (default: %d)\n"
+			"  -B, --batch <n>          Messages per batch (default: %d)\n"
+			"  -v, --verbose            Show debug messages\n",
+			pProgramName, DefaultMessages, DefaultBlockMessages, DefaultBatchSize);
+	}
+
+	bool ParseArguments(int argc, char** argv, TOptions& Options)
+	{
+		static const option LongOptions[] = {
+			{"sd",        required_argument, nullptr, 'd'},
+			{"config",    required_argument, nullptr, 'c'},
+			{"synth",     required_argument, nullptr, 's'},
+			{"messages",  required_argument, nullptr, 'n'},
+			{"per-block", required_argument, nullptr, 'p'},
+			{"batch",     required_argument, nullptr, 'B'},
+			{"verbose",   no_argument,       nullptr, 'v'},
+			{nullptr,     0,                 nullptr, 0},
+		};
+
+		int nOption;
+		while ((nOption = getopt_long(argc, argv, "d:c:s:n:p:B:v", LongOptions, nullptr)) != -1)
+		{
+			switch (nOption)
+			{
+				case 'd': Options.pSDPath        = optarg; break;
+				case 'c': Options.pConfigPath    = optarg; break;
+				case 's': Options.pSynth         = optarg; break;
+				case 'n': Options.nMessages      = atoi(optarg); break;
+				case 'p': Options.nBlockMessages = atoi(optarg); break;
+				case 'B': Options.nBatchSize     = atoi(optarg); break;
+				case 'v': Options.bVerbose       = true; break;
+				default:  return false;
+			}
+		}
+
+		if (Options.pSynth && strcmp(Options.pSynth, "mt32") && strcmp(Options.pSynth, "soundfont"))
+			return false;
+
+		return optind == argc && Options.nMessages > 0 && Options.nBlockMessages > 0 && Options.nBatchSize > 0;
+	}
+
+	u64 GetThreadCPUNanos()
+	{
+		timespec Time;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &Time);
+		return static_cast<u64>(Time.tv_sec) * 1000000000 + Time.tv_nsec;
+	}
+
+	// Drum rolls, controller sweeps and pitch bends, as in dense sequencer output; no program changes, which the
+	// SoundFont synth may have to apply on the spot to load samples
+	std::vector<u32> GenerateMessages(unsigned int nMessages)
+	{
+		static const u8 Controllers[] = {1, 7, 10, 11, 74};
+
+		u32 nRandom = 0x12345678;
+		std::vector<u32> Messages;
+		Messages.reserve(nMessages);
+
+		while (Messages.size() < nMessages)
+		{
+			nRandom = nRandom * 1664525 + 1013904223;
+			const u8 nChannel = (nRandom >> 8) % 16;
+			const u8 nValue = (nRandom >> 12) % 128;
+
+			switch ((nRandom >> 24) % 3)
+			{
+				case 0:
+				{
+					// Snare roll on the rhythm channel
+					const u8 nVelocity = 64 + nValue / 2;
+					Messages.push_back(0x99 | 38 << 8 | nVelocity << 16);
+					Messages.push_back(0x89 | 38 << 8);
+					break;
+				}
+
+				case 1:
+				{
+					const u8 nController = Controllers[(nRandom >> 20) % Utility::ArraySize(Controllers)];
+					for (u8 i = 0; i < 8; ++i)
+						Messages.push_back(0xB0 | nChannel | nController << 8 | (nValue + i * 4) % 128 << 16);
+					break;
+				}
+
+				default:
+					for (u8 i = 0; i < 8; ++i)
+						Messages.push_back(0xE0 | nChannel | i * 16 << 8 | nValue << 16);
+					break;
+			}
+		}
+
+		Messages.resize(nMessages);
+		return Messages;
+	}
+
+	CSynthBase* CreateSynth(const CConfig& Config, bool bSoundFont)
+	{
+		CSynthBase* pSynth;
+
+		if (bSoundFont)
+			pSynth = new CSoundFontSynth(Config.AudioSampleRate);
+		else
+			pSynth = new CMT32Synth(Config.AudioSampleRate, Config.MT32EmuGain, Config.MT32EmuReverbGain, Config.MT32EmuResamplerQuality);
+
+		if (!pSynth->Initialize())
+		{
+			if (bSoundFont)
+				LOGERR("FluidSynth init failed; no SoundFonts present?");
+			else
+				LOGERR("mt32emu init failed; no ROMs present?");
+
+			delete pSynth;
+			return nullptr;
+		}
+
+		pSynth->SetMasterVolume(100);
+		return pSynth;
+	}
+
+	// Returns CPU nanoseconds spent passing on the messages
+	u64 MeasureDispatch(CSynthBase& Synth, size_t nBlockFrames, const std::vector<u32>& Messages, const TOptions& Options, bool bBatched)
+	{
+		float Buffer[MaxBlockFrames * 2];
+		u64 nNanos = 0;
+
+		for (size_t nOffset = 0; nOffset < Messages.size(); nOffset += Options.nBlockMessages)
+		{
+			const size_t nCount = Utility::Min<size_t>(Options.nBlockMessages, Messages.size() - nOffset);
+			const u32* const pMessages = &Messages[nOffset];
+			const u64 nStartNanos = GetThreadCPUNanos();
+
+			if (bBatched)
+			{
+				for (size_t i = 0; i < nCount; i += Options.nBatchSize)
+					Synth.HandleMIDIShortMessages(pMessages + i, Utility::Min<size_t>(Options.nBatchSize, nCount - i));
+			}
+			else
+			{
+				for (size_t i = 0; i < nCount; ++i)
+					Synth.HandleMIDIShortMessage(pMessages[i]);
+			}
+
+			nNanos += GetThreadCPUNanos() - nStartNanos;
+
+			Synth.Render(Buffer, nBlockFrames);
+		}
+
+		return nNanos;
+	}
+
+	// Each mode gets a fresh synth so that neither inherits the other's state
+	bool RunSynth(const CConfig& Config, size_t nBlockFrames, const std::vector<u32>& Messages, const TOptions& Options, bool bSoundFont)
+	{
+		u64 nNanos[2];
+
+		for (int nMode = 0; nMode < 2; ++nMode)
+		{
+			CSynthBase* const pSynth = CreateSynth(Config, bSoundFont);
+			if (!pSynth)
+				return false;
+
+			nNanos[nMode] = MeasureDispatch(*pSynth, nBlockFrames, Messages, Options, nMode == 1);
+			delete pSynth;
+		}
+
+		char BatchName[32];
+		snprintf(BatchName, sizeof(BatchName), "batches of %u", Options.nBatchSize);
+
+		printf("%s, %zu messages, %u per %zu-frame block:\n", bSoundFont ? "FluidSynth" : "mt32emu", Messages.size(), Options.nBlockMessages, nBlockFrames);
+		printf("  %-18s %12s %10s\n", "", "messages/s", "ns/message");
+
+		for (int nMode = 0; nMode < 2; ++nMode)
+		{
+			const double nNanosPerMessage = static_cast<double>(nNanos[nMode]) / Messages.size();
+			printf("  %-18s %10.2f M %10.1f\n", nMode ? BatchName : "one at a time", nNanosPerMessage > 0 ? 1000 / nNanosPerMessage : 0.0, nNanosPerMessage);
+		}
+
+		printf("  %-18s %11.2fx\n", "speedup", nNanos[1] ? static_cast<double>(nNanos[0]) / nNanos[1] : 0.0);
+		printf("\n");
+
+		return true;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	TOptions Options;
+	if (!ParseArguments(argc, argv, Options))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	CLogger Logger(Options.bVerbose ? LogDebug : LogWarning);
+	CMemorySystem Memory(HeapMegabytes * MEGABYTE);
+
+	FATFS SDFileSystem{Options.pSDPath};
+	if (f_mount(&SDFileSystem, "SD:", 1) != FR_OK)
+	{
+		LOGERR("Couldn't use '%s' as the SD card", Options.pSDPath);
+		return EXIT_FAILURE;
+	}
+
+	CConfig Config;
+	if (!Config.Initialize(Options.pConfigPath))
+		LOGWARN("Unable to find or parse config file; using defaults");
+
+	// The secondary FluidSynth instance would need a thread of its own; dispatch doesn't depend on it
+	Config.FluidSynthParallelRendering = false;
+
+	CZoneAllocator Allocator;
+	if (!Allocator.Initialize(static_cast<size_t>(Utility::Clamp(Config.SystemSmallAllocArena, 0, 65536)) * KILOBYTE))
+		return EXIT_FAILURE;
+
+	const size_t nBlockFrames = Utility::Clamp<size_t>(Config.AudioChunkSize / 2, 1, MaxBlockFrames);
+	const std::vector<u32> Messages = GenerateMessages(Options.nMessages);
+
+	bool bSuccess = true;
+
+	if (!Options.pSynth || !strcmp(Options.pSynth, "mt32"))
+		bSuccess &= RunSynth(Config, nBlockFrames, Messages, Options, false);
+
+	if (!Options.pSynth || !strcmp(Options.pSynth, "soundfont"))
+		bSuccess &= RunSynth(Config, nBlockFrames, Messages, Options, true);
+
+	if (bSuccess)
+		printf("Times are CPU time spent passing messages to the synth, excluding rendering\n");
+
+	return bSuccess ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,347 @@
+//
+// fatfs.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Rename POSIX's DIR so that it doesn't clash with FatFs's
+#define DIR TPOSIXDir
+#include <dirent.h>
+#undef DIR
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <circle/util.h>
+#include <fatfs/ff.h>
+
+namespace
+{
+	// Volume names, as configured for FatFs in the kernel build, plus one for the host's own filesystem
+	const char* const VolumeNames[] = {"SD", "USB", "HOST"};
+	constexpr size_t VolumeCount = sizeof(VolumeNames) / sizeof(*VolumeNames);
+
+	const char* VolumeHostPaths[VolumeCount] = {nullptr};
+
+	FRESULT TranslateError(int nError)
+	{
+		switch (nError)
+		{
+			case ENOENT:	return FR_NO_FILE;
+			case ENOTDIR:	return FR_NO_PATH;
+			case EACCES:
+			case EPERM:	return FR_DENIED;
+			case EEXIST:	return FR_EXIST;
+			case EROFS:	return FR_WRITE_PROTECTED;
+			case ENOMEM:	return FR_NOT_ENOUGH_CORE;
+			case EMFILE:	return FR_TOO_MANY_OPEN_FILES;
+			default:	return FR_DISK_ERR;
+		}
+	}
+
+	void FillFileInfo(const char* pName, const struct stat& Stat, FILINFO* pFileInfo)
+	{
+		struct tm Time;
+		localtime_r(&Stat.st_mtime, &Time);
+
+		pFileInfo->fsize   = S_ISDIR(Stat.st_mode) ? 0 : Stat.st_size;
+		pFileInfo->fdate   = (Time.tm_year - 80) << 9 | (Time.tm_mon + 1) << 5 | Time.tm_mday;
+		pFileInfo->ftime   = Time.tm_hour << 11 | Time.tm_min << 5 | Time.tm_sec / 2;
+		pFileInfo->fattrib = S_ISDIR(Stat.st_mode) ? AM_DIR : AM_ARC;
+		pFileInfo->altname[0] = '\0';
+
+		// Treat dot files like hidden files on a FAT volume
+		if (pName[0] == '.')
+			pFileInfo->fattrib |= AM_HID;
+
+		snprintf(pFileInfo->fname, sizeof(pFileInfo->fname), "%s", pName);
+	}
+}
+
+// Paths are "<drive>:<path>" or "<drive>:/<path>"; paths without a drive are on the first volume
+bool HostTranslatePath(const TCHAR* pPath, char* pOutHostPath, size_t nOutSize)
+{
+	size_t nVolume = 0;
+	const char* pColon = strchr(pPath, ':');
+
+	if (pColon)
+	{
+		for (nVolume = 0; nVolume < VolumeCount; ++nVolume)
+		{
+			if (strlen(VolumeNames[nVolume]) == static_cast<size_t>(pColon - pPath) && !strncasecmp(pPath, VolumeNames[nVolume], pColon - pPath))
+				break;
+		}
+
+		if (nVolume == VolumeCount)
+			return false;
+
+		pPath = pColon + 1;
+	}
+
+	if (!VolumeHostPaths[nVolume])
+		return false;
+
+	while (*pPath == '/')
+		++pPath;
+
+	return static_cast<size_t>(snprintf(pOutHostPath, nOutSize, "%s/%s", VolumeHostPaths[nVolume], pPath)) < nOutSize;
+}
+
+FRESULT f_mount(FATFS* pFileSystem, const TCHAR* pPath, BYTE nOptions)
+{
+	const char* pColon = strchr(pPath, ':');
+	const size_t nNameLength = pColon ? static_cast<size_t>(pColon - pPath) : strlen(pPath);
+
+	for (size_t i = 0; i < VolumeCount; ++i)
+	{
+		if (strlen(VolumeNames[i]) != nNameLength || strncasecmp(pPath, VolumeNames[i], nNameLength))
+			continue;
+
+		// Unmount
+		if (!pFileSystem)
+		{
+			VolumeHostPaths[i] = nullptr;
+			return FR_OK;
+		}
+
+		struct stat Stat;
+		if (stat(pFileSystem->pHostPath, &Stat) != 0 || !S_ISDIR(Stat.st_mode))
+			return FR_NOT_READY;
+
+		VolumeHostPaths[i] = pFileSystem->pHostPath;
+		return FR_OK;
+	}
+
+	return FR_INVALID_DRIVE;
+}
+
+FRESULT f_open(FIL* pFile, const TCHAR* pPath, BYTE nMode)
+{
+	pFile->pFile = nullptr;
+
+	char HostPath[FF_MAX_PATH];
+	if (!HostTranslatePath(pPath, HostPath, sizeof(HostPath)))
+		return FR_INVALID_DRIVE;
+
+	struct stat Stat;
+	const bool bExists = stat(HostPath, &Stat) == 0;
+
+	if (bExists && S_ISDIR(Stat.st_mode))
+		return FR_DENIED;
+
+	if (bExists && (nMode & FA_CREATE_NEW))
+		return FR_EXIST;
+
+	if (!bExists && !(nMode & (FA_CREATE_NEW | FA_CREATE_ALWAYS | FA_OPEN_ALWAYS)))
+		return FR_NO_FILE;
+
+	// Truncate only when asked to; otherwise create the file if needed and open it for update
+	const char* pMode;
+	if (nMode & FA_CREATE_ALWAYS)
+		pMode = "w+b";
+	else if (!(nMode & FA_WRITE))
+		pMode = "rb";
+	else
+		pMode = bExists ? "r+b" : "w+b";
+
+	pFile->pFile = fopen(HostPath, pMode);
+	if (!pFile->pFile)
+		return TranslateError(errno);
+
+	fseek(pFile->pFile, 0, SEEK_END);
+	pFile->objsize = ftell(pFile->pFile);
+	pFile->fptr    = 0;
+
+	if ((nMode & FA_OPEN_APPEND) == FA_OPEN_APPEND)
+		pFile->fptr = pFile->objsize;
+
+	fseek(pFile->pFile, pFile->fptr, SEEK_SET);
+
+	return FR_OK;
+}
+
+FRESULT f_close(FIL* pFile)
+{
+	if (!pFile->pFile)
+		return FR_INVALID_OBJECT;
+
+	const int nResult = fclose(pFile->pFile);
+	pFile->pFile = nullptr;
+
+	return nResult == 0 ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_read(FIL* pFile, void* pBuffer, UINT nBytesToRead, UINT* pBytesRead)
+{
+	*pBytesRead = 0;
+
+	if (!pFile->pFile)
+		return FR_INVALID_OBJECT;
+
+	const size_t nRead = fread(pBuffer, 1, nBytesToRead, pFile->pFile);
+	if (nRead < nBytesToRead && ferror(pFile->pFile))
+		return FR_DISK_ERR;
+
+	pFile->fptr += nRead;
+	*pBytesRead = nRead;
+
+	return FR_OK;
+}
+
+FRESULT f_write(FIL* pFile, const void* pBuffer, UINT nBytesToWrite, UINT* pBytesWritten)
+{
+	*pBytesWritten = 0;
+
+	if (!pFile->pFile)
+		return FR_INVALID_OBJECT;
+
+	const size_t nWritten = fwrite(pBuffer, 1, nBytesToWrite, pFile->pFile);
+	if (nWritten < nBytesToWrite)
+		return FR_DISK_ERR;
+
+	pFile->fptr += nWritten;
+	if (pFile->fptr > pFile->objsize)
+		pFile->objsize = pFile->fptr;
+
+	*pBytesWritten = nWritten;
+
+	return FR_OK;
+}
+
+FRESULT f_lseek(FIL* pFile, FSIZE_t nOffset)
+{
+	if (!pFile->pFile)
+		return FR_INVALID_OBJECT;
+
+	if (fseek(pFile->pFile, nOffset, SEEK_SET) != 0)
+		return FR_DISK_ERR;
+
+	pFile->fptr = nOffset;
+
+	return FR_OK;
+}
+
+FRESULT f_stat(const TCHAR* pPath, FILINFO* pFileInfo)
+{
+	char HostPath[FF_MAX_PATH];
+	if (!HostTranslatePath(pPath, HostPath, sizeof(HostPath)))
+		return FR_INVALID_DRIVE;
+
+	struct stat Stat;
+	if (stat(HostPath, &Stat) != 0)
+		return TranslateError(errno);
+
+	if (pFileInfo)
+	{
+		const char* pSlash = strrchr(HostPath, '/');
+		FillFileInfo(pSlash ? pSlash + 1 : HostPath, Stat, pFileInfo);
+	}
+
+	return FR_OK;
+}
+
+FRESULT f_mkdir(const TCHAR* pPath)
+{
+	char HostPath[FF_MAX_PATH];
+	if (!HostTranslatePath(pPath, HostPath, sizeof(HostPath)))
+		return FR_INVALID_DRIVE;
+
+	if (mkdir(HostPath, 0777) != 0)
+		return TranslateError(errno);
+
+	return FR_OK;
+}
+
+FRESULT f_findfirst(DIR* pDir, FILINFO* pFileInfo, const TCHAR* pPath, const TCHAR* pPattern)
+{
+	pDir->pHandle = nullptr;
+
+	if (!HostTranslatePath(pPath, pDir->HostPath, sizeof(pDir->HostPath)))
+		return FR_INVALID_DRIVE;
+
+	TPOSIXDir* pHandle = opendir(pDir->HostPath);
+	if (!pHandle)
+		return errno == ENOENT ? FR_NO_PATH : TranslateError(errno);
+
+	pDir->pHandle = pHandle;
+	snprintf(pDir->Pattern, sizeof(pDir->Pattern), "%s", pPattern);
+
+	return f_findnext(pDir, pFileInfo);
+}
+
+FRESULT f_findnext(DIR* pDir, FILINFO* pFileInfo)
+{
+	if (!pDir->pHandle)
+		return FR_INVALID_OBJECT;
+
+	TPOSIXDir* pHandle = static_cast<TPOSIXDir*>(pDir->pHandle);
+
+	while (const dirent* pEntry = readdir(pHandle))
+	{
+		if (!strcmp(pEntry->d_name, ".") || !strcmp(pEntry->d_name, ".."))
+			continue;
+
+		// FAT filenames are case-insensitive
+		if (fnmatch(pDir->Pattern, pEntry->d_name, FNM_CASEFOLD) != 0)
+			continue;
+
+		char EntryPath[FF_MAX_PATH * 2];
+		snprintf(EntryPath, sizeof(EntryPath), "%s/%s", pDir->HostPath, pEntry->d_name);
+
+		struct stat Stat;
+		if (stat(EntryPath, &Stat) != 0)
+			continue;
+
+		FillFileInfo(pEntry->d_name, Stat, pFileInfo);
+		return FR_OK;
+	}
+
+	// End of directory
+	pFileInfo->fname[0] = '\0';
+
+	return FR_OK;
+}
+
+FRESULT f_closedir(DIR* pDir)
+{
+	if (!pDir->pHandle)
+		return FR_INVALID_OBJECT;
+
+	closedir(static_cast<TPOSIXDir*>(pDir->pHandle));
+	pDir->pHandle = nullptr;
+
+	return FR_OK;
+}
+
+// FluidSynth opens files through the C library, which circle-stdlib routes through FatFs; do the same here
+// (linked with --wrap=fopen)
+extern "C" FILE* __real_fopen(const char* pPath, const char* pMode);
+
+extern "C" FILE* __wrap_fopen(const char* pPath, const char* pMode)
+{
+	char HostPath[FF_MAX_PATH];
+	if (strchr(pPath, ':') && HostTranslatePath(pPath, HostPath, sizeof(HostPath)))
+		return __real_fopen(HostPath, pMode);
+
+	return __real_fopen(pPath, pMode);
+}
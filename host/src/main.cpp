@@ -0,0 +1,661 @@
+//
+// main.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Offline renderer for benchmarking the synthesizers on a host machine.
+// Plays a Standard MIDI File through the same synth, parser and player code used by the kernel, as fast as possible,
+// and reports the real-time factor, the distribution of per-block render times, and peak memory use.
+// FluidSynth's allocations can also be recorded for replay by mt32pi-allocbench, and a flood of controller messages can
+// be sent from another thread, as the main task would on core 0, to measure contention between MIDI handling and rendering.
+
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <circle/logger.h>
+#include <circle/memory.h>
+#include <circle/timer.h>
+#include <fatfs/ff.h>
+
+#include "config.h"
+#include "smfplayer.h"
+#include "synth/layeredsynth.h"
+#include "synth/mt32synth.h"
+#include "synth/soundfontsynth.h"
+#include "synth/synth.h"
+#include "zoneallocator.h"
+
+LOGMODULE("render");
+
+namespace
+{
+	constexpr size_t DefaultHeapMegabytes = 1024;
+	constexpr unsigned int DefaultTailSeconds = 2;
+	constexpr size_t MaxBlockFrames = 4096;
+
+	struct TOptions
+	{
+		const char* pInputPath    = nullptr;
+		const char* pOutputPath   = nullptr;
+		const char* pSDPath       = "sdcard";
+		const char* pUSBPath      = nullptr;
+		const char* pConfigPath   = "mt32-pi.cfg";
+		const char* pSynth        = nullptr;
+		const char* pResampler    = nullptr;
+		const char* pParallel     = nullptr;
+		const char* pAllocTrace   = nullptr;
+		int nSoundFont            = -1;
+		int nPolyphony            = -1;
+		int nSampleRate           = -1;
+		int nBlockFrames          = -1;
+		unsigned int nTailSeconds = DefaultTailSeconds;
+		unsigned int nFloodRate   = 0;
+		size_t nHeapMegabytes     = DefaultHeapMegabytes;
+		bool bVerbose             = false;
+	};
+
+	void PrintUsage(const char* pProgramName)
+	{
+		fprintf(stderr,
+			"Usage: %s [options] <input.mid> [output.wav]\n"
+			"\n"
+			"Renders a MIDI file as fast as possible and reports render performance.\n"
+			"Options override the corresponding settings from the config file.\n"
+			"\n"
+			"  -d, --sd <dir>           Directory standing in for the SD card (default: sdcard)\n"
+			"  -u, --usb <dir>          Directory standing in for a USB disk\n"
+			"  -c, --config <path>      Config file, relative to the SD card (default: mt32-pi.cfg)\n"
+			"  -s, --synth <synth>      mt32, soundfont or layered\n"
+			"  -f, --soundfont <index>  SoundFont index\n"
+			"  -p, --polyphony <n>      FluidSynth polyphony\n"
+			"  -P, --parallel <on|off>  FluidSynth parallel rendering on a second thread\n"
+			"  -q, --resampler <q>      mt32emu resampler quality (none, fastest, fast, good, best)\n"
+			"  -r, --sample-rate <hz>   Sample rate\n"
+			"  -b, --block <frames>     Frames rendered per block (default: chunk_size / 2)\n"
+			"  -t, --tail <seconds>     Time to keep rendering after the last event (default: %d)\n"
+			"  -m, --heap <megabytes>   Memory available to the synths (default: %d)\n"
+			"  -a, --alloc-trace <path> Record FluidSynth's allocations for mt32pi-allocbench\n"
+			"  -F, --cc-flood <n>       Send n controller messages per second of audio from another thread\n"
+			"  -v, --verbose            Show debug messages\n",
+			pProgramName, DefaultTailSeconds, static_cast<int>(DefaultHeapMegabytes));
+	}
+
+	bool ParseArguments(int argc, char** argv, TOptions& Options)
+	{
+		static const option LongOptions[] = {
+			{"sd",          required_argument, nullptr, 'd'},
+			{"usb",         required_argument, nullptr, 'u'},
+			{"config",      required_argument, nullptr, 'c'},
+			{"synth",       required_argument, nullptr, 's'},
+			{"soundfont",   required_argument, nullptr, 'f'},
+			{"polyphony",   required_argument, nullptr, 'p'},
+			{"parallel",    required_argument, nullptr, 'P'},
+			{"resampler",   required_argument, nullptr, 'q'},
+			{"sample-rate", required_argument, nullptr, 'r'},
+			{"block",       required_argument, nullptr, 'b'},
+			{"tail",        required_argument, nullptr, 't'},
+			{"heap",        required_argument, nullptr, 'm'},
+			{"alloc-trace", required_argument, nullptr, 'a'},
+			{"cc-flood",    required_argument, nullptr, 'F'},
+			{"verbose",     no_argument,       nullptr, 'v'},
+			{nullptr,       0,                 nullptr, 0},
+		};
+
+		int nOption;
+		while ((nOption = getopt_long(argc, argv, "d:u:c:s:f:p:P:q:r:b:t:m:a:F:v", LongOptions, nullptr)) != -1)
+		{
+			switch (nOption)
+			{
+				case 'd': Options.pSDPath        = optarg; break;
+				case 'u': Options.pUSBPath       = optarg; break;
+				case 'c': Options.pConfigPath    = optarg; break;
+				case 's': Options.pSynth         = optarg; break;
+				case 'f': Options.nSoundFont     = atoi(optarg); break;
+				case 'p': Options.nPolyphony     = atoi(optarg); break;
+				case 'P': Options.pParallel      = optarg; break;
+				case 'q': Options.pResampler     = optarg; break;
+				case 'r': Options.nSampleRate    = atoi(optarg); break;
+				case 'b': Options.nBlockFrames   = atoi(optarg); break;
+				case 't': Options.nTailSeconds   = atoi(optarg); break;
+				case 'm': Options.nHeapMegabytes = atoi(optarg); break;
+				case 'a': Options.pAllocTrace    = optarg; break;
+				case 'F': Options.nFloodRate     = atoi(optarg); break;
+				case 'v': Options.bVerbose       = true; break;
+				default:  return false;
+			}
+		}
+
+		if (optind >= argc)
+			return false;
+
+		Options.pInputPath = argv[optind++];
+		if (optind < argc)
+			Options.pOutputPath = argv[optind++];
+
+		return optind == argc;
+	}
+
+	bool ApplyOverrides(const TOptions& Options, CConfig& Config)
+	{
+		if (Options.pSynth && !CConfig::ParseOption(Options.pSynth, &Config.SystemDefaultSynth))
+		{
+			LOGERR("Invalid synth '%s'", Options.pSynth);
+			return false;
+		}
+
+		if (Options.pResampler && !CConfig::ParseOption(Options.pResampler, &Config.MT32EmuResamplerQuality))
+		{
+			LOGERR("Invalid resampler quality '%s'", Options.pResampler);
+			return false;
+		}
+
+		if (Options.pParallel && !CConfig::ParseOption(Options.pParallel, &Config.FluidSynthParallelRendering))
+		{
+			LOGERR("Invalid parallel rendering setting '%s'", Options.pParallel);
+			return false;
+		}
+
+		if (Options.nSoundFont >= 0)
+			Config.FluidSynthSoundFont = Options.nSoundFont;
+		if (Options.nPolyphony > 0)
+			Config.FluidSynthPolyphony = Options.nPolyphony;
+		if (Options.nSampleRate > 0)
+			Config.AudioSampleRate = Options.nSampleRate;
+		if (Options.bVerbose)
+			Config.SystemVerbose = true;
+
+		return true;
+	}
+
+	// Allocation trace; one line per operation, identifying each allocation by the order in which it was made:
+	//   a <id> <size>  allocation
+	//   r <id> <size>  reallocation, keeping the id
+	//   f <id>         free
+	// The lock is held across each allocator call so that an address can't be reused before it's recorded
+	struct TAllocTrace
+	{
+		std::mutex Lock;
+		FILE* pFile = nullptr;
+		std::unordered_map<void*, u32> IDs;
+		u32 nNextID = 0;
+
+		void RecordAlloc(void* pPtr, size_t nSize)
+		{
+			if (!pPtr)
+				return;
+
+			IDs[pPtr] = nNextID;
+			fprintf(pFile, "a %u %zu\n", nNextID++, nSize);
+		}
+
+		void RecordRealloc(void* pOldPtr, void* pNewPtr, size_t nSize)
+		{
+			if (!pOldPtr)
+			{
+				RecordAlloc(pNewPtr, nSize);
+				return;
+			}
+
+			if (!pNewPtr)
+				return;
+
+			const auto Iterator = IDs.find(pOldPtr);
+			if (Iterator == IDs.end())
+				return;
+
+			const u32 nID = Iterator->second;
+			IDs.erase(Iterator);
+			IDs[pNewPtr] = nID;
+			fprintf(pFile, "r %u %zu\n", nID, nSize);
+		}
+
+		void RecordFree(void* pPtr)
+		{
+			const auto Iterator = IDs.find(pPtr);
+			if (Iterator == IDs.end())
+				return;
+
+			fprintf(pFile, "f %u\n", Iterator->second);
+			IDs.erase(Iterator);
+		}
+	};
+
+	TAllocTrace AllocTrace;
+
+	struct TSynths
+	{
+		CMT32Synth* pMT32Synth           = nullptr;
+		CSoundFontSynth* pSoundFontSynth = nullptr;
+		CLayeredSynth* pLayeredSynth     = nullptr;
+		CSynthBase* pSynth               = nullptr;
+		TSynth Synth                     = TSynth::MT32;
+
+		~TSynths()
+		{
+			delete pLayeredSynth;
+			delete pSoundFontSynth;
+			delete pMT32Synth;
+		}
+	};
+
+	// Mirrors the synth setup done by CMT32Pi
+	bool CreateSynths(const CConfig& Config, size_t nBlockFrames, TSynths& Synths)
+	{
+		const bool bLayered = Config.SystemDefaultSynth == CConfig::TSystemDefaultSynth::Layered;
+
+		if (bLayered || Config.SystemDefaultSynth == CConfig::TSystemDefaultSynth::MT32)
+		{
+			Synths.pMT32Synth = new CMT32Synth(Config.AudioSampleRate, Config.MT32EmuGain, Config.MT32EmuReverbGain, Config.MT32EmuResamplerQuality);
+			if (!Synths.pMT32Synth->Initialize())
+			{
+				LOGERR("mt32emu init failed; no ROMs present?");
+				return false;
+			}
+
+			if (Config.MT32EmuMIDIChannels == CMT32Synth::TMIDIChannels::Alternate)
+				Synths.pMT32Synth->SetMIDIChannels(Config.MT32EmuMIDIChannels);
+			Synths.pMT32Synth->SetReversedStereo(Config.MT32EmuReversedStereo);
+
+			Synths.pSynth = Synths.pMT32Synth;
+			Synths.Synth  = TSynth::MT32;
+		}
+
+		if (bLayered || Config.SystemDefaultSynth == CConfig::TSystemDefaultSynth::SoundFont)
+		{
+			Synths.pSoundFontSynth = new CSoundFontSynth(Config.AudioSampleRate);
+			if (!Synths.pSoundFontSynth->Initialize())
+			{
+				LOGERR("FluidSynth init failed; no SoundFonts present?");
+				return false;
+			}
+
+			Synths.pSynth = Synths.pSoundFontSynth;
+			Synths.Synth  = TSynth::SoundFont;
+		}
+
+		if (bLayered)
+		{
+			Synths.pLayeredSynth = new CLayeredSynth(Config.AudioSampleRate, nBlockFrames, CSMFPlayer::MaxEventsPerBlock, Synths.pMT32Synth, Synths.pSoundFontSynth);
+			if (!Synths.pLayeredSynth->Initialize())
+				return false;
+
+			Synths.pLayeredSynth->SetMT32Channels(Config.LayeredMT32Channels.nMask);
+			Synths.pLayeredSynth->SetCables(Config.LayeredMT32USBCables.nMask, Config.LayeredSoundFontUSBCables.nMask);
+			Synths.pLayeredSynth->SetGains(Config.LayeredMT32Gain, Config.LayeredSoundFontGain);
+			Synths.pLayeredSynth->SetParallelRendering(true);
+
+			Synths.pSynth = Synths.pLayeredSynth;
+			Synths.Synth  = TSynth::Layered;
+		}
+
+		return true;
+	}
+
+	bool WriteWAVHeader(FILE* pFile, unsigned int nSampleRate, u32 nFrames)
+	{
+		constexpr u16 nChannels = 2;
+		constexpr u16 nBitsPerSample = 16;
+		constexpr u16 nBlockAlign = nChannels * nBitsPerSample / 8;
+		const u32 nDataSize = nFrames * nBlockAlign;
+
+		struct
+		{
+			char RIFF[4];
+			u32 nRIFFSize;
+			char WAVE[4];
+			char FormatID[4];
+			u32 nFormatSize;
+			u16 nFormat;
+			u16 nChannels;
+			u32 nSampleRate;
+			u32 nByteRate;
+			u16 nBlockAlign;
+			u16 nBitsPerSample;
+			char DataID[4];
+			u32 nDataSize;
+		} PACKED Header = {
+			{'R', 'I', 'F', 'F'}, 36 + nDataSize, {'W', 'A', 'V', 'E'},
+			{'f', 'm', 't', ' '}, 16, 1, nChannels, nSampleRate, nSampleRate * nBlockAlign, nBlockAlign, nBitsPerSample,
+			{'d', 'a', 't', 'a'}, nDataSize
+		};
+
+		return fseek(pFile, 0, SEEK_SET) == 0 && fwrite(&Header, sizeof(Header), 1, pFile) == 1;
+	}
+
+	void WriteSamples(FILE* pFile, const float* pSamples, size_t nFrames)
+	{
+		s16 Buffer[MaxBlockFrames * 2];
+
+		for (size_t i = 0; i < nFrames * 2; ++i)
+			Buffer[i] = Utility::Clamp(pSamples[i], -1.0f, 1.0f) * 32767.0f;
+
+		fwrite(Buffer, sizeof(s16), nFrames * 2, pFile);
+	}
+
+	u64 GetNanos()
+	{
+		timespec Time;
+		clock_gettime(CLOCK_MONOTONIC, &Time);
+		return static_cast<u64>(Time.tv_sec) * 1000000000 + Time.tv_nsec;
+	}
+
+	u32 Percentile(const std::vector<u32>& SortedValues, unsigned int nPermille)
+	{
+		if (SortedValues.empty())
+			return 0;
+
+		return SortedValues[Utility::Min(SortedValues.size() * nPermille / 1000, SortedValues.size() - 1)];
+	}
+
+	void PrintReport(const char* pSynthName, unsigned int nSampleRate, size_t nBlockFrames, u64 nFramesRendered, u64 nRenderMicros, u64 nWallMicros, std::vector<u32>& BlockMicros)
+	{
+		const double nAudioSeconds = static_cast<double>(nFramesRendered) / nSampleRate;
+		const double nDeadlineMicros = static_cast<double>(nBlockFrames) * 1000000 / nSampleRate;
+
+		std::sort(BlockMicros.begin(), BlockMicros.end());
+
+		printf("Synth:             %s\n", pSynthName);
+		printf("Audio rendered:    %.2f s (%llu frames at %d Hz)\n", nAudioSeconds, static_cast<unsigned long long>(nFramesRendered), nSampleRate);
+		printf("Render time:       %.3f s (%.3f s wall clock)\n", nRenderMicros / 1000000.0, nWallMicros / 1000000.0);
+		printf("Real-time factor:  %.2fx\n", nRenderMicros ? nAudioSeconds * 1000000 / nRenderMicros : 0.0);
+		printf("\n");
+		printf("Block render time (%zu frames, %.0f us budget, %zu blocks):\n", nBlockFrames, nDeadlineMicros, BlockMicros.size());
+		printf("  min   %6u us\n", Percentile(BlockMicros, 0));
+		printf("  p50   %6u us\n", Percentile(BlockMicros, 500));
+		printf("  p90   %6u us\n", Percentile(BlockMicros, 900));
+		printf("  p99   %6u us\n", Percentile(BlockMicros, 990));
+		printf("  p99.9 %6u us\n", Percentile(BlockMicros, 999));
+		printf("  max   %6u us\n", BlockMicros.empty() ? 0 : BlockMicros.back());
+		printf("\n");
+
+		// FluidSynth and the MIDI file player allocate from the zone allocator; everything else comes from malloc()/new
+		CZoneAllocator::TStats Stats;
+		CZoneAllocator::Get()->GetStats(Stats);
+
+		rusage Usage;
+		getrusage(RUSAGE_SELF, &Usage);
+
+		printf("Peak heap use:\n");
+		printf("  zone allocator    %8zu KB\n", Stats.nPeakBytes / KILOBYTE);
+		printf("    FluidSynth      %8zu KB\n", Stats.Tags[TZoneTag::FluidSynth].nPeakBytes / KILOBYTE);
+		printf("    SMF player      %8zu KB\n", Stats.Tags[TZoneTag::SMFPlayer].nPeakBytes / KILOBYTE);
+		printf("  process (RSS)     %8ld KB\n", Usage.ru_maxrss);
+	}
+
+	void PrintFloodReport(unsigned int nFloodRate, std::vector<u32>& SendNanos)
+	{
+		std::sort(SendNanos.begin(), SendNanos.end());
+
+		printf("\n");
+		printf("Controller flood (%u messages/s, %zu sent), time per message:\n", nFloodRate, SendNanos.size());
+		printf("  p50   %8u ns\n", Percentile(SendNanos, 500));
+		printf("  p99   %8u ns\n", Percentile(SendNanos, 990));
+		printf("  p99.9 %8u ns\n", Percentile(SendNanos, 999));
+		printf("  max   %8u ns\n", SendNanos.empty() ? 0 : SendNanos.back());
+	}
+}
+
+// FluidSynth's allocation functions are wrapped by the linker so that they can be recorded
+extern "C" void* __real_fluid_alloc(size_t len);
+extern "C" void* __real_fluid_realloc(void* ptr, size_t len);
+extern "C" void __real_fluid_free(void* ptr);
+
+extern "C" void* __wrap_fluid_alloc(size_t len)
+{
+	if (!AllocTrace.pFile)
+		return __real_fluid_alloc(len);
+
+	std::lock_guard<std::mutex> Guard(AllocTrace.Lock);
+	void* const pPtr = __real_fluid_alloc(len);
+	AllocTrace.RecordAlloc(pPtr, len);
+	return pPtr;
+}
+
+extern "C" void* __wrap_fluid_realloc(void* ptr, size_t len)
+{
+	if (!AllocTrace.pFile)
+		return __real_fluid_realloc(ptr, len);
+
+	std::lock_guard<std::mutex> Guard(AllocTrace.Lock);
+	void* const pPtr = __real_fluid_realloc(ptr, len);
+	AllocTrace.RecordRealloc(ptr, pPtr, len);
+	return pPtr;
+}
+
+extern "C" void __wrap_fluid_free(void* ptr)
+{
+	if (!AllocTrace.pFile)
+		return __real_fluid_free(ptr);
+
+	std::lock_guard<std::mutex> Guard(AllocTrace.Lock);
+	AllocTrace.RecordFree(ptr);
+	__real_fluid_free(ptr);
+}
+
+int main(int argc, char** argv)
+{
+	TOptions Options;
+	if (!ParseArguments(argc, argv, Options))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	CLogger Logger(Options.bVerbose ? LogDebug : LogNotice);
+	CMemorySystem Memory(Options.nHeapMegabytes * MEGABYTE);
+
+	// The HOST: drive gives the player access to files outside of the SD card/USB directories
+	FATFS SDFileSystem{Options.pSDPath};
+	FATFS USBFileSystem{Options.pUSBPath};
+	FATFS HostFileSystem{"/"};
+
+	if (f_mount(&SDFileSystem, "SD:", 1) != FR_OK)
+	{
+		LOGERR("Couldn't use '%s' as the SD card", Options.pSDPath);
+		return EXIT_FAILURE;
+	}
+
+	if (Options.pUSBPath && f_mount(&USBFileSystem, "USB:", 1) != FR_OK)
+	{
+		LOGERR("Couldn't use '%s' as a USB disk", Options.pUSBPath);
+		return EXIT_FAILURE;
+	}
+
+	f_mount(&HostFileSystem, "HOST:", 1);
+
+	CConfig Config;
+	if (!Config.Initialize(Options.pConfigPath))
+		LOGWARN("Unable to find or parse config file; using defaults");
+
+	if (!ApplyOverrides(Options, Config))
+		return EXIT_FAILURE;
+
+	const unsigned int nSampleRate = Config.AudioSampleRate;
+	const size_t nBlockFrames = Utility::Clamp<size_t>(Options.nBlockFrames > 0 ? Options.nBlockFrames : Config.AudioChunkSize / 2, 1, MaxBlockFrames);
+
+	CZoneAllocator Allocator;
+	if (!Allocator.Initialize(static_cast<size_t>(Utility::Clamp(Config.SystemSmallAllocArena, 0, 65536)) * KILOBYTE))
+		return EXIT_FAILURE;
+
+	// Left open until exit so that the frees made when the synths are destroyed are recorded
+	if (Options.pAllocTrace && !(AllocTrace.pFile = fopen(Options.pAllocTrace, "w")))
+	{
+		LOGERR("Couldn't write '%s'", Options.pAllocTrace);
+		return EXIT_FAILURE;
+	}
+
+	TSynths Synths;
+	if (!CreateSynths(Config, nBlockFrames, Synths))
+		return EXIT_FAILURE;
+
+	CSynthBase* const pSynth = Synths.pSynth;
+
+	pSynth->SetMasterVolume(100);
+
+	char InputPath[PATH_MAX];
+	char PlayerPath[PATH_MAX + 8];
+	if (!realpath(Options.pInputPath, InputPath))
+	{
+		LOGERR("Couldn't find '%s'", Options.pInputPath);
+		return EXIT_FAILURE;
+	}
+
+	snprintf(PlayerPath, sizeof(PlayerPath), "HOST:%s", InputPath);
+
+	CSMFPlayer Player(nSampleRate);
+	if (!Player.Load(PlayerPath))
+		return EXIT_FAILURE;
+
+	FILE* pOutputFile = nullptr;
+	if (Options.pOutputPath && (!(pOutputFile = fopen(Options.pOutputPath, "wb")) || !WriteWAVHeader(pOutputFile, nSampleRate, 0)))
+	{
+		LOGERR("Couldn't write '%s'", Options.pOutputPath);
+		return EXIT_FAILURE;
+	}
+
+	// Poll the secondary FluidSynth instance and the layered synth's MT-32 bus from another thread, as the render task
+	// does on core 3
+	std::atomic<bool> bRunning{true};
+	std::thread RenderThread;
+	CSoundFontSynth* const pSoundFontSynth = Synths.pSoundFontSynth;
+	CLayeredSynth* const pLayeredSynth     = Synths.pLayeredSynth;
+	const bool bSoundFontParallelRendering = pSoundFontSynth && pSoundFontSynth->IsParallelRenderingEnabled();
+	if (bSoundFontParallelRendering || pLayeredSynth)
+	{
+		RenderThread = std::thread([&]
+		{
+			while (bRunning.load(std::memory_order_relaxed))
+			{
+				if (bSoundFontParallelRendering)
+					pSoundFontSynth->RenderSecondary();
+
+				if (pLayeredSynth)
+					pLayeredSynth->RenderSecondary();
+			}
+		});
+	}
+
+	LOGNOTE("Rendering %zu frames per block", nBlockFrames);
+	Player.Play();
+
+	// Deferred events are dispatched between blocks, as the main task would on the Pi. When flooding, a separate thread
+	// takes this over from the render loop, so that the synth's command queue keeps a single producer, and sends
+	// controller sweeps across all channels, paced against the audio rendered so far.
+	std::atomic<u64> nFramesRendered{0};
+	std::thread MainThread;
+	std::vector<u32> SendNanos;
+	if (Options.nFloodRate)
+	{
+		MainThread = std::thread([&]
+		{
+			u64 nSent = 0;
+
+			while (bRunning.load(std::memory_order_relaxed))
+			{
+				Player.Update(*pSynth);
+
+				const u64 nDue = nFramesRendered.load(std::memory_order_relaxed) * Options.nFloodRate / nSampleRate;
+				while (nSent < nDue)
+				{
+					const u8 nChannel = nSent % 16;
+					const u8 nController = nSent / 16 % 2 ? 11 : 1;
+					const u8 nValue = nSent / 32 % 128;
+					const u32 nMessage = 0xB0 | nChannel | nController << 8 | nValue << 16;
+
+					const u64 nSendStartNanos = GetNanos();
+					pSynth->HandleMIDIShortMessage(nMessage);
+					SendNanos.push_back(GetNanos() - nSendStartNanos);
+					++nSent;
+				}
+
+				std::this_thread::yield();
+			}
+		});
+	}
+
+	float Buffer[MaxBlockFrames * 2];
+	TMIDIEvent Events[CSMFPlayer::MaxEventsPerBlock];
+	std::vector<u32> BlockMicros;
+	const u64 nTailFrames = static_cast<u64>(Options.nTailSeconds) * nSampleRate;
+	u64 nTailFramesRendered = 0;
+	u64 nRenderMicros = 0;
+
+	const u64 nStartTicks = CTimer::GetClockTicks64();
+
+	// Render until the last event, then until the tail has elapsed or the synth goes quiet
+	while (!Player.IsFinished() || (nTailFramesRendered < nTailFrames && pSynth->IsActive()))
+	{
+		if (!Options.nFloodRate)
+			Player.Update(*pSynth);
+
+		const u64 nBlockStartTicks = CTimer::GetClockTicks64();
+		const size_t nEvents = Player.GetEvents(*pSynth, Events, nBlockFrames);
+		if (nEvents)
+			pSynth->RenderWithMIDIEvents(Buffer, nBlockFrames, Events, nEvents);
+		else
+			pSynth->Render(Buffer, nBlockFrames);
+		const u32 nBlockMicros = CTimer::GetClockTicks64() - nBlockStartTicks;
+
+		BlockMicros.push_back(nBlockMicros);
+		nRenderMicros += nBlockMicros;
+		nFramesRendered += nBlockFrames;
+		if (Player.IsFinished())
+			nTailFramesRendered += nBlockFrames;
+
+		if (pOutputFile)
+			WriteSamples(pOutputFile, Buffer, nBlockFrames);
+	}
+
+	const u64 nWallMicros = CTimer::GetClockTicks64() - nStartTicks;
+
+	bRunning = false;
+	if (RenderThread.joinable())
+		RenderThread.join();
+	if (MainThread.joinable())
+		MainThread.join();
+
+	if (pOutputFile)
+	{
+		if (!WriteWAVHeader(pOutputFile, nSampleRate, nFramesRendered) || fclose(pOutputFile) != 0)
+			LOGERR("Couldn't write '%s'", Options.pOutputPath);
+	}
+
+	constexpr const char* SynthNames[] = {"mt32emu", "FluidSynth", "mt32emu + FluidSynth"};
+	char SynthName[64];
+	snprintf(SynthName, sizeof(SynthName), "%s%s", SynthNames[static_cast<size_t>(Synths.Synth)], bSoundFontParallelRendering ? " (FluidSynth on 2 threads)" : "");
+	PrintReport(SynthName, nSampleRate, nBlockFrames, nFramesRendered, nRenderMicros, nWallMicros, BlockMicros);
+	if (Options.nFloodRate)
+		PrintFloodReport(Options.nFloodRate, SendNanos);
+
+	Player.Unload();
+
+	return EXIT_SUCCESS;
+}
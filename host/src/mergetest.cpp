@@ -0,0 +1,570 @@
+//
+// mergetest.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Loss and fairness test for the MIDI merger.
+// Every MIDI input feeds its own synthetic stream at its line rate, in pieces of random size, on a simulated 1ms main
+// loop. Streams mix running status, System Real-Time bytes in the middle of other messages, SysEx messages and SysEx
+// messages too large for the parser; USB MIDI passes complete short messages as event packets, as the kernel does.
+// Every message must come out of the merger exactly once, in order for its source, and while any other source has a
+// message waiting, no source may have two messages dispatched in a row. No message may wait longer than the maximum
+// latency (beyond the time between dispatches) from when its last byte was parsed to when it is dispatched. The test is
+// then repeated with one source flooding as fast as its queue accepts data, to check that the others keep flowing.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <circle/logger.h>
+#include <circle/timer.h>
+
+#include "midimerger.h"
+
+LOGMODULE("mergetest");
+
+namespace
+{
+	constexpr size_t SourceCount = CMIDIMerger::SourceCount;
+
+	// Bytes per second for each source: DIN MIDI for serial and Pisound, a busy full-speed USB device, and network
+	// MIDI at a rate a LAN easily sustains
+	constexpr unsigned int LineRates[SourceCount] = {3125, 100000, 3125, 50000, 50000};
+	constexpr const char* SourceNames[SourceCount] = {"serial", "USB", "Pisound", "AppleMIDI", "UDP"};
+
+	constexpr unsigned int DefaultMessages = 20000;
+	constexpr unsigned int DefaultDispatchInterval = 1;
+	constexpr unsigned int DefaultMaxLatency = 10;
+
+	// Give up if a run takes longer than this in simulated time
+	constexpr unsigned int MaxTicks = 10000000;
+
+	struct TOptions
+	{
+		unsigned int nMessages         = DefaultMessages;
+		unsigned int nDispatchInterval = DefaultDispatchInterval;
+		unsigned int nMaxLatency       = DefaultMaxLatency;
+		bool bVerbose                  = false;
+	};
+
+	struct TExpectedMessage
+	{
+		u32 nMessage;       // Short message, or 0 for SysEx
+		size_t nSysExOffset; // SysEx data in the stream's SysEx buffer
+		size_t nSysExSize;
+		size_t nEndOffset;  // Stream offset just past the message's last byte
+	};
+
+	// A range of the stream that the USB source passes on in one call
+	struct TPacket
+	{
+		size_t nOffset;
+		size_t nSize;
+		bool bShortMessage;
+	};
+
+	struct TStream
+	{
+		std::vector<u8> Bytes;
+		std::vector<TExpectedMessage> Expected;
+		std::vector<u8> SysExData;
+		std::vector<TPacket> Packets;
+	};
+
+	struct TSourceState
+	{
+		size_t nConsumed    = 0;
+		size_t nPacket      = 0;
+		size_t nComplete    = 0; // Expected messages whose last byte has been consumed
+		size_t nReceived    = 0;
+		double nOwedBytes   = 0;
+		unsigned int nMaxLatencyTicks = 0;
+
+		// Tick at which each expected message was completed
+		std::vector<unsigned int> CompleteTicks;
+	};
+
+	void PrintUsage(const char* pProgramName)
+	{
+		fprintf(stderr,
+			"Usage: %s [options]\n"
+			"\n"
+			"Feeds every MIDI input at line rate through the MIDI merger and checks that no\n"
+			"message is lost or reordered, and that every source gets its turn, including\n"
+			"while another source floods, without any message being held up.\n"
+			"\n"
+			"  -n, --messages <n>       Messages sent by each source (default: %d)\n"
+			"  -d, --dispatch <ms>      Time between dispatches (default: %d)\n"
+			"  -l, --max-latency <ms>   Longest a complete message may wait, beyond the time\n"
+			"                           between dispatches (default: %d)\n"
+			"  -v, --verbose            Show debug messages\n",
+			pProgramName, DefaultMessages, DefaultDispatchInterval, DefaultMaxLatency);
+	}
+
+	bool ParseArguments(int argc, char** argv, TOptions& Options)
+	{
+		static const option LongOptions[] = {
+			{"messages",    required_argument, nullptr, 'n'},
+			{"dispatch",    required_argument, nullptr, 'd'},
+			{"max-latency", required_argument, nullptr, 'l'},
+			{"verbose",     no_argument,       nullptr, 'v'},
+			{nullptr,       0,                 nullptr, 0},
+		};
+
+		int nOption;
+		while ((nOption = getopt_long(argc, argv, "n:d:l:v", LongOptions, nullptr)) != -1)
+		{
+			switch (nOption)
+			{
+				case 'n': Options.nMessages         = atoi(optarg); break;
+				case 'd': Options.nDispatchInterval = atoi(optarg); break;
+				case 'l': Options.nMaxLatency       = atoi(optarg); break;
+				case 'v': Options.bVerbose          = true; break;
+				default:  return false;
+			}
+		}
+
+		return optind == argc && Options.nMessages > 0 && Options.nDispatchInterval > 0;
+	}
+
+	// SysEx messages carry the source and a sequence number so that they can be told apart, and may be large enough to
+	// be passed on in chunks. Short messages are told apart by the cable number, which is set to the source.
+	void GenerateStream(size_t nSource, unsigned int nMessages, TStream& Stream)
+	{
+		static const u8 Statuses[] = {0x80, 0x90, 0xB0, 0xC0, 0xE0};
+		const bool bUSB = nSource == static_cast<size_t>(TMIDISource::USB);
+
+		u32 nRandom = 0x12345678 + nSource;
+		auto Random = [&](u32 nMin, u32 nMax)
+		{
+			nRandom = nRandom * 1664525 + 1013904223;
+			return nMin + (nRandom >> 8) % (nMax - nMin + 1);
+		};
+
+		auto AddRealTime = [&]()
+		{
+			Stream.Bytes.push_back(0xF8);
+			Stream.Expected.push_back({0xF8, 0, 0, Stream.Bytes.size()});
+		};
+
+		u8 nRunningStatus = 0;
+
+		for (unsigned int nMessage = 0; nMessage < nMessages; ++nMessage)
+		{
+			const size_t nOffset = Stream.Bytes.size();
+			const u32 nType = Random(0, 499);
+
+			if (nType < 11)
+			{
+				// Too large for the parser's buffer every now and then
+				const size_t nSize = nType == 0 ? Random(CMIDIParser::SysExBufferSize + 1, 3 * CMIDIParser::SysExBufferSize) : Random(8, 200);
+				const size_t nSysExOffset = Stream.SysExData.size();
+
+				Stream.SysExData.push_back(0xF0);
+				Stream.SysExData.push_back(0x7D);
+				Stream.SysExData.push_back(nSource);
+				Stream.SysExData.push_back(nMessage & 0x7F);
+				Stream.SysExData.push_back(nMessage >> 7 & 0x7F);
+				while (Stream.SysExData.size() - nSysExOffset < nSize - 1)
+					Stream.SysExData.push_back(Random(0, 127));
+				Stream.SysExData.push_back(0xF7);
+
+				// A real-time byte in the middle of a message that is passed on whole is dispatched before it
+				const size_t nRealTimeOffset = !bUSB && nSize <= CMIDIParser::SysExBufferSize && Random(0, 3) == 0 ? Random(1, nSize - 1) : nSize;
+				for (size_t i = 0; i < nSize; ++i)
+				{
+					if (i == nRealTimeOffset)
+						AddRealTime();
+					Stream.Bytes.push_back(Stream.SysExData[nSysExOffset + i]);
+				}
+
+				// USB MIDI carries SysEx in 3-byte event packets
+				for (size_t i = nOffset; bUSB && i < Stream.Bytes.size(); i += 3)
+					Stream.Packets.push_back({i, std::min<size_t>(3, Stream.Bytes.size() - i), false});
+
+				Stream.Expected.push_back({0, nSysExOffset, nSize, Stream.Bytes.size()});
+				nRunningStatus = 0;
+				continue;
+			}
+
+			const u8 nStatus = Statuses[Random(0, sizeof(Statuses) - 1)] | Random(0, 15);
+			const size_t nLength = CMIDIParser::GetShortMessageLength(nStatus);
+			u8 Message[3] = {nStatus, static_cast<u8>(Random(0, 127)), static_cast<u8>(Random(0, 127))};
+
+			// USB MIDI event packets always carry the status byte
+			const bool bRunningStatus = !bUSB && nStatus == nRunningStatus && Random(0, 3) != 0;
+			const size_t nRealTimeOffset = !bUSB && Random(0, 19) == 0 ? Random(1, nLength - 1) : nLength;
+			for (size_t i = bRunningStatus ? 1 : 0; i < nLength; ++i)
+			{
+				if (i == nRealTimeOffset)
+					AddRealTime();
+				Stream.Bytes.push_back(Message[i]);
+			}
+
+			if (bUSB)
+				Stream.Packets.push_back({nOffset, nLength, true});
+
+			u32 nShortMessage = 0;
+			for (size_t i = 0; i < nLength; ++i)
+				nShortMessage |= Message[i] << 8 * i;
+			Stream.Expected.push_back({nShortMessage, 0, 0, Stream.Bytes.size()});
+			nRunningStatus = nStatus;
+		}
+	}
+
+	// Stands in for CMT32Pi, checking each message against the source's stream
+	class CMergeTest : public CMIDIMerger
+	{
+	public:
+		CMergeTest(const TStream* pStreams, TSourceState* pStates)
+			: m_pStreams(pStreams),
+			  m_pStates(pStates),
+			  m_nTick(0),
+			  m_nLastSource(SourceCount),
+			  m_nRunLength(0),
+			  m_nMaxRunLength(0),
+			  m_nStreamSource(SourceCount),
+			  m_nErrors(0)
+		{
+		}
+
+		// Runs are counted within a dispatch; a source that was idle before it started hasn't been skipped
+		void BeginDispatch(unsigned int nTick)
+		{
+			m_nTick = nTick;
+			m_nLastSource = SourceCount;
+		}
+
+		size_t GetMaxRunLength() const { return m_nMaxRunLength; }
+		size_t GetErrorCount() const { return m_nErrors; }
+
+	protected:
+		virtual void OnShortMessages(const TMIDIEvent* pMessages, size_t nCount) override
+		{
+			for (size_t i = 0; i < nCount; ++i)
+			{
+				const size_t nSource = pMessages[i].nCable;
+				if (nSource >= SourceCount)
+				{
+					Fail("Short message %08x has an invalid cable number %zu", pMessages[i].nMessage, nSource);
+					continue;
+				}
+
+				const TExpectedMessage* pExpected = GetNextExpected(nSource);
+				if (!pExpected || pExpected->nMessage != pMessages[i].nMessage)
+				{
+					Fail("%s: received short message %08x instead of message %zu", SourceNames[nSource], pMessages[i].nMessage, m_pStates[nSource].nReceived);
+					continue;
+				}
+
+				Received(nSource, true);
+			}
+		}
+
+		virtual void OnSysExMessage(const u8* pData, size_t nSize) override
+		{
+			const size_t nSource = nSize > 2 ? pData[2] : SourceCount;
+			if (!CheckSysEx(nSource, pData, nSize))
+				return;
+
+			Received(nSource, true);
+		}
+
+		virtual void OnSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize) override
+		{
+			if (Chunk == TSysExChunk::Abort)
+			{
+				Fail("SysEx stream aborted");
+				m_nStreamSource = SourceCount;
+				return;
+			}
+
+			if (Chunk == TSysExChunk::Begin)
+			{
+				m_StreamData.clear();
+				m_nStreamSource = nSize > 2 ? pData[2] : SourceCount;
+			}
+
+			m_StreamData.insert(m_StreamData.end(), pData, pData + nSize);
+
+			if (Chunk == TSysExChunk::End)
+			{
+				if (CheckSysEx(m_nStreamSource, m_StreamData.data(), m_StreamData.size()))
+					Received(m_nStreamSource, false);
+				m_nStreamSource = SourceCount;
+			}
+
+			// The stream holds back other sources' streams, so it's not part of a run
+			m_nLastSource = SourceCount;
+		}
+
+		virtual void OnUnexpectedStatus() override
+		{
+			Fail("Unexpected status byte");
+		}
+
+		virtual void OnSysExOverflow() override
+		{
+			Fail("SysEx overflow");
+		}
+
+	private:
+		template <class... TArgs>
+		void Fail(const char* pFormat, TArgs... Args)
+		{
+			if (!m_nErrors)
+				LOGERR(pFormat, Args...);
+			++m_nErrors;
+		}
+
+		const TExpectedMessage* GetNextExpected(size_t nSource) const
+		{
+			const TStream& Stream = m_pStreams[nSource];
+			const size_t nIndex = m_pStates[nSource].nReceived;
+			return nIndex < Stream.Expected.size() ? &Stream.Expected[nIndex] : nullptr;
+		}
+
+		bool CheckSysEx(size_t nSource, const u8* pData, size_t nSize)
+		{
+			if (nSource >= SourceCount)
+			{
+				Fail("Received SysEx from an unknown source");
+				return false;
+			}
+
+			const TExpectedMessage* pExpected = GetNextExpected(nSource);
+			if (!pExpected || pExpected->nMessage || pExpected->nSysExSize != nSize || memcmp(&m_pStreams[nSource].SysExData[pExpected->nSysExOffset], pData, nSize))
+			{
+				Fail("%s: received a %zu byte SysEx message instead of message %zu", SourceNames[nSource], nSize, m_pStates[nSource].nReceived);
+				return false;
+			}
+
+			return true;
+		}
+
+		bool IsStreamedSysEx(const TExpectedMessage& Message) const
+		{
+			return !Message.nMessage && Message.nSysExSize > CMIDIParser::SysExBufferSize;
+		}
+
+		void Received(size_t nSource, bool bCountRun)
+		{
+			TSourceState& State = m_pStates[nSource];
+			State.nMaxLatencyTicks = std::max(State.nMaxLatencyTicks, m_nTick - State.CompleteTicks[State.nReceived]);
+			++State.nReceived;
+
+			if (!bCountRun)
+				return;
+
+			m_nRunLength = nSource == m_nLastSource ? m_nRunLength + 1 : 1;
+			m_nLastSource = nSource;
+
+			// A source waiting to start a SysEx stream may be held back by another stream, so doesn't count as waiting
+			for (size_t i = 0; i < SourceCount; ++i)
+			{
+				const TSourceState& Other = m_pStates[i];
+				if (i != nSource && Other.nReceived < Other.nComplete && !IsStreamedSysEx(m_pStreams[i].Expected[Other.nReceived]))
+				{
+					m_nMaxRunLength = std::max(m_nMaxRunLength, m_nRunLength);
+					break;
+				}
+			}
+		}
+
+		const TStream* m_pStreams;
+		TSourceState* m_pStates;
+		unsigned int m_nTick;
+
+		size_t m_nLastSource;
+		size_t m_nRunLength;
+		size_t m_nMaxRunLength;
+
+		size_t m_nStreamSource;
+		std::vector<u8> m_StreamData;
+
+		size_t m_nErrors;
+	};
+
+	void Feed(CMIDIMerger& Merger, size_t nSource, const TStream& Stream, TSourceState& State, bool bFlood, u32& nRandom)
+	{
+		const TMIDISource Source = static_cast<TMIDISource>(nSource);
+		const u32 nTimestamp = CTimer::GetClockTicks();
+
+		if (!bFlood)
+			State.nOwedBytes += LineRates[nSource] / 1000.0;
+
+		while (State.nConsumed < Stream.Bytes.size() && (bFlood || State.nOwedBytes >= 1))
+		{
+			nRandom = nRandom * 1664525 + 1013904223;
+			const size_t nRemaining = Stream.Bytes.size() - State.nConsumed;
+			const size_t nAllowed = bFlood ? nRemaining : std::min(static_cast<size_t>(State.nOwedBytes), nRemaining);
+
+			size_t nSize;
+			size_t nConsumed;
+
+			if (!Stream.Packets.empty())
+			{
+				const TPacket& Packet = Stream.Packets[State.nPacket];
+				if (Packet.nSize > nAllowed)
+					break;
+
+				// A packet is passed on whole or not at all
+				nSize = Packet.nSize;
+				if (Packet.bShortMessage)
+					nConsumed = Merger.EnqueueShortMessage(Source, &Stream.Bytes[Packet.nOffset], nSize, nTimestamp, nSource) ? nSize : 0;
+				else if (Merger.GetFreeSpace(Source) >= nSize)
+					nConsumed = Merger.ParseMIDIBytes(Source, &Stream.Bytes[Packet.nOffset], nSize, nTimestamp, nSource);
+				else
+					nConsumed = 0;
+
+				if (nConsumed == nSize)
+					++State.nPacket;
+			}
+			else
+			{
+				nSize = std::min<size_t>(1 + (nRandom >> 8) % 64, nAllowed);
+				nConsumed = Merger.ParseMIDIBytes(Source, &Stream.Bytes[State.nConsumed], nSize, nTimestamp, nSource);
+			}
+
+			State.nConsumed += nConsumed;
+			State.nOwedBytes = bFlood ? 0 : State.nOwedBytes - nConsumed;
+
+			// The source's queue is full; the rest waits in the transport's own buffers
+			if (nConsumed < nSize)
+				break;
+		}
+	}
+
+	// Returns the number of errors
+	size_t RunTest(const TStream* pStreams, size_t nFloodSource, const TOptions& Options)
+	{
+		TSourceState States[SourceCount];
+		for (size_t i = 0; i < SourceCount; ++i)
+			States[i].CompleteTicks.resize(pStreams[i].Expected.size());
+
+		CMergeTest Merger(pStreams, States);
+		u32 nRandom = 0x87654321;
+		unsigned int nTick = 0;
+
+		auto IsFinished = [&]()
+		{
+			for (size_t i = 0; i < SourceCount; ++i)
+			{
+				if (States[i].nReceived < pStreams[i].Expected.size())
+					return false;
+			}
+
+			return true;
+		};
+
+		while (!IsFinished() && nTick < MaxTicks)
+		{
+			for (size_t i = 0; i < SourceCount; ++i)
+			{
+				TSourceState& State = States[i];
+				Feed(Merger, i, pStreams[i], State, i == nFloodSource, nRandom);
+
+				const std::vector<TExpectedMessage>& Expected = pStreams[i].Expected;
+				while (State.nComplete < Expected.size() && Expected[State.nComplete].nEndOffset <= State.nConsumed)
+					State.CompleteTicks[State.nComplete++] = nTick;
+			}
+
+			if (nTick % Options.nDispatchInterval == 0)
+			{
+				Merger.BeginDispatch(nTick);
+				Merger.DispatchMIDIMessages();
+			}
+
+			++nTick;
+		}
+
+		size_t nErrors = Merger.GetErrorCount();
+
+		printf("%s:\n", nFloodSource < SourceCount ? "One source flooding" : "All sources at line rate");
+		printf("  %-10s %10s %10s %10s %12s\n", "source", "rate", "sent", "received", "max latency");
+
+		for (size_t i = 0; i < SourceCount; ++i)
+		{
+			char Rate[16];
+			if (i == nFloodSource)
+				snprintf(Rate, sizeof(Rate), "flood");
+			else
+				snprintf(Rate, sizeof(Rate), "%u B/s", LineRates[i]);
+
+			printf("  %-10s %10s %10zu %10zu %9u ms\n", SourceNames[i], Rate, pStreams[i].Expected.size(), States[i].nReceived, States[i].nMaxLatencyTicks);
+
+			if (States[i].nReceived < pStreams[i].Expected.size())
+			{
+				LOGERR("%s: %zu messages lost", SourceNames[i], pStreams[i].Expected.size() - States[i].nReceived);
+				++nErrors;
+			}
+
+			if (States[i].nMaxLatencyTicks > Options.nMaxLatency + Options.nDispatchInterval)
+			{
+				LOGERR("%s: messages waited up to %u ms to be dispatched", SourceNames[i], States[i].nMaxLatencyTicks);
+				++nErrors;
+			}
+		}
+
+		printf("  Longest run from one source while others waited: %zu\n", Merger.GetMaxRunLength());
+		printf("  Simulated time: %.1f s\n", nTick / 1000.0);
+		printf("\n");
+
+		if (Merger.GetMaxRunLength() > 1)
+		{
+			LOGERR("Sources were not serviced in turn");
+			++nErrors;
+		}
+
+		return nErrors;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	TOptions Options;
+	if (!ParseArguments(argc, argv, Options))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	CLogger Logger(Options.bVerbose ? LogDebug : LogWarning);
+
+	TStream Streams[SourceCount];
+	for (size_t i = 0; i < SourceCount; ++i)
+		GenerateStream(i, Options.nMessages, Streams[i]);
+
+	size_t nErrors = RunTest(Streams, SourceCount, Options);
+	nErrors += RunTest(Streams, static_cast<size_t>(TMIDISource::USB), Options);
+
+	if (nErrors)
+	{
+		LOGERR("Messages were lost, reordered, corrupted or held up");
+		return EXIT_FAILURE;
+	}
+
+	printf("Every message was received once, in order and in time, and every source was serviced in turn\n");
+	return EXIT_SUCCESS;
+}
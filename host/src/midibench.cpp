@@ -0,0 +1,341 @@
+//
+// midibench.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Benchmark for the cost of MIDI capture on the MIDI input path.
+// A synthetic stream at full DIN bandwidth is parsed and merged by the same code used by the kernel, with and without
+// the MIDI recorder attached, and the CPU time spent on the parsing thread is compared.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include <circle/logger.h>
+#include <circle/sched/scheduler.h>
+#include <circle/timer.h>
+#include <fatfs/ff.h>
+
+#include "midimerger.h"
+#include "midirecorder.h"
+
+LOGMODULE("midibench");
+
+namespace
+{
+	// 31250 baud with 10 bits per byte
+	constexpr unsigned int DINBytesPerSecond = 3125;
+	constexpr unsigned int DINMicrosPerByte = 1000000 / DINBytesPerSecond;
+
+	// Bytes that arrive during one pass of the main loop, which polls roughly every millisecond
+	constexpr size_t BytesPerPass = 4;
+
+	// The stream is parsed far faster than real time, so give the recorder's writer thread time to catch up now and
+	// then, as it would have on the Pi; time spent sleeping isn't counted as CPU time
+	constexpr size_t BytesPerWriterPause = DINBytesPerSecond * 10;
+	constexpr timespec WriterPause = {0, 5000000};
+
+	constexpr unsigned int DefaultSeconds = 600;
+	constexpr unsigned int DefaultRuns = 5;
+
+	struct TOptions
+	{
+		const char* pOutputPath = "/tmp";
+		unsigned int nSeconds   = DefaultSeconds;
+		unsigned int nRuns      = DefaultRuns;
+		bool bVerbose           = false;
+	};
+
+	// Stands in for CMT32Pi, without the synth
+	class CMIDIBench : public CMIDIMerger
+	{
+	public:
+		CMIDIBench(CMIDIRecorder* pRecorder) : m_pRecorder(pRecorder), m_nShortMessages(0), m_nSysExMessages(0), m_nChecksum(0) {}
+
+		size_t GetShortMessageCount() const { return m_nShortMessages; }
+		size_t GetSysExMessageCount() const { return m_nSysExMessages; }
+		u32 GetChecksum() const { return m_nChecksum; }
+
+	protected:
+		virtual void OnShortMessages(const TMIDIEvent* pMessages, size_t nCount) override
+		{
+			if (m_pRecorder && m_pRecorder->IsRecording())
+				m_pRecorder->RecordShortMessages(pMessages, nCount);
+
+			for (size_t i = 0; i < nCount; ++i)
+				m_nChecksum += pMessages[i].nMessage;
+			m_nShortMessages += nCount;
+		}
+
+		virtual void OnSysExMessage(const u8* pData, size_t nSize) override
+		{
+			if (m_pRecorder && m_pRecorder->IsRecording())
+				m_pRecorder->RecordSysExMessage(pData, nSize, GetMessageTimestamp());
+
+			m_nChecksum += pData[nSize - 2];
+			++m_nSysExMessages;
+		}
+
+		virtual void OnSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize) override
+		{
+			if (m_pRecorder && m_pRecorder->IsRecording())
+				m_pRecorder->RecordSysExChunk(Chunk, pData, nSize, GetMessageTimestamp());
+		}
+
+	private:
+		CMIDIRecorder* m_pRecorder;
+		size_t m_nShortMessages;
+		size_t m_nSysExMessages;
+		u32 m_nChecksum;
+	};
+
+	void PrintUsage(const char* pProgramName)
+	{
+		fprintf(stderr,
+			"Usage: %s [options]\n"
+			"\n"
+			"Measures the CPU time added to the MIDI input path by MIDI capture, using a\n"
+			"synthetic stream at full DIN bandwidth.\n"
+			"\n"
+			"  -o, --output <dir>       Directory to save recordings into (default: /tmp)\n"
+			"  -s, --seconds <n>        Length of the MIDI stream (default: %d)\n"
+			"  -r, --runs <n>           Runs of each case; the fastest is reported (default: %d)\n"
+			"  -v, --verbose            Show debug messages\n",
+			pProgramName, DefaultSeconds, DefaultRuns);
+	}
+
+	bool ParseArguments(int argc, char** argv, TOptions& Options)
+	{
+		static const option LongOptions[] = {
+			{"output",  required_argument, nullptr, 'o'},
+			{"seconds", required_argument, nullptr, 's'},
+			{"runs",    required_argument, nullptr, 'r'},
+			{"verbose", no_argument,       nullptr, 'v'},
+			{nullptr,   0,                 nullptr, 0},
+		};
+
+		int nOption;
+		while ((nOption = getopt_long(argc, argv, "o:s:r:v", LongOptions, nullptr)) != -1)
+		{
+			switch (nOption)
+			{
+				case 'o': Options.pOutputPath = optarg; break;
+				case 's': Options.nSeconds    = atoi(optarg); break;
+				case 'r': Options.nRuns       = atoi(optarg); break;
+				case 'v': Options.bVerbose    = true; break;
+				default:  return false;
+			}
+		}
+
+		return optind == argc && Options.nSeconds > 0 && Options.nRuns > 0;
+	}
+
+	// A busy General MIDI/MT-32 style stream: notes (mostly with running status), controllers, pitch bend, program
+	// changes, active sensing every 300ms and a short Roland DT1 SysEx message every couple of seconds
+	std::vector<u8> GenerateStream(unsigned int nSeconds)
+	{
+		const size_t nSize = static_cast<size_t>(nSeconds) * DINBytesPerSecond;
+		std::vector<u8> Stream;
+		Stream.reserve(nSize + 64);
+
+		u32 nRandom = 0x12345678;
+		auto Random = [&nRandom](u32 nRange)
+		{
+			nRandom = nRandom * 1664525 + 1013904223;
+			return (nRandom >> 8) % nRange;
+		};
+
+		size_t nNextActiveSense = DINBytesPerSecond * 3 / 10;
+		size_t nNextSysEx = DINBytesPerSecond * 2;
+		u8 nRunningStatus = 0;
+
+		while (Stream.size() < nSize)
+		{
+			if (Stream.size() >= nNextActiveSense)
+			{
+				Stream.push_back(0xFE);
+				nNextActiveSense += DINBytesPerSecond * 3 / 10;
+				continue;
+			}
+
+			if (Stream.size() >= nNextSysEx)
+			{
+				// Set reverb mode/time/level (F0 41 10 16 12 10 00 01 ...)
+				const u8 SysEx[] = { 0xF0, 0x41, 0x10, 0x16, 0x12, 0x10, 0x00, 0x01, static_cast<u8>(Random(4)), static_cast<u8>(Random(8)), static_cast<u8>(Random(8)), 0x00, 0xF7 };
+				u8 nChecksum = 0;
+				for (size_t i = 5; i < sizeof(SysEx) - 2; ++i)
+					nChecksum += SysEx[i];
+
+				Stream.insert(Stream.end(), SysEx, SysEx + sizeof(SysEx));
+				Stream[Stream.size() - 2] = (128 - (nChecksum & 0x7F)) & 0x7F;
+				nRunningStatus = 0;
+				nNextSysEx += DINBytesPerSecond * 2;
+				continue;
+			}
+
+			const u8 nChannel = Random(16);
+			const u32 nType = Random(100);
+			u8 nStatus;
+			u8 Data[2];
+			size_t nDataSize = 2;
+
+			if (nType < 70)
+			{
+				// Note on/off (velocity 0) on a handful of channels, so that running status is often used
+				nStatus = 0x90 | (nChannel & 0x03);
+				Data[0] = 36 + Random(48);
+				Data[1] = Random(2) ? 0 : 1 + Random(127);
+			}
+			else if (nType < 88)
+			{
+				nStatus = 0xB0 | nChannel;
+				Data[0] = Random(2) ? 7 : 10 + Random(2) * 81;
+				Data[1] = Random(128);
+			}
+			else if (nType < 97)
+			{
+				nStatus = 0xE0 | nChannel;
+				Data[0] = Random(128);
+				Data[1] = Random(128);
+			}
+			else
+			{
+				nStatus = 0xC0 | nChannel;
+				Data[0] = Random(128);
+				nDataSize = 1;
+			}
+
+			if (nStatus != nRunningStatus)
+				Stream.push_back(nStatus);
+			nRunningStatus = nStatus;
+			Stream.insert(Stream.end(), Data, Data + nDataSize);
+		}
+
+		return Stream;
+	}
+
+	u64 GetThreadCPUNanos()
+	{
+		timespec Time;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &Time);
+		return static_cast<u64>(Time.tv_sec) * 1000000000 + Time.tv_nsec;
+	}
+
+	// Feeds the stream in the amounts that would arrive per pass of the main loop; returns the CPU time taken
+	u64 RunPass(const std::vector<u8>& Stream, CMIDIBench& Bench)
+	{
+		const u32 nStartTicks = CTimer::GetClockTicks();
+		const u64 nStartNanos = GetThreadCPUNanos();
+
+		for (size_t nOffset = 0; nOffset < Stream.size();)
+		{
+			const size_t nSize = Utility::Min(BytesPerPass, Stream.size() - nOffset);
+			const u32 nTimestamp = nStartTicks + nOffset * DINMicrosPerByte;
+
+			nOffset += Bench.ParseMIDIBytes(TMIDISource::Serial, Stream.data() + nOffset, nSize, nTimestamp);
+			while (Bench.DispatchMIDIMessages())
+				;
+
+			if (nOffset % BytesPerWriterPause < nSize)
+				nanosleep(&WriterPause, nullptr);
+		}
+
+		return GetThreadCPUNanos() - nStartNanos;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	TOptions Options;
+	if (!ParseArguments(argc, argv, Options))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	CLogger Logger(Options.bVerbose ? LogDebug : LogWarning);
+
+	FATFS OutputFileSystem{Options.pOutputPath};
+	if (f_mount(&OutputFileSystem, "SD:", 1) != FR_OK)
+	{
+		LOGERR("Couldn't use '%s' for recordings", Options.pOutputPath);
+		return EXIT_FAILURE;
+	}
+
+	const std::vector<u8> Stream = GenerateStream(Options.nSeconds);
+
+	// The recorder task must outlive the program; start its thread as the scheduler would
+	CMIDIRecorder* const pRecorder = new CMIDIRecorder();
+	CScheduler::Get()->Yield();
+
+	u64 nBaselineNanos = UINT64_MAX;
+	u64 nCaptureNanos = UINT64_MAX;
+	size_t nShortMessages = 0;
+	size_t nSysExMessages = 0;
+	size_t nDroppedMessages = 0;
+
+	// Alternate between the two cases so that both see the same machine conditions
+	for (unsigned int nRun = 0; nRun < Options.nRuns; ++nRun)
+	{
+		CMIDIBench* pBench = new CMIDIBench(nullptr);
+		nBaselineNanos = Utility::Min(nBaselineNanos, RunPass(Stream, *pBench));
+		nShortMessages = pBench->GetShortMessageCount();
+		nSysExMessages = pBench->GetSysExMessageCount();
+		delete pBench;
+
+		if (!pRecorder->Start("SD"))
+		{
+			LOGERR("Couldn't start recording");
+			return EXIT_FAILURE;
+		}
+
+		pBench = new CMIDIBench(pRecorder);
+		nCaptureNanos = Utility::Min(nCaptureNanos, RunPass(Stream, *pBench));
+		delete pBench;
+
+		nDroppedMessages = Utility::Max(nDroppedMessages, pRecorder->GetDroppedCount());
+		pRecorder->Stop();
+		while (pRecorder->GetState() == CMIDIRecorder::TState::Stopping)
+			CScheduler::Get()->Yield();
+
+		if (pRecorder->GetState() != CMIDIRecorder::TState::Idle)
+		{
+			LOGERR("Recording failed");
+			return EXIT_FAILURE;
+		}
+	}
+
+	const double nStreamSeconds = Options.nSeconds;
+	const double nOverheadNanos = nCaptureNanos > nBaselineNanos ? nCaptureNanos - nBaselineNanos : 0;
+
+	printf("MIDI stream:       %u s at %u bytes/s (%zu bytes, %zu short messages, %zu SysEx messages)\n", Options.nSeconds, DINBytesPerSecond, Stream.size(), nShortMessages, nSysExMessages);
+	printf("Without capture:   %.3f ms CPU (%.1f us per second of MIDI)\n", nBaselineNanos / 1e6, nBaselineNanos / 1e3 / nStreamSeconds);
+	printf("With capture:      %.3f ms CPU (%.1f us per second of MIDI)\n", nCaptureNanos / 1e6, nCaptureNanos / 1e3 / nStreamSeconds);
+	printf("\n");
+	printf("Capture overhead:  %.1f ns per message, %.1f us per second of MIDI\n", nOverheadNanos / (nShortMessages + nSysExMessages), nOverheadNanos / 1e3 / nStreamSeconds);
+	printf("                   %.4f%% of one core at full DIN bandwidth\n", nOverheadNanos / 1e7 / nStreamSeconds);
+	printf("                   %.1f%% of the parse/merge path itself\n", nBaselineNanos ? nOverheadNanos * 100 / nBaselineNanos : 0.0);
+	printf("Messages dropped:  %zu\n", nDroppedMessages);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,344 @@
+//
+// onsetbench.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Benchmark for note timing with and without sample-accurate MIDI.
+// Drum hits are sent at random times, as they would arrive from a MIDI input, and rendered by the same synth code used
+// by the kernel. Without sample-accurate timing, each message is applied at the start of the block after it arrived;
+// with it, the message is passed to the synth with its frame offset, one block later. The delay from each hit's arrival
+// to its onset in the rendered audio is measured, and its spread (the onset jitter) is compared between the two.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <circle/logger.h>
+#include <circle/memory.h>
+#include <fatfs/ff.h>
+
+#include "config.h"
+#include "synth/mt32synth.h"
+#include "synth/soundfontsynth.h"
+#include "zoneallocator.h"
+
+LOGMODULE("onsetbench");
+
+namespace
+{
+	constexpr size_t HeapMegabytes = 1024;
+	constexpr size_t MaxBlockFrames = 4096;
+
+	constexpr unsigned int DefaultHits = 200;
+	constexpr unsigned int DefaultSpacingMillis = 1000;
+	constexpr unsigned int HitLengthMillis = 100;
+
+	// Acoustic snare on the rhythm channel; present on the MT-32 and in General MIDI
+	constexpr u32 HitNoteOn  = 0x99 | 38 << 8 | 127 << 16;
+	constexpr u32 HitNoteOff = 0x89 | 38 << 8;
+
+	// Level at which a hit is considered to have started; anything left of the previous hit must have decayed below it
+	constexpr float OnsetThreshold = 0.01f;
+
+	struct TOptions
+	{
+		const char* pSDPath       = "sdcard";
+		const char* pConfigPath   = "mt32-pi.cfg";
+		const char* pSynth        = nullptr;
+		unsigned int nHits        = DefaultHits;
+		unsigned int nSpacing     = DefaultSpacingMillis;
+		int nBlockFrames          = -1;
+		bool bVerbose             = false;
+	};
+
+	struct TStats
+	{
+		double nMinMicros;
+		double nMeanMicros;
+		double nMaxMicros;
+		double nStdDevMicros;
+	};
+
+	void PrintUsage(const char* pProgramName)
+	{
+		fprintf(stderr,
+			"Usage: %s [options]\n"
+			"\n"
+			"Measures the jitter of note onsets with and without sample-accurate MIDI\n"
+			"timing, by rendering drum hits sent at random times through each synth.\n"
+			"\n"
+			"  -d, --sd <dir>           Directory standing in for the SD card (default: sdcard)\n"
+			"  -c, --config <path>      Config file, relative to the SD card (default: mt32-pi.cfg)\n"
+			"  -s, --synth <synth>      mt32 or soundfont (default: both)\n"
+			"  -n, --hits <n>           Number of drum hits (default: %d)\n"
+			"  -g, --spacing <ms>       Average time between hits (default: %d)\n"
+			"  -b, --block <frames>     Frames rendered per block (default: chunk_size / 2)\n"
+			"  -v, --verbose            Show debug messages\n",
+			pProgramName, DefaultHits, DefaultSpacingMillis);
+	}
+
+	bool ParseArguments(int argc, char** argv, TOptions& Options)
+	{
+		static const option LongOptions[] = {
+			{"sd",      required_argument, nullptr, 'd'},
+			{"config",  required_argument, nullptr, 'c'},
+			{"synth",   required_argument, nullptr, 's'},
+			{"hits",    required_argument, nullptr, 'n'},
+			{"spacing", required_argument, nullptr, 'g'},
+			{"block",   required_argument, nullptr, 'b'},
+			{"verbose", no_argument,       nullptr, 'v'},
+			{nullptr,   0,                 nullptr, 0},
+		};
+
+		int nOption;
+		while ((nOption = getopt_long(argc, argv, "d:c:s:n:g:b:v", LongOptions, nullptr)) != -1)
+		{
+			switch (nOption)
+			{
+				case 'd': Options.pSDPath      = optarg; break;
+				case 'c': Options.pConfigPath  = optarg; break;
+				case 's': Options.pSynth       = optarg; break;
+				case 'n': Options.nHits        = atoi(optarg); break;
+				case 'g': Options.nSpacing     = atoi(optarg); break;
+				case 'b': Options.nBlockFrames = atoi(optarg); break;
+				case 'v': Options.bVerbose     = true; break;
+				default:  return false;
+			}
+		}
+
+		if (Options.pSynth && strcmp(Options.pSynth, "mt32") && strcmp(Options.pSynth, "soundfont"))
+			return false;
+
+		return optind == argc && Options.nHits > 0 && Options.nSpacing > HitLengthMillis * 2;
+	}
+
+	// Arrival frames of the hits; each lands at a random point within a few blocks of its slot
+	std::vector<u32> GenerateArrivals(unsigned int nSampleRate, size_t nBlockFrames, const TOptions& Options)
+	{
+		const u32 nSpacingFrames = static_cast<u64>(Options.nSpacing) * nSampleRate / 1000;
+		const u32 nSpreadFrames = Utility::Min<u32>(nBlockFrames * 4, nSpacingFrames / 2);
+
+		u32 nRandom = 0x12345678;
+		std::vector<u32> Arrivals;
+
+		for (unsigned int i = 0; i < Options.nHits; ++i)
+		{
+			nRandom = nRandom * 1664525 + 1013904223;
+			Arrivals.push_back((i + 1) * nSpacingFrames + (nRandom >> 8) % nSpreadFrames);
+		}
+
+		return Arrivals;
+	}
+
+	// Renders the hits and returns the delay from the arrival of each one to its onset in frames
+	bool MeasureDelays(CSynthBase& Synth, unsigned int nSampleRate, size_t nBlockFrames, const std::vector<u32>& Arrivals, bool bSampleAccurate, std::vector<u32>& Delays)
+	{
+		const u32 nHitLengthFrames = static_cast<u64>(HitLengthMillis) * nSampleRate / 1000;
+
+		// Note ons and offs in order of arrival
+		std::vector<TMIDIEvent> Events;
+		for (u32 nArrival : Arrivals)
+		{
+			Events.push_back(TMIDIEvent{nArrival, HitNoteOn, 0});
+			Events.push_back(TMIDIEvent{nArrival + nHitLengthFrames, HitNoteOff, 0});
+		}
+
+		const size_t nTotalFrames = Arrivals.back() + nSampleRate;
+		std::vector<float> Levels;
+		Levels.reserve(nTotalFrames + nBlockFrames);
+
+		float Buffer[MaxBlockFrames * 2];
+		TMIDIEvent BlockEvents[64];
+		size_t nNextEvent = 0;
+
+		for (size_t nBlockStart = 0; nBlockStart < nTotalFrames; nBlockStart += nBlockFrames)
+		{
+			// Messages that arrived while the previous block was playing are picked up by the audio core for this one
+			size_t nEvents = 0;
+			while (nNextEvent < Events.size() && Events[nNextEvent].nTimestamp < nBlockStart && nEvents < Utility::ArraySize(BlockEvents))
+			{
+				BlockEvents[nEvents] = Events[nNextEvent++];
+				BlockEvents[nEvents].nTimestamp -= nBlockStart - Utility::Min(nBlockStart, nBlockFrames);
+				++nEvents;
+			}
+
+			if (bSampleAccurate && nEvents)
+				Synth.RenderWithMIDIEvents(Buffer, nBlockFrames, BlockEvents, nEvents);
+			else
+			{
+				for (size_t i = 0; i < nEvents; ++i)
+					Synth.HandleMIDIShortMessage(BlockEvents[i].nMessage);
+
+				Synth.Render(Buffer, nBlockFrames);
+			}
+
+			for (size_t i = 0; i < nBlockFrames; ++i)
+				Levels.push_back(Utility::Max(fabsf(Buffer[i * 2]), fabsf(Buffer[i * 2 + 1])));
+		}
+
+		Delays.clear();
+		for (u32 nArrival : Arrivals)
+		{
+			if (Levels[nArrival] >= OnsetThreshold)
+			{
+				LOGERR("The previous hit hasn't decayed by the time the next one arrives; increase the spacing");
+				return false;
+			}
+
+			size_t nFrame = nArrival;
+			while (nFrame < Levels.size() && Levels[nFrame] < OnsetThreshold)
+				++nFrame;
+
+			if (nFrame == Levels.size())
+			{
+				LOGERR("No onset found for the hit at frame %u", nArrival);
+				return false;
+			}
+
+			Delays.push_back(nFrame - nArrival);
+		}
+
+		return true;
+	}
+
+	TStats GetStats(const std::vector<u32>& Delays, unsigned int nSampleRate)
+	{
+		const double nMicrosPerFrame = 1e6 / nSampleRate;
+		const auto MinMax = std::minmax_element(Delays.begin(), Delays.end());
+
+		double nSum = 0, nSumSquares = 0;
+		for (u32 nDelay : Delays)
+		{
+			nSum += nDelay;
+			nSumSquares += static_cast<double>(nDelay) * nDelay;
+		}
+
+		const double nMean = nSum / Delays.size();
+		const double nVariance = Utility::Max(nSumSquares / Delays.size() - nMean * nMean, 0.0);
+
+		return TStats{*MinMax.first * nMicrosPerFrame, nMean * nMicrosPerFrame, *MinMax.second * nMicrosPerFrame, sqrt(nVariance) * nMicrosPerFrame};
+	}
+
+	void PrintStats(const char* pName, const TStats& Stats)
+	{
+		printf("  %-18s %8.0f %8.0f %8.0f %8.0f %8.1f\n", pName, Stats.nMinMicros, Stats.nMeanMicros, Stats.nMaxMicros, Stats.nMaxMicros - Stats.nMinMicros, Stats.nStdDevMicros);
+	}
+
+	CSynthBase* CreateSynth(const CConfig& Config, bool bSoundFont)
+	{
+		CSynthBase* pSynth;
+
+		if (bSoundFont)
+			pSynth = new CSoundFontSynth(Config.AudioSampleRate);
+		else
+			pSynth = new CMT32Synth(Config.AudioSampleRate, Config.MT32EmuGain, Config.MT32EmuReverbGain, Config.MT32EmuResamplerQuality);
+
+		if (!pSynth->Initialize())
+		{
+			if (bSoundFont)
+				LOGERR("FluidSynth init failed; no SoundFonts present?");
+			else
+				LOGERR("mt32emu init failed; no ROMs present?");
+
+			delete pSynth;
+			return nullptr;
+		}
+
+		pSynth->SetMasterVolume(100);
+		return pSynth;
+	}
+
+	// Each mode gets a fresh synth so that neither inherits the other's state
+	bool RunSynth(const CConfig& Config, size_t nBlockFrames, const std::vector<u32>& Arrivals, bool bSoundFont)
+	{
+		const unsigned int nSampleRate = Config.AudioSampleRate;
+		std::vector<u32> Delays[2];
+
+		for (int nMode = 0; nMode < 2; ++nMode)
+		{
+			CSynthBase* const pSynth = CreateSynth(Config, bSoundFont);
+			if (!pSynth)
+				return false;
+
+			const bool bResult = MeasureDelays(*pSynth, nSampleRate, nBlockFrames, Arrivals, nMode == 1, Delays[nMode]);
+			delete pSynth;
+
+			if (!bResult)
+				return false;
+		}
+
+		printf("%s, %zu-frame blocks (%.0f us), %zu hits:\n", bSoundFont ? "FluidSynth" : "mt32emu", nBlockFrames, nBlockFrames * 1e6 / nSampleRate, Arrivals.size());
+		printf("  %-18s %8s %8s %8s %8s %8s\n", "onset delay (us)", "min", "mean", "max", "jitter", "std dev");
+		PrintStats("block start", GetStats(Delays[0], nSampleRate));
+		PrintStats("sample-accurate", GetStats(Delays[1], nSampleRate));
+		printf("\n");
+
+		return true;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	TOptions Options;
+	if (!ParseArguments(argc, argv, Options))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	CLogger Logger(Options.bVerbose ? LogDebug : LogWarning);
+	CMemorySystem Memory(HeapMegabytes * MEGABYTE);
+
+	FATFS SDFileSystem{Options.pSDPath};
+	if (f_mount(&SDFileSystem, "SD:", 1) != FR_OK)
+	{
+		LOGERR("Couldn't use '%s' as the SD card", Options.pSDPath);
+		return EXIT_FAILURE;
+	}
+
+	CConfig Config;
+	if (!Config.Initialize(Options.pConfigPath))
+		LOGWARN("Unable to find or parse config file; using defaults");
+
+	// The secondary FluidSynth instance would need a thread of its own; timing doesn't depend on it
+	Config.FluidSynthParallelRendering = false;
+
+	CZoneAllocator Allocator;
+	if (!Allocator.Initialize(static_cast<size_t>(Utility::Clamp(Config.SystemSmallAllocArena, 0, 65536)) * KILOBYTE))
+		return EXIT_FAILURE;
+
+	const size_t nBlockFrames = Utility::Clamp<size_t>(Options.nBlockFrames > 0 ? Options.nBlockFrames : Config.AudioChunkSize / 2, 1, MaxBlockFrames);
+	const std::vector<u32> Arrivals = GenerateArrivals(Config.AudioSampleRate, nBlockFrames, Options);
+
+	bool bSuccess = true;
+
+	if (!Options.pSynth || !strcmp(Options.pSynth, "mt32"))
+		bSuccess &= RunSynth(Config, nBlockFrames, Arrivals, false);
+
+	if (!Options.pSynth || !strcmp(Options.pSynth, "soundfont"))
+		bSuccess &= RunSynth(Config, nBlockFrames, Arrivals, true);
+
+	return bSuccess ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,343 @@
+//
+// ringbench.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Stress test and benchmark for the MIDI receive ring buffer.
+// A producer thread stands in for the USB/Pisound IRQ handler and a consumer thread for the main task's MIDI polling,
+// on separate cores. Threads yield while they have nothing to do, so that the test also completes on a single CPU.
+// Every byte is checked to arrive exactly once and in order, and the throughput and the time from
+// enqueue to dequeue are compared between the lock-free buffer and the spinlock-based one it replaced.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <circle/logger.h>
+
+#include "midievent.h"
+#include "ringbuffer.h"
+
+LOGMODULE("ringbench");
+
+namespace
+{
+	// Same as CMT32Pi::MIDIRxBufferSize and CMT32Pi::MIDIRxSliceSize; the main task drains the buffer in slices
+	constexpr size_t BufferSize = 2048;
+	constexpr size_t SliceSize = 128;
+
+	// Largest number of bytes queued by one call of the IRQ handler (a full USB bulk transfer)
+	constexpr size_t MaxBurstSize = 64;
+
+	// Bytes of a USB MIDI event packet carrying a short message
+	constexpr size_t PacketSize = 3;
+
+	constexpr unsigned int DefaultMegabytes = 64;
+	constexpr unsigned int DefaultPackets = 200000;
+	constexpr unsigned int DefaultPeriodMicros = 20;
+	constexpr unsigned int DefaultRuns = 5;
+
+	using TLockedBuffer   = CRingBuffer<TMIDIRxByte, BufferSize>;
+	using TLockFreeBuffer = CSPSCRingBuffer<TMIDIRxByte, BufferSize>;
+
+	struct TOptions
+	{
+		unsigned int nMegabytes    = DefaultMegabytes;
+		unsigned int nPackets      = DefaultPackets;
+		unsigned int nPeriodMicros = DefaultPeriodMicros;
+		unsigned int nRuns         = DefaultRuns;
+		bool bVerbose              = false;
+	};
+
+	struct TResult
+	{
+		u64 nThroughputNanos = UINT64_MAX;
+		std::vector<u32> LatencyNanos;
+		size_t nErrors = 0;
+	};
+
+	void PrintUsage(const char* pProgramName)
+	{
+		fprintf(stderr,
+			"Usage: %s [options]\n"
+			"\n"
+			"Checks that the MIDI receive ring buffer passes every byte exactly once and in\n"
+			"order between two threads, and compares its throughput and enqueue to dequeue\n"
+			"latency with the spinlock-based ring buffer.\n"
+			"\n"
+			"  -m, --megabytes <n>      Data passed through per throughput run (default: %d)\n"
+			"  -p, --packets <n>        Packets sent for the latency test (default: %d)\n"
+			"  -i, --interval <us>      Time between packets in the latency test (default: %d)\n"
+			"  -r, --runs <n>           Throughput runs of each buffer; the fastest is reported (default: %d)\n"
+			"  -v, --verbose            Show debug messages\n",
+			pProgramName, DefaultMegabytes, DefaultPackets, DefaultPeriodMicros, DefaultRuns);
+	}
+
+	bool ParseArguments(int argc, char** argv, TOptions& Options)
+	{
+		static const option LongOptions[] = {
+			{"megabytes", required_argument, nullptr, 'm'},
+			{"packets",   required_argument, nullptr, 'p'},
+			{"interval",  required_argument, nullptr, 'i'},
+			{"runs",      required_argument, nullptr, 'r'},
+			{"verbose",   no_argument,       nullptr, 'v'},
+			{nullptr,     0,                 nullptr, 0},
+		};
+
+		int nOption;
+		while ((nOption = getopt_long(argc, argv, "m:p:i:r:v", LongOptions, nullptr)) != -1)
+		{
+			switch (nOption)
+			{
+				case 'm': Options.nMegabytes    = atoi(optarg); break;
+				case 'p': Options.nPackets      = atoi(optarg); break;
+				case 'i': Options.nPeriodMicros = atoi(optarg); break;
+				case 'r': Options.nRuns         = atoi(optarg); break;
+				case 'v': Options.bVerbose      = true; break;
+				default:  return false;
+			}
+		}
+
+		return optind == argc && Options.nMegabytes > 0 && Options.nPackets > 0 && Options.nRuns > 0;
+	}
+
+	u64 GetNanos()
+	{
+		timespec Time;
+		clock_gettime(CLOCK_MONOTONIC, &Time);
+		return static_cast<u64>(Time.tv_sec) * 1000000000 + Time.tv_nsec;
+	}
+
+	// Passes nBytes bytes through the buffer as fast as possible, in bursts of random size; returns the number of bytes
+	// that arrived out of order, more than once or not at all
+	template <class TBuffer>
+	size_t RunThroughput(TBuffer& Buffer, size_t nBytes, u64& nNanos)
+	{
+		std::atomic<bool> bProducerDone{false};
+		size_t nErrors = 0;
+
+		const u64 nStartNanos = GetNanos();
+
+		std::thread Consumer([&]
+		{
+			TMIDIRxByte Items[SliceSize];
+			u32 nExpected = 0;
+
+			while (true)
+			{
+				// Check for the producer finishing before draining, so that nothing it enqueued is missed
+				const bool bDone = bProducerDone.load(std::memory_order_acquire);
+				const size_t nCount = Buffer.Dequeue(Items, SliceSize);
+				if (!nCount && bDone)
+					break;
+				if (!nCount)
+					std::this_thread::yield();
+
+				for (size_t i = 0; i < nCount; ++i)
+				{
+					if (Items[i].nTimestamp != nExpected || Items[i].nByte != (nExpected & 0x7F) || Items[i].nSource != (nExpected & 0x03))
+					{
+						++nErrors;
+						nExpected = Items[i].nTimestamp;
+					}
+
+					++nExpected;
+				}
+			}
+
+			nErrors += nBytes > nExpected ? nBytes - nExpected : nExpected - nBytes;
+		});
+
+		u32 nRandom = 0x12345678;
+		TMIDIRxByte Burst[MaxBurstSize];
+		u32 nSequence = 0;
+
+		while (nSequence < nBytes)
+		{
+			nRandom = nRandom * 1664525 + 1013904223;
+			const size_t nBurstSize = Utility::Min<size_t>(1 + (nRandom >> 8) % MaxBurstSize, nBytes - nSequence);
+
+			for (size_t i = 0; i < nBurstSize; ++i, ++nSequence)
+				Burst[i] = TMIDIRxByte{nSequence, static_cast<u8>(nSequence & 0x7F), static_cast<u8>(nSequence & 0x03)};
+
+			// Wait for room rather than dropping, so that every byte can be checked
+			for (size_t nQueued = Buffer.Enqueue(Burst, nBurstSize); nQueued < nBurstSize; std::this_thread::yield())
+				nQueued += Buffer.Enqueue(Burst + nQueued, nBurstSize - nQueued);
+		}
+
+		bProducerDone.store(true, std::memory_order_release);
+		Consumer.join();
+
+		nNanos = GetNanos() - nStartNanos;
+		return nErrors;
+	}
+
+	// Sends a packet at fixed intervals and measures the time until each one is dequeued by a consumer that is polling
+	// the buffer continuously; returns the number of packets that arrived out of order or incomplete
+	template <class TBuffer>
+	size_t RunLatency(TBuffer& Buffer, size_t nPackets, unsigned int nPeriodMicros, std::vector<u32>& LatencyNanos)
+	{
+		// Written before each packet is enqueued; made visible to the consumer by the buffer itself
+		std::vector<u64> EnqueueNanos(nPackets);
+		std::atomic<bool> bProducerDone{false};
+		size_t nErrors = 0;
+
+		LatencyNanos.clear();
+		LatencyNanos.reserve(nPackets);
+
+		std::thread Consumer([&]
+		{
+			TMIDIRxByte Items[SliceSize];
+			u32 nExpectedPacket = 0;
+			u8 nExpectedByte = 0;
+
+			while (nExpectedPacket < nPackets)
+			{
+				const bool bDone = bProducerDone.load(std::memory_order_acquire);
+				const size_t nCount = Buffer.Dequeue(Items, SliceSize);
+				const u64 nDequeueNanos = GetNanos();
+				if (!nCount && bDone)
+					break;
+				if (!nCount)
+					std::this_thread::yield();
+
+				for (size_t i = 0; i < nCount; ++i)
+				{
+					if (Items[i].nTimestamp != nExpectedPacket || Items[i].nByte != nExpectedByte)
+					{
+						++nErrors;
+						nExpectedPacket = Items[i].nTimestamp;
+						nExpectedByte = Items[i].nByte;
+					}
+
+					if (++nExpectedByte < PacketSize || nExpectedPacket >= nPackets)
+						continue;
+
+					LatencyNanos.push_back(nDequeueNanos - EnqueueNanos[nExpectedPacket]);
+					++nExpectedPacket;
+					nExpectedByte = 0;
+				}
+			}
+		});
+
+		const u64 nPeriodNanos = static_cast<u64>(nPeriodMicros) * 1000;
+		u64 nNextNanos = GetNanos();
+
+		for (u32 nPacket = 0; nPacket < nPackets; ++nPacket)
+		{
+			while (GetNanos() < nNextNanos)
+				std::this_thread::yield();
+			nNextNanos += nPeriodNanos;
+
+			const TMIDIRxByte Packet[PacketSize] = {{nPacket, 0, 0}, {nPacket, 1, 0}, {nPacket, 2, 0}};
+			EnqueueNanos[nPacket] = GetNanos();
+
+			for (size_t nQueued = Buffer.Enqueue(Packet, PacketSize); nQueued < PacketSize; std::this_thread::yield())
+				nQueued += Buffer.Enqueue(Packet + nQueued, PacketSize - nQueued);
+		}
+
+		bProducerDone.store(true, std::memory_order_release);
+		Consumer.join();
+
+		return nErrors + nPackets - LatencyNanos.size();
+	}
+
+	template <class TBuffer>
+	TResult RunBenchmark(const TOptions& Options)
+	{
+		TResult Result;
+		TBuffer* const pBuffer = new TBuffer();
+
+		for (unsigned int nRun = 0; nRun < Options.nRuns; ++nRun)
+		{
+			u64 nNanos;
+			Result.nErrors += RunThroughput(*pBuffer, static_cast<size_t>(Options.nMegabytes) * MEGABYTE, nNanos);
+			Result.nThroughputNanos = Utility::Min(Result.nThroughputNanos, nNanos);
+		}
+
+		Result.nErrors += RunLatency(*pBuffer, Options.nPackets, Options.nPeriodMicros, Result.LatencyNanos);
+		std::sort(Result.LatencyNanos.begin(), Result.LatencyNanos.end());
+
+		delete pBuffer;
+		return Result;
+	}
+
+	u32 Percentile(const std::vector<u32>& SortedValues, unsigned int nPermille)
+	{
+		if (SortedValues.empty())
+			return 0;
+
+		return SortedValues[Utility::Min(SortedValues.size() * nPermille / 1000, SortedValues.size() - 1)];
+	}
+
+	void PrintResult(const char* pName, const TOptions& Options, const TResult& Result)
+	{
+		const double nBytes = static_cast<double>(Options.nMegabytes) * MEGABYTE;
+
+		printf("%s:\n", pName);
+		printf("  throughput        %8.1f MB/s (%.2f ns per byte)\n", nBytes / MEGABYTE * 1e9 / Result.nThroughputNanos, Result.nThroughputNanos / nBytes);
+		printf("  latency p50       %8u ns\n", Percentile(Result.LatencyNanos, 500));
+		printf("  latency p99       %8u ns\n", Percentile(Result.LatencyNanos, 990));
+		printf("  latency p99.9     %8u ns\n", Percentile(Result.LatencyNanos, 999));
+		printf("  latency max       %8u ns\n", Result.LatencyNanos.empty() ? 0 : Result.LatencyNanos.back());
+		printf("  errors            %8zu\n", Result.nErrors);
+		printf("\n");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	TOptions Options;
+	if (!ParseArguments(argc, argv, Options))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	CLogger Logger(Options.bVerbose ? LogDebug : LogWarning);
+
+	if (std::thread::hardware_concurrency() < 2)
+		LOGWARN("Fewer than 2 CPUs; producer and consumer will share a core");
+
+	const TResult Locked   = RunBenchmark<TLockedBuffer>(Options);
+	const TResult LockFree = RunBenchmark<TLockFreeBuffer>(Options);
+
+	printf("Buffer:            %zu entries, bursts of 1-%zu bytes\n", BufferSize, MaxBurstSize);
+	printf("Throughput runs:   %u x %u MB\n", Options.nRuns, Options.nMegabytes);
+	printf("Latency test:      %u packets of %zu bytes every %u us\n", Options.nPackets, PacketSize, Options.nPeriodMicros);
+	printf("\n");
+	PrintResult("Spinlock (CRingBuffer)", Options, Locked);
+	PrintResult("Lock-free (CSPSCRingBuffer)", Options, LockFree);
+
+	if (Locked.nErrors || LockFree.nErrors)
+	{
+		LOGERR("Data was lost, duplicated or reordered");
+		return EXIT_FAILURE;
+	}
+
+	printf("All bytes arrived once and in order\n");
+	return EXIT_SUCCESS;
+}
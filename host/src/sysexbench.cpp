@@ -0,0 +1,444 @@
+//
+// sysexbench.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Benchmark for skipping redundant MT-32 SysEx uploads.
+// The SysEx messages from captured game init streams are replayed several times, as a game resends them on each level
+// load, through the same synth code used by the kernel with and without the SysEx cache. Audio is rendered alongside at
+// the rate that the messages would arrive over DIN MIDI, and the CPU time spent by each case is compared.
+// The time taken to restore the resulting synth state from a snapshot instead is measured as well.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <circle/logger.h>
+#include <circle/memory.h>
+#include <fatfs/ff.h>
+
+#include "config.h"
+#include "synth/mt32synth.h"
+
+LOGMODULE("sysexbench");
+
+namespace
+{
+	// 31250 baud with 10 bits per byte
+	constexpr unsigned int DINBytesPerSecond = 3125;
+
+	constexpr size_t BlockFrames = 256;
+	constexpr size_t HeapMegabytes = 64;
+
+	constexpr unsigned int DefaultLoads = 10;
+	constexpr unsigned int DefaultRuns = 5;
+
+	using TMessages = std::vector<std::vector<u8>>;
+
+	struct TOptions
+	{
+		const char* pSDPath     = "sdcard";
+		const char* pConfigPath = "mt32-pi.cfg";
+		unsigned int nLoads     = DefaultLoads;
+		unsigned int nRuns      = DefaultRuns;
+		bool bVerbose           = false;
+		std::vector<const char*> InputPaths;
+	};
+
+	struct TResult
+	{
+		u64 nNanos;
+		u32 nHits;
+		u32 nMisses;
+		size_t nSkippedBytes;
+	};
+
+	void PrintUsage(const char* pProgramName)
+	{
+		fprintf(stderr,
+			"Usage: %s [options] <input> [input...]\n"
+			"\n"
+			"Measures the CPU time saved by skipping redundant MT-32 SysEx uploads, by\n"
+			"replaying the SysEx messages from captured game init streams (Standard MIDI\n"
+			"Files or raw .syx dumps) into mt32emu with and without the SysEx cache, and\n"
+			"the time taken to restore the same state from a snapshot.\n"
+			"\n"
+			"  -d, --sd <dir>           Directory standing in for the SD card (default: sdcard)\n"
+			"  -c, --config <path>      Config file, relative to the SD card (default: mt32-pi.cfg)\n"
+			"  -l, --loads <n>          Times the messages are replayed per run (default: %d)\n"
+			"  -r, --runs <n>           Runs of each case; the fastest is reported (default: %d)\n"
+			"  -v, --verbose            Show debug messages\n",
+			pProgramName, DefaultLoads, DefaultRuns);
+	}
+
+	bool ParseArguments(int argc, char** argv, TOptions& Options)
+	{
+		static const option LongOptions[] = {
+			{"sd",      required_argument, nullptr, 'd'},
+			{"config",  required_argument, nullptr, 'c'},
+			{"loads",   required_argument, nullptr, 'l'},
+			{"runs",    required_argument, nullptr, 'r'},
+			{"verbose", no_argument,       nullptr, 'v'},
+			{nullptr,   0,                 nullptr, 0},
+		};
+
+		int nOption;
+		while ((nOption = getopt_long(argc, argv, "d:c:l:r:v", LongOptions, nullptr)) != -1)
+		{
+			switch (nOption)
+			{
+				case 'd': Options.pSDPath     = optarg; break;
+				case 'c': Options.pConfigPath = optarg; break;
+				case 'l': Options.nLoads      = atoi(optarg); break;
+				case 'r': Options.nRuns       = atoi(optarg); break;
+				case 'v': Options.bVerbose    = true; break;
+				default:  return false;
+			}
+		}
+
+		for (int i = optind; i < argc; ++i)
+			Options.InputPaths.push_back(argv[i]);
+
+		return !Options.InputPaths.empty() && Options.nLoads > 0 && Options.nRuns > 0;
+	}
+
+	bool LoadFile(const char* pPath, std::vector<u8>& Data)
+	{
+		FILE* pFile = fopen(pPath, "rb");
+		if (!pFile)
+			return false;
+
+		u8 Buffer[4096];
+		size_t nRead;
+		while ((nRead = fread(Buffer, 1, sizeof(Buffer), pFile)) > 0)
+			Data.insert(Data.end(), Buffer, Buffer + nRead);
+
+		fclose(pFile);
+		return true;
+	}
+
+	// Complete F0...F7 messages from a raw dump; anything in between is ignored
+	void ExtractRawSysEx(const std::vector<u8>& Data, TMessages& Messages)
+	{
+		for (size_t i = 0; i < Data.size(); ++i)
+		{
+			if (Data[i] != 0xF0)
+				continue;
+
+			const size_t nStart = i;
+			while (++i < Data.size() && Data[i] < 0x80)
+				;
+
+			if (i < Data.size() && Data[i] == 0xF7)
+				Messages.emplace_back(Data.begin() + nStart, Data.begin() + i + 1);
+			else
+				--i;
+		}
+	}
+
+	u32 ReadVarLen(const u8*& pData, const u8* pEnd)
+	{
+		u32 nValue = 0;
+		for (size_t i = 0; i < 4 && pData < pEnd; ++i)
+		{
+			const u8 nByte = *pData++;
+			nValue = (nValue << 7) | (nByte & 0x7F);
+			if (!(nByte & 0x80))
+				break;
+		}
+
+		return nValue;
+	}
+
+	// SysEx events from one track of a Standard MIDI File, with their times in ticks
+	void ExtractTrackSysEx(const u8* pData, const u8* pEnd, std::vector<std::pair<u32, std::vector<u8>>>& Events)
+	{
+		u32 nTick = 0;
+		u8 nRunningStatus = 0;
+
+		while (pData < pEnd)
+		{
+			nTick += ReadVarLen(pData, pEnd);
+			if (pData >= pEnd)
+				break;
+
+			const u8 nStatus = *pData;
+
+			// Meta event
+			if (nStatus == 0xFF)
+			{
+				pData += 2;
+				const u32 nLength = ReadVarLen(pData, pEnd);
+				pData += nLength;
+				continue;
+			}
+
+			// SysEx event; F7 events are escapes or continuation packets, and are skipped
+			if (nStatus == 0xF0 || nStatus == 0xF7)
+			{
+				++pData;
+				const u32 nLength = ReadVarLen(pData, pEnd);
+				if (nLength > static_cast<size_t>(pEnd - pData))
+					break;
+
+				if (nStatus == 0xF0 && nLength && pData[nLength - 1] == 0xF7)
+				{
+					std::vector<u8> Message(1, 0xF0);
+					Message.insert(Message.end(), pData, pData + nLength);
+					Events.emplace_back(nTick, std::move(Message));
+				}
+
+				pData += nLength;
+				nRunningStatus = 0;
+				continue;
+			}
+
+			// Channel message
+			if (nStatus & 0x80)
+			{
+				nRunningStatus = nStatus;
+				++pData;
+			}
+			else if (!nRunningStatus)
+				break;
+
+			pData += (nRunningStatus & 0xE0) == 0xC0 ? 1 : 2;
+		}
+	}
+
+	// SysEx messages from all tracks of a Standard MIDI File, in time order
+	bool ExtractSMFSysEx(const std::vector<u8>& Data, TMessages& Messages)
+	{
+		std::vector<std::pair<u32, std::vector<u8>>> Events;
+		const u8* pData = Data.data();
+		const u8* const pEnd = pData + Data.size();
+
+		while (pEnd - pData >= 8)
+		{
+			const u32 nLength = pData[4] << 24 | pData[5] << 16 | pData[6] << 8 | pData[7];
+			const u8* const pChunk = pData + 8;
+			if (nLength > static_cast<size_t>(pEnd - pChunk))
+				return false;
+
+			if (!memcmp(pData, "MTrk", 4))
+				ExtractTrackSysEx(pChunk, pChunk + nLength, Events);
+
+			pData = pChunk + nLength;
+		}
+
+		std::stable_sort(Events.begin(), Events.end(), [](const auto& A, const auto& B) { return A.first < B.first; });
+		for (auto& Event : Events)
+			Messages.push_back(std::move(Event.second));
+
+		return true;
+	}
+
+	bool LoadMessages(const char* pPath, TMessages& Messages)
+	{
+		std::vector<u8> Data;
+		if (!LoadFile(pPath, Data))
+		{
+			LOGERR("Couldn't read '%s'", pPath);
+			return false;
+		}
+
+		if (Data.size() >= 4 && !memcmp(Data.data(), "MThd", 4))
+		{
+			if (!ExtractSMFSysEx(Data, Messages))
+			{
+				LOGERR("'%s' is not a valid MIDI file", pPath);
+				return false;
+			}
+		}
+		else
+			ExtractRawSysEx(Data, Messages);
+
+		return true;
+	}
+
+	u64 GetThreadCPUNanos()
+	{
+		timespec Time;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &Time);
+		return static_cast<u64>(Time.tv_sec) * 1000000000 + Time.tv_nsec;
+	}
+
+	// Replays the messages into a freshly opened synth; returns false if the synth couldn't be opened
+	bool RunPass(const TMessages& Messages, unsigned int nLoads, bool bSkipRedundantSysEx, TResult& Result)
+	{
+		const CConfig* const pConfig = CConfig::Get();
+		const unsigned int nSampleRate = pConfig->AudioSampleRate;
+
+		CMT32Synth Synth(nSampleRate, pConfig->MT32EmuGain, pConfig->MT32EmuReverbGain, pConfig->MT32EmuResamplerQuality);
+		if (!Synth.Initialize())
+		{
+			LOGERR("mt32emu init failed; no ROMs present?");
+			return false;
+		}
+
+		Synth.SetSkipRedundantSysEx(bSkipRedundantSysEx);
+
+		float Buffer[BlockFrames * 2];
+		double nPendingFrames = 0;
+
+		const u64 nStartNanos = GetThreadCPUNanos();
+
+		for (unsigned int nLoad = 0; nLoad < nLoads; ++nLoad)
+		{
+			for (const auto& Message : Messages)
+			{
+				Synth.HandleMIDISysExMessage(Message.data(), Message.size());
+
+				// Render the audio that would play while the message arrives; mt32emu applies SysEx as it renders
+				nPendingFrames += static_cast<double>(Message.size()) * nSampleRate / DINBytesPerSecond;
+				while (nPendingFrames >= BlockFrames)
+				{
+					Synth.Render(Buffer, BlockFrames);
+					nPendingFrames -= BlockFrames;
+				}
+			}
+		}
+
+		Synth.Render(Buffer, BlockFrames);
+
+		Result.nNanos        = GetThreadCPUNanos() - nStartNanos;
+		Result.nHits         = Synth.GetSysExCache().GetHitCount();
+		Result.nMisses       = Synth.GetSysExCache().GetMissCount();
+		Result.nSkippedBytes = Synth.GetSysExCache().GetSkippedBytes();
+
+		return true;
+	}
+
+	// Captures the state left by the messages, then restores it; returns the fastest restore in CPU nanoseconds
+	bool MeasureSnapshotRestore(const TMessages& Messages, unsigned int nRuns, u64& nRestoreNanos)
+	{
+		const CConfig* const pConfig = CConfig::Get();
+
+		CMT32Synth Synth(pConfig->AudioSampleRate, pConfig->MT32EmuGain, pConfig->MT32EmuReverbGain, pConfig->MT32EmuResamplerQuality);
+		if (!Synth.Initialize())
+		{
+			LOGERR("mt32emu init failed; no ROMs present?");
+			return false;
+		}
+
+		for (const auto& Message : Messages)
+			Synth.HandleMIDISysExMessage(Message.data(), Message.size());
+
+		CMT32Snapshot Snapshot;
+		Synth.CaptureSnapshot(Snapshot);
+
+		nRestoreNanos = UINT64_MAX;
+		for (unsigned int nRun = 0; nRun < nRuns; ++nRun)
+		{
+			const u64 nStartNanos = GetThreadCPUNanos();
+			Synth.RestoreSnapshot(Snapshot);
+			nRestoreNanos = std::min(nRestoreNanos, GetThreadCPUNanos() - nStartNanos);
+		}
+
+		return true;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	TOptions Options;
+	if (!ParseArguments(argc, argv, Options))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	CLogger Logger(Options.bVerbose ? LogDebug : LogWarning);
+	CMemorySystem Memory(HeapMegabytes * MEGABYTE);
+
+	FATFS SDFileSystem{Options.pSDPath};
+	if (f_mount(&SDFileSystem, "SD:", 1) != FR_OK)
+	{
+		LOGERR("Couldn't use '%s' as the SD card", Options.pSDPath);
+		return EXIT_FAILURE;
+	}
+
+	CConfig Config;
+	if (!Config.Initialize(Options.pConfigPath))
+		LOGWARN("Unable to find or parse config file; using defaults");
+
+	TMessages Messages;
+	for (const char* pPath : Options.InputPaths)
+		if (!LoadMessages(pPath, Messages))
+			return EXIT_FAILURE;
+
+	if (Messages.empty())
+	{
+		LOGERR("No SysEx messages found");
+		return EXIT_FAILURE;
+	}
+
+	size_t nBytesPerLoad = 0;
+	for (const auto& Message : Messages)
+		nBytesPerLoad += Message.size();
+
+	TResult Baseline{UINT64_MAX, 0, 0, 0};
+	TResult Cached{UINT64_MAX, 0, 0, 0};
+
+	// Alternate between the two cases so that both see the same machine conditions
+	for (unsigned int nRun = 0; nRun < Options.nRuns; ++nRun)
+	{
+		TResult Result;
+
+		if (!RunPass(Messages, Options.nLoads, false, Result))
+			return EXIT_FAILURE;
+
+		if (Result.nNanos < Baseline.nNanos)
+			Baseline = Result;
+
+		if (!RunPass(Messages, Options.nLoads, true, Result))
+			return EXIT_FAILURE;
+
+		if (Result.nNanos < Cached.nNanos)
+			Cached = Result;
+	}
+
+	u64 nRestoreNanos;
+	if (!MeasureSnapshotRestore(Messages, Options.nRuns, nRestoreNanos))
+		return EXIT_FAILURE;
+
+	const double nBlockMicros = BlockFrames * 1e6 / Config.AudioSampleRate;
+
+	const double nSavedNanos = Cached.nNanos < Baseline.nNanos ? Baseline.nNanos - Cached.nNanos : 0;
+	const u32 nDT1Messages = Cached.nHits + Cached.nMisses;
+
+	printf("SysEx stream:      %zu messages, %zu bytes per load, %u loads\n", Messages.size(), nBytesPerLoad, Options.nLoads);
+	printf("Without cache:     %.3f ms CPU (%.1f us per load)\n", Baseline.nNanos / 1e6, Baseline.nNanos / 1e3 / Options.nLoads);
+	printf("With cache:        %.3f ms CPU (%.1f us per load)\n", Cached.nNanos / 1e6, Cached.nNanos / 1e3 / Options.nLoads);
+	printf("\n");
+	printf("Cache hits:        %u of %u MT-32 DT1 messages (%.1f%%)\n", Cached.nHits, nDT1Messages, nDT1Messages ? Cached.nHits * 100.0 / nDT1Messages : 0.0);
+	printf("Cache misses:      %u\n", Cached.nMisses);
+	printf("Bytes skipped:     %zu of %zu (%.1f%%)\n", Cached.nSkippedBytes, nBytesPerLoad * Options.nLoads, Cached.nSkippedBytes * 100.0 / (nBytesPerLoad * Options.nLoads));
+	printf("CPU time saved:    %.3f ms (%.1f%%), %.1f ns per byte skipped\n", nSavedNanos / 1e6, Baseline.nNanos ? nSavedNanos * 100 / Baseline.nNanos : 0.0, Cached.nSkippedBytes ? nSavedNanos / Cached.nSkippedBytes : 0.0);
+	printf("\n");
+	printf("Snapshot restore:  %.1f us CPU (%.1f%% of a %zu-frame block)\n", nRestoreNanos / 1e3, nRestoreNanos / 1e1 / nBlockMicros, BlockFrames);
+
+	return EXIT_SUCCESS;
+}
@@ -37,7 +37,8 @@ class CConfig
 public:
 	#define ENUM_SYSTEMDEFAULTSYNTH(ENUM) \
 		ENUM(MT32, mt32)                  \
-		ENUM(SoundFont, soundfont)
+		ENUM(SoundFont, soundfont)        \
+		ENUM(Layered, layered)
 
 	#define ENUM_AUDIOOUTPUTDEVICE(ENUM) \
 		ENUM(PWM, pwm)                   \
@@ -54,6 +55,9 @@ public:
 	using TMT32EmuResamplerQuality = CMT32Synth::TResamplerQuality;
 	using TMT32EmuMIDIChannels     = CMT32Synth::TMIDIChannels;
 	using TMT32EmuROMSet           = TMT32ROMSet;
+	using TMT32EmuProfile          = CMT32Synth::TProfile;
+	using TMT32EmuAnalogOutputMode = CMT32Synth::TAnalogOutputMode;
+	using TMT32EmuRendererType     = CMT32Synth::TRendererType;
 
 	using TLCDRotation             = CSSD1306::TLCDRotation;
 	using TLCDMirror               = CSSD1306::TLCDMirror;
@@ -76,6 +80,18 @@ public:
 	CONFIG_ENUM(TLCDType, ENUM_LCDTYPE);
 	CONFIG_ENUM(TNetworkMode, ENUM_NETWORKMODE);
 
+	// Set of numbers from 1 to 16 (e.g. MIDI channels), with bit n - 1 set for each number n
+	struct TNumberMask
+	{
+		u16 nMask;
+	};
+
+	// Set of MT-32 ROM sets, with bit n set for each TMT32ROMSet value n
+	struct TROMSetMask
+	{
+		u8 nMask;
+	};
+
 	CConfig();
 	bool Initialize(const char* pPath);
 
@@ -91,11 +107,16 @@ public:
 	static bool ParseOption(const char* pString, float* pOutFloat);
 	static bool ParseOption(const char *pString, CString* pOut);
 	static bool ParseOption(const char *pString, CIPAddress* pOut);
+	static bool ParseOption(const char* pString, TNumberMask* pOut);
+	static bool ParseOption(const char* pString, TROMSetMask* pOut);
 	static bool ParseOption(const char* pString, TSystemDefaultSynth* pOut);
 	static bool ParseOption(const char* pString, TAudioOutputDevice* pOut);
 	static bool ParseOption(const char* pString, TMT32EmuResamplerQuality* pOut);
 	static bool ParseOption(const char* pString, TMT32EmuMIDIChannels* pOut);
 	static bool ParseOption(const char* pString, TMT32EmuROMSet* pOut);
+	static bool ParseOption(const char* pString, TMT32EmuProfile* pOut);
+	static bool ParseOption(const char* pString, TMT32EmuAnalogOutputMode* pOut);
+	static bool ParseOption(const char* pString, TMT32EmuRendererType* pOut);
 	static bool ParseOption(const char* pString, TLCDType* pOut);
 	static bool ParseOption(const char* pString, TControlScheme* pOut);
 	static bool ParseOption(const char* pString, TEncoderType* pOut);
@@ -66,6 +66,19 @@ struct TDisplayImageEvent
 	TImage Image;
 };
 
+enum class TSMFPlayerCommand
+{
+	PlayStop,
+	NextFile,
+	SeekBackward,
+	SeekForward,
+};
+
+struct TSMFPlayerEvent
+{
+	TSMFPlayerCommand Command;
+};
+
 enum class TEventType
 {
 	Button,
@@ -75,6 +88,7 @@ enum class TEventType
 	SwitchSoundFont,
 	AllSoundOff,
 	DisplayImage,
+	SMFPlayer,
 };
 
 struct TEvent
@@ -90,6 +104,7 @@ struct TEvent
 		TSwitchSoundFontEvent SwitchSoundFont;
 		TAllSoundOffEvent AllSoundOff;
 		TDisplayImageEvent DisplayImage;
+		TSMFPlayerEvent SMFPlayer;
 	};
 };
 
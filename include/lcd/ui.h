@@ -45,6 +45,7 @@ public:
 
 	void ShowSystemMessage(const char* pMessage, bool bSpinner = false);
 	void ClearSpinnerMessage();
+	void SetSpinnerProgress(u8 nPercent);
 	void DisplayImage(TImage Image);
 	void ShowSysExText(TSysExDisplayMessage Type, const u8* pMessage, size_t nSize, u8 nOffset);
 	void ShowSysExBitmap(TSysExDisplayMessage Type, const u8* pData, size_t nSize);
@@ -91,6 +92,7 @@ private:
 	bool m_bIsScrolling;
 	size_t m_nCurrentScrollOffset;
 	size_t m_nCurrentSpinnerChar;
+	volatile s8 m_nSpinnerProgress;
 	TImage m_CurrentImage;
 	char m_SystemMessageTextBuffer[SystemMessageTextBufferSize];
 	TSysExDisplayMessage m_SysExDisplayMessageType;
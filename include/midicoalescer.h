@@ -0,0 +1,55 @@
+//
+// midicoalescer.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _midicoalescer_h
+#define _midicoalescer_h
+
+#include <circle/types.h>
+
+#include "midievent.h"
+
+// Drops continuous controller messages (pitch bend, channel pressure and controllers such as modulation, volume and
+// expression) that are overwritten by a later message with the same channel and controller in the same batch, so that
+// floods of them cost no more than one message per batch. A message is only dropped if nothing else happens on its
+// channel in between (e.g. a note or program change), so the result sounds the same.
+// Coalescing can run on more than one core at once; only the counters are shared.
+class CMIDICoalescer
+{
+public:
+	CMIDICoalescer();
+
+	// Both return the number of messages kept, which are moved to the front in their original order
+	size_t Coalesce(u32* pMessages, size_t nCount);
+	size_t Coalesce(TMIDIEvent* pEvents, size_t nCount);
+
+	u32 GetMessageCount() const { return __atomic_load_n(&m_nMessages, __ATOMIC_RELAXED); }
+	u32 GetFoldedCount() const { return __atomic_load_n(&m_nFolded, __ATOMIC_RELAXED); }
+
+private:
+	template <class T>
+	size_t CoalesceMessages(T* pMessages, size_t nCount);
+
+	u32 m_nMessages;
+	u32 m_nFolded;
+};
+
+#endif
@@ -0,0 +1,65 @@
+//
+// midievent.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _midievent_h
+#define _midievent_h
+
+#include <circle/types.h>
+
+// A single received MIDI byte, stamped with the 1MHz clock tick at which it arrived and the input it arrived on
+struct TMIDIRxByte
+{
+	u32 nTimestamp;
+	u8 nByte;
+	u8 nSource;
+};
+
+// A USB-MIDI event packet; Circle has already decoded the Code Index Number into the cable number and message length
+struct TUSBMIDIPacket
+{
+	u32 nTimestamp;
+	u8 nCable;
+	u8 nLength;
+	u8 Data[3];
+};
+
+// A complete MIDI short message
+// nTimestamp holds the 1MHz clock tick of arrival while queued, and a frame offset into the block when passed to a synth
+// nCable is the USB-MIDI cable number the message arrived on (0 for other inputs)
+struct TMIDIEvent
+{
+	u32 nTimestamp;
+	u32 nMessage;
+	u8 nCable;
+};
+
+// Part of a SysEx message delivered in pieces as it arrives, because it is too large to be buffered whole
+// Begin starts with 0xF0 and End finishes with 0xF7; Abort (with no data) means the message was interrupted
+enum class TSysExChunk
+{
+	Begin,
+	Continue,
+	End,
+	Abort,
+};
+
+#endif
@@ -0,0 +1,168 @@
+//
+// midimerger.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _midimerger_h
+#define _midimerger_h
+
+#include <circle/types.h>
+
+#include "midievent.h"
+#include "midiparser.h"
+#include "ringbuffer.h"
+
+enum class TMIDISource : u8
+{
+	Serial,
+	USB,
+	Pisound,
+	AppleMIDI,
+	UDP,
+};
+
+// Parses each MIDI input with its own parser state, so that interleaved data from different sources can't corrupt
+// each other's messages, and merges the complete messages into a single stream.
+// Each source has a bounded queue; sources are serviced round-robin so that a flooding source can't starve the others.
+// SysEx messages too large for the parser are streamed in chunks from one source at a time; other sources starting a
+// stream are held back until it ends, or until it stalls for longer than StreamTimeoutMillis. A stream isn't started
+// until it has been queued in full (or its source's queue is full), so that a slow input can't hold up the others'
+// streams for as long as it takes its own to arrive.
+class CMIDIMerger
+{
+public:
+	static constexpr size_t SourceCount = 5;
+	static constexpr size_t ShortMessageBatchSize = 64;
+
+	// Largest SysEx message (or chunk of a larger one) passed to the handlers below
+	static constexpr size_t MaxSysExSize = CMIDIParser::SysExBufferSize;
+
+	CMIDIMerger();
+	virtual ~CMIDIMerger() = default;
+
+	// Parses as many bytes as the source's queue has room for; returns the number of bytes consumed
+	size_t ParseMIDIBytes(TMIDISource Source, const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable = 0);
+
+	// Queues a complete short message already framed by the transport (e.g. a USB-MIDI event packet) without parsing it
+	// byte by byte; falls back to parsing if the source is part-way through another message.
+	// Returns false without consuming anything if the source's queue is full.
+	bool EnqueueShortMessage(TMIDISource Source, const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable = 0);
+	size_t GetFreeSpace(TMIDISource Source) const { return m_Sources[static_cast<size_t>(Source)].GetFreeSpace(); }
+
+	// Passes queued messages on to the handlers below, taking one message from each source in turn
+	// Consecutive short messages are passed on in batches of up to ShortMessageBatchSize, stamped with their arrival time
+	size_t DispatchMIDIMessages();
+
+protected:
+	virtual void OnShortMessages(const TMIDIEvent* pMessages, size_t nCount) = 0;
+	virtual void OnSysExMessage(const u8* pData, size_t nSize) = 0;
+	virtual void OnSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize) = 0;
+
+	virtual void OnUnexpectedStatus() {}
+	virtual void OnSysExOverflow() {}
+
+	// Arrival time (1MHz clock ticks) of the SysEx message currently being dispatched
+	u32 GetMessageTimestamp() const { return m_nMessageTimestamp; }
+
+private:
+	static constexpr size_t MessageQueueSize = 256;
+	static constexpr size_t SysExQueueSize   = 8192;
+	static constexpr unsigned StreamTimeoutMillis = 250;
+
+	enum class TMessageType : u8
+	{
+		ShortMessage,
+		SysEx,
+		SysExChunk,
+	};
+
+	struct TMessage
+	{
+		u32 nTimestamp;
+		u32 nMessage;   // Short message, or TSysExChunk for SysEx chunks
+		u32 nSysExSize; // Data is held in the SysEx queue
+		TMessageType Type;
+		u8 nCable;
+	};
+
+	class CSourceParser : public CMIDIParser
+	{
+	public:
+		CSourceParser();
+
+		void Initialize(CMIDIMerger* pMerger);
+		size_t Parse(const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable);
+		bool EnqueueShortMessage(const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable);
+		size_t GetFreeSpace() const;
+		bool HasMessages() const { return m_bMessageHeld || m_MessageQueue.GetCount(); }
+		u32 GetLastTimestamp() const { return __atomic_load_n(&m_nTimestamp, __ATOMIC_RELAXED); }
+		// The stream at the front of the queue has ended, or there's no room to receive the rest of it (allowing for
+		// transports that pass on whole 3-byte USB-MIDI event packets)
+		bool IsStreamQueued() const { return __atomic_load_n(&m_nStreamEndsQueued, __ATOMIC_ACQUIRE) || GetFreeSpace() < 3; }
+		bool DequeueMessage(TMessage& OutMessage);
+		void HoldMessage(const TMessage& Message);
+		void DequeueSysEx(u8* pOutData, size_t nSize) { m_SysExQueue.Dequeue(pOutData, nSize); }
+		size_t PeekSysEx(const u8*& pOutData) const { return m_SysExQueue.Peek(pOutData); }
+		void CommitSysEx(size_t nSize) { m_SysExQueue.Commit(nSize); }
+
+	protected:
+		// CMIDIParser
+		virtual void OnShortMessage(u32 nMessage) override;
+		virtual void OnSysExMessage(const u8* pData, size_t nSize) override;
+		virtual void OnSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize) override;
+		virtual void OnUnexpectedStatus() override;
+		virtual void OnSysExOverflow() override;
+
+	private:
+		void FlushSysExChunk();
+		void QueueSysExChunk(TSysExChunk Chunk, size_t nSize);
+
+		CMIDIMerger* m_pMerger;
+		u32 m_nTimestamp;
+		u8 m_nCable;
+
+		// Stream data in the SysEx queue not yet passed on as a chunk
+		size_t m_nSysExBytesPending;
+
+		// Ends of SysEx streams (or aborted streams) waiting in the message queue
+		size_t m_nStreamEndsQueued;
+
+		// Message put back by the dispatcher to be dispatched later
+		TMessage m_HeldMessage;
+		bool m_bMessageHeld;
+
+		CSPSCRingBuffer<TMessage, MessageQueueSize> m_MessageQueue;
+		CSPSCRingBuffer<u8, SysExQueueSize> m_SysExQueue;
+	};
+
+	static bool IsStreamEnd(TSysExChunk Chunk) { return Chunk == TSysExChunk::End || Chunk == TSysExChunk::Abort; }
+	bool IsStreamInProgress(size_t nSource) const;
+	void DispatchSysExChunk(size_t nSource, TSysExChunk Chunk, const u8* pData, size_t nSize);
+
+	CSourceParser m_Sources[SourceCount];
+	size_t m_nNextSource;
+	size_t m_nStreamingSource;
+	u32 m_nMessageTimestamp;
+
+	// SysEx data that wraps around the end of its source's queue is copied out here to be passed on in one piece
+	u8 m_SysExBuffer[MaxSysExSize];
+};
+
+#endif
@@ -33,6 +33,7 @@ public:
 	CMIDIMonitor();
 
 	void OnShortMessage(u32 nMessage);
+	void OnShortMessages(const u32* pMessages, size_t nCount);
 	void GetChannelLevels(unsigned int nTicks, float* pOutLevels, float* pOutPeaks, u16 nPercussionBitMask = (1 << 9));
 	void AllNotesOff();
 	void ResetControllers(bool bIsResetAllControllers);
@@ -74,6 +75,7 @@ private:
 		TNoteState Notes[NoteCount];
 	};
 
+	void ProcessShortMessage(u32 nMessage, unsigned int nTicks);
 	void ProcessCC(u8 nChannel, u8 nCC, u8 nValue, unsigned int nTicks);
 	inline float ComputeEnvelope(TNoteState& NoteState) const;
 	inline float ComputePercussionEnvelope(TNoteState& NoteState) const;
@@ -25,6 +25,8 @@
 
 #include <circle/types.h>
 
+#include "midievent.h"
+
 class CMIDIParser
 {
 public:
@@ -32,10 +34,23 @@ public:
 
 	void ParseMIDIBytes(const u8* pData, size_t nSize, bool bIgnoreNoteOns = false);
 
+	// True if the parser isn't part-way through a message, so a complete message can be passed on without parsing
+	bool IsIdle() const { return m_State == TState::StatusByte; }
+
+	// Length in bytes of the short message starting with the given status byte, or 0 if it doesn't start one
+	static size_t GetShortMessageLength(u8 nStatus);
+
+	// Matches mt32emu's SysEx buffer size
+	static constexpr size_t SysExBufferSize = 1000;
+
 protected:
+
 	virtual void OnShortMessage(u32 nMessage) = 0;
 	virtual void OnSysExMessage(const u8* pData, size_t nSize) = 0;
 
+	// Called for SysEx messages larger than SysExBufferSize; the default implementation drops them
+	virtual void OnSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize);
+
 	virtual void OnUnexpectedStatus();
 	virtual void OnSysExOverflow();
 
@@ -47,10 +62,8 @@ private:
 		SysExByte
 	};
 
-	// Matches mt32emu's SysEx buffer size
-	static constexpr size_t SysExBufferSize = 1000;
-
 	void ParseStatusByte(u8 nByte);
+	size_t ParseSysExBytes(const u8* pData, size_t nSize, size_t nOffset);
 	bool CheckCompleteShortMessage(bool bIgnoreNoteOns = false);
 	u32 PrepareShortMessage() const;
 	void ResetState(bool bClearStatusByte);
@@ -58,6 +71,7 @@ private:
 	TState m_State;
 	u8 m_MessageBuffer[SysExBufferSize];
 	size_t m_nMessageLength;
+	bool m_bSysExStreaming;
 };
 
 #endif
@@ -0,0 +1,117 @@
+//
+// midirecorder.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _midirecorder_h
+#define _midirecorder_h
+
+#include <circle/sched/synchronizationevent.h>
+#include <circle/sched/task.h>
+#include <circle/string.h>
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+#include "midievent.h"
+
+// Captures incoming MIDI to a Standard MIDI File (type 0) in the "recordings" directory of the SD card or a USB disk.
+// The main task encodes each message into a ring of fixed-size blocks as it is dispatched, which costs no more than a
+// short copy; full blocks are written out by a scheduler task in large sequential writes, so MIDI handling never waits
+// on the disk. If the disk can't keep up and the ring fills, messages are dropped and counted.
+class CMIDIRecorder : protected CTask
+{
+public:
+	enum class TState
+	{
+		Idle,
+		Recording,
+		Stopping,
+		Failed,
+	};
+
+	CMIDIRecorder();
+
+	// Main task
+	bool Start(const char* pDisk);
+	void Stop();
+	void Reset();
+	void Update();
+
+	TState GetState() const { return __atomic_load_n(&m_State, __ATOMIC_ACQUIRE); }
+	bool IsRecording() const { return GetState() == TState::Recording; }
+	size_t GetDroppedCount() const { return m_nDroppedMessages; }
+
+	// Timestamps are 1MHz clock ticks of arrival
+	void RecordShortMessages(const TMIDIEvent* pMessages, size_t nCount);
+	void RecordSysExMessage(const u8* pData, size_t nSize, u32 nTimestamp);
+	void RecordSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize, u32 nTimestamp);
+
+	virtual void Run() override;
+
+private:
+	static constexpr unsigned StackSize = 0x4000;
+
+	// 128KB is over 40 seconds of MIDI at full DIN bandwidth
+	static constexpr size_t BlockSize  = 16 * 1024;
+	static constexpr size_t BlockCount = 8;
+
+	// Partially-filled blocks are written out after this long, so that little is lost if power is cut
+	static constexpr unsigned FlushPeriodMillis = 2000;
+
+	// 120 BPM at 5000 ticks per quarter note; one tick is 100us
+	static constexpr u16 TicksPerQuarterNote = 5000;
+	static constexpr u32 MicrosPerTick       = 100;
+
+	bool Append(u32 nTimestamp, const u8* pHeader, size_t nHeaderSize, const u8* pData, size_t nDataSize);
+	void CopyIn(const u8* pData, size_t nSize);
+	void PublishBlock();
+
+	// Writer task
+	bool OpenFile();
+	bool WriteBlocks();
+	bool WriteFile(const void* pData, size_t nSize);
+	void CloseFile(bool bFinalize);
+
+	CSynchronizationEvent m_Event;
+	TState m_State;
+	CString m_Disk;
+
+	// Producer state; only touched by the main task
+	u32 m_nLastTimestamp;
+	u32 m_nPendingMicros;
+	size_t m_nBlockFill;
+	unsigned m_nLastPublishTime;
+	size_t m_nDroppedMessages;
+	bool m_bSysExStreaming;
+
+	// Blocks [m_nBlocksWritten, m_nBlocksPublished) are waiting to be written; the counters only ever increase
+	size_t m_nBlocksPublished;
+	size_t m_nBlocksWritten;
+	size_t m_BlockSizes[BlockCount];
+	u8 m_Blocks[BlockCount][BlockSize];
+
+	// Writer state; only touched by the writer task
+	FIL m_File;
+	bool m_bFileOpen;
+	CString m_FilePath;
+	u32 m_nTrackSize;
+};
+
+#endif
@@ -52,21 +52,29 @@
 #include "control/mister.h"
 #include "event.h"
 #include "lcd/ui.h"
-#include "midiparser.h"
+#include "midicoalescer.h"
+#include "midievent.h"
+#include "midimerger.h"
+#include "midirecorder.h"
 #include "net/applemidi.h"
 #include "net/ftpdaemon.h"
 #include "net/udpmidi.h"
 #include "pisound.h"
 #include "power.h"
+#include "renderprofiler.h"
 #include "ringbuffer.h"
+#include "smfplayer.h"
+#include "synth/layeredsynth.h"
 #include "synth/mt32romset.h"
+#include "synth/mt32snapshot.h"
 #include "synth/mt32synth.h"
 #include "synth/soundfontsynth.h"
 #include "synth/synth.h"
 
 //#define MONITOR_TEMPERATURE
+//#define MONITOR_HEAP
 
-class CMT32Pi : CMultiCoreSupport, CPower, CMIDIParser, CAppleMIDIHandler, CUDPMIDIHandler
+class CMT32Pi : CMultiCoreSupport, CPower, CMIDIMerger, CAppleMIDIHandler, CUDPMIDIHandler
 {
 public:
 	CMT32Pi(CI2CMaster* pI2CMaster, CSPIMaster* pSPIMaster, CInterruptSystem* pInterrupt, CGPIOManager* pGPIOManager, CSerialDevice* pSerialDevice, CUSBHCIDevice* pUSBHCI);
@@ -87,6 +95,13 @@ private:
 	};
 
 	static constexpr size_t MIDIRxBufferSize = 2048;
+	static constexpr size_t USBMIDIPacketBufferSize = 512;
+	// Incoming MIDI is drained this many bytes (or USB-MIDI packets) at a time, to keep the main task's stack small
+	static constexpr size_t MIDIRxSliceSize = 128;
+	static constexpr size_t MIDIEventQueueSize = 1024;
+	static constexpr size_t SysExEventQueueSize = 16384;
+	static constexpr unsigned int MIDIEventWaitRetryMicros = 100;
+	static constexpr unsigned int MIDIFileSeekStepMillis = 10000;
 
 	// CPower
 	virtual void OnEnterPowerSavingMode() override;
@@ -94,36 +109,50 @@ private:
 	virtual void OnThrottleDetected() override;
 	virtual void OnUnderVoltageDetected() override;
 
-	// CMIDIParser
-	virtual void OnShortMessage(u32 nMessage) override;
+	// CMIDIMerger
+	virtual void OnShortMessages(const TMIDIEvent* pMessages, size_t nCount) override;
 	virtual void OnSysExMessage(const u8* pData, size_t nSize) override;
+	virtual void OnSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize) override;
 	virtual void OnUnexpectedStatus() override;
 	virtual void OnSysExOverflow() override;
 
 	// CAppleMIDIHandler
-	virtual void OnAppleMIDIDataReceived(const u8* pData, size_t nSize) override { ParseMIDIBytes(pData, nSize); };
+	virtual void OnAppleMIDIDataReceived(const u8* pData, size_t nSize) override { ParseMIDIFromSource(TMIDISource::AppleMIDI, pData, nSize, CTimer::GetClockTicks()); };
 	virtual void OnAppleMIDIConnect(const CIPAddress* pIPAddress, const char* pName) override;
 	virtual void OnAppleMIDIDisconnect(const CIPAddress* pIPAddress, const char* pName) override;
 
 	// CUDPMIDIHandler
-	virtual void OnUDPMIDIDataReceived(const u8* pData, size_t nSize) override { ParseMIDIBytes(pData, nSize); };
+	virtual void OnUDPMIDIDataReceived(const u8* pData, size_t nSize) override { ParseMIDIFromSource(TMIDISource::UDP, pData, nSize, CTimer::GetClockTicks()); };
 
 	// Initialization
 	bool InitNetwork();
 	bool InitMT32Synth();
 	bool InitSoundFontSynth();
+	bool InitLayeredSynth();
 
 	// Tasks for specific CPU cores
 	void MainTask();
 	void UITask();
 	void AudioTask();
+	void RenderTask();
 
 	void UpdateUSB(bool bStartup = false);
 	void UpdateNetwork();
 	void UpdateMIDI();
-	void PurgeMIDIBuffers();
+	size_t ParseRxBufferMIDI();
+	size_t ParseUSBMIDIPackets();
+	void ParseMIDIFromSource(TMIDISource Source, const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable = 0);
 	size_t ReceiveSerialMIDI(u8* pOutData, size_t nSize);
+	bool QueueMIDIEvent(const TMIDIEvent& Event);
+	bool QueueSysExEvent(u32 nKind, const u8* pData, size_t nSize);
+	bool WaitForMIDIEvents(u32 nMaxPending);
+	void RenderMIDIEvents(float* pOutBuffer, size_t nFrames, TMIDIEvent* pEvents, size_t nEvents);
+	void ApplySysExEvent(u32 nMessage);
+
 	bool ParseCustomSysEx(const u8* pData, size_t nSize);
+	void SendHeapStats();
+	void SendRenderStats();
+	void SendCustomSysExReply(u8 nCommand, const u32* pValues, size_t nValues);
 
 	void ProcessEventQueue();
 	void ProcessButtonEvent(const TButtonEvent& Event);
@@ -135,6 +164,15 @@ private:
 	void SwitchSoundFont(size_t nIndex);
 	void DeferSwitchSoundFont(size_t nIndex);
 	void SetMasterVolume(s32 nVolume);
+	void ProcessSMFPlayerEvent(const TSMFPlayerEvent& Event);
+	void PlayMIDIFile(size_t nIndex);
+	void StopMIDIFile();
+	void UpdateSMFPlayer();
+	void StartMIDIRecording();
+	void StopMIDIRecording();
+	void UpdateMIDIRecorder();
+	void SaveMT32Snapshot(u8 nSlot);
+	void RestoreMT32Snapshot(u8 nSlot);
 
 	const char* GetNetworkDeviceShortName() const;
 	void LEDOn();
@@ -172,8 +210,16 @@ private:
 #ifdef MONITOR_TEMPERATURE
 	unsigned m_nTempUpdateTime;
 #endif
+#ifdef MONITOR_HEAP
+	unsigned m_nHeapUpdateTime;
+#endif
 
 	CControl* m_pControl;
+	u8 m_nHeldButtons;
+	bool m_bButtonChord;
+	bool m_bButtonChordSnapshotPending;
+	u8 m_nButtonChordVolume;
+	bool m_bButtonSeekPending;
 
 	// MiSTer control interface
 	CMisterControl m_MisterControl;
@@ -203,6 +249,9 @@ private:
 
 	// Audio output
 	CSoundBaseDevice* m_pSound;
+	CRenderProfiler m_RenderProfiler;
+	unsigned m_nRenderLoadCheckTime;
+	u32 m_nRenderUnderruns;
 
 	// Extra devices
 	CPisound* m_pPisound;
@@ -212,9 +261,41 @@ private:
 	CSynthBase* m_pCurrentSynth;
 	CMT32Synth* m_pMT32Synth;
 	CSoundFontSynth* m_pSoundFontSynth;
-
-	// MIDI receive buffer
-	CRingBuffer<u8, MIDIRxBufferSize> m_MIDIRxBuffer;
+	CLayeredSynth* m_pLayeredSynth;
+
+	// Saved/restored MT-32 synth state; allocated up front so that a restore doesn't wait on the allocator
+	CMT32Snapshot* m_pMT32Snapshot;
+
+	// Standard MIDI File player; events are merged into the audio task's render blocks
+	CSMFPlayer* m_pSMFPlayer;
+
+	// MIDI capture to a Standard MIDI File; incoming messages are recorded as they're dispatched on core 0
+	CMIDIRecorder* m_pMIDIRecorder;
+
+	// MIDI receive buffer; filled from IRQ context (Pisound) and drained by the main task on core 0
+	CSPSCRingBuffer<TMIDIRxByte, MIDIRxBufferSize> m_MIDIRxBuffer;
+
+	// USB-MIDI event packets; kept whole so that complete short messages don't have to be reparsed byte by byte
+	CSPSCRingBuffer<TUSBMIDIPacket, USBMIDIPacketBufferSize> m_USBMIDIPacketBuffer;
+
+	// Sample-accurate MIDI; timestamped short messages passed from the main task to the audio task.
+	// SysEx goes the same way, with its data held in a separate queue, so that it reaches the synth in order from a
+	// single core. Messages that can't be deferred are only handled on core 0 once everything queued before them has
+	// been applied; the audio task counts the events it has applied, and gives up on waiting for them after the timeout.
+	// After a timeout, further waits give up straight away until the audio task applies another event.
+	bool m_bMIDISampleAccurate;
+	CSPSCRingBuffer<TMIDIEvent, MIDIEventQueueSize> m_MIDIEventQueue;
+	CSPSCRingBuffer<u8, SysExEventQueueSize> m_SysExEventQueue;
+	u32 m_nMIDIEventsQueued;
+	u32 m_nMIDIEventsApplied;
+	unsigned int m_nMIDIEventWaitMicros;
+	bool m_bMIDIEventWaitTimedOut;
+	u32 m_nMIDIEventsAppliedAtTimeout;
+	bool m_bSysExChunksDeferred;
+
+	// Optional dropping of redundant controller messages before they reach the synth
+	bool m_bMIDICoalesceControllers;
+	CMIDICoalescer m_MIDICoalescer;
 
 	// Event handling
 	TEventQueue m_EventQueue;
@@ -222,7 +303,8 @@ private:
 	static void EventHandler(const TEvent& Event);
 	static void USBMIDIDeviceRemovedHandler(CDevice* pDevice, void* pContext);
 	static void USBMIDIPacketHandler(unsigned nCable, u8* pPacket, unsigned nLength);
-	static void IRQMIDIReceiveHandler(const u8* pData, size_t nSize);
+	static void PisoundMIDIReceiveHandler(const u8* pData, size_t nSize);
+	static void IRQMIDIReceiveHandler(TMIDISource Source, const u8* pData, size_t nSize);
 
 	static void PanicHandler();
 
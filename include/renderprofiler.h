@@ -0,0 +1,83 @@
+//
+// renderprofiler.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _renderprofiler_h
+#define _renderprofiler_h
+
+#include <circle/types.h>
+
+#include "synth/synth.h"
+
+// Records how much of each audio block's real-time budget was spent rendering.
+// Only the audio task writes; any core may read statistics or request a reset without locking.
+class CRenderProfiler
+{
+public:
+	static constexpr size_t SynthCount       = 3;
+	static constexpr size_t HistogramBuckets = 128; // 1% load per bucket; the last also counts anything higher
+	static constexpr u32 NearMissPercent     = 90;
+
+	struct TStats
+	{
+		u32 nBlocks;
+		u32 nMinMicros;
+		u32 nAvgMicros;
+		u32 nMaxMicros;
+		u32 nDeadlineMicros; // Budget for the most recent block
+		u32 nAvgLoad;        // Percentages of the block budget
+		u32 nP99Load;
+		u32 nMaxLoad;
+		u32 nUnderruns;  // Blocks that took longer to render than they take to play
+		u32 nNearMisses; // Blocks above NearMissPercent but within budget
+	};
+
+	CRenderProfiler();
+
+	// Audio task only
+	void Record(TSynth Synth, u32 nRenderMicros, u32 nDeadlineMicros);
+
+	void GetStats(TSynth Synth, TStats& Stats) const;
+	u32 GetLoad() const { return __atomic_load_n(&m_nSmoothedLoad, __ATOMIC_RELAXED); }
+	u32 GetTotalUnderruns() const;
+	void Reset() { __atomic_store_n(&m_bResetRequested, true, __ATOMIC_RELEASE); }
+
+private:
+	struct TSynthProfile
+	{
+		u32 nBlocks;
+		u32 nMinMicros;
+		u32 nMaxMicros;
+		u32 nMaxLoad;
+		u32 nDeadlineMicros;
+		u64 nTotalMicros;
+		u64 nTotalDeadlineMicros;
+		u32 nUnderruns;
+		u32 nNearMisses;
+		u32 Histogram[HistogramBuckets];
+	};
+
+	TSynthProfile m_Profiles[SynthCount];
+	u32 m_nSmoothedLoad;
+	bool m_bResetRequested;
+};
+
+#endif
@@ -25,6 +25,7 @@
 
 #include <circle/spinlock.h>
 #include <circle/types.h>
+#include <circle/util.h>
 
 #include "utility.h"
 
@@ -120,4 +121,106 @@ private:
 	T m_Data[N];
 };
 
+// Lock-free ring buffer for exactly one producer and one consumer (e.g. an IRQ handler feeding the main task).
+// The producer only writes the input pointer and the consumer only writes the output pointer; publication of the
+// item data is ordered by release stores/acquire loads on those pointers, so no lock or interrupt masking is required.
+// Items are copied with memcpy(), so T must be trivially copyable.
+template <class T, size_t N>
+class CSPSCRingBuffer
+{
+public:
+	CSPSCRingBuffer()
+		: m_nInPtr(0),
+		  m_nOutPtr(0),
+		  m_Data{}
+	{
+	}
+
+	bool Enqueue(const T& Item)
+	{
+		return Enqueue(&Item, 1) == 1;
+	}
+
+	size_t Enqueue(const T* pItems, size_t nCount)
+	{
+		// Only the producer modifies the input pointer
+		const size_t nInPtr  = __atomic_load_n(&m_nInPtr, __ATOMIC_RELAXED);
+		const size_t nOutPtr = __atomic_load_n(&m_nOutPtr, __ATOMIC_ACQUIRE);
+
+		nCount = Utility::Min(nCount, (nOutPtr - nInPtr - 1) & BufferMask);
+		if (!nCount)
+			return 0;
+
+		// Copy in at most two contiguous spans (before and after wrap-around)
+		const size_t nFirstSpan = Utility::Min(nCount, N - nInPtr);
+		memcpy(m_Data + nInPtr, pItems, nFirstSpan * sizeof(T));
+		memcpy(m_Data, pItems + nFirstSpan, (nCount - nFirstSpan) * sizeof(T));
+
+		// Publish the new items to the consumer
+		__atomic_store_n(&m_nInPtr, (nInPtr + nCount) & BufferMask, __ATOMIC_RELEASE);
+		return nCount;
+	}
+
+	bool Dequeue(T& OutItem)
+	{
+		return Dequeue(&OutItem, 1) == 1;
+	}
+
+	size_t Dequeue(T* pOutBuffer, size_t nMaxCount)
+	{
+		// Only the consumer modifies the output pointer
+		const size_t nOutPtr = __atomic_load_n(&m_nOutPtr, __ATOMIC_RELAXED);
+		const size_t nInPtr  = __atomic_load_n(&m_nInPtr, __ATOMIC_ACQUIRE);
+
+		const size_t nCount = Utility::Min(nMaxCount, (nInPtr - nOutPtr) & BufferMask);
+		if (!nCount)
+			return 0;
+
+		// Copy out at most two contiguous spans (before and after wrap-around)
+		const size_t nFirstSpan = Utility::Min(nCount, N - nOutPtr);
+		memcpy(pOutBuffer, m_Data + nOutPtr, nFirstSpan * sizeof(T));
+		memcpy(pOutBuffer + nFirstSpan, m_Data, (nCount - nFirstSpan) * sizeof(T));
+
+		// Hand the free space back to the producer
+		__atomic_store_n(&m_nOutPtr, (nOutPtr + nCount) & BufferMask, __ATOMIC_RELEASE);
+		return nCount;
+	}
+
+	// Lets the consumer use queued items in place: returns the contiguous run of items at the front of the queue (up to
+	// the wrap-around point). They stay in the queue until released with Commit().
+	size_t Peek(const T*& pOutItems) const
+	{
+		const size_t nOutPtr = __atomic_load_n(&m_nOutPtr, __ATOMIC_RELAXED);
+		const size_t nInPtr  = __atomic_load_n(&m_nInPtr, __ATOMIC_ACQUIRE);
+
+		pOutItems = m_Data + nOutPtr;
+		return Utility::Min((nInPtr - nOutPtr) & BufferMask, N - nOutPtr);
+	}
+
+	void Commit(size_t nCount)
+	{
+		// Hand the free space back to the producer
+		const size_t nOutPtr = __atomic_load_n(&m_nOutPtr, __ATOMIC_RELAXED);
+		__atomic_store_n(&m_nOutPtr, (nOutPtr + nCount) & BufferMask, __ATOMIC_RELEASE);
+	}
+
+	size_t GetCount() const
+	{
+		const size_t nInPtr  = __atomic_load_n(&m_nInPtr, __ATOMIC_ACQUIRE);
+		const size_t nOutPtr = __atomic_load_n(&m_nOutPtr, __ATOMIC_ACQUIRE);
+		return (nInPtr - nOutPtr) & BufferMask;
+	}
+
+private:
+	static_assert(Utility::IsPowerOfTwo(N), "Ring buffer size must be a power of 2");
+
+	static constexpr size_t BufferMask    = N - 1;
+	static constexpr size_t CacheLineSize = 64;
+
+	// Keep the pointers on separate cache lines so that the producer and consumer cores don't contend
+	alignas(CacheLineSize) size_t m_nInPtr;
+	alignas(CacheLineSize) size_t m_nOutPtr;
+	alignas(CacheLineSize) T m_Data[N];
+};
+
 #endif
@@ -0,0 +1,68 @@
+//
+// sampleconverter.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _sampleconverter_h
+#define _sampleconverter_h
+
+#include <circle/types.h>
+
+// Converts rendered floating point audio to the integer format expected by the sound device,
+// with saturation, optional channel swap and optional TPDF dither applied in a single pass
+class CSampleConverter
+{
+public:
+	enum class TFormat
+	{
+		Packed24, // 3 bytes per sample (PWM/HDMI)
+		I2S32,    // 24-bit samples in 32-bit containers (I2S "fast path")
+	};
+
+	CSampleConverter(TFormat Format, bool bReversedStereo, bool bDither);
+
+	size_t GetBytesPerSample() const { return m_Format == TFormat::I2S32 ? sizeof(s32) : 3; }
+
+	// Vectorized where supported; output is bit-exact with the scalar reference
+	void Convert(const float* pInBuffer, void* pOutBuffer, size_t nFrames) { (this->*m_pConvertFunc)(pInBuffer, static_cast<u8*>(pOutBuffer), nFrames); }
+	void ConvertScalar(const float* pInBuffer, void* pOutBuffer, size_t nFrames) { (this->*m_pScalarConvertFunc)(pInBuffer, static_cast<u8*>(pOutBuffer), nFrames); }
+
+private:
+	using TConvertFunc = void (CSampleConverter::*)(const float* pInBuffer, u8* pOutBuffer, size_t nFrames);
+
+	// One dither generator per vector lane; sample n of a call always uses lane n % DitherLanes
+	static constexpr size_t DitherLanes = 4;
+
+	template <TFormat Format, bool bReversedStereo, bool bDither>
+	void ConvertImpl(const float* pInBuffer, u8* pOutBuffer, size_t nFrames);
+
+	template <TFormat Format, bool bReversedStereo, bool bDither>
+	void ConvertScalarImpl(const float* pInBuffer, u8* pOutBuffer, size_t nFrames);
+
+	template <TFormat Format, bool bReversedStereo, bool bDither>
+	void ConvertScalarRange(const float* pInBuffer, u8* pOutBuffer, size_t nStart, size_t nEnd);
+
+	TFormat m_Format;
+	TConvertFunc m_pConvertFunc;
+	TConvertFunc m_pScalarConvertFunc;
+	u32 m_DitherState[DitherLanes];
+};
+
+#endif
@@ -0,0 +1,119 @@
+//
+// smfplayer.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _smfplayer_h
+#define _smfplayer_h
+
+#include <circle/spinlock.h>
+#include <circle/string.h>
+#include <circle/types.h>
+
+#include "midievent.h"
+#include "synth/synthbase.h"
+
+// Plays Standard MIDI Files (type 0 and 1) from the "midi" directory of the SD card or a USB disk.
+// Files are parsed up-front into a single tempo-resolved timeline with timestamps in audio frames, which the audio task
+// consumes a block at a time. Anything that can't be applied from the audio core (SysEx, or messages the synth wants on
+// the main core) is handed back to the main task, and the playhead waits until it has been dispatched.
+class CSMFPlayer
+{
+public:
+	static constexpr size_t MaxFiles          = 256;
+	static constexpr size_t MaxEventsPerBlock = 256;
+
+	CSMFPlayer(unsigned int nSampleRate);
+	~CSMFPlayer();
+
+	// Main core
+	bool ScanFiles();
+	size_t GetFileCount() const { return m_nFiles; }
+	size_t GetFileIndex() const { return m_nFileIndex; }
+	const char* GetFileName(size_t nIndex) const;
+
+	bool Load(size_t nIndex);
+	bool Load(const char* pPath);
+	void Unload();
+	void Play();
+	void Stop();
+	void Seek(unsigned int nMillis, CSynthBase& Synth);
+	void Update(CSynthBase& Synth);
+
+	bool IsLoaded() const { return m_pEvents != nullptr; }
+	bool IsPlaying() const { return m_State == TState::Playing; }
+	bool IsFinished() const { return m_State == TState::Finished; }
+	unsigned int GetPositionMillis() const { return FramesToMillis(m_nPosition); }
+	unsigned int GetLengthMillis() const { return FramesToMillis(m_nLength); }
+
+	// Audio core; returns events due within the next nFrames, with timestamps as frame offsets into the block
+	size_t GetEvents(const CSynthBase& Synth, TMIDIEvent* pOutEvents, size_t nFrames);
+
+private:
+	enum class TState
+	{
+		Stopped,
+		Playing,
+		Finished,
+	};
+
+	struct TTimelineEvent
+	{
+		u32 nFrame;
+		u32 nMessage;
+		u32 nSysExOffset;
+		u32 nSysExSize; // Non-zero for SysEx messages
+	};
+
+	struct TTrack;
+	struct TTrackEvent;
+
+	static constexpr size_t MaxTracks = 128;
+
+	bool Parse(const u8* pData, size_t nSize);
+	static bool ReadTrackEvent(TTrack& Track, TTrackEvent& OutEvent);
+	void Chase(size_t nEndEvent, CSynthBase& Synth);
+	void DispatchEvent(const TTimelineEvent& Event, CSynthBase& Synth) const;
+	bool DefersEvent(const TTimelineEvent& Event, const CSynthBase& Synth) const { return Event.nSysExSize || !Synth.CanRenderWithMIDIMessage(Event.nMessage); }
+	unsigned int FramesToMillis(u32 nFrames) const { return static_cast<u64>(nFrames) * 1000 / m_nSampleRate; }
+
+	static bool FileListComparator(const CString& PathA, const CString& PathB);
+
+	CSpinLock m_Lock;
+	unsigned int m_nSampleRate;
+
+	CString m_FileList[MaxFiles];
+	size_t m_nFiles;
+	size_t m_nFileIndex;
+
+	// Timeline; allocated from the zone allocator
+	TTimelineEvent* m_pEvents;
+	size_t m_nEvents;
+	u8* m_pSysExData;
+	u32 m_nLength;
+
+	// Playback state; shared with the audio core
+	volatile TState m_State;
+	size_t m_nNextEvent;
+	u32 m_nPosition;
+	volatile bool m_bEventDeferred;
+};
+
+#endif
@@ -24,6 +24,7 @@
 #define _soundfontmanager_h
 
 #include <circle/string.h>
+#include <circle/types.h>
 
 #include "synth/fxprofile.h"
 
@@ -37,7 +38,7 @@ public:
 	size_t GetSoundFontCount() const { return m_nSoundFonts; }
 	const char* GetSoundFontPath(size_t nIndex) const;
 	const char* GetSoundFontName(size_t nIndex) const;
-	TFXProfile GetSoundFontFXProfile(size_t nIndex) const;
+	TFXProfile GetSoundFontFXProfile(size_t nIndex);
 	const char* GetFirstValidSoundFontPath() const;
 
 	static constexpr size_t MaxSoundFonts = 512;
@@ -47,15 +48,46 @@ private:
 	{
 		CString Name;
 		CString Path;
+
+		// File size and FAT timestamp for index cache validation
+		u32 nSize;
+		u32 nTimestamp;
+
+		// Cached effects profile and the size/timestamp of the .cfg file it came from (zero if absent)
+		bool bFXProfileCached;
+		u32 nFXProfileSize;
+		u32 nFXProfileTimestamp;
+		TFXProfile FXProfile;
 	};
 
+	// Files that were found not to be SoundFonts; indexed so that they aren't probed again
+	struct TNonSoundFontListEntry
+	{
+		CString Path;
+		u32 nSize;
+		u32 nTimestamp;
+	};
+
+	struct TIndexCacheEntry;
+
 	static constexpr size_t MaxSoundFontNameLength = 256;
+	static constexpr size_t MaxNonSoundFonts = 512;
 
-	void CheckSoundFont(const char* pFullPath, const char* pFileName);
+	void CheckSoundFont(const char* pFullPath, const char* pFileName, u32 nSize, u32 nTimestamp);
+	bool ProbeSoundFont(const char* pFullPath, char* pName);
+	void AddNonSoundFont(const char* pFullPath, u32 nSize, u32 nTimestamp);
+	static bool ParseFXProfile(const char* pPath, TFXProfile& FXProfile);
+
+	// Persistent index
+	TIndexCacheEntry* LoadIndex(u8*& pIndexData, size_t& nEntries);
+	void SaveIndex();
 
 	size_t m_nSoundFonts;
 	TSoundFontListEntry m_SoundFontList[MaxSoundFonts];
 
+	size_t m_nNonSoundFonts;
+	TNonSoundFontListEntry m_NonSoundFontList[MaxNonSoundFonts];
+
 	static int INIHandler(void* pUser, const char* pSection, const char* pName, const char* pValue);
 	inline static bool SoundFontListComparator(const TSoundFontListEntry& lhs, const TSoundFontListEntry& rhs);
 };
@@ -0,0 +1,116 @@
+//
+// layeredsynth.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef _layeredsynth_h
+#define _layeredsynth_h
+
+#include <circle/types.h>
+
+#include "synth/mt32synth.h"
+#include "synth/soundfontsynth.h"
+#include "synth/synthbase.h"
+
+// Plays the MT-32 and SoundFont synths at the same time, routing each MIDI channel (or a whole USB MIDI cable) to one
+// of them. The MT-32 synth renders into its own bus, optionally on another core, while the SoundFont synth renders into
+// the output buffer; the two are then mixed with a gain for each synth.
+// The synths are owned by the caller and must outlive this object.
+class CLayeredSynth : public CSynthBase
+{
+public:
+	CLayeredSynth(unsigned nSampleRate, size_t nMaxFrames, size_t nMaxEvents, CMT32Synth* pMT32Synth, CSoundFontSynth* pSoundFontSynth);
+	virtual ~CLayeredSynth() override;
+
+	// CSynthBase
+	virtual bool Initialize() override;
+	virtual void HandleMIDIShortMessage(u32 nMessage) override;
+	virtual void HandleMIDIShortMessages(const u32* pMessages, size_t nCount) override;
+	virtual void HandleMIDIEvents(const TMIDIEvent* pEvents, size_t nCount) override;
+	virtual void HandleMIDISysExMessage(const u8* pData, size_t nSize) override;
+	virtual void ApplyMIDISysExMessage(const u8* pData, size_t nSize) override;
+	virtual bool IsActive() override;
+	virtual void AllSoundOff() override;
+	virtual void SetMasterVolume(u8 nVolume) override;
+	virtual size_t Render(s16* pOutBuffer, size_t nFrames) override;
+	virtual size_t Render(float* pOutBuffer, size_t nFrames) override;
+	virtual size_t RenderWithMIDIEvents(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents) override;
+	virtual bool CanRenderWithMIDIMessage(u32 nMessage) const override;
+	virtual bool CanApplyMIDISysExMessage(const u8* pData, size_t nSize) const override;
+	virtual void ReportStatus() const override;
+	virtual void UpdateLCD(CLCD& LCD, unsigned int nTicks) override;
+
+	// Bit n set sends MIDI channel n + 1 to the MT-32 synth; other channels go to the SoundFont synth
+	void SetMT32Channels(u16 nChannelMask) { m_nMT32ChannelMask = nChannelMask; }
+
+	// Bit n set sends everything on USB MIDI cable n to that synth, regardless of channel
+	void SetCables(u16 nMT32CableMask, u16 nSoundFontCableMask);
+
+	void SetGains(float nMT32Gain, float nSoundFontGain);
+
+	// Parallel rendering; when enabled, RenderSecondary() must be polled continuously from another core
+	void SetParallelRendering(bool bEnabled) { m_bParallelRendering = bEnabled; }
+	void RenderSecondary();
+
+private:
+	enum class TRoute : u8
+	{
+		MT32,
+		SoundFont,
+		Both,
+	};
+
+	static constexpr size_t MessageBatchSize = 64;
+
+	TRoute RouteShortMessage(u32 nMessage, u8 nCable) const;
+	static TRoute RouteSysExMessage(const u8* pData, size_t nSize);
+	template <class TGetEvent>
+	void RouteShortMessages(size_t nCount, TGetEvent GetEvent);
+	void RenderMT32(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents);
+	void MixBuses(float* pOutBuffer, size_t nFrames) const;
+
+	CMT32Synth* m_pMT32Synth;
+	CSoundFontSynth* m_pSoundFontSynth;
+
+	// Routing
+	u16 m_nMT32ChannelMask;
+	u16 m_nMT32CableMask;
+	u16 m_nSoundFontCableMask;
+
+	// Mixer
+	float m_nMT32Gain;
+	float m_nSoundFontGain;
+	size_t m_nMaxFrames;
+	float* m_pMT32Bus;
+
+	// Events for the current block, split by destination
+	size_t m_nMaxEvents;
+	TMIDIEvent* m_pMT32Events;
+	TMIDIEvent* m_pSoundFontEvents;
+
+	// Parallel rendering; a request is pending while m_nMT32RenderFrames is non-zero
+	bool m_bParallelRendering;
+	const TMIDIEvent* m_pMT32RenderEvents;
+	size_t m_nMT32RenderEvents;
+	size_t m_nMT32RenderFrames;
+};
+
+#endif
@@ -0,0 +1,70 @@
+//
+// mt32snapshot.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef _mt32snapshot_h
+#define _mt32snapshot_h
+
+#include <circle/types.h>
+
+#include <mt32emu/mt32emu.h>
+
+#include "synth/mt32romset.h"
+
+// A copy of everything in mt32emu's memory that a game can upload (system area, timbre and patch memory, rhythm setup,
+// and the parts' temporary patches and timbres), which can be saved to numbered slots in the "snapshots" directory of
+// the SD card. Restoring one replaces the state left by a game's setup SysEx without resending it over MIDI.
+// Each area is stored with its SysEx address in front, so that it can be written back with a single writeSysex() call.
+class CMT32Snapshot
+{
+public:
+	CMT32Snapshot();
+
+	void Capture(MT32Emu::Synth& Synth, TMT32ROMSet ROMSet);
+	void Restore(MT32Emu::Synth& Synth) const;
+
+	bool Save(u8 nSlot) const;
+	bool Load(u8 nSlot);
+
+	bool IsValid() const { return m_bValid; }
+	TMT32ROMSet GetROMSet() const { return m_ROMSet; }
+
+private:
+	// An area of mt32emu's memory; the address is a SysEx address (7 bits per byte)
+	struct TRegion
+	{
+		u32 nAddress;
+		u32 nSize;
+	};
+
+	static constexpr size_t RegionCount = 6;
+	static const TRegion Regions[RegionCount];
+
+	// Sum of the region sizes, plus 3 address bytes for each
+	static constexpr size_t DataSize = 0x17 + 64 * 256 + 128 * 8 + 85 * 4 + 9 * 16 + 8 * 246 + RegionCount * 3;
+
+	bool m_bValid;
+	TMT32ROMSet m_ROMSet;
+	u8 m_Data[DataSize];
+};
+
+#endif
@@ -29,6 +29,8 @@
 
 #include "rommanager.h"
 #include "synth/mt32romset.h"
+#include "synth/mt32snapshot.h"
+#include "synth/mt32sysexcache.h"
 #include "synth/synthbase.h"
 #include "utility.h"
 
@@ -40,14 +42,49 @@ public:
 		ENUM(Fastest, fastest)          \
 		ENUM(Fast, fast)                \
 		ENUM(Good, good)                \
-		ENUM(Best, best)
+		ENUM(Best, best)                \
+		ENUM(Auto, auto)
 
 	#define ENUM_MIDICHANNELS(ENUM) \
 		ENUM(Standard, standard)    \
 		ENUM(Alternate, alternate)
 
+	// Named profiles are in order of increasing quality and CPU cost
+	#define ENUM_PROFILE(ENUM)       \
+		ENUM(Manual, manual)     \
+		ENUM(Auto, auto)         \
+		ENUM(Minimal, minimal)   \
+		ENUM(Low, low)           \
+		ENUM(Standard, standard) \
+		ENUM(High, high)         \
+		ENUM(Best, best)
+
+	// In the same order as mt32emu's AnalogOutputMode and RendererType
+	#define ENUM_ANALOGOUTPUTMODE(ENUM)    \
+		ENUM(DigitalOnly, digital_only) \
+		ENUM(Coarse, coarse)            \
+		ENUM(Accurate, accurate)        \
+		ENUM(Oversampled, oversampled)
+
+	#define ENUM_RENDERERTYPE(ENUM) \
+		ENUM(Integer, int16)    \
+		ENUM(Float, float)
+
 	CONFIG_ENUM(TResamplerQuality, ENUM_RESAMPLERQUALITY);
 	CONFIG_ENUM(TMIDIChannels, ENUM_MIDICHANNELS);
+	CONFIG_ENUM(TProfile, ENUM_PROFILE);
+	CONFIG_ENUM(TAnalogOutputMode, ENUM_ANALOGOUTPUTMODE);
+	CONFIG_ENUM(TRendererType, ENUM_RENDERERTYPE);
+
+	struct TMIDIQueueStats
+	{
+		u32 nSize;
+		u32 nPeakDepth;
+		u32 nStalls;
+		u32 nStallMicros;
+		u32 nMaxStallMicros;
+		u32 nDropped;
+	};
 
 	CMT32Synth(unsigned nSampleRate, float nGain, float nReverbGain, TResamplerQuality ResamplerQuality);
 	virtual ~CMT32Synth();
@@ -55,23 +92,36 @@ public:
 	// CSynthBase
 	virtual bool Initialize() override;
 	virtual void HandleMIDIShortMessage(u32 nMessage) override;
+	virtual void HandleMIDIShortMessages(const u32* pMessages, size_t nCount) override;
 	virtual void HandleMIDISysExMessage(const u8* pData, size_t nSize) override;
+	virtual void ApplyMIDISysExMessage(const u8* pData, size_t nSize) override;
 	virtual bool IsActive() override { return m_pSynth->isActive(); }
 	virtual void AllSoundOff() override;
 	virtual void SetMasterVolume(u8 nVolume) override;
 	virtual size_t Render(s16* pBuffer, size_t nFrames) override;
 	virtual size_t Render(float* pBuffer, size_t nFrames) override;
+	virtual size_t RenderWithMIDIEvents(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents) override;
 	virtual void ReportStatus() const override;
 	virtual void UpdateLCD(CLCD& LCD, unsigned int nTicks) override;
 
 	void SetMIDIChannels(TMIDIChannels Channels);
-	void SetReversedStereo(bool bEnabled) { m_pSynth->setReversedStereoEnabled(bEnabled); }
+	void SetReversedStereo(bool bEnabled);
+	void SetPreloadROMSets(u8 nMask);
+	void SetSkipRedundantSysEx(bool bEnabled) { m_bSkipRedundantSysEx = bEnabled; }
+	void SetMIDIQueue(unsigned int nSize, unsigned int nTimeoutMillis);
+	void GetMIDIQueueStats(TMIDIQueueStats& Stats) const;
+	const CMT32SysExCache& GetSysExCache() const { return m_SysExCache; }
+	bool UpdatePreloadedROMSets();
 	bool SwitchROMSet(TMT32ROMSet ROMSet);
 	bool NextROMSet();
 	TMT32ROMSet GetROMSet() const;
 	const char* GetControlROMName() const;
 	CROMManager& GetROMManager() { return m_ROMManager; }
 
+	// Restoring returns how long rendering was held off for, in microseconds
+	void CaptureSnapshot(CMT32Snapshot& Snapshot);
+	unsigned RestoreSnapshot(const CMT32Snapshot& Snapshot);
+
 	u8 GetMasterVolume() const;
 
 private:
@@ -80,6 +130,68 @@ private:
 	// N characters plus null terminator
 	static constexpr size_t LCDTextBufferSize = 20 + 1;
 
+	// MT-32 (old), MT-32 (new) and CM-32L
+	static constexpr size_t ROMSetCount = 3;
+
+	// An mt32emu instance opened with a particular ROM set, kept on standby for instant switching
+	// State is shared between the main task and the UI core, which opens preloaded instances in the background and
+	// deletes retired ones
+	enum class TInstanceState : u8
+	{
+		Closed,
+		Pending,
+		Opening,
+		Ready,
+		Retired,
+	};
+
+	struct TROMSetInstance
+	{
+		MT32Emu::Synth* pSynth;
+		MT32Emu::SampleRateConverter* pSampleRateConverter;
+		const MT32Emu::ROMImage* pControlROMImage;
+		const MT32Emu::ROMImage* pPCMROMImage;
+		size_t nMemoryBytes;
+		TInstanceState State;
+	};
+
+	bool OpenInstance(TROMSetInstance& Instance);
+	void CloseInstance(TROMSetInstance& Instance);
+	bool SwapROMSet(TMT32ROMSet ROMSet, const MT32Emu::ROMImage* pControlROMImage, const MT32Emu::ROMImage* pPCMROMImage);
+	MT32Emu::SampleRateConverter* CreateSampleRateConverter(MT32Emu::Synth& Synth, TResamplerQuality ResamplerQuality) const;
+	static const char* GetControlROMName(const MT32Emu::ROMImage* pControlROMImage);
+
+	// Settings that trade emulation quality for CPU time
+	struct TProfileSettings
+	{
+		const char* pName;
+		TRendererType RendererType;
+		TAnalogOutputMode AnalogOutputMode;
+		TResamplerQuality ResamplerQuality;
+		u32 nPartials;
+	};
+
+	static constexpr size_t ProfileCount = 5;
+	static const TProfileSettings Profiles[ProfileCount];
+
+	// Render load of each named profile in tenths of a percent, as measured on this machine
+	static constexpr u16 ProfileLoadNotMeasured = 0xFFFF;
+	using TProfileLoads = u16[ProfileCount];
+
+	void ApplyProfile();
+	size_t SelectAutoProfile();
+	u16 BenchmarkProfile(const TProfileSettings& Profile);
+	TResamplerQuality GetProfileResamplerQuality(const TProfileSettings& Profile) const;
+	bool LoadProfileCache(TProfileLoads& Loads) const;
+	bool SaveProfileCache(const TProfileLoads& Loads) const;
+
+	// How often to retry while waiting for room in mt32emu's MIDI queue
+	static constexpr unsigned int MIDIQueueRetryMicros = 100;
+
+	template <class TPlayFunction>
+	bool QueueMIDIMessage(TPlayFunction PlayMessage);
+	void ClearSysExCache();
+
 	void GetPartLevels(unsigned int nTicks, float PartLevels[9], float PartPeaks[9]);
 
 	// MT32Emu::ReportHandler
@@ -95,8 +207,12 @@ private:
 
 	float m_nGain;
 	float m_nReverbGain;
+	bool m_bReversedStereo;
 
 	TResamplerQuality m_ResamplerQuality;
+	TAnalogOutputMode m_AnalogOutputMode;
+	TRendererType m_RendererType;
+	u32 m_nPartials;
 	MT32Emu::SampleRateConverter* m_pSampleRateConverter;
 
 	CROMManager m_ROMManager;
@@ -104,6 +220,27 @@ private:
 	const MT32Emu::ROMImage* m_pControlROMImage;
 	const MT32Emu::ROMImage* m_pPCMROMImage;
 
+	// Preloaded ROM sets; the active ROM set's instance is held by m_pSynth and m_pSampleRateConverter instead
+	// UpdatePreloadedROMSets() must be called from the same core as UpdateLCD()
+	u8 m_nPreloadROMSetMask;
+	TROMSetInstance m_Instances[ROMSetCount];
+
+	// Drops SysEx uploads that wouldn't change anything; only used under m_MIDIQueueLock, as SysEx may be handled on
+	// either the main core or the rendering core
+	bool m_bSkipRedundantSysEx;
+	CMT32SysExCache m_SysExCache;
+
+	// MIDI input waits up to the timeout for the audio core to make room in mt32emu's queue rather than dropping messages;
+	// the depth is the number of messages queued since the start of the last render, and is reset by the audio core.
+	// The queue only supports one producer, but messages come from both the main core and the rendering core (e.g. the
+	// MIDI file player), so every push into it is made while holding m_MIDIQueueLock; never held while waiting.
+	CSpinLock m_MIDIQueueLock;
+	u32 m_nMIDIQueueSize;
+	unsigned int m_nMIDIQueueTimeoutMicros;
+	bool m_bMIDIQueueBlocked;
+	u32 m_nMIDIQueueDepth;
+	TMIDIQueueStats m_MIDIQueueStats;
+
 	// LCD state
 	char m_LCDTextBuffer[LCDTextBufferSize];
 };
@@ -0,0 +1,80 @@
+//
+// mt32sysexcache.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _mt32sysexcache_h
+#define _mt32sysexcache_h
+
+#include <circle/types.h>
+
+// Remembers the data of Roland DT1 (data set) messages written to the MT-32's rhythm setup, patch and timbre memory, so
+// that uploads which would write the same values again can be dropped before they reach mt32emu. Many games resend
+// several kilobytes of these on every level load.
+// The data that was sent is tracked rather than mt32emu's memory, because mt32emu applies SysEx messages later, on the
+// audio core. Memory areas that MIDI short messages modify (patch temp, timbre temp and system) are never tracked, so
+// messages for those are always passed on, as are channel-addressed messages (device IDs below 0x10).
+class CMT32SysExCache
+{
+public:
+	CMT32SysExCache();
+
+	// Returns true if the message would change nothing and can be dropped; otherwise its data is remembered
+	bool IsRedundant(const u8* pData, size_t nSize);
+
+	// Forgets everything that was written; for when mt32emu's memory is reset or the synth is replaced
+	void Clear();
+
+	// Hits are dropped DT1 messages, misses are DT1 messages that were passed on
+	u32 GetHitCount() const { return m_nHits; }
+	u32 GetMissCount() const { return m_nMisses; }
+	size_t GetSkippedBytes() const { return m_nSkippedBytes; }
+	void ResetStats();
+
+private:
+	// A tracked area of mt32emu's memory, using mt32emu's linear addresses (the 7-bit SysEx address bytes packed together)
+	struct TRegion
+	{
+		u32 nAddress;
+		u32 nSize;
+		u32 nOffset;
+	};
+
+	static constexpr size_t RegionCount = 3;
+	static const TRegion Regions[RegionCount];
+
+	// Remembers data written at a linear address; returns true if it was all tracked and unchanged
+	bool Update(u32 nAddress, const u8* pData, size_t nSize);
+
+	// Forgets timbre memory, so that the next write to it reaches mt32emu and reloads the parts' timbre temp
+	void InvalidateTimbres();
+
+	// Rhythm setup (85 keys of 4 bytes), patch memory (128 patches of 8 bytes) and timbre memory (64 timbres padded to 256 bytes)
+	static constexpr size_t DataSize = 85 * 4 + 128 * 8 + 64 * 256;
+
+	// Bytes that haven't been written hold 0xFF, which is never a valid data byte
+	u8 m_Data[DataSize];
+
+	u32 m_nHits;
+	u32 m_nMisses;
+	size_t m_nSkippedBytes;
+};
+
+#endif
@@ -27,6 +27,7 @@
 
 enum TRolandModelID : u8
 {
+	MT32 = 0x16,
 	GS   = 0x42,
 	SC55 = 0x45
 };
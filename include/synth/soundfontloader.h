@@ -0,0 +1,79 @@
+//
+// synth/soundfontloader.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _soundfontloader_h
+#define _soundfontloader_h
+
+#include <circle/sched/synchronizationevent.h>
+#include <circle/sched/task.h>
+#include <circle/string.h>
+#include <circle/types.h>
+
+#include <fluidsynth.h>
+
+// Loads a SoundFont into a FluidSynth instance as a scheduler task; yields to other tasks between reads so that MIDI
+// processing continues while loading
+class CSoundFontLoader : protected CTask
+{
+public:
+	enum class TState
+	{
+		Idle,
+		Loading,
+		Succeeded,
+		Failed,
+	};
+
+	CSoundFontLoader();
+
+	bool Load(fluid_synth_t* pSynth, const char* pSoundFontPath);
+	void Reset();
+
+	TState GetState() const { return m_State; }
+	int GetSoundFontID() const { return m_nSoundFontID; }
+	u8 GetProgress() const;
+
+	virtual void Run() override;
+
+	// Called by the FluidSynth file hooks
+	static void OnFileOpened(size_t nFileSize);
+	static void OnFileRead(size_t nBytes);
+
+private:
+	static constexpr unsigned StackSize = 0x10000;
+
+	static bool IsLoaderTask();
+
+	CSynchronizationEvent m_Event;
+
+	volatile TState m_State;
+	fluid_synth_t* m_pSynth;
+	CString m_SoundFontPath;
+	int m_nSoundFontID;
+
+	volatile size_t m_nFileSize;
+	volatile size_t m_nBytesRead;
+
+	static CSoundFontLoader* s_pThis;
+};
+
+#endif
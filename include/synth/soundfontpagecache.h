@@ -0,0 +1,83 @@
+//
+// synth/soundfontpagecache.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _soundfontpagecache_h
+#define _soundfontpagecache_h
+
+#include <circle/sysconfig.h>
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+// Fixed-size LRU cache of SoundFont file pages; used with FluidSynth's dynamic sample loading so that
+// sample data for presets being switched in and out isn't re-read from the SD card every time
+class CSoundFontPageCache
+{
+public:
+	struct TStats
+	{
+		u32 nHits;
+		u32 nMisses;
+		u32 nPagesRead;
+		u32 nStallMicros;
+	};
+
+	CSoundFontPageCache();
+	~CSoundFontPageCache();
+
+	bool Initialize();
+	bool Read(FIL* pFile, u32 nFileID, u32 nOffset, void* pBuffer, size_t nSize);
+	void GetStats(TStats& Stats) const;
+	void DumpStats() const;
+
+	// Reads bigger than this bypass the cache
+	static constexpr size_t MaxCachedReadSize = 512 * KILOBYTE;
+
+	static CSoundFontPageCache* Get() { return s_pThis; }
+
+private:
+	struct TPage
+	{
+		u32 nFileID;
+		u32 nPageIndex;
+		u32 nValidBytes;
+		u32 nLastUsed;
+	};
+
+	static constexpr size_t PageSize       = 32 * KILOBYTE;
+	static constexpr size_t CacheSize      = 4 * MEGABYTE;
+	static constexpr size_t PageCount      = CacheSize / PageSize;
+	static constexpr size_t ReadAheadPages = 4;
+
+	TPage* FindPage(u32 nFileID, u32 nPageIndex);
+	TPage* FillPages(FIL* pFile, u32 nFileID, u32 nPageIndex);
+	u8* GetPageData(const TPage* pPage) const { return m_pData + (pPage - m_Pages) * PageSize; }
+
+	u8* m_pData;
+	TPage m_Pages[PageCount];
+	u32 m_nUseCounter;
+
+	TStats m_Stats;
+
+	static CSoundFontPageCache* s_pThis;
+};
+
+#endif
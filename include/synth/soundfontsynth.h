@@ -27,8 +27,11 @@
 
 #include <fluidsynth.h>
 
+#include "ringbuffer.h"
 #include "soundfontmanager.h"
 #include "synth/fxprofile.h"
+#include "synth/soundfontloader.h"
+#include "synth/soundfontpagecache.h"
 #include "synth/synthbase.h"
 
 class CSoundFontSynth : public CSynthBase
@@ -40,21 +43,86 @@ public:
 	// CSynthBase
 	virtual bool Initialize() override;
 	virtual void HandleMIDIShortMessage(u32 nMessage) override;
+	virtual void HandleMIDIShortMessages(const u32* pMessages, size_t nCount) override;
 	virtual void HandleMIDISysExMessage(const u8* pData, size_t nSize) override;
-	virtual bool IsActive() override;
+	virtual void ApplyMIDISysExMessage(const u8* pData, size_t nSize) override;
+	virtual bool IsActive() override { return __atomic_load_n(&m_bActive, __ATOMIC_RELAXED); }
 	virtual void AllSoundOff() override;
 	virtual void SetMasterVolume(u8 nVolume) override;
 	virtual size_t Render(s16* pOutBuffer, size_t nFrames) override;
 	virtual size_t Render(float* pOutBuffer, size_t nFrames) override;
+	virtual size_t RenderWithMIDIEvents(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents) override;
+	virtual bool CanRenderWithMIDIMessage(u32 nMessage) const override;
+	virtual bool CanApplyMIDISysExMessage(const u8* pData, size_t nSize) const override { return !m_bDynamicSampleLoading; }
 	virtual void ReportStatus() const override;
 	virtual void UpdateLCD(CLCD& LCD, unsigned int nTicks) override;
 
 	bool SwitchSoundFont(size_t nIndex);
+	bool UpdateSoundFontSwitch();
+	bool IsSwitchingSoundFont() const { return m_pPendingSynth != nullptr; }
 	size_t GetSoundFontIndex() const { return m_nCurrentSoundFontIndex; }
 	CSoundFontManager& GetSoundFontManager() { return m_SoundFontManager; }
 
+	// Parallel rendering; must be polled continuously from another core
+	bool IsParallelRenderingEnabled() const { return m_bParallelRendering; }
+	void RenderSecondary();
+
+	// While the other core is taken by another synth (layered mode), the secondary synth is rendered on the audio core
+	void SetRenderCoreAvailable(bool bAvailable) { m_bRenderCoreAvailable = bAvailable; }
+
 private:
+	// Frames rendered by the secondary synth per hand-off
+	static constexpr size_t SecondaryBufferFrames = 256;
+
+	static constexpr unsigned CrossfadeMillis = 20;
+
+	// Commands from the main core; applied by the audio core at the start of each block
+	static constexpr size_t CommandQueueSize = 1024;
+	static constexpr unsigned int CommandQueueRetryMicros = 100;
+	static constexpr unsigned int CommandQueueTimeoutMicros = 100000;
+
+	// SysEx data for queued commands; FluidSynth only acts on short messages (resets, GS/XG parameters, tunings)
+	static constexpr size_t SysExQueueSize = 4096;
+	static constexpr size_t MaxSysExSize = 1024;
+
+	enum class TCommandType : u8
+	{
+		ShortMessage,
+		AllSoundOff,
+		SysEx,
+	};
+
+	struct TCommand
+	{
+		TCommandType Type;
+		u32 nValue;
+	};
+
+	void QueueCommand(const TCommand& Command);
+	size_t QueueCommands(const TCommand* pCommands, size_t nCount);
+	bool WaitForCommands(u32 nMaxPending);
+	void ApplyCommandNow(const TCommand& Command);
+	void ApplyQueuedCommands();
+	void ApplyCommand(const TCommand& Command);
+	void ApplySysEx(const u8* pData, size_t nSize);
+	void ApplyMIDIShortMessage(u32 nMessage);
+	void PageInMIDIShortMessage(u32 nMessage);
+	void UpdateActiveState();
+
 	bool Reinitialize(const char* pSoundFontPath, const TFXProfile* pFXProfile);
+	bool CreateSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pSecondarySynth, const TFXProfile* pFXProfile, float nInitialGain);
+	void ApplyFXProfile(fluid_synth_t* pSynth, const TFXProfile* pFXProfile, float nInitialGain);
+	void ShareSoundFont(fluid_synth_t* pSynth, fluid_synth_t* pSecondarySynth, int nSoundFontID);
+	void CopyChannelState(fluid_synth_t* pSynth, fluid_synth_t* pSecondarySynth);
+	void CopyPrograms(fluid_synth_t* pDest);
+	void SetPagerSoundFont(fluid_sfont_t* pSoundFont);
+	static void DeleteSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pSecondarySynth);
+	void RenderBlock(float* pOutBuffer, size_t nFrames);
+	void RenderParallel(float* pOutBuffer, size_t nFrames);
+	void RenderCrossfade(float* pOutBuffer, size_t nFrames);
+
+	static void ApplyChannelMessage(fluid_synth_t* pSynth, u8 nStatus, u8 nData1, u8 nData2);
+	fluid_synth_t* SelectNoteSynth(u8 nChannel);
 	void ResetMIDIMonitor();
 #ifndef NDEBUG
 	void DumpFXSettings() const;
@@ -66,7 +134,55 @@ private:
 	fluid_settings_t* m_pSettings;
 	fluid_synth_t* m_pSynth;
 
+	// Only the audio core takes commands off the queue, applying them under the lock. The main core waits for it to
+	// make room, or to apply everything queued before a message that can't be queued; the audio core counts the
+	// commands it has applied, and after a timeout (e.g. another synth is active) the main core stops waiting for it
+	// until it applies another one.
+	CSPSCRingBuffer<TCommand, CommandQueueSize> m_CommandQueue;
+	CSPSCRingBuffer<u8, SysExQueueSize> m_SysExQueue;
+	u32 m_nCommandsQueued;
+	u32 m_nCommandsApplied;
+	bool m_bCommandWaitTimedOut;
+	u32 m_nCommandsAppliedAtTimeout;
+	u8 m_SysExData[MaxSysExSize];
+	bool m_bActive;
+	bool m_bDynamicSampleLoading;
+
+	// Parallel rendering; channel state is sent to both synths, and each note is started on the one with fewer voices.
+	// The voice counts are taken after each render, and a note started since counts as one voice.
+	bool m_bParallelRendering;
+	bool m_bRenderCoreAvailable;
+	fluid_synth_t* m_pSecondarySynth;
+	size_t m_nSecondaryRenderFrames;
+	float m_SecondaryBuffer[SecondaryBufferFrames * 2];
+	int m_nPrimaryVoices;
+	int m_nSecondaryVoices;
+	u16 m_nMonoModeMask;
+
+	// Sample page cache for dynamic sample loading
+	CSoundFontPageCache m_PageCache;
+
+	// Silent synth sharing the SoundFont; bank selects, program changes and resets are applied to it first, outside
+	// the lock, so that their samples are already loaded when the playing synths select the same presets
+	fluid_synth_t* m_pPagerSynth;
+
+	// Background SoundFont switching
+	CSoundFontLoader m_Loader;
+	fluid_synth_t* m_pPendingSynth;
+	fluid_synth_t* m_pPendingSecondarySynth;
+	size_t m_nPendingSoundFontIndex;
+	float m_nPendingInitialGain;
+	u8 m_nLastLoadProgress;
+
+	// Previous synths being faded out after a switch
+	fluid_synth_t* m_pFadingSynth;
+	fluid_synth_t* m_pFadingSecondarySynth;
+	size_t m_nCrossfadeFrames;
+	volatile size_t m_nCrossfadeFramesRemaining;
+
+	// The latest volume is applied by the audio core at the start of each block
 	u8 m_nVolume;
+	u8 m_nAppliedVolume;
 	float m_nInitialGain;
 
 	u16 m_nPercussionMask;
@@ -25,9 +25,11 @@
 
 #include <circle/spinlock.h>
 #include <circle/types.h>
+#include <circle/util.h>
 
 #include "lcd/lcd.h"
 #include "lcd/ui.h"
+#include "midievent.h"
 #include "midimonitor.h"
 
 class CSynthBase
@@ -36,20 +38,36 @@ public:
 	CSynthBase(unsigned int nSampleRate)
 		: m_Lock(TASK_LEVEL),
 		  m_nSampleRate(nSampleRate),
-		  m_pUI(nullptr)
+		  m_pUI(nullptr),
+		  m_pSysExBuffer(nullptr),
+		  m_nSysExBufferSize(0),
+		  m_nSysExLength(0),
+		  m_bSysExInProgress(false)
 	{
 	}
 
-	virtual ~CSynthBase() = default;
+	virtual ~CSynthBase() { delete[] m_pSysExBuffer; }
 
 	virtual bool Initialize() = 0;
 	virtual void HandleMIDIShortMessage(u32 nMessage) { m_MIDIMonitor.OnShortMessage(nMessage); };
+	virtual void HandleMIDIShortMessages(const u32* pMessages, size_t nCount);
+	// As above, but with the USB MIDI cable number of each message available for routing
+	virtual void HandleMIDIEvents(const TMIDIEvent* pEvents, size_t nCount);
 	virtual void HandleMIDISysExMessage(const u8* pData, size_t nSize) = 0;
+	virtual void HandleMIDISysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize);
+	// As above, but from the core that renders the synth, between two renders (i.e. at a position within a block)
+	virtual void ApplyMIDISysExMessage(const u8* pData, size_t nSize) { HandleMIDISysExMessage(pData, nSize); }
+	void ApplyMIDISysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize);
 	virtual bool IsActive() = 0;
 	virtual void AllSoundOff() { m_MIDIMonitor.AllNotesOff(); };
 	virtual void SetMasterVolume(u8 nVolume) = 0;
 	virtual size_t Render(s16* pOutBuffer, size_t nFrames) = 0;
 	virtual size_t Render(float* pOutBuffer, size_t nFrames) = 0;
+	virtual size_t RenderWithMIDIEvents(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents);
+	// Whether a short message may be passed to RenderWithMIDIEvents(), i.e. applied from the audio core
+	virtual bool CanRenderWithMIDIMessage(u32 nMessage) const { return true; }
+	// Whether a SysEx message (or a chunked one, given its first chunk) may be passed to ApplyMIDISysExMessage()
+	virtual bool CanApplyMIDISysExMessage(const u8* pData, size_t nSize) const { return true; }
 	virtual void ReportStatus() const = 0;
 	virtual void UpdateLCD(CLCD& LCD, unsigned int nTicks) = 0;
 	void SetUserInterface(CUserInterface* pUI) { m_pUI = pUI; }
@@ -58,6 +76,120 @@ public:
 	unsigned int m_nSampleRate;
 	CMIDIMonitor m_MIDIMonitor;
 	CUserInterface* m_pUI;
+
+private:
+	// Upper limit for reassembled SysEx messages
+	static constexpr size_t MaxSysExSize = 64 * 1024;
+
+	bool AppendSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize);
+
+	u8* m_pSysExBuffer;
+	size_t m_nSysExBufferSize;
+	size_t m_nSysExLength;
+	bool m_bSysExInProgress;
 };
 
+// Default implementation splits the block at each event's frame offset so that it takes effect at the right time
+inline size_t CSynthBase::RenderWithMIDIEvents(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents)
+{
+	size_t nFramesRendered = 0;
+
+	for (size_t i = 0; i < nEvents; ++i)
+	{
+		const size_t nOffset = pEvents[i].nTimestamp;
+		if (nOffset > nFramesRendered)
+			nFramesRendered += Render(pOutBuffer + nFramesRendered * 2, nOffset - nFramesRendered);
+
+		HandleMIDIShortMessage(pEvents[i].nMessage);
+	}
+
+	if (nFrames > nFramesRendered)
+		nFramesRendered += Render(pOutBuffer + nFramesRendered * 2, nFrames - nFramesRendered);
+
+	return nFramesRendered;
+}
+
+// Default implementation reassembles the message and passes it to HandleMIDISysExMessage() once complete
+inline void CSynthBase::HandleMIDISysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize)
+{
+	if (AppendSysExChunk(Chunk, pData, nSize))
+		HandleMIDISysExMessage(m_pSysExBuffer, m_nSysExLength);
+}
+
+// Reassembles the message in the same way, but passes it to ApplyMIDISysExMessage()
+// A message must be passed in chunks to one of these two functions only
+inline void CSynthBase::ApplyMIDISysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize)
+{
+	if (AppendSysExChunk(Chunk, pData, nSize))
+		ApplyMIDISysExMessage(m_pSysExBuffer, m_nSysExLength);
+}
+
+// Returns true once the message is complete
+inline bool CSynthBase::AppendSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize)
+{
+	if (Chunk == TSysExChunk::Begin)
+	{
+		m_nSysExLength = 0;
+		m_bSysExInProgress = true;
+	}
+	else if (!m_bSysExInProgress)
+		return false;
+
+	if (Chunk == TSysExChunk::Abort || m_nSysExLength + nSize > MaxSysExSize)
+	{
+		m_bSysExInProgress = false;
+		return false;
+	}
+
+	// Grow the buffer as needed
+	if (m_nSysExLength + nSize > m_nSysExBufferSize)
+	{
+		size_t nNewSize = m_nSysExBufferSize ? m_nSysExBufferSize : 4096;
+		while (nNewSize < m_nSysExLength + nSize)
+			nNewSize *= 2;
+
+		u8* pNewBuffer = new u8[nNewSize];
+		if (m_pSysExBuffer)
+		{
+			memcpy(pNewBuffer, m_pSysExBuffer, m_nSysExLength);
+			delete[] m_pSysExBuffer;
+		}
+
+		m_pSysExBuffer = pNewBuffer;
+		m_nSysExBufferSize = nNewSize;
+	}
+
+	memcpy(m_pSysExBuffer + m_nSysExLength, pData, nSize);
+	m_nSysExLength += nSize;
+
+	if (Chunk != TSysExChunk::End)
+		return false;
+
+	m_bSysExInProgress = false;
+	return true;
+}
+
+// Default implementation handles each message individually; synths override this to amortize per-message overhead
+inline void CSynthBase::HandleMIDIShortMessages(const u32* pMessages, size_t nCount)
+{
+	for (size_t i = 0; i < nCount; ++i)
+		HandleMIDIShortMessage(pMessages[i]);
+}
+
+// Default implementation ignores the timestamps and cable numbers
+inline void CSynthBase::HandleMIDIEvents(const TMIDIEvent* pEvents, size_t nCount)
+{
+	constexpr size_t BatchSize = 64;
+	u32 Messages[BatchSize];
+
+	for (size_t nOffset = 0; nOffset < nCount; nOffset += BatchSize)
+	{
+		const size_t nBatchSize = nCount - nOffset < BatchSize ? nCount - nOffset : BatchSize;
+		for (size_t i = 0; i < nBatchSize; ++i)
+			Messages[i] = pEvents[nOffset + i].nMessage;
+
+		HandleMIDIShortMessages(Messages, nBatchSize);
+	}
+}
+
 #endif
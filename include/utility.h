@@ -108,6 +108,15 @@ namespace Utility
 		return 128 - nSum;
 	}
 
+	// 32-bit FNV-1a hash of a null-terminated string
+	constexpr u32 HashString(const char* pString, u32 nHash = 0x811C9DC5)
+	{
+		while (*pString)
+			nHash = (nHash ^ static_cast<u8>(*pString++)) * 0x01000193;
+
+		return nHash;
+	}
+
 	// Comparators for sorting
 	namespace Comparator
 	{
@@ -132,14 +141,16 @@ namespace Utility
 		}
 	}
 
-	// Swaps two objects in-place
+	// Swaps two objects in-place (bitwise, so also suitable for non-trivially-copyable types that don't hold self-references)
 	template<class T>
 	inline void Swap(T& ObjectA, T& ObjectB)
 	{
 		u8 Buffer[sizeof(T)];
-		memcpy(Buffer, &ObjectA, sizeof(T));
-		memcpy(&ObjectA, &ObjectB, sizeof(T));
-		memcpy(&ObjectB, Buffer, sizeof(T));
+		void* const pObjectA = &ObjectA;
+		void* const pObjectB = &ObjectB;
+		memcpy(Buffer, pObjectA, sizeof(T));
+		memcpy(pObjectA, pObjectB, sizeof(T));
+		memcpy(pObjectB, Buffer, sizeof(T));
 	}
 
 	namespace
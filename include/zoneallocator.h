@@ -23,6 +23,7 @@
 #ifndef _zoneallocator_h
 #define _zoneallocator_h
 
+#include <circle/sysconfig.h>
 #include <circle/types.h>
 
 // Block allocation tags
@@ -30,17 +31,44 @@ enum TZoneTag : u32
 {
 	Free = 0,
 	Uncategorized = 1,
-	FluidSynth
+	FluidSynth,
+	SMFPlayer
 };
 
 class CZoneAllocator
 {
 public:
+	static constexpr size_t TagCount         = TZoneTag::SMFPlayer + 1;
+	static constexpr size_t HistogramBuckets = 16;
+
+	struct TTagStats
+	{
+		size_t nBytesInUse;
+		size_t nPeakBytes;
+		u32 nAllocs;
+		u32 nFrees;
+	};
+
+	struct TStats
+	{
+		size_t nHeapSize;
+		size_t nBytesInUse;
+		size_t nPeakBytes;
+		size_t nBytesFree;
+		size_t nLargestFreeBlock;
+		u8 nFragmentation; // Percentage of free space not in the largest free block
+		TTagStats Tags[TagCount];
+		u32 Histogram[HistogramBuckets]; // Requested sizes; bucket n counts sizes up to 16 << n bytes
+	};
+
 	CZoneAllocator();
 	~CZoneAllocator();
 
+	// Small allocations are served from an arena of the given size (rounded down to whole pages) at the start of the heap
+	static constexpr size_t DefaultSlabArenaSize = 4 * MEGABYTE;
+
 	// Allocator interface
-	bool Initialize();
+	bool Initialize(size_t nSlabArenaSize = DefaultSlabArenaSize);
 	void* Alloc(size_t nSize, TZoneTag Tag);
 	void* Realloc(void* pPtr, size_t nSize, TZoneTag Tag);
 	void Free(void* pPtr);
@@ -50,9 +78,35 @@ public:
 	void Clear();
 	void Dump() const;
 
+	// Byte counts include allocation headers, so that they reflect actual heap consumption
+	void GetStats(TStats& Stats) const;
+	void DumpStats() const;
+
 	static CZoneAllocator* Get() { return s_pThis; }
 
 private:
+	// Small allocation header; nMagic sits immediately before the user data, as it does for TBlock on 64-bit
+	struct TSlabObject
+	{
+		TSlabObject* pNextFree; // 32bit: 4  bytes  |  64bit: 8  bytes
+		TZoneTag Tag;           //        8  bytes  |         12 bytes
+#if AARCH == 32
+		u32 Padding;            //        12 bytes  |
+#endif
+		u32 nMagic;             //        16 bytes  |         16 bytes
+	};
+
+	// Bookkeeping for one page of the small allocation arena
+	struct TSlabPage
+	{
+		TSlabObject* pFreeList;
+		TSlabPage* pNext;
+		TSlabPage* pPrevious;
+		u16 nUsed;
+		u16 nBumpIndex;
+		u8 nClass;
+	};
+
 	// Memory block header/linked list
 	struct TBlock
 	{
@@ -70,18 +124,75 @@ private:
 	static constexpr u32 BlockMagic         = 0xDA1EDEAD;
 	static constexpr size_t MinFragmentSize = 16;
 
+	static constexpr u32 SlabMagic           = 0x51ABDEAD;
+	static constexpr size_t SlabPageSize     = 16 * KILOBYTE;
+	static constexpr size_t SlabClassSizes[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+	static constexpr size_t SlabClassCount   = sizeof(SlabClassSizes) / sizeof(*SlabClassSizes);
+	static constexpr size_t SlabMaxSize      = SlabClassSizes[SlabClassCount - 1];
+
 	inline u32& GetEndMagic(TBlock* pBlock) const
 	{
 		return *reinterpret_cast<u32*>(reinterpret_cast<u8*>(pBlock) + pBlock->nSize - sizeof(BlockMagic));
 	}
 
+	static constexpr size_t GetSlabObjectSize(u8 nClass) { return sizeof(TSlabObject) + SlabClassSizes[nClass]; }
+	static constexpr u16 GetSlabCapacity(u8 nClass) { return SlabPageSize / GetSlabObjectSize(nClass); }
+
+	inline bool IsSlabObject(const void* pPtr) const
+	{
+		return pPtr >= m_pSlabArena && pPtr < m_pSlabArena + m_nSlabPageCount * SlabPageSize;
+	}
+
+	inline TSlabPage* GetSlabPage(const TSlabObject* pObject)
+	{
+		return &m_SlabPages[(reinterpret_cast<const u8*>(pObject) - m_pSlabArena) / SlabPageSize];
+	}
+
+	inline u8* GetSlabPageBase(const TSlabPage* pPage) const
+	{
+		return m_pSlabArena + (pPage - m_SlabPages) * SlabPageSize;
+	}
+
+	inline bool IsSlabPageFull(const TSlabPage* pPage) const
+	{
+		return !pPage->pFreeList && pPage->nBumpIndex == GetSlabCapacity(pPage->nClass);
+	}
+
+	static constexpr size_t GetTagIndex(u32 nTag) { return nTag < TagCount ? nTag : TZoneTag::Uncategorized; }
+
+	void AddUsage(TZoneTag Tag, size_t nBytes);
+	void RemoveUsage(TZoneTag Tag, size_t nBytes);
+
+	// Allocate/free without counting towards the allocation statistics, so that moves made by Realloc() aren't counted
+	void* Allocate(size_t nSize, TZoneTag Tag);
+	TZoneTag Release(void* pPtr);
+
+	void* ZoneAlloc(size_t nSize, TZoneTag Tag);
+	void* SlabAlloc(size_t nSize, TZoneTag Tag);
+	void SlabFree(TSlabObject* pObject);
+	void LinkPartialSlabPage(TSlabPage* pPage);
+	void UnlinkPartialSlabPage(TSlabPage* pPage);
+
 	void* m_pHeap;
 	size_t m_nHeapSize;
 	TBlock m_MainBlock;
 	TBlock* m_pCurrentBlock;
 
+	// Size-class pages for small allocations, carved from the start of the heap along with their bookkeeping
+	u8* m_pSlabArena;
+	TSlabPage* m_SlabPages;
+	size_t m_nSlabPageCount;
+	TSlabPage* m_pPartialSlabPages[SlabClassCount];
+	TSlabPage* m_pFreeSlabPages;
+
 	size_t m_nAllocCount;
 
+	// Usage statistics
+	size_t m_nBytesInUse;
+	size_t m_nPeakBytes;
+	TTagStats m_TagStats[TagCount];
+	u32 m_Histogram[HistogramBuckets];
+
 	static CZoneAllocator* s_pThis;
 };
 
@@ -62,6 +62,9 @@ CONFIG_ENUM_STRINGS(TAudioOutputDevice, ENUM_AUDIOOUTPUTDEVICE);
 CONFIG_ENUM_STRINGS(TMT32EmuResamplerQuality, ENUM_RESAMPLERQUALITY);
 CONFIG_ENUM_STRINGS(TMT32EmuMIDIChannels, ENUM_MIDICHANNELS);
 CONFIG_ENUM_STRINGS(TMT32EmuROMSet, ENUM_MT32ROMSET);
+CONFIG_ENUM_STRINGS(TMT32EmuProfile, ENUM_PROFILE);
+CONFIG_ENUM_STRINGS(TMT32EmuAnalogOutputMode, ENUM_ANALOGOUTPUTMODE);
+CONFIG_ENUM_STRINGS(TMT32EmuRendererType, ENUM_RENDERERTYPE);
 CONFIG_ENUM_STRINGS(TLCDType, ENUM_LCDTYPE);
 CONFIG_ENUM_STRINGS(TControlScheme, ENUM_CONTROLSCHEME);
 CONFIG_ENUM_STRINGS(TEncoderType, ENUM_ENCODERTYPE);
@@ -200,12 +203,94 @@ bool CConfig::ParseOption(const char* pString, CIPAddress* pOut)
 	return true;
 }
 
+bool CConfig::ParseOption(const char* pString, TNumberMask* pOut)
+{
+	// Comma-separated list of numbers and ranges, e.g. "1,3,5-8", or "none"
+	char Buffer[64];
+	u16 nMask = 0;
+
+	if (!strcasecmp(pString, "none"))
+	{
+		pOut->nMask = 0;
+		return true;
+	}
+
+	strncpy(Buffer, pString, sizeof(Buffer) - 1);
+	Buffer[sizeof(Buffer) - 1] = '\0';
+
+	for (char* pToken = strtok(Buffer, ","); pToken; pToken = strtok(nullptr, ","))
+	{
+		char* pEnd;
+		const int nFirst = strtol(pToken, &pEnd, 10);
+		int nLast = nFirst;
+
+		while (*pEnd == ' ')
+			++pEnd;
+
+		if (*pEnd == '-')
+			nLast = strtol(pEnd + 1, &pEnd, 10);
+
+		while (*pEnd == ' ')
+			++pEnd;
+
+		if (*pEnd || nFirst < 1 || nLast > 16 || nFirst > nLast)
+			return false;
+
+		for (int i = nFirst; i <= nLast; ++i)
+			nMask |= 1 << (i - 1);
+	}
+
+	pOut->nMask = nMask;
+	return true;
+}
+
+bool CConfig::ParseOption(const char* pString, TROMSetMask* pOut)
+{
+	// Comma-separated list of ROM sets, e.g. "old,cm32l", or "all" or "none"
+	char Buffer[64];
+	u8 nMask = 0;
+
+	if (!strcasecmp(pString, "none"))
+	{
+		pOut->nMask = 0;
+		return true;
+	}
+
+	strncpy(Buffer, pString, sizeof(Buffer) - 1);
+	Buffer[sizeof(Buffer) - 1] = '\0';
+
+	for (char* pToken = strtok(Buffer, ","); pToken; pToken = strtok(nullptr, ","))
+	{
+		TMT32EmuROMSet ROMSet;
+
+		while (*pToken == ' ')
+			++pToken;
+
+		for (char* pEnd = pToken + strlen(pToken); pEnd > pToken && pEnd[-1] == ' '; --pEnd)
+			pEnd[-1] = '\0';
+
+		if (!ParseOption(pToken, &ROMSet) || ROMSet == TMT32EmuROMSet::Any)
+			return false;
+
+		if (ROMSet == TMT32EmuROMSet::All)
+			nMask |= (1 << static_cast<u8>(TMT32EmuROMSet::MT32Old)) | (1 << static_cast<u8>(TMT32EmuROMSet::MT32New)) | (1 << static_cast<u8>(TMT32EmuROMSet::CM32L));
+		else
+			nMask |= 1 << static_cast<u8>(ROMSet);
+	}
+
+	pOut->nMask = nMask;
+	return true;
+}
+
 // Define template function wrappers for parsing enums
 CONFIG_ENUM_PARSER(TSystemDefaultSynth);
 CONFIG_ENUM_PARSER(TAudioOutputDevice);
 CONFIG_ENUM_PARSER(TMT32EmuResamplerQuality);
 CONFIG_ENUM_PARSER(TMT32EmuMIDIChannels);
 CONFIG_ENUM_PARSER(TMT32EmuROMSet);
+CONFIG_ENUM_PARSER(TMT32EmuProfile);
+CONFIG_ENUM_PARSER(TMT32EmuAnalogOutputMode);
+CONFIG_ENUM_PARSER(TMT32EmuRendererType);
 CONFIG_ENUM_PARSER(TLCDType);
 CONFIG_ENUM_PARSER(TControlScheme);
 CONFIG_ENUM_PARSER(TEncoderType);
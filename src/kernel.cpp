@@ -105,7 +105,7 @@ bool CKernel::Initialize(void)
 		return false;
 
 	// Init custom memory allocator
-	if (!m_Allocator.Initialize())
+	if (!m_Allocator.Initialize(static_cast<size_t>(Utility::Clamp(m_Config.SystemSmallAllocArena, 0, 65536)) * KILOBYTE))
 		return false;
 
 	if (!m_MT32Pi.Initialize(bSerialMIDIAvailable))
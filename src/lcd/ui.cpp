@@ -40,6 +40,7 @@ CUserInterface::CUserInterface()
 	  m_bIsScrolling(false),
 	  m_nCurrentScrollOffset(0),
 	  m_nCurrentSpinnerChar(0),
+	  m_nSpinnerProgress(-1),
 	  m_CurrentImage(TImage::None),
 	  m_SystemMessageTextBuffer{'\0'},
 	  m_SysExDisplayMessageType(TSysExDisplayMessage::Roland),
@@ -98,6 +99,15 @@ void CUserInterface::Update(CLCD& LCD, CSynthBase& Synth, unsigned int nTicks)
 		// TODO: API for getting width in pixels/characters for a string
 		const size_t nCharWidth = LCD.GetType() == CLCD::TType::Graphical ? 20 : LCD.Width();
 
+		// Show progress (if known) to the left of the spinner
+		const s8 nProgress = m_nSpinnerProgress;
+		if (nProgress >= 0)
+		{
+			char ProgressText[5];
+			snprintf(ProgressText, sizeof(ProgressText), "%3d%%", nProgress);
+			memcpy(m_SystemMessageTextBuffer + nCharWidth - 7, ProgressText, 4);
+		}
+
 		m_nCurrentSpinnerChar = (m_nCurrentSpinnerChar + 1) % sizeof(SpinnerChars);
 		m_SystemMessageTextBuffer[nCharWidth - 2] = SpinnerChars[m_nCurrentSpinnerChar];
 		m_nStateTime = nTicks;
@@ -152,6 +162,7 @@ void CUserInterface::ShowSystemMessage(const char* pMessage, bool bSpinner)
 		snprintf(m_SystemMessageTextBuffer, sizeof(m_SystemMessageTextBuffer), "%-*.*s %c", nMaxMessageLen, nMaxMessageLen, pMessage, SpinnerChars[0]);
 		m_State = TState::DisplayingSpinnerMessage;
 		m_nCurrentSpinnerChar = 0;
+		m_nSpinnerProgress = -1;
 	}
 	else
 	{
@@ -167,6 +178,12 @@ void CUserInterface::ClearSpinnerMessage()
 {
 	m_State = TState::None;
 	m_nCurrentSpinnerChar = 0;
+	m_nSpinnerProgress = -1;
+}
+
+void CUserInterface::SetSpinnerProgress(u8 nPercent)
+{
+	m_nSpinnerProgress = Utility::Min<u8>(nPercent, 100);
 }
 
 void CUserInterface::DisplayImage(TImage Image)
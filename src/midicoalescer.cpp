@@ -0,0 +1,158 @@
+//
+// midicoalescer.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/util.h>
+
+#include "midicoalescer.h"
+
+// One key per controller, followed by channel pressure and pitch bend
+constexpr size_t ChannelPressureKey = 128;
+constexpr size_t PitchBendKey       = 129;
+constexpr size_t KeyWords           = 5;
+
+static inline u32 GetMessage(u32 nMessage) { return nMessage; }
+static inline u32 GetMessage(const TMIDIEvent& Event) { return Event.nMessage; }
+
+// Controllers whose latest value is all that matters: modulation, breath, foot, portamento time, volume, balance, pan,
+// expression, effect controls and general purpose controllers 1-4 (MSB and LSB), sound controllers and effect depths.
+// Bank select, data entry, switches, RPN/NRPN and channel mode messages change the meaning of what follows, and are
+// never dropped.
+static constexpr bool IsContinuousController(u8 nController)
+{
+	const u8 nMSB = nController < 64 ? nController & 0x1F : nController;
+
+	switch (nMSB)
+	{
+		case 1:
+		case 2:
+		case 4:
+		case 5:
+		case 7:
+		case 8:
+		case 10:
+		case 11:
+		case 12:
+		case 13:
+		case 16:
+		case 17:
+		case 18:
+		case 19:
+			return true;
+
+		default:
+			return (nMSB >= 70 && nMSB <= 79) || (nMSB >= 91 && nMSB <= 95);
+	}
+}
+
+CMIDICoalescer::CMIDICoalescer()
+	: m_nMessages(0),
+	  m_nFolded(0)
+{
+}
+
+size_t CMIDICoalescer::Coalesce(u32* pMessages, size_t nCount)
+{
+	return CoalesceMessages(pMessages, nCount);
+}
+
+size_t CMIDICoalescer::Coalesce(TMIDIEvent* pEvents, size_t nCount)
+{
+	return CoalesceMessages(pEvents, nCount);
+}
+
+template <class T>
+size_t CMIDICoalescer::CoalesceMessages(T* pMessages, size_t nCount)
+{
+	if (nCount < 2)
+	{
+		__atomic_fetch_add(&m_nMessages, nCount, __ATOMIC_RELAXED);
+		return nCount;
+	}
+
+	// Keys that have a later message on each channel, with nothing else on the channel since
+	u32 LaterKeys[16][KeyWords] = {};
+
+	// Walk backwards so that the latest message for each key is the one kept; kept messages are packed towards the end
+	size_t nFirstKept = nCount;
+	for (size_t i = nCount; i-- > 0;)
+	{
+		const u32 nMessage = GetMessage(pMessages[i]);
+		const u8 nStatus   = nMessage & 0xFF;
+		const u8 nChannel  = nStatus & 0x0F;
+		size_t nKey        = 0;
+		bool bCoalescable  = false;
+
+		switch (nStatus & 0xF0)
+		{
+			case 0xB0:
+				nKey = (nMessage >> 8) & 0x7F;
+				bCoalescable = IsContinuousController(nKey);
+				break;
+
+			case 0xD0:
+				nKey = ChannelPressureKey;
+				bCoalescable = true;
+				break;
+
+			case 0xE0:
+				nKey = PitchBendKey;
+				bCoalescable = true;
+				break;
+
+			default:
+				break;
+		}
+
+		if (bCoalescable)
+		{
+			u32& nWord = LaterKeys[nChannel][nKey / 32];
+			const u32 nBit = 1u << (nKey % 32);
+
+			// Overwritten by a later message before anything could depend on it
+			if (nWord & nBit)
+				continue;
+
+			nWord |= nBit;
+		}
+		else if (nStatus < 0xF0)
+		{
+			// Anything else on the channel may depend on the current controller values
+			memset(LaterKeys[nChannel], 0, sizeof(LaterKeys[nChannel]));
+		}
+		else if (nStatus == 0xFF || nStatus == 0xF0)
+		{
+			// System reset, or SysEx queued alongside short messages (which may change any channel)
+			memset(LaterKeys, 0, sizeof(LaterKeys));
+		}
+
+		pMessages[--nFirstKept] = pMessages[i];
+	}
+
+	const size_t nKept = nCount - nFirstKept;
+	if (nFirstKept)
+		memmove(pMessages, pMessages + nFirstKept, nKept * sizeof(T));
+
+	__atomic_fetch_add(&m_nMessages, nCount, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m_nFolded, nFirstKept, __ATOMIC_RELAXED);
+
+	return nKept;
+}
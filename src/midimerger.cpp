@@ -0,0 +1,334 @@
+//
+// midimerger.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/timer.h>
+
+#include "midimerger.h"
+#include "utility.h"
+
+LOGMODULE("midimerger");
+
+CMIDIMerger::CMIDIMerger()
+	: m_nNextSource(0),
+	  m_nStreamingSource(SourceCount),
+	  m_nMessageTimestamp(0),
+	  m_SysExBuffer{}
+{
+	for (CSourceParser& Source : m_Sources)
+		Source.Initialize(this);
+}
+
+size_t CMIDIMerger::ParseMIDIBytes(TMIDISource Source, const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable)
+{
+	return m_Sources[static_cast<size_t>(Source)].Parse(pData, nSize, nTimestamp, nCable);
+}
+
+bool CMIDIMerger::EnqueueShortMessage(TMIDISource Source, const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable)
+{
+	return m_Sources[static_cast<size_t>(Source)].EnqueueShortMessage(pData, nSize, nTimestamp, nCable);
+}
+
+size_t CMIDIMerger::DispatchMIDIMessages()
+{
+	TMIDIEvent Batch[ShortMessageBatchSize];
+	size_t nBatched = 0;
+	size_t nDispatched = 0;
+	size_t nIdleSources = 0;
+
+	// Keep going round the sources until a full pass yields nothing
+	while (nIdleSources < SourceCount)
+	{
+		const size_t nSource  = m_nNextSource;
+		CSourceParser& Source = m_Sources[nSource];
+		m_nNextSource = (m_nNextSource + 1) % SourceCount;
+
+		TMessage Message;
+		if (!Source.DequeueMessage(Message))
+		{
+			++nIdleSources;
+			continue;
+		}
+
+		// Wait for the whole stream to arrive, and for the SysEx stream from another source to finish, before starting
+		// a new one
+		if (Message.Type == TMessageType::SysExChunk && static_cast<TSysExChunk>(Message.nMessage) == TSysExChunk::Begin && (!Source.IsStreamQueued() || IsStreamInProgress(nSource)))
+		{
+			Source.HoldMessage(Message);
+			++nIdleSources;
+			continue;
+		}
+
+		++nDispatched;
+		nIdleSources = 0;
+
+		if (Message.Type == TMessageType::ShortMessage)
+		{
+			Batch[nBatched++] = TMIDIEvent{Message.nTimestamp, Message.nMessage, Message.nCable};
+			if (nBatched == ShortMessageBatchSize)
+			{
+				OnShortMessages(Batch, nBatched);
+				nBatched = 0;
+			}
+
+			continue;
+		}
+
+		// Preserve ordering with the short messages batched so far
+		if (nBatched)
+		{
+			OnShortMessages(Batch, nBatched);
+			nBatched = 0;
+		}
+
+		// Pass the data on straight from the source's queue, unless it wraps around the end
+		const u8* pSysExData;
+		const bool bContiguous = Source.PeekSysEx(pSysExData) >= Message.nSysExSize;
+		if (!bContiguous)
+		{
+			Source.DequeueSysEx(m_SysExBuffer, Message.nSysExSize);
+			pSysExData = m_SysExBuffer;
+		}
+
+		m_nMessageTimestamp = Message.nTimestamp;
+
+		if (Message.Type == TMessageType::SysEx)
+			OnSysExMessage(pSysExData, Message.nSysExSize);
+		else
+			DispatchSysExChunk(nSource, static_cast<TSysExChunk>(Message.nMessage), pSysExData, Message.nSysExSize);
+
+		if (bContiguous)
+			Source.CommitSysEx(Message.nSysExSize);
+	}
+
+	if (nBatched)
+		OnShortMessages(Batch, nBatched);
+
+	return nDispatched;
+}
+
+bool CMIDIMerger::IsStreamInProgress(size_t nSource) const
+{
+	if (m_nStreamingSource == SourceCount || m_nStreamingSource == nSource)
+		return false;
+
+	if (m_Sources[m_nStreamingSource].HasMessages())
+		return true;
+
+	// Give up on a stream that has stopped receiving data (e.g. device unplugged); its data is passed on in chunks, so
+	// go by when the source last received anything rather than when a chunk was last dispatched
+	return CTimer::GetClockTicks() - m_Sources[m_nStreamingSource].GetLastTimestamp() < StreamTimeoutMillis * 1000;
+}
+
+void CMIDIMerger::DispatchSysExChunk(size_t nSource, TSysExChunk Chunk, const u8* pData, size_t nSize)
+{
+	// Only one stream can be passed on at a time; a stalled stream is abandoned when another source starts one
+	if (Chunk == TSysExChunk::Begin)
+	{
+		if (m_nStreamingSource != SourceCount && m_nStreamingSource != nSource)
+		{
+			LOGWARN("Incomplete SysEx message timed out");
+			OnSysExChunk(TSysExChunk::Abort, nullptr, 0);
+		}
+
+		m_nStreamingSource = nSource;
+	}
+	else if (nSource != m_nStreamingSource)
+		return;
+
+	OnSysExChunk(Chunk, pData, nSize);
+
+	if (IsStreamEnd(Chunk))
+		m_nStreamingSource = SourceCount;
+}
+
+CMIDIMerger::CSourceParser::CSourceParser()
+	: m_pMerger(nullptr),
+	  m_nTimestamp(0),
+	  m_nCable(0),
+	  m_nSysExBytesPending(0),
+	  m_nStreamEndsQueued(0),
+	  m_HeldMessage{},
+	  m_bMessageHeld(false)
+{
+}
+
+void CMIDIMerger::CSourceParser::Initialize(CMIDIMerger* pMerger)
+{
+	m_pMerger = pMerger;
+}
+
+size_t CMIDIMerger::CSourceParser::Parse(const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable)
+{
+	nSize = Utility::Min(nSize, GetFreeSpace());
+	if (!nSize)
+		return 0;
+
+	__atomic_store_n(&m_nTimestamp, nTimestamp, __ATOMIC_RELAXED);
+	m_nCable = nCable;
+	ParseMIDIBytes(pData, nSize);
+
+	return nSize;
+}
+
+bool CMIDIMerger::CSourceParser::EnqueueShortMessage(const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable)
+{
+	assert(nSize > 0 && nSize <= 3);
+
+	// Enough room to parse it instead if need be
+	if (GetFreeSpace() < nSize)
+		return false;
+
+	// System Real-Time can appear in the middle of another message, but anything else must interrupt it properly
+	bool bComplete = pData[0] >= 0xF8 || IsIdle();
+	bComplete = bComplete && GetShortMessageLength(pData[0]) == nSize;
+
+	u32 nMessage = pData[0];
+	for (size_t i = 1; i < nSize; ++i)
+	{
+		bComplete = bComplete && pData[i] < 0x80;
+		nMessage |= pData[i] << 8 * i;
+	}
+
+	if (!bComplete)
+		return Parse(pData, nSize, nTimestamp, nCable) == nSize;
+
+	m_MessageQueue.Enqueue(TMessage{nTimestamp, nMessage, 0, TMessageType::ShortMessage, nCable});
+	return true;
+}
+
+bool CMIDIMerger::CSourceParser::DequeueMessage(TMessage& OutMessage)
+{
+	if (m_bMessageHeld)
+	{
+		OutMessage = m_HeldMessage;
+		m_bMessageHeld = false;
+		return true;
+	}
+
+	if (!m_MessageQueue.Dequeue(OutMessage))
+		return false;
+
+	if (OutMessage.Type == TMessageType::SysExChunk && IsStreamEnd(static_cast<TSysExChunk>(OutMessage.nMessage)))
+		__atomic_sub_fetch(&m_nStreamEndsQueued, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+void CMIDIMerger::CSourceParser::HoldMessage(const TMessage& Message)
+{
+	m_HeldMessage = Message;
+	m_bMessageHeld = true;
+}
+
+size_t CMIDIMerger::CSourceParser::GetFreeSpace() const
+{
+	// Each byte parsed can complete at most one message, and SysEx messages may also include up to a full buffer of
+	// bytes received earlier; a SysEx stream can add three more messages for starting, passing on the data gathered
+	// so far, and being interrupted.
+	// Only accept as many bytes as are guaranteed to fit.
+	const size_t nFreeMessages = MessageQueueSize - 1 - m_MessageQueue.GetCount();
+	const size_t nFreeSysEx    = SysExQueueSize - 1 - m_SysExQueue.GetCount();
+
+	if (nFreeMessages <= 3 || nFreeSysEx <= SysExBufferSize)
+		return 0;
+
+	return Utility::Min(nFreeMessages - 3, nFreeSysEx - SysExBufferSize);
+}
+
+void CMIDIMerger::CSourceParser::OnShortMessage(u32 nMessage)
+{
+	// System Real-Time in the middle of a stream; keep it in order with the data received before it
+	FlushSysExChunk();
+	m_MessageQueue.Enqueue(TMessage{m_nTimestamp, nMessage, 0, TMessageType::ShortMessage, m_nCable});
+}
+
+void CMIDIMerger::CSourceParser::OnSysExMessage(const u8* pData, size_t nSize)
+{
+	// Data must be queued before the message that refers to it
+	m_SysExQueue.Enqueue(pData, nSize);
+	m_MessageQueue.Enqueue(TMessage{m_nTimestamp, 0, static_cast<u32>(nSize), TMessageType::SysEx, m_nCable});
+}
+
+void CMIDIMerger::CSourceParser::OnSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize)
+{
+	// Data must be queued before the message that refers to it
+	if (nSize)
+		m_SysExQueue.Enqueue(pData, nSize);
+	m_nSysExBytesPending += nSize;
+
+	// Slow inputs deliver a stream a few bytes at a time; gather them into chunks as large as the dispatcher takes, so
+	// that the whole stream can be queued before it's passed on
+	if (Chunk == TSysExChunk::Continue)
+	{
+		while (m_nSysExBytesPending >= MaxSysExSize)
+			QueueSysExChunk(TSysExChunk::Continue, MaxSysExSize);
+		return;
+	}
+
+	if (Chunk == TSysExChunk::Abort)
+		FlushSysExChunk();
+
+	QueueSysExChunk(Chunk, m_nSysExBytesPending);
+
+	if (IsStreamEnd(Chunk))
+		__atomic_add_fetch(&m_nStreamEndsQueued, 1, __ATOMIC_RELEASE);
+}
+
+void CMIDIMerger::CSourceParser::FlushSysExChunk()
+{
+	if (m_nSysExBytesPending)
+		QueueSysExChunk(TSysExChunk::Continue, m_nSysExBytesPending);
+}
+
+void CMIDIMerger::CSourceParser::QueueSysExChunk(TSysExChunk Chunk, size_t nSize)
+{
+	// Split into pieces that fit the dispatcher's buffer
+	size_t nOffset = 0;
+	do
+	{
+		const size_t nPieceSize = Utility::Min(nSize - nOffset, MaxSysExSize);
+		const bool bFirst = nOffset == 0;
+		const bool bLast  = nOffset + nPieceSize == nSize;
+
+		TSysExChunk Piece = Chunk;
+		if ((Chunk == TSysExChunk::Begin && !bFirst) || (Chunk == TSysExChunk::End && !bLast))
+			Piece = TSysExChunk::Continue;
+
+		m_MessageQueue.Enqueue(TMessage{m_nTimestamp, static_cast<u32>(Piece), static_cast<u32>(nPieceSize), TMessageType::SysExChunk, m_nCable});
+		nOffset += nPieceSize;
+	} while (nOffset < nSize);
+
+	m_nSysExBytesPending -= nSize;
+}
+
+void CMIDIMerger::CSourceParser::OnUnexpectedStatus()
+{
+	CMIDIParser::OnUnexpectedStatus();
+	m_pMerger->OnUnexpectedStatus();
+}
+
+void CMIDIMerger::CSourceParser::OnSysExOverflow()
+{
+	CMIDIParser::OnSysExOverflow();
+	m_pMerger->OnSysExOverflow();
+}
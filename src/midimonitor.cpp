@@ -44,6 +44,20 @@ CMIDIMonitor::CMIDIMonitor()
 }
 
 void CMIDIMonitor::OnShortMessage(u32 nMessage)
+{
+	ProcessShortMessage(nMessage, CTimer::GetClockTicks());
+}
+
+void CMIDIMonitor::OnShortMessages(const u32* pMessages, size_t nCount)
+{
+	// Messages in a batch arrived together; stamp them all with the same time
+	const unsigned int nTicks = CTimer::GetClockTicks();
+
+	for (size_t i = 0; i < nCount; ++i)
+		ProcessShortMessage(pMessages[i], nTicks);
+}
+
+void CMIDIMonitor::ProcessShortMessage(u32 nMessage, unsigned int nTicks)
 {
 	const u8 nStatus  = nMessage & 0xF0;
 	const u8 nChannel = nMessage & 0x0F;
@@ -52,7 +66,6 @@ void CMIDIMonitor::OnShortMessage(u32 nMessage)
 
 	TChannelState& ChannelState = m_State[nChannel];
 	TNoteState& NoteState = ChannelState.Notes[nData1];
-	const unsigned int nTicks = CTimer::GetClockTicks();
 
 	switch (nStatus)
 	{
@@ -21,6 +21,7 @@
 //
 
 #include <circle/logger.h>
+#include <circle/util.h>
 
 #include "midiparser.h"
 
@@ -29,7 +30,8 @@ LOGMODULE("midiparser");
 CMIDIParser::CMIDIParser()
 	: m_State(TState::StatusByte),
 	  m_MessageBuffer{0},
-	  m_nMessageLength(0)
+	  m_nMessageLength(0),
+	  m_bSysExStreaming(false)
 {
 }
 
@@ -74,38 +76,30 @@ void CMIDIParser::ParseMIDIBytes(const u8* pData, size_t nSize, bool bIgnoreNote
 				CheckCompleteShortMessage(bIgnoreNoteOns);
 				break;
 
-			// Expecting a SysEx data byte or EOX
+			// Expecting SysEx data bytes or EOX
 			case TState::SysExByte:
-				// Received a status that wasn't EOX
-				if (nByte & 0x80 && nByte != 0xF7)
-				{
-					OnUnexpectedStatus();
-					ResetState(true);
-					ParseStatusByte(nByte);
-					break;
-				}
+				i = ParseSysExBytes(pData, nSize, i);
+				break;
+		}
+	}
+}
 
-				// Buffer overflow
-				if (m_nMessageLength == sizeof(m_MessageBuffer))
-				{
-					OnSysExOverflow();
-					ResetState(true);
-					ParseStatusByte(nByte);
-					break;
-				}
+size_t CMIDIParser::GetShortMessageLength(u8 nStatus)
+{
+	// Note Off/On, Polyphonic Aftertouch, Control Change, Pitch Bend, Song Position Pointer
+	if ((nStatus >= 0x80 && nStatus <= 0xBF) || (nStatus >= 0xE0 && nStatus <= 0xEF) || nStatus == 0xF2)
+		return 3;
 
-				m_MessageBuffer[m_nMessageLength++] = nByte;
+	// Program Change, Channel Pressure/Aftertouch, Time Code Quarter Frame, Song Select
+	if ((nStatus >= 0xC0 && nStatus <= 0xDF) || nStatus == 0xF1 || nStatus == 0xF3)
+		return 2;
 
-				// End of SysEx
-				if (nByte == 0xF7)
-				{
-					OnSysExMessage(m_MessageBuffer, m_nMessageLength);
-					ResetState(true);
-				}
+	// Tune Request, System Real-Time (except undefined)
+	if (nStatus == 0xF6 || (nStatus >= 0xF8 && nStatus != 0xF9 && nStatus != 0xFD))
+		return 1;
 
-				break;
-		}
-	}
+	// SysEx, EOX, undefined System Common/Real-Time, or a data byte
+	return 0;
 }
 
 void CMIDIParser::OnUnexpectedStatus()
@@ -116,11 +110,81 @@ void CMIDIParser::OnUnexpectedStatus()
 		LOGWARN("Received illegal status byte when data expected");
 }
 
+void CMIDIParser::OnSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize)
+{
+	if (Chunk == TSysExChunk::Begin)
+		OnSysExOverflow();
+}
+
 void CMIDIParser::OnSysExOverflow()
 {
 	LOGWARN("Buffer overrun when receiving SysEx message; SysEx ignored");
 }
 
+// Consumes the run of SysEx data bytes starting at nOffset; returns the index of the last byte consumed
+size_t CMIDIParser::ParseSysExBytes(const u8* pData, size_t nSize, size_t nOffset)
+{
+	const u8 nByte = pData[nOffset];
+
+	// Received a status that wasn't EOX
+	if (nByte & 0x80 && nByte != 0xF7)
+	{
+		OnUnexpectedStatus();
+		if (m_bSysExStreaming)
+			OnSysExChunk(TSysExChunk::Abort, nullptr, 0);
+		ResetState(true);
+		ParseStatusByte(nByte);
+		return nOffset;
+	}
+
+	// Find the end of the data bytes available in this buffer; a System Real-Time byte will interrupt the run
+	size_t nEnd = nOffset;
+	while (nEnd < nSize && pData[nEnd] < 0x80)
+		++nEnd;
+
+	const bool bComplete = nEnd < nSize && pData[nEnd] == 0xF7;
+	if (bComplete)
+		++nEnd;
+
+	const size_t nLength = nEnd - nOffset;
+
+	if (!m_bSysExStreaming)
+	{
+		// Whole message is contiguous in the input; pass it on without copying
+		if (bComplete && m_nMessageLength == 1 && nOffset > 0 && pData[nOffset - 1] == 0xF0 && nLength < sizeof(m_MessageBuffer))
+		{
+			OnSysExMessage(pData + nOffset - 1, nLength + 1);
+			ResetState(true);
+			return nEnd - 1;
+		}
+
+		// Message was split across inputs; buffer it while it fits
+		if (m_nMessageLength + nLength <= sizeof(m_MessageBuffer))
+		{
+			memcpy(m_MessageBuffer + m_nMessageLength, pData + nOffset, nLength);
+			m_nMessageLength += nLength;
+
+			if (bComplete)
+			{
+				OnSysExMessage(m_MessageBuffer, m_nMessageLength);
+				ResetState(true);
+			}
+
+			return nEnd - 1;
+		}
+
+		// Too large to buffer; pass on what we have so far, and the rest as it arrives
+		OnSysExChunk(TSysExChunk::Begin, m_MessageBuffer, m_nMessageLength);
+		m_bSysExStreaming = true;
+	}
+
+	OnSysExChunk(bComplete ? TSysExChunk::End : TSysExChunk::Continue, pData + nOffset, nLength);
+	if (bComplete)
+		ResetState(true);
+
+	return nEnd - 1;
+}
+
 void CMIDIParser::ParseStatusByte(u8 nByte)
 {
 	// Is it a status byte?
@@ -206,5 +270,6 @@ void CMIDIParser::ResetState(bool bClearStatusByte)
 		m_MessageBuffer[0] = 0;
 
 	m_nMessageLength = 0;
+	m_bSysExStreaming = false;
 	m_State = TState::StatusByte;
 }
@@ -0,0 +1,452 @@
+//
+// midirecorder.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/sched/scheduler.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+
+#include "midirecorder.h"
+#include "utility.h"
+
+LOGMODULE("midirecorder");
+
+const char RecordingDirectory[] = "recordings";
+constexpr unsigned MaxFileNumber = 9999;
+
+// Offset of the MTrk chunk length, which is filled in when the recording is finished
+constexpr FSIZE_t TrackSizeOffset = 18;
+
+// Writes a variable-length quantity (up to 4 bytes); returns the number of bytes written
+static size_t WriteVLQ(u32 nValue, u8* pOutData)
+{
+	u8 Bytes[4];
+	size_t nBytes = 0;
+
+	do
+	{
+		Bytes[nBytes++] = nValue & 0x7F;
+		nValue >>= 7;
+	} while (nValue && nBytes < 4);
+
+	for (size_t i = 0; i < nBytes; ++i)
+		pOutData[i] = Bytes[nBytes - 1 - i] | (i < nBytes - 1 ? 0x80 : 0);
+
+	return nBytes;
+}
+
+static inline void WriteBE32(u32 nValue, u8* pOutData)
+{
+	pOutData[0] = nValue >> 24;
+	pOutData[1] = nValue >> 16;
+	pOutData[2] = nValue >> 8;
+	pOutData[3] = nValue;
+}
+
+static size_t GetShortMessageLength(u8 nStatus)
+{
+	switch (nStatus & 0xF0)
+	{
+		case 0xC0:
+		case 0xD0:
+			return 2;
+
+		case 0xF0:
+			break;
+
+		default:
+			return 3;
+	}
+
+	switch (nStatus)
+	{
+		case 0xF1:
+		case 0xF3:
+			return 2;
+
+		case 0xF2:
+			return 3;
+
+		default:
+			return 1;
+	}
+}
+
+CMIDIRecorder::CMIDIRecorder()
+	: CTask(StackSize),
+	  m_State(TState::Idle),
+
+	  m_nLastTimestamp(0),
+	  m_nPendingMicros(0),
+	  m_nBlockFill(0),
+	  m_nLastPublishTime(0),
+	  m_nDroppedMessages(0),
+	  m_bSysExStreaming(false),
+
+	  m_nBlocksPublished(0),
+	  m_nBlocksWritten(0),
+	  m_BlockSizes{0},
+
+	  m_File{},
+	  m_bFileOpen(false),
+	  m_nTrackSize(0)
+{
+	SetName("midirecorder");
+}
+
+bool CMIDIRecorder::Start(const char* pDisk)
+{
+	if (GetState() != TState::Idle)
+		return false;
+
+	// The writer task is idle, so the ring can be reset from here
+	m_Disk              = pDisk;
+	m_nLastTimestamp    = CTimer::GetClockTicks();
+	m_nPendingMicros    = 0;
+	m_nBlockFill        = 0;
+	m_nLastPublishTime  = m_nLastTimestamp;
+	m_nDroppedMessages  = 0;
+	m_bSysExStreaming   = false;
+	m_nBlocksPublished  = 0;
+	m_nBlocksWritten    = 0;
+
+	__atomic_store_n(&m_State, TState::Recording, __ATOMIC_RELEASE);
+	m_Event.Set();
+
+	return true;
+}
+
+void CMIDIRecorder::Stop()
+{
+	if (!IsRecording())
+		return;
+
+	// Terminate a SysEx message that is still arriving
+	if (m_bSysExStreaming)
+		RecordSysExChunk(TSysExChunk::Abort, nullptr, 0, CTimer::GetClockTicks());
+
+	if (m_nBlockFill)
+		PublishBlock();
+
+	// Everything published so far is written before the file is closed
+	__atomic_store_n(&m_State, TState::Stopping, __ATOMIC_RELEASE);
+	m_Event.Set();
+}
+
+void CMIDIRecorder::Reset()
+{
+	// Acknowledge a failed recording
+	if (GetState() == TState::Failed)
+		__atomic_store_n(&m_State, TState::Idle, __ATOMIC_RELEASE);
+}
+
+void CMIDIRecorder::Update()
+{
+	if (IsRecording() && m_nBlockFill && CTimer::GetClockTicks() - m_nLastPublishTime >= FlushPeriodMillis * 1000)
+		PublishBlock();
+}
+
+void CMIDIRecorder::RecordShortMessages(const TMIDIEvent* pMessages, size_t nCount)
+{
+	for (size_t i = 0; i < nCount; ++i)
+	{
+		const u32 nMessage = pMessages[i].nMessage;
+		const u8 nStatus   = nMessage & 0xFF;
+
+		// Active sensing would only fill the file with noise
+		if (nStatus == 0xFE)
+			continue;
+
+		const u8 Message[] = { nStatus, static_cast<u8>((nMessage >> 8) & 0x7F), static_cast<u8>((nMessage >> 16) & 0x7F) };
+		const size_t nLength = GetShortMessageLength(nStatus);
+
+		if (nStatus < 0xF0)
+			Append(pMessages[i].nTimestamp, Message, nLength, nullptr, 0);
+		else
+		{
+			// System common and real-time messages have no SMF event of their own; store them as escaped data
+			const u8 Escape[] = { 0xF7, static_cast<u8>(nLength) };
+			Append(pMessages[i].nTimestamp, Escape, sizeof(Escape), Message, nLength);
+		}
+	}
+}
+
+void CMIDIRecorder::RecordSysExMessage(const u8* pData, size_t nSize, u32 nTimestamp)
+{
+	// F0 <length> <data after F0, including F7>
+	u8 Header[5];
+	Header[0] = 0xF0;
+	const size_t nHeaderSize = 1 + WriteVLQ(nSize - 1, Header + 1);
+
+	Append(nTimestamp, Header, nHeaderSize, pData + 1, nSize - 1);
+}
+
+void CMIDIRecorder::RecordSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize, u32 nTimestamp)
+{
+	u8 Header[5];
+
+	switch (Chunk)
+	{
+		case TSysExChunk::Begin:
+			Header[0] = 0xF0;
+			m_bSysExStreaming = Append(nTimestamp, Header, 1 + WriteVLQ(nSize - 1, Header + 1), pData + 1, nSize - 1);
+			break;
+
+		// The remainder of the message follows as F7 <length> <data> continuation events
+		case TSysExChunk::Continue:
+		case TSysExChunk::End:
+			if (!m_bSysExStreaming)
+				break;
+
+			Header[0] = 0xF7;
+			if (!Append(nTimestamp, Header, 1 + WriteVLQ(nSize, Header + 1), pData, nSize) || Chunk == TSysExChunk::End)
+				m_bSysExStreaming = false;
+			break;
+
+		case TSysExChunk::Abort:
+		{
+			if (!m_bSysExStreaming)
+				break;
+
+			const u8 Terminator[] = { 0xF7, 0x01, 0xF7 };
+			Append(nTimestamp, Terminator, sizeof(Terminator), nullptr, 0);
+			m_bSysExStreaming = false;
+			break;
+		}
+	}
+}
+
+bool CMIDIRecorder::Append(u32 nTimestamp, const u8* pHeader, size_t nHeaderSize, const u8* pData, size_t nDataSize)
+{
+	// Messages from different inputs may be merged slightly out of order; never step backwards in time
+	const u32 nElapsed = nTimestamp - m_nLastTimestamp;
+	const bool bForwards = static_cast<s32>(nElapsed) > 0;
+	const u32 nMicros = m_nPendingMicros + (bForwards ? nElapsed : 0);
+	const u32 nDeltaTicks = Utility::Min(nMicros / MicrosPerTick, 0x0FFFFFFFu);
+
+	u8 Delta[4];
+	const size_t nDeltaSize = WriteVLQ(nDeltaTicks, Delta);
+	const size_t nSize = nDeltaSize + nHeaderSize + nDataSize;
+
+	// The block being filled is free until it's published
+	const size_t nBlocksWritten = __atomic_load_n(&m_nBlocksWritten, __ATOMIC_ACQUIRE);
+	const size_t nFreeBlocks = BlockCount - (m_nBlocksPublished - nBlocksWritten);
+	if (nSize > nFreeBlocks * BlockSize - m_nBlockFill)
+	{
+		// The next message's delta time will cover the gap
+		++m_nDroppedMessages;
+		return false;
+	}
+
+	CopyIn(Delta, nDeltaSize);
+	CopyIn(pHeader, nHeaderSize);
+	CopyIn(pData, nDataSize);
+
+	if (bForwards)
+		m_nLastTimestamp = nTimestamp;
+	m_nPendingMicros = nMicros - nDeltaTicks * MicrosPerTick;
+
+	return true;
+}
+
+void CMIDIRecorder::CopyIn(const u8* pData, size_t nSize)
+{
+	while (nSize)
+	{
+		u8* const pBlock = m_Blocks[m_nBlocksPublished % BlockCount];
+		const size_t nCopy = Utility::Min(nSize, BlockSize - m_nBlockFill);
+
+		memcpy(pBlock + m_nBlockFill, pData, nCopy);
+		m_nBlockFill += nCopy;
+		pData += nCopy;
+		nSize -= nCopy;
+
+		if (m_nBlockFill == BlockSize)
+			PublishBlock();
+	}
+}
+
+void CMIDIRecorder::PublishBlock()
+{
+	m_BlockSizes[m_nBlocksPublished % BlockCount] = m_nBlockFill;
+	__atomic_store_n(&m_nBlocksPublished, m_nBlocksPublished + 1, __ATOMIC_RELEASE);
+
+	m_nBlockFill       = 0;
+	m_nLastPublishTime = CTimer::GetClockTicks();
+
+	m_Event.Set();
+}
+
+void CMIDIRecorder::Run()
+{
+	while (true)
+	{
+		m_Event.Wait();
+		m_Event.Clear();
+
+		// Read the state first; any blocks published before Stop() are then visible below
+		const TState State = GetState();
+		if (State != TState::Recording && State != TState::Stopping)
+			continue;
+
+		if (!m_bFileOpen && !OpenFile())
+		{
+			__atomic_store_n(&m_State, TState::Failed, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		if (!WriteBlocks())
+		{
+			CloseFile(false);
+			__atomic_store_n(&m_State, TState::Failed, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		if (State == TState::Stopping)
+		{
+			CloseFile(true);
+			__atomic_store_n(&m_State, TState::Idle, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+bool CMIDIRecorder::OpenFile()
+{
+	CString DirectoryPath;
+	DirectoryPath.Format("%s:%s", static_cast<const char*>(m_Disk), RecordingDirectory);
+
+	const FRESULT Result = f_mkdir(DirectoryPath);
+	if (Result != FR_OK && Result != FR_EXIST)
+	{
+		LOGERR("Couldn't create '%s' (error %d)", static_cast<const char*>(DirectoryPath), Result);
+		return false;
+	}
+
+	// Find the first unused file name
+	FILINFO FileInfo;
+	unsigned nFileNumber = 1;
+	for (; nFileNumber <= MaxFileNumber; ++nFileNumber)
+	{
+		m_FilePath.Format("%s/rec%04d.mid", static_cast<const char*>(DirectoryPath), nFileNumber);
+		if (f_stat(m_FilePath, &FileInfo) == FR_NO_FILE)
+			break;
+	}
+
+	if (nFileNumber > MaxFileNumber)
+	{
+		LOGERR("Too many recordings in '%s'", static_cast<const char*>(DirectoryPath));
+		return false;
+	}
+
+	if (f_open(&m_File, m_FilePath, FA_WRITE | FA_CREATE_NEW) != FR_OK)
+	{
+		LOGERR("Couldn't create '%s'", static_cast<const char*>(m_FilePath));
+		return false;
+	}
+
+	m_bFileOpen = true;
+
+	// Type 0, one track; the track length is filled in on close
+	const u8 Header[] =
+	{
+		'M', 'T', 'h', 'd', 0, 0, 0, 6,
+		0, 0, 0, 1, TicksPerQuarterNote >> 8, TicksPerQuarterNote & 0xFF,
+		'M', 'T', 'r', 'k', 0, 0, 0, 0,
+	};
+
+	// Tempo of 120 BPM, so that one tick is MicrosPerTick
+	constexpr u32 nTempo = TicksPerQuarterNote * MicrosPerTick;
+	const u8 Tempo[] = { 0x00, 0xFF, 0x51, 0x03, nTempo >> 16, (nTempo >> 8) & 0xFF, nTempo & 0xFF };
+
+	if (!WriteFile(Header, sizeof(Header)))
+		return false;
+
+	m_nTrackSize = 0;
+	if (!WriteFile(Tempo, sizeof(Tempo)))
+		return false;
+
+	LOGNOTE("Recording MIDI to '%s'", static_cast<const char*>(m_FilePath));
+	return true;
+}
+
+bool CMIDIRecorder::WriteBlocks()
+{
+	const size_t nBlocksPublished = __atomic_load_n(&m_nBlocksPublished, __ATOMIC_ACQUIRE);
+
+	for (size_t i = m_nBlocksWritten; i != nBlocksPublished; ++i)
+	{
+		const size_t nBlock = i % BlockCount;
+		if (!WriteFile(m_Blocks[nBlock], m_BlockSizes[nBlock]))
+			return false;
+
+		// Hand the block back to the main task
+		__atomic_store_n(&m_nBlocksWritten, i + 1, __ATOMIC_RELEASE);
+
+		// Let the main task process MIDI between blocks
+		CScheduler::Get()->Yield();
+	}
+
+	return true;
+}
+
+bool CMIDIRecorder::WriteFile(const void* pData, size_t nSize)
+{
+	UINT nBytesWritten;
+	if (f_write(&m_File, pData, nSize, &nBytesWritten) != FR_OK || nBytesWritten != nSize)
+	{
+		LOGERR("Write to '%s' failed", static_cast<const char*>(m_FilePath));
+		return false;
+	}
+
+	m_nTrackSize += nSize;
+	return true;
+}
+
+void CMIDIRecorder::CloseFile(bool bFinalize)
+{
+	if (!m_bFileOpen)
+		return;
+
+	if (bFinalize)
+	{
+		const u8 EndOfTrack[] = { 0x00, 0xFF, 0x2F, 0x00 };
+		u8 TrackSize[4];
+		UINT nBytesWritten;
+
+		bool bSuccess = WriteFile(EndOfTrack, sizeof(EndOfTrack));
+		if (bSuccess)
+		{
+			WriteBE32(m_nTrackSize, TrackSize);
+			bSuccess = f_lseek(&m_File, TrackSizeOffset) == FR_OK &&
+				   f_write(&m_File, TrackSize, sizeof(TrackSize), &nBytesWritten) == FR_OK &&
+				   nBytesWritten == sizeof(TrackSize);
+		}
+
+		if (bSuccess)
+			LOGNOTE("Saved '%s' (%d bytes, %d messages dropped)", static_cast<const char*>(m_FilePath), m_nTrackSize, m_nDroppedMessages);
+		else
+			LOGERR("Couldn't finish '%s'", static_cast<const char*>(m_FilePath));
+	}
+
+	f_close(&m_File);
+	m_bFileOpen = false;
+}
@@ -32,6 +32,8 @@
 #include "lcd/drivers/ssd1306.h"
 #include "lcd/ui.h"
 #include "mt32pi.h"
+#include "sampleconverter.h"
+#include "zoneallocator.h"
 
 #define MT32_PI_NAME "mt32-pi"
 LOGMODULE(MT32_PI_NAME);
@@ -44,8 +46,13 @@ constexpr u32 LCDUpdatePeriodMillis                = 16;
 constexpr u32 MisterUpdatePeriodMillis             = 50;
 constexpr u32 LEDTimeoutMillis                     = 50;
 constexpr u32 ActiveSenseTimeoutMillis             = 330;
+constexpr u32 RenderLoadCheckPeriodMillis          = 1000;
+constexpr u32 MIDIRecorderStopTimeoutMillis        = 2000;
 
-constexpr float Sample24BitMax = (1 << 24 - 1) - 1;
+// SysEx passed to the audio task is marked by an event with a SysEx status byte, the kind of message (whole, or
+// 1 + TSysExChunk) in the second byte, and the size of its data (held in the SysEx event queue) in the upper half
+constexpr u32 SysExEventStatus  = 0xF0;
+constexpr u32 SysExEventMessage = 0;
 
 enum class TCustomSysExCommand : u8
 {
@@ -54,13 +61,18 @@ enum class TCustomSysExCommand : u8
 	SwitchSoundFont       = 0x02,
 	SwitchSynth           = 0x03,
 	SetMT32ReversedStereo = 0x04,
+	QueryHeapStats        = 0x05,
+	QueryRenderStats      = 0x06,
+	SetMIDIRecording      = 0x07,
+	SaveMT32Snapshot      = 0x08,
+	LoadMT32Snapshot      = 0x09,
 };
 
 CMT32Pi* CMT32Pi::s_pThis = nullptr;
 
 CMT32Pi::CMT32Pi(CI2CMaster* pI2CMaster, CSPIMaster* pSPIMaster, CInterruptSystem* pInterrupt, CGPIOManager* pGPIOManager, CSerialDevice* pSerialDevice, CUSBHCIDevice* pUSBHCI)
 	: CMultiCoreSupport(CMemorySystem::Get()),
-	  CMIDIParser(),
+	  CMIDIMerger(),
 
 	  m_pConfig(CConfig::Get()),
 
@@ -90,8 +102,16 @@ CMT32Pi::CMT32Pi(CI2CMaster* pI2CMaster, CSPIMaster* pSPIMaster, CInterruptSyste
 #ifdef MONITOR_TEMPERATURE
 	  m_nTempUpdateTime(0),
 #endif
+#ifdef MONITOR_HEAP
+	  m_nHeapUpdateTime(0),
+#endif
 
 	  m_pControl(nullptr),
+	  m_nHeldButtons(0),
+	  m_bButtonChord(false),
+	  m_bButtonChordSnapshotPending(false),
+	  m_nButtonChordVolume(0),
+	  m_bButtonSeekPending(false),
 	  m_MisterControl(pI2CMaster, m_EventQueue),
 	  m_nMisterUpdateTime(0),
 
@@ -114,12 +134,29 @@ CMT32Pi::CMT32Pi(CI2CMaster* pI2CMaster, CSPIMaster* pSPIMaster, CInterruptSyste
 	  m_nLEDOnTime(0),
 
 	  m_pSound(nullptr),
+	  m_nRenderLoadCheckTime(0),
+	  m_nRenderUnderruns(0),
+
 	  m_pPisound(nullptr),
 
 	  m_nMasterVolume(100),
 	  m_pCurrentSynth(nullptr),
 	  m_pMT32Synth(nullptr),
-	  m_pSoundFontSynth(nullptr)
+	  m_pSoundFontSynth(nullptr),
+	  m_pLayeredSynth(nullptr),
+	  m_pMT32Snapshot(nullptr),
+
+	  m_pSMFPlayer(nullptr),
+	  m_pMIDIRecorder(nullptr),
+
+	  m_bMIDISampleAccurate(false),
+	  m_nMIDIEventsQueued(0),
+	  m_nMIDIEventsApplied(0),
+	  m_nMIDIEventWaitMicros(0),
+	  m_bMIDIEventWaitTimedOut(false),
+	  m_nMIDIEventsAppliedAtTimeout(0),
+	  m_bSysExChunksDeferred(false),
+	  m_bMIDICoalesceControllers(false)
 {
 	s_pThis = this;
 }
@@ -132,6 +169,8 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 {
 	m_bSerialMIDIAvailable = bSerialMIDIAvailable;
 	m_bSerialMIDIEnabled = bSerialMIDIAvailable;
+	m_bMIDISampleAccurate = m_pConfig->MIDISampleAccurate;
+	m_bMIDICoalesceControllers = m_pConfig->MIDICoalesceControllers;
 
 	switch (m_pConfig->LCDType)
 	{
@@ -202,7 +241,7 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 		if (m_pPisound->Initialize())
 		{
 			LOGWARN("Blokas Pisound detected");
-			m_pPisound->RegisterMIDIReceiveHandler(IRQMIDIReceiveHandler);
+			m_pPisound->RegisterMIDIReceiveHandler(PisoundMIDIReceiveHandler);
 			m_bSerialMIDIEnabled = false;
 		}
 		else
@@ -256,6 +295,9 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 	if (!m_pSound->AllocateQueueFrames(nQueueSize))
 		LOGPANIC("Failed to allocate sound queue");
 
+	// Deferred MIDI events are applied within two queue lengths unless the audio task has stopped (e.g. power saving)
+	m_nMIDIEventWaitMicros = static_cast<u64>(m_pSound->GetQueueSizeFrames()) * 2 * 1000000 / m_pConfig->AudioSampleRate;
+
 	LCDLog(TLCDLogType::Startup, "Init controls");
 	if (m_pConfig->ControlScheme == CConfig::TControlScheme::SimpleButtons)
 		m_pControl = new CControlSimpleButtons(m_EventQueue);
@@ -275,11 +317,17 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 	LCDLog(TLCDLogType::Startup, "Init FluidSynth");
 	InitSoundFontSynth();
 
+	// Layered mode needs both synths
+	if (m_pMT32Synth && m_pSoundFontSynth)
+		InitLayeredSynth();
+
 	// Set initial synthesizer
 	if (m_pConfig->SystemDefaultSynth == CConfig::TSystemDefaultSynth::MT32)
 		m_pCurrentSynth = m_pMT32Synth;
 	else if (m_pConfig->SystemDefaultSynth == CConfig::TSystemDefaultSynth::SoundFont)
 		m_pCurrentSynth = m_pSoundFontSynth;
+	else if (m_pConfig->SystemDefaultSynth == CConfig::TSystemDefaultSynth::Layered)
+		m_pCurrentSynth = m_pLayeredSynth;
 
 	if (!m_pCurrentSynth)
 	{
@@ -309,6 +357,15 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 	if (m_pLCD)
 		m_pLCD->Clear();
 
+	// Look for MIDI files to play
+	m_pSMFPlayer = new CSMFPlayer(m_pConfig->AudioSampleRate);
+	if (m_pSMFPlayer->ScanFiles() && m_pConfig->PlayerAutoplay)
+		PlayMIDIFile(0);
+
+	m_pMIDIRecorder = new CMIDIRecorder();
+	if (m_pConfig->RecorderAutostart)
+		StartMIDIRecording();
+
 	// Start audio
 	m_pSound->Start();
 
@@ -387,8 +444,18 @@ bool CMT32Pi::InitMT32Synth()
 	// Set MT-32 reversed stereo option from config
 	m_pMT32Synth->SetReversedStereo(m_pConfig->MT32EmuReversedStereo);
 
+	m_pMT32Synth->SetSkipRedundantSysEx(m_pConfig->MT32EmuSkipRedundantSysEx);
+
+	// Bulk SysEx uploads can fill mt32emu's MIDI queue faster than it is drained
+	m_pMT32Synth->SetMIDIQueue(Utility::Clamp(m_pConfig->MT32EmuMIDIQueueSize, 64, 65536), Utility::Clamp(m_pConfig->MT32EmuMIDIQueueTimeout, 0, 1000));
+
+	// Other ROM sets are opened in the background by the UI task
+	m_pMT32Synth->SetPreloadROMSets(m_pConfig->MT32EmuPreloadROMSets.nMask);
+
 	m_pMT32Synth->SetUserInterface(&m_UserInterface);
 
+	m_pMT32Snapshot = new CMT32Snapshot();
+
 	return true;
 }
 
@@ -410,6 +477,31 @@ bool CMT32Pi::InitSoundFontSynth()
 	return true;
 }
 
+bool CMT32Pi::InitLayeredSynth()
+{
+	assert(m_pLayeredSynth == nullptr);
+
+	// Room for a full block of events from both the MIDI input and the MIDI file player
+	m_pLayeredSynth = new CLayeredSynth(m_pConfig->AudioSampleRate, m_pSound->GetQueueSizeFrames(), MIDIEventQueueSize + CSMFPlayer::MaxEventsPerBlock, m_pMT32Synth, m_pSoundFontSynth);
+	if (!m_pLayeredSynth->Initialize())
+	{
+		LOGWARN("Layered synth init failed");
+		delete m_pLayeredSynth;
+		m_pLayeredSynth = nullptr;
+		return false;
+	}
+
+	m_pLayeredSynth->SetMT32Channels(m_pConfig->LayeredMT32Channels.nMask);
+	m_pLayeredSynth->SetCables(m_pConfig->LayeredMT32USBCables.nMask, m_pConfig->LayeredSoundFontUSBCables.nMask);
+	m_pLayeredSynth->SetGains(m_pConfig->LayeredMT32Gain, m_pConfig->LayeredSoundFontGain);
+
+	// The render task renders the MT-32 synth on core 3
+	m_pLayeredSynth->SetParallelRendering(true);
+	m_pLayeredSynth->SetUserInterface(&m_UserInterface);
+
+	return true;
+}
+
 void CMT32Pi::MainTask()
 {
 	CScheduler* const pScheduler = CScheduler::Get();
@@ -450,10 +542,31 @@ void CMT32Pi::MainTask()
 			LOGNOTE("Active sense timeout - turning notes off");
 		}
 
+		// Dispatch events deferred by the MIDI file player, and move on when a file finishes
+		UpdateSMFPlayer();
+
+		// Flush captured MIDI, and report recording errors
+		UpdateMIDIRecorder();
+
 		// Update power management
-		if (m_pCurrentSynth->IsActive())
+		if (m_pCurrentSynth->IsActive() || m_pSMFPlayer->IsPlaying())
 			Awaken();
 
+		// Report blocks that took longer to render than to play
+		if (nTicks - m_nRenderLoadCheckTime >= MSEC2HZ(RenderLoadCheckPeriodMillis))
+		{
+			const u32 nUnderruns = m_RenderProfiler.GetTotalUnderruns();
+			if (nUnderruns > m_nRenderUnderruns)
+			{
+				LOGWARN("%d audio blocks overran their render budget (load: %d%%)", nUnderruns - m_nRenderUnderruns, m_RenderProfiler.GetLoad());
+				if (m_pConfig->SystemVerbose)
+					LCDLog(TLCDLogType::Warning, "Render overload!");
+			}
+
+			m_nRenderUnderruns     = nUnderruns;
+			m_nRenderLoadCheckTime = nTicks;
+		}
+
 #ifdef MONITOR_TEMPERATURE
 		if (nTicks - m_nTempUpdateTime >= MSEC2HZ(5000))
 		{
@@ -464,6 +577,16 @@ void CMT32Pi::MainTask()
 		}
 #endif
 
+#ifdef MONITOR_HEAP
+		if (nTicks - m_nHeapUpdateTime >= MSEC2HZ(5000))
+		{
+			CZoneAllocator::TStats Stats;
+			CZoneAllocator::Get()->GetStats(Stats);
+			LOGDBG("Heap: %d/%d KB in use, largest free block: %d KB", Stats.nBytesInUse / KILOBYTE, Stats.nHeapSize / KILOBYTE, Stats.nLargestFreeBlock / KILOBYTE);
+			m_nHeapUpdateTime = nTicks;
+		}
+#endif
+
 		CPower::Update();
 
 		// Check for deferred SoundFont switch
@@ -482,6 +605,19 @@ void CMT32Pi::MainTask()
 			}
 		}
 
+		// Check for completion of background SoundFont load
+		if (m_pSoundFontSynth && m_pSoundFontSynth->UpdateSoundFontSwitch())
+		{
+			if (m_pCurrentSynth == m_pSoundFontSynth)
+				m_pSoundFontSynth->ReportStatus();
+
+			// Render cost depends on the SoundFont; start profiling afresh
+			m_RenderProfiler.Reset();
+			m_nRenderUnderruns = 0;
+
+			Awaken();
+		}
+
 		// Check for USB PnP events
 		UpdateUSB();
 
@@ -489,6 +625,11 @@ void CMT32Pi::MainTask()
 		pScheduler->Yield();
 	}
 
+	// Finish writing any MIDI recording before rebooting
+	StopMIDIRecording();
+	const unsigned int nStopTime = m_pTimer->GetTicks();
+	while (m_pMIDIRecorder->GetState() == CMIDIRecorder::TState::Stopping && m_pTimer->GetTicks() - nStopTime < MSEC2HZ(MIDIRecorderStopTimeoutMillis))
+		pScheduler->Yield();
 
 	// Stop audio
 	m_pSound->Cancel();
@@ -503,9 +644,10 @@ void CMT32Pi::UITask()
 	LOGNOTE("UI task on Core 1 starting up");
 
 	const bool bMisterEnabled = m_pConfig->ControlMister;
+	const bool bPreloadROMSets = m_pConfig->MT32EmuPreloadROMSets.nMask != 0;
 
 	// Nothing for this core to do; bail out
-	if (!(m_pLCD || bMisterEnabled))
+	if (!(m_pLCD || bMisterEnabled || bPreloadROMSets))
 	{
 		m_bUITaskDone = true;
 		return;
@@ -544,6 +686,10 @@ void CMT32Pi::UITask()
 			m_MisterControl.Update(Status);
 			m_nMisterUpdateTime = nTicks;
 		}
+
+		// Open preloaded MT-32 ROM sets; this core has time to spare, whereas core 0 must keep up with incoming MIDI
+		if (bPreloadROMSets && m_pMT32Synth)
+			m_pMT32Synth->UpdatePreloadedROMSets();
 	}
 
 	// Clear screen
@@ -561,50 +707,192 @@ void CMT32Pi::AudioTask()
 
 	// Circle's "fast path" for I2S 24-bit really expects 32-bit samples
 	const bool bI2S = m_pConfig->AudioOutputDevice == CConfig::TAudioOutputDevice::I2S;
-	const bool bReversedStereo = m_pConfig->AudioReversedStereo;
-	const u8 nBytesPerSample = bI2S ? sizeof(s32) : (sizeof(s8) * 3);
-	const u8 nBytesPerFrame = 2 * nBytesPerSample;
+	CSampleConverter SampleConverter(bI2S ? CSampleConverter::TFormat::I2S32 : CSampleConverter::TFormat::Packed24, m_pConfig->AudioReversedStereo, m_pConfig->AudioDither);
+	const u8 nBytesPerFrame = nChannels * SampleConverter.GetBytesPerSample();
 
 	const size_t nQueueSizeFrames = m_pSound->GetQueueSizeFrames();
+	const unsigned int nSampleRate = m_pConfig->AudioSampleRate;
 
 	// Extra byte so that we can write to the 24-bit buffer with overlapping 32-bit writes (efficiency)
 	float FloatBuffer[nQueueSizeFrames * nChannels];
-	s8 IntBuffer[nQueueSizeFrames * nBytesPerFrame + bI2S ? 0 : 1];
+	s8 IntBuffer[nQueueSizeFrames * nBytesPerFrame + (bI2S ? 0 : 1)];
+
+	// Room for events from both the MIDI input and the MIDI file player
+	TMIDIEvent MIDIEvents[MIDIEventQueueSize + CSMFPlayer::MaxEventsPerBlock];
+	TMIDIEvent PlayerEvents[CSMFPlayer::MaxEventsPerBlock];
+	unsigned int nLastRenderTicks = CTimer::GetClockTicks();
 
 	while (m_bRunning)
 	{
 		const size_t nFrames = nQueueSizeFrames - m_pSound->GetQueueFramesAvail();
 		const size_t nWriteBytes = nFrames * nBytesPerFrame;
+		const unsigned int nRenderStartTicks = CTimer::GetClockTicks();
+		size_t nEvents = 0;
+		size_t nQueuedEvents = 0;
 
-		m_pCurrentSynth->Render(FloatBuffer, nFrames);
-
-		if (bReversedStereo)
+		if (m_bMIDISampleAccurate && nFrames)
 		{
-			// Convert to signed 24-bit integers with channel swap
-			for (size_t i = 0; i < nFrames * nChannels; i += nChannels)
+			const unsigned int nTicks = CTimer::GetClockTicks();
+			const unsigned int nElapsedTicks = nTicks - nLastRenderTicks;
+			nEvents = m_MIDIEventQueue.Dequeue(MIDIEvents, MIDIEventQueueSize);
+			nQueuedEvents = nEvents;
+
+			// Only the latest value of each controller received since the last render needs to be applied
+			if (m_bMIDICoalesceControllers)
+				nEvents = m_MIDICoalescer.Coalesce(MIDIEvents, nEvents);
+
+			// Map the arrival times of events received since the last render onto frame offsets within this block,
+			// trading a constant block of latency for jitter-free timing
+			size_t nPreviousOffset = 0;
+			for (size_t i = 0; i < nEvents; ++i)
 			{
-				s32* const pLeftSample = reinterpret_cast<s32*>(IntBuffer + i * nBytesPerSample);
-				s32* const pRightSample = reinterpret_cast<s32*>(IntBuffer + (i + 1) * nBytesPerSample);
-				*pLeftSample = FloatBuffer[i + 1] * Sample24BitMax;
-				*pRightSample = FloatBuffer[i] * Sample24BitMax;
+				const s32 nDeltaTicks = static_cast<s32>(MIDIEvents[i].nTimestamp - nLastRenderTicks);
+				size_t nOffset = 0;
+
+				if (nDeltaTicks > 0 && nElapsedTicks)
+					nOffset = static_cast<u64>(nDeltaTicks) * nFrames / nElapsedTicks;
+
+				// Keep offsets in order and within the block
+				nOffset = Utility::Clamp(nOffset, nPreviousOffset, nFrames - 1);
+				MIDIEvents[i].nTimestamp = nOffset;
+				nPreviousOffset = nOffset;
 			}
+
+			nLastRenderTicks = nTicks;
 		}
-		else
+
+		// Merge in events from the MIDI file player, which are already scheduled at frame offsets within the block
+		const size_t nPlayerEvents = nFrames ? m_pSMFPlayer->GetEvents(*m_pCurrentSynth, PlayerEvents, nFrames) : 0;
+		if (nPlayerEvents)
 		{
-			// Convert to signed 24-bit integers
-			for (size_t i = 0; i < nFrames * nChannels; ++i)
+			size_t nInputEvents = nEvents;
+			size_t nRemainingPlayerEvents = nPlayerEvents;
+			nEvents += nPlayerEvents;
+
+			for (size_t i = nEvents; nRemainingPlayerEvents; --i)
 			{
-				s32* const pSample = reinterpret_cast<s32*>(IntBuffer + i * nBytesPerSample);
-				*pSample = FloatBuffer[i] * Sample24BitMax;
+				if (nInputEvents && MIDIEvents[nInputEvents - 1].nTimestamp > PlayerEvents[nRemainingPlayerEvents - 1].nTimestamp)
+					MIDIEvents[i - 1] = MIDIEvents[--nInputEvents];
+				else
+					MIDIEvents[i - 1] = PlayerEvents[--nRemainingPlayerEvents];
 			}
 		}
 
+		if ((m_bMIDISampleAccurate && nFrames) || nPlayerEvents)
+			RenderMIDIEvents(FloatBuffer, nFrames, MIDIEvents, nEvents);
+		else
+			m_pCurrentSynth->Render(FloatBuffer, nFrames);
+
+		// Let the main task know that the events it queued have reached the synth
+		if (nQueuedEvents)
+			__atomic_add_fetch(&m_nMIDIEventsApplied, nQueuedEvents, __ATOMIC_RELEASE);
+
+		// Convert to signed 24-bit integers
+		SampleConverter.Convert(FloatBuffer, IntBuffer, nFrames);
+
+		// Compare time taken against the time it will take to play the block
+		if (nFrames)
+		{
+			const TSynth Synth = m_pCurrentSynth == m_pMT32Synth ? TSynth::MT32 : m_pCurrentSynth == m_pSoundFontSynth ? TSynth::SoundFont : TSynth::Layered;
+			m_RenderProfiler.Record(Synth, CTimer::GetClockTicks() - nRenderStartTicks, static_cast<u64>(nFrames) * 1000000 / nSampleRate);
+		}
+
 		const int nResult = m_pSound->Write(IntBuffer, nWriteBytes);
 		if (nResult != static_cast<int>(nWriteBytes))
 			LOGERR("Sound data dropped");
 	}
 }
 
+void CMT32Pi::RenderMIDIEvents(float* pOutBuffer, size_t nFrames, TMIDIEvent* pEvents, size_t nEvents)
+{
+	// SysEx is applied between two renders, splitting the block at its frame offset
+	size_t nFramesRendered = 0;
+	size_t nFirstEvent = 0;
+
+	for (size_t i = 0; i <= nEvents; ++i)
+	{
+		const bool bSysEx = i < nEvents && (pEvents[i].nMessage & 0xFF) == SysExEventStatus;
+		if (i < nEvents && !bSysEx)
+			continue;
+
+		const size_t nOffset = bSysEx ? pEvents[i].nTimestamp : nFrames;
+		TMIDIEvent* const pSpanEvents = pEvents + nFirstEvent;
+		const size_t nSpanEvents = i - nFirstEvent;
+
+		if (nOffset > nFramesRendered)
+		{
+			for (size_t j = 0; j < nSpanEvents; ++j)
+				pSpanEvents[j].nTimestamp -= nFramesRendered;
+
+			m_pCurrentSynth->RenderWithMIDIEvents(pOutBuffer + nFramesRendered * 2, nOffset - nFramesRendered, pSpanEvents, nSpanEvents);
+			nFramesRendered = nOffset;
+		}
+		else if (nSpanEvents)
+			m_pCurrentSynth->HandleMIDIEvents(pSpanEvents, nSpanEvents);
+
+		if (bSysEx)
+			ApplySysExEvent(pEvents[i].nMessage);
+
+		nFirstEvent = i + 1;
+	}
+}
+
+void CMT32Pi::ApplySysExEvent(u32 nMessage)
+{
+	const u32 nKind = (nMessage >> 8) & 0xFF;
+	const size_t nSize = nMessage >> 16;
+
+	// The data was queued before the event
+	u8 Data[MaxSysExSize];
+
+	// Never queued by QueueSysExEvent(); skip over the data so that the next event's data is found in the right place
+	if (nSize > MaxSysExSize)
+	{
+		for (size_t nSkipped = 0; nSkipped < nSize;)
+		{
+			const size_t nDequeued = m_SysExEventQueue.Dequeue(Data, Utility::Min(nSize - nSkipped, MaxSysExSize));
+			if (!nDequeued)
+				break;
+
+			nSkipped += nDequeued;
+		}
+
+		LOGERR("Oversized SysEx event dropped");
+		return;
+	}
+
+	if (m_SysExEventQueue.Dequeue(Data, nSize) != nSize)
+	{
+		LOGERR("SysEx event data missing");
+		return;
+	}
+
+	if (nKind == SysExEventMessage)
+		m_pCurrentSynth->ApplyMIDISysExMessage(Data, nSize);
+	else
+		m_pCurrentSynth->ApplyMIDISysExChunk(static_cast<TSysExChunk>(nKind - 1), Data, nSize);
+}
+
+void CMT32Pi::RenderTask()
+{
+	LOGNOTE("Render task on Core 3 starting up");
+
+	const bool bSoundFontParallelRendering = m_pSoundFontSynth && m_pSoundFontSynth->IsParallelRenderingEnabled();
+	if (!bSoundFontParallelRendering && !m_pLayeredSynth)
+		return;
+
+	// Serve whichever synth is waiting on this core; in layered mode, FluidSynth doesn't hand its secondary instance
+	// over while the MT-32 synth is rendering here, so only one of them is ever waiting
+	while (m_bRunning)
+	{
+		if (bSoundFontParallelRendering)
+			m_pSoundFontSynth->RenderSecondary();
+
+		if (m_pLayeredSynth)
+			m_pLayeredSynth->RenderSecondary();
+	}
+}
+
 void CMT32Pi::Run(unsigned nCore)
 {
 	// Assign tasks to different CPU cores
@@ -619,6 +907,9 @@ void CMT32Pi::Run(unsigned nCore)
 		case 2:
 			return AudioTask();
 
+		case 3:
+			return RenderTask();
+
 		default:
 			break;
 	}
@@ -650,23 +941,70 @@ void CMT32Pi::OnUnderVoltageDetected()
 	LCDLog(TLCDLogType::Warning, "Low voltage! Chk PSU");
 }
 
-void CMT32Pi::OnShortMessage(u32 nMessage)
+void CMT32Pi::OnShortMessages(const TMIDIEvent* pMessages, size_t nCount)
 {
-	// Active sensing
-	if (nMessage == 0xFE)
+	TMIDIEvent Messages[ShortMessageBatchSize];
+	size_t nMessages = 0;
+	size_t nActiveSenseMessages = 0;
+	bool bChannelMessage = false;
+
+	assert(nCount <= ShortMessageBatchSize);
+
+	if (m_pMIDIRecorder->IsRecording())
+		m_pMIDIRecorder->RecordShortMessages(pMessages, nCount);
+
+	for (size_t i = 0; i < nCount; ++i)
 	{
-		m_bActiveSenseFlag = true;
-		return;
+		const u32 nMessage = pMessages[i].nMessage;
+
+		// Active sensing
+		if (nMessage == 0xFE)
+		{
+			m_bActiveSenseFlag = true;
+			++nActiveSenseMessages;
+			continue;
+		}
+
+		if ((nMessage & 0xFF) < 0xF0)
+			bChannelMessage = true;
+
+		if (m_bMIDISampleAccurate)
+		{
+			// Defer to the audio task so that the message is played at the correct position within the next block;
+			// anything handled immediately before it must reach the synth first
+			if (m_pCurrentSynth->CanRenderWithMIDIMessage(nMessage))
+			{
+				if (nMessages)
+				{
+					m_pCurrentSynth->HandleMIDIEvents(Messages, nMessages);
+					nMessages = 0;
+				}
+
+				if (QueueMIDIEvent(pMessages[i]))
+					continue;
+			}
+
+			// Handled immediately; wait for everything deferred before it to be applied
+			WaitForMIDIEvents(0);
+		}
+
+		Messages[nMessages++] = pMessages[i];
 	}
 
 	// Flash LED for channel messages
-	if ((nMessage & 0xFF) < 0xF0)
+	if (bChannelMessage)
 		LEDOn();
 
-	m_pCurrentSynth->HandleMIDIShortMessage(nMessage);
+	// Messages handled immediately can be coalesced within the batch
+	if (m_bMIDICoalesceControllers)
+		nMessages = m_MIDICoalescer.Coalesce(Messages, nMessages);
+
+	if (nMessages)
+		m_pCurrentSynth->HandleMIDIEvents(Messages, nMessages);
 
 	// Wake from power saving mode if necessary
-	Awaken();
+	if (nActiveSenseMessages < nCount)
+		Awaken();
 }
 
 void CMT32Pi::OnSysExMessage(const u8* pData, size_t nSize)
@@ -674,24 +1012,125 @@ void CMT32Pi::OnSysExMessage(const u8* pData, size_t nSize)
 	// Flash LED
 	LEDOn();
 
-	// If we don't consume the SysEx message, forward it to the synthesizer
-	if (!ParseCustomSysEx(pData, nSize))
-		m_pCurrentSynth->HandleMIDISysExMessage(pData, nSize);
+	if (m_pMIDIRecorder->IsRecording())
+		m_pMIDIRecorder->RecordSysExMessage(pData, nSize, GetMessageTimestamp());
+
+	// Defer to the audio task so that the message is applied in order with deferred short messages
+	const bool bCustomSysEx = nSize >= 4 && pData[1] == 0x7D;
+	const bool bDeferred = m_bMIDISampleAccurate && !bCustomSysEx && m_pCurrentSynth->CanApplyMIDISysExMessage(pData, nSize) && QueueSysExEvent(SysExEventMessage, pData, nSize);
+
+	if (!bDeferred)
+	{
+		// Handled immediately; wait for everything deferred before it to be applied
+		if (m_bMIDISampleAccurate)
+			WaitForMIDIEvents(0);
+
+		// If we don't consume the SysEx message, forward it to the synthesizer
+		if (!ParseCustomSysEx(pData, nSize))
+			m_pCurrentSynth->HandleMIDISysExMessage(pData, nSize);
+	}
 
 	// Wake from power saving mode if necessary
 	Awaken();
 }
 
+void CMT32Pi::OnSysExChunk(TSysExChunk Chunk, const u8* pData, size_t nSize)
+{
+	// Flash LED
+	LEDOn();
+
+	if (m_pMIDIRecorder->IsRecording())
+		m_pMIDIRecorder->RecordSysExChunk(Chunk, pData, nSize, GetMessageTimestamp());
+
+	// Custom SysEx messages are small enough to always arrive whole; pass large ones on to the synthesizer.
+	// The path is chosen from the first chunk, and the rest of the message follows it.
+	if (Chunk == TSysExChunk::Begin)
+		m_bSysExChunksDeferred = m_bMIDISampleAccurate && m_pCurrentSynth->CanApplyMIDISysExMessage(pData, nSize);
+
+	if (m_bSysExChunksDeferred)
+	{
+		// The audio task has stopped; the synth drops the incomplete message
+		if (!QueueSysExEvent(static_cast<u32>(Chunk) + 1, pData, nSize))
+			LOGWARN("SysEx chunk dropped");
+	}
+	else
+	{
+		// Handled immediately; wait for everything deferred before it to be applied
+		if (m_bMIDISampleAccurate)
+			WaitForMIDIEvents(0);
+
+		m_pCurrentSynth->HandleMIDISysExChunk(Chunk, pData, nSize);
+	}
+
+	// Wake from power saving mode if necessary
+	Awaken();
+}
+
+bool CMT32Pi::QueueMIDIEvent(const TMIDIEvent& Event)
+{
+	// Wait for room rather than handling the message out of order
+	if (!m_MIDIEventQueue.Enqueue(Event) && (!WaitForMIDIEvents(MIDIEventQueueSize / 2) || !m_MIDIEventQueue.Enqueue(Event)))
+		return false;
+
+	++m_nMIDIEventsQueued;
+	return true;
+}
+
+bool CMT32Pi::QueueSysExEvent(u32 nKind, const u8* pData, size_t nSize)
+{
+	// The audio task applies the message from a buffer of this size
+	if (nSize > MaxSysExSize)
+		return false;
+
+	// The data goes in before the event that refers to it; make sure both fit first, so that data is never left in
+	// the queue without its event. Once everything queued earlier has been applied, both queues are empty.
+	const bool bRoom = m_SysExEventQueue.GetCount() + nSize < SysExEventQueueSize && m_MIDIEventQueue.GetCount() + 1 < MIDIEventQueueSize;
+	if (!bRoom && !WaitForMIDIEvents(0))
+		return false;
+
+	m_SysExEventQueue.Enqueue(pData, nSize);
+	m_MIDIEventQueue.Enqueue(TMIDIEvent{GetMessageTimestamp(), SysExEventStatus | nKind << 8 | static_cast<u32>(nSize) << 16, 0});
+
+	++m_nMIDIEventsQueued;
+	return true;
+}
+
+bool CMT32Pi::WaitForMIDIEvents(u32 nMaxPending)
+{
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
+
+	// Only this task adds to the queued count
+	u32 nApplied;
+	while (m_nMIDIEventsQueued - (nApplied = __atomic_load_n(&m_nMIDIEventsApplied, __ATOMIC_ACQUIRE)) > nMaxPending)
+	{
+		// The audio task hasn't applied anything since the last wait timed out (e.g. power saving); don't hold up
+		// every message for the full timeout while it is stopped
+		if (m_bMIDIEventWaitTimedOut && nApplied == m_nMIDIEventsAppliedAtTimeout)
+			return false;
+
+		if (CTimer::GetClockTicks() - nStartTicks >= m_nMIDIEventWaitMicros)
+		{
+			m_bMIDIEventWaitTimedOut = true;
+			m_nMIDIEventsAppliedAtTimeout = nApplied;
+			return false;
+		}
+
+		CTimer::SimpleusDelay(MIDIEventWaitRetryMicros);
+	}
+
+	return true;
+}
+
 void CMT32Pi::OnUnexpectedStatus()
 {
-	CMIDIParser::OnUnexpectedStatus();
+	CMIDIMerger::OnUnexpectedStatus();
 	if (m_pConfig->SystemVerbose)
 		LCDLog(TLCDLogType::Warning, "Unexp. MIDI status!");
 }
 
 void CMT32Pi::OnSysExOverflow()
 {
-	CMIDIParser::OnSysExOverflow();
+	CMIDIMerger::OnSysExOverflow();
 	LCDLog(TLCDLogType::Error, "SysEx overflow!");
 }
 
@@ -730,6 +1169,20 @@ bool CMT32Pi::ParseCustomSysEx(const u8* pData, size_t nSize)
 		return true;
 	}
 
+	// Query heap statistics (F0 7D 05 F7)
+	if (nSize == 4 && Command == TCustomSysExCommand::QueryHeapStats)
+	{
+		SendHeapStats();
+		return true;
+	}
+
+	// Query render load statistics (F0 7D 06 F7)
+	if (nSize == 4 && Command == TCustomSysExCommand::QueryRenderStats)
+	{
+		SendRenderStats();
+		return true;
+	}
+
 	if (nSize != 5)
 		return false;
 
@@ -765,11 +1218,149 @@ bool CMT32Pi::ParseCustomSysEx(const u8* pData, size_t nSize)
 			return true;
 		}
 
+		// Start/stop MIDI recording (F0 7D 07 xx F7)
+		case TCustomSysExCommand::SetMIDIRecording:
+		{
+			if (nParameter)
+				StartMIDIRecording();
+			else
+				StopMIDIRecording();
+			return true;
+		}
+
+		// Save MT-32 snapshot (F0 7D 08 xx F7)
+		case TCustomSysExCommand::SaveMT32Snapshot:
+			SaveMT32Snapshot(nParameter);
+			return true;
+
+		// Restore MT-32 snapshot (F0 7D 09 xx F7)
+		case TCustomSysExCommand::LoadMT32Snapshot:
+			RestoreMT32Snapshot(nParameter);
+			return true;
+
 		default:
 			return false;
 	}
 }
 
+void CMT32Pi::SendHeapStats()
+{
+	const CZoneAllocator* pAllocator = CZoneAllocator::Get();
+	CZoneAllocator::TStats Stats;
+	pAllocator->GetStats(Stats);
+	pAllocator->DumpStats();
+
+	const size_t nPercentUsed = (Stats.nBytesInUse / KILOBYTE) * 100 / (Stats.nHeapSize / KILOBYTE);
+	LCDLog(TLCDLogType::Notice, "Heap: %d%% used", nPercentUsed);
+
+	u32 Values[5 + (CZoneAllocator::TagCount - 1) * 4 + CZoneAllocator::HistogramBuckets];
+	u32* pValue = Values;
+
+	*pValue++ = Stats.nHeapSize;
+	*pValue++ = Stats.nBytesInUse;
+	*pValue++ = Stats.nPeakBytes;
+	*pValue++ = Stats.nLargestFreeBlock;
+	*pValue++ = Stats.nFragmentation;
+
+	for (size_t i = TZoneTag::Uncategorized; i < CZoneAllocator::TagCount; ++i)
+	{
+		*pValue++ = Stats.Tags[i].nBytesInUse;
+		*pValue++ = Stats.Tags[i].nPeakBytes;
+		*pValue++ = Stats.Tags[i].nAllocs;
+		*pValue++ = Stats.Tags[i].nFrees;
+	}
+
+	for (size_t i = 0; i < CZoneAllocator::HistogramBuckets; ++i)
+		*pValue++ = Stats.Histogram[i];
+
+	SendCustomSysExReply(static_cast<u8>(TCustomSysExCommand::QueryHeapStats), Values, Utility::ArraySize(Values));
+}
+
+void CMT32Pi::SendRenderStats()
+{
+	constexpr const char* SynthNames[] = {"MT-32", "SoundFont", "Layered"};
+
+	u32 Values[CRenderProfiler::SynthCount * 10 + 6];
+	u32* pValue = Values;
+
+	for (size_t i = 0; i < CRenderProfiler::SynthCount; ++i)
+	{
+		CRenderProfiler::TStats Stats;
+		m_RenderProfiler.GetStats(static_cast<TSynth>(i), Stats);
+
+		if (Stats.nBlocks)
+		{
+			LOGNOTE("%s: %d blocks, budget %dus, render min/avg/max %d/%d/%dus", SynthNames[i], Stats.nBlocks, Stats.nDeadlineMicros, Stats.nMinMicros, Stats.nAvgMicros, Stats.nMaxMicros);
+			LOGNOTE("%s: load avg/p99/max %d/%d/%d%%, %d underruns, %d near misses", SynthNames[i], Stats.nAvgLoad, Stats.nP99Load, Stats.nMaxLoad, Stats.nUnderruns, Stats.nNearMisses);
+		}
+
+		*pValue++ = Stats.nBlocks;
+		*pValue++ = Stats.nDeadlineMicros;
+		*pValue++ = Stats.nMinMicros;
+		*pValue++ = Stats.nAvgMicros;
+		*pValue++ = Stats.nMaxMicros;
+		*pValue++ = Stats.nAvgLoad;
+		*pValue++ = Stats.nP99Load;
+		*pValue++ = Stats.nMaxLoad;
+		*pValue++ = Stats.nUnderruns;
+		*pValue++ = Stats.nNearMisses;
+	}
+
+	if (m_bMIDICoalesceControllers)
+		LOGNOTE("Coalescing: %d of %d MIDI messages dropped", m_MIDICoalescer.GetFoldedCount(), m_MIDICoalescer.GetMessageCount());
+
+	if (m_pMT32Synth && m_pConfig->MT32EmuSkipRedundantSysEx)
+	{
+		const CMT32SysExCache& SysExCache = m_pMT32Synth->GetSysExCache();
+		LOGNOTE("SysEx cache: %d hits, %d misses, %d bytes skipped", SysExCache.GetHitCount(), SysExCache.GetMissCount(), SysExCache.GetSkippedBytes());
+	}
+
+	CMT32Synth::TMIDIQueueStats QueueStats{};
+	if (m_pMT32Synth)
+	{
+		m_pMT32Synth->GetMIDIQueueStats(QueueStats);
+		LOGNOTE("MT-32 MIDI queue: size %d, peak depth %d, %d stalls (total/max %d/%dus), %d dropped", QueueStats.nSize, QueueStats.nPeakDepth, QueueStats.nStalls, QueueStats.nStallMicros, QueueStats.nMaxStallMicros, QueueStats.nDropped);
+	}
+
+	*pValue++ = QueueStats.nSize;
+	*pValue++ = QueueStats.nPeakDepth;
+	*pValue++ = QueueStats.nStalls;
+	*pValue++ = QueueStats.nStallMicros;
+	*pValue++ = QueueStats.nMaxStallMicros;
+	*pValue++ = QueueStats.nDropped;
+
+	LCDLog(TLCDLogType::Notice, "Render load: %d%%", m_RenderProfiler.GetLoad());
+
+	SendCustomSysExReply(static_cast<u8>(TCustomSysExCommand::QueryRenderStats), Values, Utility::ArraySize(Values));
+}
+
+void CMT32Pi::SendCustomSysExReply(u8 nCommand, const u32* pValues, size_t nValues)
+{
+	// Replies are only possible via the GPIO MIDI out
+	if (!m_bSerialMIDIEnabled)
+		return;
+
+	// F0 7D <command> <values> F7, with each value sent as five 7-bit bytes, most significant first
+	const size_t nReplySize = 3 + nValues * 5 + 1;
+	u8 Reply[nReplySize];
+	u8* pOut = Reply;
+
+	*pOut++ = 0xF0;
+	*pOut++ = 0x7D;
+	*pOut++ = nCommand;
+
+	for (size_t i = 0; i < nValues; ++i)
+	{
+		for (int nShift = 28; nShift >= 0; nShift -= 7)
+			*pOut++ = (pValues[i] >> nShift) & 0x7F;
+	}
+
+	*pOut = 0xF7;
+
+	if (m_pSerial->Write(Reply, nReplySize) != static_cast<int>(nReplySize))
+		LOGERR("Failed to send SysEx reply");
+}
+
 void CMT32Pi::UpdateUSB(bool bStartup)
 {
 	if (!m_bUSBAvailable || !m_pUSBHCI->UpdatePlugAndPlay())
@@ -792,7 +1383,10 @@ void CMT32Pi::UpdateUSB(bool bStartup)
 			{
 				LCDLog(TLCDLogType::Spinner, "MT-32 ROM rescan");
 				if (m_pMT32Synth)
+				{
 					m_pMT32Synth->GetROMManager().ScanROMs();
+					m_pMT32Synth->SetPreloadROMSets(m_pConfig->MT32EmuPreloadROMSets.nMask);
+				}
 				else
 					InitMT32Synth();
 
@@ -804,6 +1398,8 @@ void CMT32Pi::UpdateUSB(bool bStartup)
 
 				if (m_pSoundFontSynth)
 					LCDLog(TLCDLogType::Notice, "%d SoundFonts avail", m_pSoundFontSynth->GetSoundFontManager().GetSoundFontCount());
+
+				m_pSMFPlayer->ScanFiles();
 			}
 		}
 	}
@@ -821,6 +1417,9 @@ void CMT32Pi::UpdateUSB(bool bStartup)
 			m_pSoundFontSynth->GetSoundFontManager().ScanSoundFonts();
 			LCDLog(TLCDLogType::Notice, "%d SoundFonts avail", m_pSoundFontSynth->GetSoundFontManager().GetSoundFontCount());
 		}
+
+		// A file that's already loaded keeps playing from memory
+		m_pSMFPlayer->ScanFiles();
 	}
 	m_pUSBMassStorageDevice = pUSBMassStorageDevice;
 
@@ -912,44 +1511,133 @@ void CMT32Pi::UpdateNetwork()
 
 void CMT32Pi::UpdateMIDI()
 {
-	size_t nBytes;
-	u8 Buffer[MIDIRxBufferSize];
+	size_t nBytes = 0;
 
 	// Read MIDI messages from serial device or ring buffer
-	if (m_bSerialMIDIEnabled)
-		nBytes = ReceiveSerialMIDI(Buffer, sizeof(Buffer));
-	else if (m_pUSBSerialDevice)
+	if (m_bSerialMIDIEnabled || m_pUSBSerialDevice)
 	{
-		const int nResult = m_pUSBSerialDevice->Read(Buffer, sizeof(Buffer));
-		nBytes = nResult > 0 ? static_cast<size_t>(nResult) : 0;
+		const TMIDISource Source = m_bSerialMIDIEnabled ? TMIDISource::Serial : TMIDISource::USB;
+		u8 Buffer[MIDIRxSliceSize];
+		size_t nSliceBytes;
+
+		do
+		{
+			if (m_bSerialMIDIEnabled)
+				nSliceBytes = ReceiveSerialMIDI(Buffer, sizeof(Buffer));
+			else
+			{
+				const int nResult = m_pUSBSerialDevice->Read(Buffer, sizeof(Buffer));
+				nSliceBytes = nResult > 0 ? static_cast<size_t>(nResult) : 0;
+			}
+
+			ParseMIDIFromSource(Source, Buffer, nSliceBytes, CTimer::GetClockTicks());
+			nBytes += nSliceBytes;
+		} while (nSliceBytes == sizeof(Buffer) && nBytes < MIDIRxBufferSize);
 	}
 	else
-		nBytes = m_MIDIRxBuffer.Dequeue(Buffer, sizeof(Buffer));
+		nBytes = ParseRxBufferMIDI() + ParseUSBMIDIPackets();
+
+	// Interleave the messages from each source
+	DispatchMIDIMessages();
 
 	if (nBytes == 0)
 		return;
 
-	// Process MIDI messages
-	ParseMIDIBytes(Buffer, nBytes);
-
 	// Reset the Active Sense timer
 	s_pThis->m_nActiveSenseTime = s_pThis->m_pTimer->GetTicks();
 }
 
-void CMT32Pi::PurgeMIDIBuffers()
+size_t CMT32Pi::ParseRxBufferMIDI()
 {
-	size_t nBytes;
-	u8 Buffer[MIDIRxBufferSize];
+	TMIDIRxByte RxBuffer[MIDIRxSliceSize];
+	u8 Buffer[MIDIRxSliceSize];
+	size_t nRxBytes = 0;
+	size_t nSliceBytes;
+
+	do
+	{
+		nSliceBytes = m_MIDIRxBuffer.Dequeue(RxBuffer, MIDIRxSliceSize);
+		size_t i = 0;
+
+		// Parse runs of bytes that arrived together from the same source with their arrival timestamp
+		while (i < nSliceBytes)
+		{
+			size_t nBytes = 0;
+			const u32 nTimestamp = RxBuffer[i].nTimestamp;
+			const u8 nSource     = RxBuffer[i].nSource;
+
+			while (i < nSliceBytes && RxBuffer[i].nTimestamp == nTimestamp && RxBuffer[i].nSource == nSource)
+				Buffer[nBytes++] = RxBuffer[i++].nByte;
 
-	// Process MIDI messages from all devices/ring buffers, but ignore note-ons
-	while (m_bSerialMIDIEnabled && (nBytes = ReceiveSerialMIDI(Buffer, sizeof(Buffer))) > 0)
-		ParseMIDIBytes(Buffer, nBytes, true);
+			ParseMIDIFromSource(static_cast<TMIDISource>(nSource), Buffer, nBytes, nTimestamp);
+		}
 
-	while (m_pUSBSerialDevice && (nBytes = m_pUSBSerialDevice->Read(Buffer, sizeof(Buffer))) > 0)
-		ParseMIDIBytes(Buffer, nBytes, true);
+		nRxBytes += nSliceBytes;
+	} while (nSliceBytes == MIDIRxSliceSize && nRxBytes < MIDIRxBufferSize);
 
-	while ((nBytes = m_MIDIRxBuffer.Dequeue(Buffer, sizeof(Buffer))) > 0)
-		ParseMIDIBytes(Buffer, nBytes, true);
+	return nRxBytes;
+}
+
+size_t CMT32Pi::ParseUSBMIDIPackets()
+{
+	TUSBMIDIPacket Packets[MIDIRxSliceSize];
+	u8 Buffer[MIDIRxSliceSize * sizeof(TUSBMIDIPacket::Data)];
+	size_t nPackets = 0;
+	size_t nSlicePackets;
+
+	do
+	{
+		nSlicePackets = m_USBMIDIPacketBuffer.Dequeue(Packets, MIDIRxSliceSize);
+		size_t nBytes = 0;
+		u32 nTimestamp = 0;
+		u8 nCable = 0;
+
+		for (size_t i = 0; i < nSlicePackets; ++i)
+		{
+			const TUSBMIDIPacket& Packet = Packets[i];
+			const bool bShortMessage     = CMIDIParser::GetShortMessageLength(Packet.Data[0]) == Packet.nLength;
+
+			// Parse the SysEx data gathered so far before anything that can't be appended to it
+			if (nBytes && (bShortMessage || Packet.nTimestamp != nTimestamp || Packet.nCable != nCable))
+			{
+				ParseMIDIFromSource(TMIDISource::USB, Buffer, nBytes, nTimestamp, nCable);
+				nBytes = 0;
+			}
+
+			if (bShortMessage)
+			{
+				// The source's queue is full; drain all sources to make room rather than dropping data
+				while (!EnqueueShortMessage(TMIDISource::USB, Packet.Data, Packet.nLength, Packet.nTimestamp, Packet.nCable))
+					DispatchMIDIMessages();
+
+				continue;
+			}
+
+			nTimestamp = Packet.nTimestamp;
+			nCable     = Packet.nCable;
+			memcpy(Buffer + nBytes, Packet.Data, Packet.nLength);
+			nBytes += Packet.nLength;
+		}
+
+		if (nBytes)
+			ParseMIDIFromSource(TMIDISource::USB, Buffer, nBytes, nTimestamp, nCable);
+
+		nPackets += nSlicePackets;
+	} while (nSlicePackets == MIDIRxSliceSize && nPackets < USBMIDIPacketBufferSize);
+
+	return nPackets;
+}
+
+void CMT32Pi::ParseMIDIFromSource(TMIDISource Source, const u8* pData, size_t nSize, u32 nTimestamp, u8 nCable)
+{
+	size_t nParsed = ParseMIDIBytes(Source, pData, nSize, nTimestamp, nCable);
+
+	// The source's queue is full; drain all sources to make room rather than dropping data
+	while (nParsed < nSize)
+	{
+		DispatchMIDIMessages();
+		nParsed += ParseMIDIBytes(Source, pData + nParsed, nSize - nParsed, nTimestamp, nCable);
+	}
 }
 
 size_t CMT32Pi::ReceiveSerialMIDI(u8* pOutData, size_t nSize)
@@ -1045,6 +1733,10 @@ void CMT32Pi::ProcessEventQueue()
 					m_pSoundFontSynth->AllSoundOff();
 				break;
 
+			case TEventType::SMFPlayer:
+				ProcessSMFPlayerEvent(Event.SMFPlayer);
+				break;
+
 			case TEventType::DisplayImage:
 				m_UserInterface.DisplayImage(Event.DisplayImage.Image);
 				break;
@@ -1058,15 +1750,79 @@ void CMT32Pi::ProcessEventQueue()
 
 void CMT32Pi::ProcessButtonEvent(const TButtonEvent& Event)
 {
+	// Keep track of held buttons for combinations
+	const u8 nButtonMask = 1 << Event.Button;
+	const u8 nChordMask = 1 << TButton::Button3 | 1 << TButton::Button4;
+	if (Event.bPressed)
+		m_nHeldButtons |= nButtonMask;
+	else
+		m_nHeldButtons &= ~nButtonMask;
+
 	if (Event.Button == TButton::EncoderButton)
 	{
-		LCDLog(TLCDLogType::Notice, "Enc. button %s", Event.bPressed ? "PRESSED" : "RELEASED");
+		// Start/stop MIDI file playback
+		if (Event.bPressed && !Event.bRepeat)
+			ProcessSMFPlayerEvent(TSMFPlayerEvent{TSMFPlayerCommand::PlayStop});
+		return;
+	}
+
+	// Holding buttons 3 and 4 together turns buttons 1 and 2 into MIDI recorder and MT-32 snapshot controls; the chord
+	// lasts until both are released
+	if (m_bButtonChord)
+	{
+		if ((m_nHeldButtons & nChordMask) == 0)
+			m_bButtonChord = false;
+		else if (Event.Button == TButton::Button1)
+		{
+			// Release before the button repeats to restore the snapshot in slot 0, hold to save it
+			if (Event.bPressed && !Event.bRepeat)
+				m_bButtonChordSnapshotPending = true;
+			else if (m_bButtonChordSnapshotPending)
+			{
+				if (Event.bRepeat)
+					SaveMT32Snapshot(0);
+				else
+					RestoreMT32Snapshot(0);
+
+				m_bButtonChordSnapshotPending = false;
+			}
+		}
+		else if (Event.Button == TButton::Button2 && Event.bPressed && !Event.bRepeat)
+		{
+			if (m_pMIDIRecorder->IsRecording())
+				StopMIDIRecording();
+			else
+				StartMIDIRecording();
+		}
+
+		return;
+	}
+
+	// A seek held back by the press below happens when the button is released or starts repeating, unless the chord
+	// was made in the meantime
+	if (m_bButtonSeekPending && (Event.Button == TButton::Button3 || Event.Button == TButton::Button4) && (!Event.bPressed || Event.bRepeat))
+	{
+		m_bButtonSeekPending = false;
+		ProcessSMFPlayerEvent(TSMFPlayerEvent{Event.Button == TButton::Button3 ? TSMFPlayerCommand::SeekBackward : TSMFPlayerCommand::SeekForward});
 		return;
 	}
 
 	if (!Event.bPressed)
 		return;
 
+	if ((m_nHeldButtons & nChordMask) == nChordMask && !Event.bRepeat)
+	{
+		// Undo the volume change made by the first button of the chord, and drop its seek
+		SetMasterVolume(m_nButtonChordVolume);
+		m_bButtonChord = true;
+		m_bButtonChordSnapshotPending = false;
+		m_bButtonSeekPending = false;
+		return;
+	}
+
+	if ((Event.Button == TButton::Button3 || Event.Button == TButton::Button4) && !Event.bRepeat)
+		m_nButtonChordVolume = m_nMasterVolume;
+
 	if (Event.Button == TButton::Button1 && !Event.bRepeat)
 	{
 		// Swap synths
@@ -1074,8 +1830,29 @@ void CMT32Pi::ProcessButtonEvent(const TButtonEvent& Event)
 			SwitchSynth(TSynth::SoundFont);
 		else
 			SwitchSynth(TSynth::MT32);
+		return;
 	}
-	else if (Event.Button == TButton::Button2 && !Event.bRepeat)
+
+	// Buttons 2-4 control the MIDI file player while it's playing
+	if (m_pSMFPlayer->IsPlaying())
+	{
+		if (Event.Button == TButton::Button2 && !Event.bRepeat)
+		{
+			ProcessSMFPlayerEvent(TSMFPlayerEvent{TSMFPlayerCommand::NextFile});
+			return;
+		}
+		else if (Event.Button == TButton::Button3 || Event.Button == TButton::Button4)
+		{
+			// Hold back the first seek in case this is the start of the chord
+			if (!Event.bRepeat)
+				m_bButtonSeekPending = true;
+			else
+				ProcessSMFPlayerEvent(TSMFPlayerEvent{Event.Button == TButton::Button3 ? TSMFPlayerCommand::SeekBackward : TSMFPlayerCommand::SeekForward});
+			return;
+		}
+	}
+
+	if (Event.Button == TButton::Button2 && !Event.bRepeat)
 	{
 		if (m_pCurrentSynth == m_pMT32Synth)
 			NextMT32ROMSet();
@@ -1115,6 +1892,166 @@ void CMT32Pi::ProcessButtonEvent(const TButtonEvent& Event)
 	}
 }
 
+void CMT32Pi::ProcessSMFPlayerEvent(const TSMFPlayerEvent& Event)
+{
+	switch (Event.Command)
+	{
+		case TSMFPlayerCommand::PlayStop:
+			if (m_pSMFPlayer->IsPlaying())
+				StopMIDIFile();
+			else
+				PlayMIDIFile(m_pSMFPlayer->GetFileIndex());
+			break;
+
+		case TSMFPlayerCommand::NextFile:
+			PlayMIDIFile(m_pSMFPlayer->GetFileIndex() + 1);
+			break;
+
+		case TSMFPlayerCommand::SeekBackward:
+		case TSMFPlayerCommand::SeekForward:
+		{
+			if (!m_pSMFPlayer->IsPlaying())
+				break;
+
+			const unsigned int nPosition = m_pSMFPlayer->GetPositionMillis();
+			unsigned int nNewPosition;
+			if (Event.Command == TSMFPlayerCommand::SeekForward)
+				nNewPosition = nPosition + MIDIFileSeekStepMillis;
+			else
+				nNewPosition = nPosition > MIDIFileSeekStepMillis ? nPosition - MIDIFileSeekStepMillis : 0;
+
+			m_pSMFPlayer->Seek(nNewPosition, *m_pCurrentSynth);
+
+			const unsigned int nSeconds = m_pSMFPlayer->GetPositionMillis() / 1000;
+			LCDLog(TLCDLogType::Notice, "Seek: %d:%02d", nSeconds / 60, nSeconds % 60);
+			break;
+		}
+	}
+}
+
+void CMT32Pi::PlayMIDIFile(size_t nIndex)
+{
+	const size_t nFiles = m_pSMFPlayer->GetFileCount();
+	if (!nFiles)
+	{
+		LCDLog(TLCDLogType::Error, "No MIDI files!");
+		return;
+	}
+
+	nIndex %= nFiles;
+	m_pCurrentSynth->AllSoundOff();
+
+	LCDLog(TLCDLogType::Spinner, "Loading MIDI file");
+	if (!m_pSMFPlayer->Load(nIndex))
+	{
+		LCDLog(TLCDLogType::Error, "MIDI file error!");
+		return;
+	}
+
+	m_pSMFPlayer->Play();
+	LOGNOTE("Playing '%s'", m_pSMFPlayer->GetFileName(nIndex));
+	LCDLog(TLCDLogType::Notice, "%s", m_pSMFPlayer->GetFileName(nIndex));
+}
+
+void CMT32Pi::StopMIDIFile()
+{
+	m_pSMFPlayer->Stop();
+	m_pCurrentSynth->AllSoundOff();
+	LCDLog(TLCDLogType::Notice, "Playback stopped");
+}
+
+void CMT32Pi::UpdateSMFPlayer()
+{
+	m_pSMFPlayer->Update(*m_pCurrentSynth);
+
+	if (!m_pSMFPlayer->IsFinished())
+		return;
+
+	if (m_pConfig->PlayerLoop)
+		PlayMIDIFile(m_pSMFPlayer->GetFileIndex() + 1);
+	else
+	{
+		m_pSMFPlayer->Stop();
+		LCDLog(TLCDLogType::Notice, "Playback finished");
+	}
+}
+
+void CMT32Pi::StartMIDIRecording()
+{
+	// Prefer a USB disk if one is attached
+	const char* pDisk = m_pUSBMassStorageDevice ? "USB" : "SD";
+
+	if (!m_pMIDIRecorder->Start(pDisk))
+	{
+		LCDLog(TLCDLogType::Warning, "Recorder busy!");
+		return;
+	}
+
+	LOGNOTE("MIDI recording started");
+	LCDLog(TLCDLogType::Notice, "Recording MIDI");
+}
+
+void CMT32Pi::StopMIDIRecording()
+{
+	if (!m_pMIDIRecorder->IsRecording())
+		return;
+
+	m_pMIDIRecorder->Stop();
+
+	const size_t nDropped = m_pMIDIRecorder->GetDroppedCount();
+	if (nDropped)
+		LOGWARN("%d MIDI messages were dropped from the recording", nDropped);
+
+	LCDLog(TLCDLogType::Notice, "Recording stopped");
+}
+
+void CMT32Pi::UpdateMIDIRecorder()
+{
+	m_pMIDIRecorder->Update();
+
+	if (m_pMIDIRecorder->GetState() == CMIDIRecorder::TState::Failed)
+	{
+		m_pMIDIRecorder->Reset();
+		LCDLog(TLCDLogType::Error, "Recording failed!");
+	}
+}
+
+void CMT32Pi::SaveMT32Snapshot(u8 nSlot)
+{
+	if (!m_pMT32Synth)
+		return;
+
+	m_pMT32Synth->CaptureSnapshot(*m_pMT32Snapshot);
+
+	if (m_pMT32Snapshot->Save(nSlot))
+		LCDLog(TLCDLogType::Notice, "Saved snapshot %d", nSlot);
+	else
+		LCDLog(TLCDLogType::Error, "Snapshot save failed!");
+}
+
+void CMT32Pi::RestoreMT32Snapshot(u8 nSlot)
+{
+	if (!m_pMT32Synth)
+		return;
+
+	// Read the whole file first so that the synth is only held up by the restore itself
+	if (!m_pMT32Snapshot->Load(nSlot))
+	{
+		LCDLog(TLCDLogType::Error, "No snapshot %d!", nSlot);
+		return;
+	}
+
+	if (m_pMT32Snapshot->GetROMSet() != m_pMT32Synth->GetROMSet())
+		LOGWARN("Snapshot %d was saved with a different ROM set", nSlot);
+
+	const unsigned nRestoreMicros = m_pMT32Synth->RestoreSnapshot(*m_pMT32Snapshot);
+
+	// Compare with the time it takes to play one audio chunk (chunk size is in samples, 2 per frame)
+	const unsigned nChunkMicros = static_cast<u64>(m_pConfig->AudioChunkSize / 2) * 1000000 / m_pConfig->AudioSampleRate;
+	LOGNOTE("Restored snapshot %d in %dus (audio chunk: %dus)", nSlot, nRestoreMicros, nChunkMicros);
+	LCDLog(TLCDLogType::Notice, "Snapshot %d: %dus", nSlot, nRestoreMicros);
+}
+
 void CMT32Pi::SwitchSynth(TSynth NewSynth)
 {
 	CSynthBase* pNewSynth = nullptr;
@@ -1123,6 +2060,8 @@ void CMT32Pi::SwitchSynth(TSynth NewSynth)
 		pNewSynth = m_pMT32Synth;
 	else if (NewSynth == TSynth::SoundFont)
 		pNewSynth = m_pSoundFontSynth;
+	else if (NewSynth == TSynth::Layered)
+		pNewSynth = m_pLayeredSynth;
 
 	if (pNewSynth == nullptr)
 	{
@@ -1138,7 +2077,7 @@ void CMT32Pi::SwitchSynth(TSynth NewSynth)
 
 	m_pCurrentSynth->AllSoundOff();
 	m_pCurrentSynth = pNewSynth;
-	const char* pMode = NewSynth == TSynth::MT32 ? "MT-32 mode" : "SoundFont mode";
+	const char* pMode = NewSynth == TSynth::MT32 ? "MT-32 mode" : NewSynth == TSynth::SoundFont ? "SoundFont mode" : "Layered mode";
 	LOGNOTE("Switching to %s", pMode);
 	LCDLog(TLCDLogType::Notice, pMode);
 }
@@ -1169,15 +2108,9 @@ void CMT32Pi::SwitchSoundFont(size_t nIndex)
 	if (m_pSoundFontSynth == nullptr)
 		return;
 
+	// Loads in the background; completion is handled by UpdateSoundFontSwitch()
 	LOGNOTE("Switching to SoundFont %d", nIndex);
-	if (m_pSoundFontSynth->SwitchSoundFont(nIndex))
-	{
-		// Handle any MIDI data that has been queued up while busy
-		PurgeMIDIBuffers();
-
-		if (m_pCurrentSynth == m_pSoundFontSynth)
-			m_pSoundFontSynth->ReportStatus();
-	}
+	m_pSoundFontSynth->SwitchSoundFont(nIndex);
 }
 
 void CMT32Pi::DeferSwitchSoundFont(size_t nIndex)
@@ -1272,18 +2205,52 @@ void CMT32Pi::USBMIDIDeviceRemovedHandler(CDevice* pDevice, void* pContext)
 	}
 }
 
-// The following handlers are called from interrupt context, enqueue into ring buffer for main thread
+// The following handlers are called from interrupt context, enqueue into ring buffers for main thread
+// Each ring buffer is filled by a single handler, so each has a single producer
 void CMT32Pi::USBMIDIPacketHandler(unsigned nCable, u8* pPacket, unsigned nLength)
 {
-	IRQMIDIReceiveHandler(pPacket, nLength);
+	assert(s_pThis != nullptr);
+
+	// Circle passes the MIDI bytes of each event packet with the length given by its Code Index Number
+	if (nLength == 0 || nLength > sizeof(TUSBMIDIPacket::Data))
+		return;
+
+	TUSBMIDIPacket Packet{CTimer::GetClockTicks(), static_cast<u8>(nCable), static_cast<u8>(nLength), {0}};
+	memcpy(Packet.Data, pPacket, nLength);
+
+	if (!s_pThis->m_USBMIDIPacketBuffer.Enqueue(Packet))
+	{
+		static const char* pErrorString = "MIDI overrun error!";
+		LOGWARN(pErrorString);
+		s_pThis->LCDLog(TLCDLogType::Error, pErrorString);
+	}
+}
+
+void CMT32Pi::PisoundMIDIReceiveHandler(const u8* pData, size_t nSize)
+{
+	IRQMIDIReceiveHandler(TMIDISource::Pisound, pData, nSize);
 }
 
-void CMT32Pi::IRQMIDIReceiveHandler(const u8* pData, size_t nSize)
+void CMT32Pi::IRQMIDIReceiveHandler(TMIDISource Source, const u8* pData, size_t nSize)
 {
 	assert(s_pThis != nullptr);
 
-	// Enqueue data into ring buffer
-	if (s_pThis->m_MIDIRxBuffer.Enqueue(pData, nSize) != nSize)
+	constexpr size_t ChunkSize = 64;
+	const u32 nTimestamp = CTimer::GetClockTicks();
+	TMIDIRxByte RxBytes[ChunkSize];
+	size_t nEnqueued = 0;
+
+	// Stamp each byte with its arrival time and enqueue data into ring buffer
+	for (size_t nOffset = 0; nOffset < nSize; nOffset += ChunkSize)
+	{
+		const size_t nChunkSize = Utility::Min(nSize - nOffset, ChunkSize);
+		for (size_t i = 0; i < nChunkSize; ++i)
+			RxBytes[i] = TMIDIRxByte{nTimestamp, pData[nOffset + i], static_cast<u8>(Source)};
+
+		nEnqueued += s_pThis->m_MIDIRxBuffer.Enqueue(RxBytes, nChunkSize);
+	}
+
+	if (nEnqueued != nSize)
 	{
 		static const char* pErrorString = "MIDI overrun error!";
 		LOGWARN(pErrorString);
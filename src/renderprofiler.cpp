@@ -0,0 +1,131 @@
+//
+// renderprofiler.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/util.h>
+
+#include "renderprofiler.h"
+#include "utility.h"
+
+// Statistics are plain counters with a single writer; readers may see a block's update partially applied
+template <class T>
+inline void Store(T& Dest, T Value)
+{
+	__atomic_store_n(&Dest, Value, __ATOMIC_RELAXED);
+}
+
+template <class T>
+inline T Load(const T& Src)
+{
+	return __atomic_load_n(&Src, __ATOMIC_RELAXED);
+}
+
+CRenderProfiler::CRenderProfiler()
+	: m_Profiles{},
+	  m_nSmoothedLoad(0),
+	  m_bResetRequested(false)
+{
+	for (TSynthProfile& Profile : m_Profiles)
+		Profile.nMinMicros = 0xFFFFFFFF;
+}
+
+void CRenderProfiler::Record(TSynth Synth, u32 nRenderMicros, u32 nDeadlineMicros)
+{
+	if (!nDeadlineMicros)
+		return;
+
+	if (__atomic_load_n(&m_bResetRequested, __ATOMIC_ACQUIRE))
+	{
+		for (TSynthProfile& Profile : m_Profiles)
+		{
+			memset(&Profile, 0, sizeof(Profile));
+			Profile.nMinMicros = 0xFFFFFFFF;
+		}
+		__atomic_store_n(&m_bResetRequested, false, __ATOMIC_RELEASE);
+	}
+
+	TSynthProfile& Profile = m_Profiles[static_cast<size_t>(Synth)];
+	const u32 nLoad        = static_cast<u64>(nRenderMicros) * 100 / nDeadlineMicros;
+
+	Store(Profile.nBlocks, Profile.nBlocks + 1);
+	Store(Profile.nMinMicros, Utility::Min(Profile.nMinMicros, nRenderMicros));
+	Store(Profile.nMaxMicros, Utility::Max(Profile.nMaxMicros, nRenderMicros));
+	Store(Profile.nMaxLoad, Utility::Max(Profile.nMaxLoad, nLoad));
+	Store(Profile.nDeadlineMicros, nDeadlineMicros);
+	Store(Profile.nTotalMicros, Profile.nTotalMicros + nRenderMicros);
+	Store(Profile.nTotalDeadlineMicros, Profile.nTotalDeadlineMicros + nDeadlineMicros);
+
+	if (nRenderMicros > nDeadlineMicros)
+		Store(Profile.nUnderruns, Profile.nUnderruns + 1);
+	else if (nLoad >= NearMissPercent)
+		Store(Profile.nNearMisses, Profile.nNearMisses + 1);
+
+	u32& nBucket = Profile.Histogram[Utility::Min<u32>(nLoad, HistogramBuckets - 1)];
+	Store(nBucket, nBucket + 1);
+
+	// Exponential moving average over roughly the last 16 blocks, for display
+	Store(m_nSmoothedLoad, (m_nSmoothedLoad * 15 + nLoad) / 16);
+}
+
+void CRenderProfiler::GetStats(TSynth Synth, TStats& Stats) const
+{
+	const TSynthProfile& Profile = m_Profiles[static_cast<size_t>(Synth)];
+
+	Stats.nBlocks         = Load(Profile.nBlocks);
+	Stats.nMinMicros      = Stats.nBlocks ? Load(Profile.nMinMicros) : 0;
+	Stats.nMaxMicros      = Load(Profile.nMaxMicros);
+	Stats.nMaxLoad        = Load(Profile.nMaxLoad);
+	Stats.nDeadlineMicros = Load(Profile.nDeadlineMicros);
+	Stats.nUnderruns      = Load(Profile.nUnderruns);
+	Stats.nNearMisses     = Load(Profile.nNearMisses);
+
+	const u64 nTotalMicros         = Load(Profile.nTotalMicros);
+	const u64 nTotalDeadlineMicros = Load(Profile.nTotalDeadlineMicros);
+	Stats.nAvgMicros               = Stats.nBlocks ? nTotalMicros / Stats.nBlocks : 0;
+	Stats.nAvgLoad                 = nTotalDeadlineMicros ? nTotalMicros * 100 / nTotalDeadlineMicros : 0;
+
+	// Walk the histogram down from the top until 1% of blocks have been passed
+	u32 nHistogramTotal = 0;
+	for (size_t i = 0; i < HistogramBuckets; ++i)
+		nHistogramTotal += Load(Profile.Histogram[i]);
+
+	const u32 nThreshold = nHistogramTotal / 100;
+	u32 nCount           = 0;
+	Stats.nP99Load       = 0;
+	for (size_t i = HistogramBuckets; i-- > 0;)
+	{
+		nCount += Load(Profile.Histogram[i]);
+		if (nCount > nThreshold)
+		{
+			Stats.nP99Load = i;
+			break;
+		}
+	}
+}
+
+u32 CRenderProfiler::GetTotalUnderruns() const
+{
+	u32 nUnderruns = 0;
+	for (const TSynthProfile& Profile : m_Profiles)
+		nUnderruns += Load(Profile.nUnderruns);
+
+	return nUnderruns;
+}
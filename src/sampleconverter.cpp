@@ -0,0 +1,211 @@
+//
+// sampleconverter.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SAMPLECONVERTER_NEON
+#endif
+
+#include "sampleconverter.h"
+#include "utility.h"
+
+constexpr float SampleMax = (1 << 23) - 1;
+
+// When dithering, samples are converted with 8 extra fractional bits so that sub-LSB dither can be added in the integer domain;
+// this keeps the vector and scalar paths bit-exact regardless of floating point contraction
+constexpr u32 DitherFractionalBits = 8;
+constexpr float DitherSampleMax    = SampleMax * (1 << DitherFractionalBits);
+
+// Fast xorshift PRNG; quality is more than sufficient for dither
+inline u32 NextDitherState(u32 nState)
+{
+	nState ^= nState << 13;
+	nState ^= nState >> 17;
+	nState ^= nState << 5;
+	return nState;
+}
+
+// Sum of two uniform 8-bit values gives triangular distribution in the range (-1, 1) LSB
+inline s32 GetDitherValue(u32 nState)
+{
+	return static_cast<s32>(((nState >> 16) & 0xFF) + (nState >> 24)) - 255;
+}
+
+template <bool bDither>
+inline s32 ConvertSample(float nSample, u32& nDitherState)
+{
+	nSample = Utility::Clamp(nSample, -1.0f, 1.0f);
+
+	if (bDither)
+	{
+		nDitherState = NextDitherState(nDitherState);
+		return (static_cast<s32>(nSample * DitherSampleMax) + GetDitherValue(nDitherState)) >> DitherFractionalBits;
+	}
+
+	return static_cast<s32>(nSample * SampleMax);
+}
+
+inline void StorePacked24(u8* pOut, s32 nSample)
+{
+	pOut[0] = nSample & 0xFF;
+	pOut[1] = (nSample >> 8) & 0xFF;
+	pOut[2] = (nSample >> 16) & 0xFF;
+}
+
+#define CONVERT_FUNCS(IMPL, FORMAT)                                                                   \
+	{                                                                                             \
+		{ &CSampleConverter::IMPL<FORMAT, false, false>, &CSampleConverter::IMPL<FORMAT, false, true> }, \
+		{ &CSampleConverter::IMPL<FORMAT, true, false>, &CSampleConverter::IMPL<FORMAT, true, true> }    \
+	}
+
+CSampleConverter::CSampleConverter(TFormat Format, bool bReversedStereo, bool bDither)
+	: m_Format(Format),
+	  m_DitherState{ 0x9E3779B9, 0x7F4A7C15, 0xF39CC060, 0x5CEDC834 }
+{
+	// Select specialization once up-front so that there's no per-sample branching
+	static const TConvertFunc ConvertFuncs[2][2][2] =
+	{
+		CONVERT_FUNCS(ConvertImpl, TFormat::Packed24),
+		CONVERT_FUNCS(ConvertImpl, TFormat::I2S32),
+	};
+
+	static const TConvertFunc ScalarConvertFuncs[2][2][2] =
+	{
+		CONVERT_FUNCS(ConvertScalarImpl, TFormat::Packed24),
+		CONVERT_FUNCS(ConvertScalarImpl, TFormat::I2S32),
+	};
+
+	const size_t nFormatIndex = Format == TFormat::I2S32 ? 1 : 0;
+	m_pConvertFunc = ConvertFuncs[nFormatIndex][bReversedStereo][bDither];
+	m_pScalarConvertFunc = ScalarConvertFuncs[nFormatIndex][bReversedStereo][bDither];
+}
+
+template <CSampleConverter::TFormat Format, bool bReversedStereo, bool bDither>
+void CSampleConverter::ConvertScalarRange(const float* pInBuffer, u8* pOutBuffer, size_t nStart, size_t nEnd)
+{
+	for (size_t i = nStart; i < nEnd; ++i)
+	{
+		// Channel swap is a matter of reading the other sample of the frame
+		const size_t nInIndex = bReversedStereo ? i ^ 1 : i;
+		const s32 nSample = ConvertSample<bDither>(pInBuffer[nInIndex], m_DitherState[i % DitherLanes]);
+
+		if (Format == TFormat::I2S32)
+			reinterpret_cast<s32*>(pOutBuffer)[i] = nSample;
+		else
+			StorePacked24(pOutBuffer + i * 3, nSample);
+	}
+}
+
+template <CSampleConverter::TFormat Format, bool bReversedStereo, bool bDither>
+void CSampleConverter::ConvertScalarImpl(const float* pInBuffer, u8* pOutBuffer, size_t nFrames)
+{
+	ConvertScalarRange<Format, bReversedStereo, bDither>(pInBuffer, pOutBuffer, 0, nFrames * 2);
+}
+
+#ifdef SAMPLECONVERTER_NEON
+
+template <CSampleConverter::TFormat Format, bool bReversedStereo, bool bDither>
+void CSampleConverter::ConvertImpl(const float* pInBuffer, u8* pOutBuffer, size_t nFrames)
+{
+	// Byte shuffle for packing eight 32-bit samples into 24 bytes
+	static const u8 PackIndices[24] =
+	{
+		0,  1,  2,  4,  5,  6,  8,  9,
+		10, 12, 13, 14, 16, 17, 18, 20,
+		21, 22, 24, 25, 26, 28, 29, 30,
+	};
+
+	constexpr size_t nSamplesPerIteration = 8;
+	const size_t nSamples = nFrames * 2;
+	const size_t nVectorSamples = nSamples & ~(nSamplesPerIteration - 1);
+
+	const float32x4_t vMin = vdupq_n_f32(-1.0f);
+	const float32x4_t vMax = vdupq_n_f32(1.0f);
+	const uint8x8_t vPack0 = vld1_u8(PackIndices);
+	const uint8x8_t vPack1 = vld1_u8(PackIndices + 8);
+	const uint8x8_t vPack2 = vld1_u8(PackIndices + 16);
+	uint32x4_t vDitherState = vld1q_u32(m_DitherState);
+
+	// Processes four interleaved samples (two frames) at a time; sample n lands in lane n % 4, matching the scalar path
+	auto ConvertVector = [&](float32x4_t vSamples) -> int32x4_t
+	{
+		// Swap left/right within each frame
+		if (bReversedStereo)
+			vSamples = vrev64q_f32(vSamples);
+
+		vSamples = vminq_f32(vmaxq_f32(vSamples, vMin), vMax);
+
+		if (bDither)
+		{
+			vDitherState = veorq_u32(vDitherState, vshlq_n_u32(vDitherState, 13));
+			vDitherState = veorq_u32(vDitherState, vshrq_n_u32(vDitherState, 17));
+			vDitherState = veorq_u32(vDitherState, vshlq_n_u32(vDitherState, 5));
+
+			const uint32x4_t vDitherSum = vaddq_u32(vandq_u32(vshrq_n_u32(vDitherState, 16), vdupq_n_u32(0xFF)), vshrq_n_u32(vDitherState, 24));
+			const int32x4_t vDither = vsubq_s32(vreinterpretq_s32_u32(vDitherSum), vdupq_n_s32(255));
+			const int32x4_t vScaled = vcvtq_s32_f32(vmulq_n_f32(vSamples, DitherSampleMax));
+			return vshrq_n_s32(vaddq_s32(vScaled, vDither), DitherFractionalBits);
+		}
+
+		return vcvtq_s32_f32(vmulq_n_f32(vSamples, SampleMax));
+	};
+
+	for (size_t i = 0; i < nVectorSamples; i += nSamplesPerIteration)
+	{
+		const int32x4_t vLow = ConvertVector(vld1q_f32(pInBuffer + i));
+		const int32x4_t vHigh = ConvertVector(vld1q_f32(pInBuffer + i + 4));
+
+		if (Format == TFormat::I2S32)
+		{
+			s32* const pOut = reinterpret_cast<s32*>(pOutBuffer) + i;
+			vst1q_s32(pOut, vLow);
+			vst1q_s32(pOut + 4, vHigh);
+		}
+		else
+		{
+			const uint8x16_t vLowBytes = vreinterpretq_u8_s32(vLow);
+			const uint8x16_t vHighBytes = vreinterpretq_u8_s32(vHigh);
+			const uint8x8x4_t vTable = { { vget_low_u8(vLowBytes), vget_high_u8(vLowBytes), vget_low_u8(vHighBytes), vget_high_u8(vHighBytes) } };
+
+			u8* const pOut = pOutBuffer + i * 3;
+			vst1_u8(pOut, vtbl4_u8(vTable, vPack0));
+			vst1_u8(pOut + 8, vtbl4_u8(vTable, vPack1));
+			vst1_u8(pOut + 16, vtbl4_u8(vTable, vPack2));
+		}
+	}
+
+	vst1q_u32(m_DitherState, vDitherState);
+
+	// Remaining samples
+	ConvertScalarRange<Format, bReversedStereo, bDither>(pInBuffer, pOutBuffer, nVectorSamples, nSamples);
+}
+
+#else
+
+// No vector unit; the scalar implementation is simple enough for the compiler to auto-vectorize
+template <CSampleConverter::TFormat Format, bool bReversedStereo, bool bDither>
+void CSampleConverter::ConvertImpl(const float* pInBuffer, u8* pOutBuffer, size_t nFrames)
+{
+	ConvertScalarImpl<Format, bReversedStereo, bDither>(pInBuffer, pOutBuffer, nFrames);
+}
+
+#endif
@@ -0,0 +1,818 @@
+//
+// smfplayer.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/util.h>
+#include <fatfs/ff.h>
+
+#include "smfplayer.h"
+#include "utility.h"
+#include "zoneallocator.h"
+
+LOGMODULE("smfplayer");
+
+const char* const Disks[] = { "SD", "USB" };
+const char MIDIFileDirectory[] = "midi";
+const char* const MIDIFileExtensions[] = { ".mid", ".midi", ".smf" };
+
+// Default tempo of 120 BPM in microseconds per quarter note
+constexpr u32 DefaultTempo = 500000;
+
+struct CSMFPlayer::TTrack
+{
+	const u8* pData;
+	const u8* pEnd;
+	u32 nTick;
+	u8 nRunningStatus;
+	bool bEnded;
+};
+
+struct CSMFPlayer::TTrackEvent
+{
+	enum class TType
+	{
+		ShortMessage,
+		SysEx,
+		Tempo,
+		Other,
+	};
+
+	TType Type;
+	u32 nMessage;
+	const u8* pSysExData;
+	u32 nSysExSize;
+	u32 nTempo;
+};
+
+static inline u32 ReadBE16(const u8* pData)
+{
+	return pData[0] << 8 | pData[1];
+}
+
+static inline u32 ReadBE32(const u8* pData)
+{
+	return pData[0] << 24 | pData[1] << 16 | pData[2] << 8 | pData[3];
+}
+
+// Reads a variable-length quantity, up to 4 bytes
+static bool ReadVLQ(const u8*& pData, const u8* pEnd, u32& nOutValue)
+{
+	nOutValue = 0;
+	for (size_t i = 0; i < 4 && pData < pEnd; ++i)
+	{
+		const u8 nByte = *pData++;
+		nOutValue = (nOutValue << 7) | (nByte & 0x7F);
+		if (!(nByte & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+CSMFPlayer::CSMFPlayer(unsigned int nSampleRate)
+	: m_Lock(TASK_LEVEL),
+	  m_nSampleRate(nSampleRate),
+
+	  m_nFiles(0),
+	  m_nFileIndex(0),
+
+	  m_pEvents(nullptr),
+	  m_nEvents(0),
+	  m_pSysExData(nullptr),
+	  m_nLength(0),
+
+	  m_State(TState::Stopped),
+	  m_nNextEvent(0),
+	  m_nPosition(0),
+	  m_bEventDeferred(false)
+{
+}
+
+CSMFPlayer::~CSMFPlayer()
+{
+	Unload();
+}
+
+bool CSMFPlayer::ScanFiles()
+{
+	for (size_t i = 0; i < m_nFiles; ++i)
+		m_FileList[i] = CString();
+
+	m_nFiles = 0;
+
+	DIR Dir;
+	FILINFO FileInfo;
+	FRESULT Result;
+	CString DirectoryPath;
+
+	// Loop over each disk
+	for (auto pDisk : Disks)
+	{
+		DirectoryPath.Format("%s:%s", pDisk, MIDIFileDirectory);
+		Result = f_findfirst(&Dir, &FileInfo, DirectoryPath, "*");
+
+		// Loop over each file in the directory
+		while (Result == FR_OK && *FileInfo.fname && m_nFiles < MaxFiles)
+		{
+			// Ensure not directory, hidden, or system file
+			if (!(FileInfo.fattrib & (AM_DIR | AM_HID | AM_SYS)))
+			{
+				const char* pExtension = strrchr(FileInfo.fname, '.');
+				bool bIsMIDIFile = false;
+
+				if (pExtension)
+				{
+					for (auto pMIDIFileExtension : MIDIFileExtensions)
+						bIsMIDIFile |= !strcasecmp(pExtension, pMIDIFileExtension);
+				}
+
+				if (bIsMIDIFile)
+					m_FileList[m_nFiles++].Format("%s/%s", static_cast<const char*>(DirectoryPath), FileInfo.fname);
+			}
+
+			Result = f_findnext(&Dir, &FileInfo);
+		}
+
+		f_closedir(&Dir);
+	}
+
+	// Sort into lexicographical order
+	if (m_nFiles)
+		Utility::QSort(m_FileList, FileListComparator, 0, m_nFiles - 1);
+
+	LOGNOTE("%d MIDI files found", m_nFiles);
+
+	return m_nFiles > 0;
+}
+
+const char* CSMFPlayer::GetFileName(size_t nIndex) const
+{
+	if (nIndex >= m_nFiles)
+		return nullptr;
+
+	// Strip disk and directory
+	const char* pPath = m_FileList[nIndex];
+	const char* pSlash = strrchr(pPath, '/');
+	return pSlash ? pSlash + 1 : pPath;
+}
+
+bool CSMFPlayer::Load(size_t nIndex)
+{
+	if (nIndex >= m_nFiles || !Load(m_FileList[nIndex]))
+		return false;
+
+	m_nFileIndex = nIndex;
+	return true;
+}
+
+bool CSMFPlayer::Load(const char* pPath)
+{
+	Unload();
+
+	FIL File;
+	if (f_open(&File, pPath, FA_READ) != FR_OK)
+	{
+		LOGERR("Couldn't open '%s'", pPath);
+		return false;
+	}
+
+	// Read the whole file; it's only needed until it has been parsed
+	const size_t nSize = f_size(&File);
+	u8* pData = static_cast<u8*>(CZoneAllocator::Get()->Alloc(nSize, TZoneTag::SMFPlayer));
+	UINT nRead = 0;
+	bool bResult = false;
+
+	if (!pData)
+		LOGERR("Not enough memory to load '%s'", pPath);
+	else if (f_read(&File, pData, nSize, &nRead) != FR_OK || nRead != nSize)
+		LOGERR("Couldn't read '%s'", pPath);
+	else if (!(bResult = Parse(pData, nSize)))
+		LOGERR("'%s' is not a valid MIDI file", pPath);
+
+	f_close(&File);
+	CZoneAllocator::Get()->Free(pData);
+
+	if (!bResult)
+	{
+		Unload();
+		return false;
+	}
+
+	LOGNOTE("Loaded '%s': %d events, %d:%02d", pPath, m_nEvents, GetLengthMillis() / 60000, GetLengthMillis() / 1000 % 60);
+
+	return true;
+}
+
+void CSMFPlayer::Unload()
+{
+	Stop();
+
+	m_Lock.Acquire();
+
+	if (m_pEvents)
+		CZoneAllocator::Get()->Free(m_pEvents);
+	if (m_pSysExData)
+		CZoneAllocator::Get()->Free(m_pSysExData);
+
+	m_pEvents    = nullptr;
+	m_nEvents    = 0;
+	m_pSysExData = nullptr;
+	m_nLength    = 0;
+
+	m_Lock.Release();
+}
+
+void CSMFPlayer::Play()
+{
+	m_Lock.Acquire();
+
+	if (m_pEvents)
+	{
+		// Start over if we reached the end
+		if (m_State == TState::Finished)
+		{
+			m_nNextEvent = 0;
+			m_nPosition  = 0;
+		}
+
+		m_State = TState::Playing;
+	}
+
+	m_Lock.Release();
+}
+
+void CSMFPlayer::Stop()
+{
+	m_Lock.Acquire();
+	m_State          = TState::Stopped;
+	m_nNextEvent     = 0;
+	m_nPosition      = 0;
+	m_bEventDeferred = false;
+	m_Lock.Release();
+}
+
+void CSMFPlayer::Seek(unsigned int nMillis, CSynthBase& Synth)
+{
+	if (!m_pEvents)
+		return;
+
+	// Hold the playhead while the synth is brought up to date
+	m_Lock.Acquire();
+	const TState PreviousState = m_State;
+	m_State = TState::Stopped;
+	m_Lock.Release();
+
+	const u32 nFrame = Utility::Min(static_cast<u64>(nMillis) * m_nSampleRate / 1000, static_cast<u64>(m_nLength));
+
+	// Find the first event at or after the seek position
+	size_t nLow = 0, nHigh = m_nEvents;
+	while (nLow < nHigh)
+	{
+		const size_t nMid = (nLow + nHigh) / 2;
+		if (m_pEvents[nMid].nFrame < nFrame)
+			nLow = nMid + 1;
+		else
+			nHigh = nMid;
+	}
+
+	Synth.AllSoundOff();
+	Chase(nLow, Synth);
+
+	m_Lock.Acquire();
+	m_nNextEvent     = nLow;
+	m_nPosition      = nFrame;
+	m_bEventDeferred = false;
+	m_State          = PreviousState == TState::Finished ? TState::Playing : PreviousState;
+	m_Lock.Release();
+}
+
+void CSMFPlayer::Update(CSynthBase& Synth)
+{
+	if (!m_bEventDeferred)
+		return;
+
+	// The audio core won't touch the timeline until the flag is cleared; dispatch every deferred event for this frame
+	const u32 nFrame = m_pEvents[m_nNextEvent].nFrame;
+	size_t nEvent = m_nNextEvent;
+
+	while (nEvent < m_nEvents && m_pEvents[nEvent].nFrame == nFrame && DefersEvent(m_pEvents[nEvent], Synth))
+		DispatchEvent(m_pEvents[nEvent++], Synth);
+
+	m_Lock.Acquire();
+	m_nNextEvent     = nEvent;
+	m_bEventDeferred = false;
+	m_Lock.Release();
+}
+
+size_t CSMFPlayer::GetEvents(const CSynthBase& Synth, TMIDIEvent* pOutEvents, size_t nFrames)
+{
+	size_t nOutEvents = 0;
+
+	m_Lock.Acquire();
+
+	if (m_State == TState::Playing && !m_bEventDeferred)
+	{
+		u32 nEndFrame = m_nPosition + nFrames;
+
+		while (m_nNextEvent < m_nEvents)
+		{
+			const TTimelineEvent& Event = m_pEvents[m_nNextEvent];
+			if (Event.nFrame >= nEndFrame)
+				break;
+
+			// Stop the playhead here until the main core has dispatched the event
+			if (DefersEvent(Event, Synth))
+			{
+				m_bEventDeferred = true;
+				nEndFrame = Event.nFrame;
+				break;
+			}
+
+			// Leave the rest for the next block
+			if (nOutEvents == MaxEventsPerBlock)
+			{
+				nEndFrame = Event.nFrame;
+				break;
+			}
+
+			pOutEvents[nOutEvents++] = TMIDIEvent{Event.nFrame - m_nPosition, Event.nMessage, 0};
+			++m_nNextEvent;
+		}
+
+		m_nPosition = nEndFrame;
+
+		if (m_nNextEvent == m_nEvents)
+			m_State = TState::Finished;
+	}
+
+	m_Lock.Release();
+
+	return nOutEvents;
+}
+
+bool CSMFPlayer::Parse(const u8* pData, size_t nSize)
+{
+	if (nSize < 14 || memcmp(pData, "MThd", 4) != 0)
+		return false;
+
+	const u32 nHeaderLength = ReadBE32(pData + 4);
+	const u32 nFormat       = ReadBE16(pData + 8);
+	const u32 nTrackCount   = ReadBE16(pData + 10);
+	const u32 nDivision     = ReadBE16(pData + 12);
+
+	if (nHeaderLength < 6 || nFormat > 1 || nDivision == 0)
+	{
+		LOGERR("Unsupported MIDI file (format %d)", nFormat);
+		return false;
+	}
+
+	// Microseconds per tick is nTempoNumerator / nTempoDenominator
+	u64 nTempoNumerator, nTempoDenominator;
+	const bool bSMPTE = nDivision & 0x8000;
+	if (bSMPTE)
+	{
+		// Frames per second (as a negative number) and ticks per frame; 29 means 29.97 drop-frame
+		const u32 nFPS = -static_cast<s8>(nDivision >> 8);
+		const u32 nTicksPerFrame = nDivision & 0xFF;
+		nTempoNumerator   = nFPS == 29 ? 1001000 : 1000000;
+		nTempoDenominator = (nFPS == 29 ? 30 : nFPS) * nTicksPerFrame;
+		if (!nTempoDenominator)
+			return false;
+	}
+	else
+	{
+		nTempoNumerator   = DefaultTempo;
+		nTempoDenominator = nDivision;
+	}
+
+	// Find track chunks, skipping any unknown chunk types
+	TTrack Tracks[MaxTracks];
+	size_t nTracks = 0;
+	const u8* pChunk = pData + 8 + nHeaderLength;
+	const u8* const pEnd = pData + nSize;
+
+	while (pChunk + 8 <= pEnd && nTracks < nTrackCount)
+	{
+		const u32 nChunkLength = ReadBE32(pChunk + 4);
+		const u8* pChunkData = pChunk + 8;
+		const u8* pChunkEnd = static_cast<size_t>(pEnd - pChunkData) < nChunkLength ? pEnd : pChunkData + nChunkLength;
+
+		if (!memcmp(pChunk, "MTrk", 4))
+		{
+			if (nTracks == MaxTracks)
+			{
+				LOGWARN("Too many tracks; only the first %d will be played", MaxTracks);
+				break;
+			}
+
+			TTrack& Track = Tracks[nTracks++];
+			Track.pData = pChunkData;
+			Track.pEnd = pChunkEnd;
+			Track.nTick = 0;
+			Track.nRunningStatus = 0;
+			Track.bEnded = !ReadVLQ(Track.pData, Track.pEnd, Track.nTick);
+		}
+
+		pChunk = pChunkEnd;
+	}
+
+	if (!nTracks)
+		return false;
+
+	// First pass: count events and SysEx data so that the timeline can be allocated in one go
+	size_t nEvents = 0;
+	size_t nSysExDataSize = 0;
+	for (size_t i = 0; i < nTracks; ++i)
+	{
+		TTrack Track = Tracks[i];
+		TTrackEvent Event;
+
+		while (!Track.bEnded && ReadTrackEvent(Track, Event))
+		{
+			if (Event.Type == TTrackEvent::TType::ShortMessage)
+				++nEvents;
+			else if (Event.Type == TTrackEvent::TType::SysEx)
+			{
+				++nEvents;
+				nSysExDataSize += Event.nSysExSize;
+			}
+		}
+	}
+
+	if (!nEvents)
+		return false;
+
+	CZoneAllocator* const pAllocator = CZoneAllocator::Get();
+	m_pEvents = static_cast<TTimelineEvent*>(pAllocator->Alloc(nEvents * sizeof(TTimelineEvent), TZoneTag::SMFPlayer));
+	if (nSysExDataSize)
+		m_pSysExData = static_cast<u8*>(pAllocator->Alloc(nSysExDataSize, TZoneTag::SMFPlayer));
+
+	if (!m_pEvents || (nSysExDataSize && !m_pSysExData))
+	{
+		LOGERR("Not enough memory for %d events", nEvents);
+		return false;
+	}
+
+	// Second pass: merge the tracks in tick order, converting ticks to frames through the tempo map as we go
+	u32 nTempoTick = 0;
+	u64 nTempoMicros = 0;
+	size_t nSysExOffset = 0;
+	m_nEvents = 0;
+
+	while (true)
+	{
+		// Next event is the earliest of all tracks; ties go to the lowest-numbered track (the tempo track in type 1)
+		TTrack* pTrack = nullptr;
+		for (size_t i = 0; i < nTracks; ++i)
+		{
+			if (!Tracks[i].bEnded && (!pTrack || Tracks[i].nTick < pTrack->nTick))
+				pTrack = &Tracks[i];
+		}
+
+		if (!pTrack)
+			break;
+
+		const u32 nTick = pTrack->nTick;
+		TTrackEvent Event;
+		if (!ReadTrackEvent(*pTrack, Event))
+			continue;
+
+		const u64 nMicros = nTempoMicros + (nTick - nTempoTick) * nTempoNumerator / nTempoDenominator;
+
+		if (Event.Type == TTrackEvent::TType::Tempo)
+		{
+			// Tempo is ignored for SMPTE timing
+			if (!bSMPTE && Event.nTempo)
+			{
+				nTempoTick      = nTick;
+				nTempoMicros    = nMicros;
+				nTempoNumerator = Event.nTempo;
+			}
+
+			continue;
+		}
+
+		if (Event.Type == TTrackEvent::TType::Other)
+			continue;
+
+		// Counting pass guarantees space
+		assert(m_nEvents < nEvents);
+
+		const u64 nFrame = nMicros / 1000000 * m_nSampleRate + nMicros % 1000000 * m_nSampleRate / 1000000;
+		TTimelineEvent& TimelineEvent = m_pEvents[m_nEvents++];
+		TimelineEvent.nFrame = Utility::Min(nFrame, static_cast<u64>(0xFFFFFFFF));
+		TimelineEvent.nMessage = Event.nMessage;
+		TimelineEvent.nSysExOffset = nSysExOffset;
+		TimelineEvent.nSysExSize = 0;
+
+		if (Event.Type == TTrackEvent::TType::SysEx)
+		{
+			// SMF stores SysEx without the leading 0xF0
+			m_pSysExData[nSysExOffset] = 0xF0;
+			memcpy(m_pSysExData + nSysExOffset + 1, Event.pSysExData, Event.nSysExSize - 1);
+			TimelineEvent.nSysExSize = Event.nSysExSize;
+			nSysExOffset += Event.nSysExSize;
+		}
+	}
+
+	m_nLength = m_nEvents ? m_pEvents[m_nEvents - 1].nFrame : 0;
+
+	return m_nEvents > 0;
+}
+
+// Reads the event at the track's position, then the delta time of the next one
+bool CSMFPlayer::ReadTrackEvent(TTrack& Track, TTrackEvent& OutEvent)
+{
+	const u8*& pData = Track.pData;
+	const u8* const pEnd = Track.pEnd;
+
+	OutEvent.Type = TTrackEvent::TType::Other;
+
+	if (pData >= pEnd)
+	{
+		Track.bEnded = true;
+		return false;
+	}
+
+	const u8 nStatus = *pData;
+	u32 nLength;
+
+	// Meta event
+	if (nStatus == 0xFF)
+	{
+		if (pEnd - pData < 2)
+		{
+			Track.bEnded = true;
+			return false;
+		}
+
+		const u8 nType = pData[1];
+		pData += 2;
+
+		if (!ReadVLQ(pData, pEnd, nLength) || static_cast<size_t>(pEnd - pData) < nLength)
+		{
+			Track.bEnded = true;
+			return false;
+		}
+
+		// End of track
+		if (nType == 0x2F)
+		{
+			Track.bEnded = true;
+			return true;
+		}
+
+		// Set tempo
+		if (nType == 0x51 && nLength == 3)
+		{
+			OutEvent.Type = TTrackEvent::TType::Tempo;
+			OutEvent.nTempo = pData[0] << 16 | pData[1] << 8 | pData[2];
+		}
+
+		pData += nLength;
+		Track.nRunningStatus = 0;
+	}
+
+	// SysEx event, or escaped data
+	else if (nStatus == 0xF0 || nStatus == 0xF7)
+	{
+		++pData;
+
+		if (!ReadVLQ(pData, pEnd, nLength) || static_cast<size_t>(pEnd - pData) < nLength)
+		{
+			Track.bEnded = true;
+			return false;
+		}
+
+		// Only complete SysEx messages are played; split messages and escaped data are skipped
+		if (nStatus == 0xF0 && nLength && pData[nLength - 1] == 0xF7)
+		{
+			OutEvent.Type = TTrackEvent::TType::SysEx;
+			OutEvent.pSysExData = pData;
+			OutEvent.nSysExSize = nLength + 1;
+		}
+
+		pData += nLength;
+		Track.nRunningStatus = 0;
+	}
+
+	// Channel message
+	else
+	{
+		if (nStatus & 0x80)
+		{
+			Track.nRunningStatus = nStatus;
+			++pData;
+		}
+
+		const u8 nRunningStatus = Track.nRunningStatus;
+		const size_t nDataBytes = (nRunningStatus & 0xE0) == 0xC0 ? 1 : 2;
+
+		// Invalid status, missing running status, or truncated
+		if (nRunningStatus < 0x80 || nRunningStatus >= 0xF0 || static_cast<size_t>(pEnd - pData) < nDataBytes)
+		{
+			Track.bEnded = true;
+			return false;
+		}
+
+		OutEvent.Type = TTrackEvent::TType::ShortMessage;
+		OutEvent.nMessage = nRunningStatus | (pData[0] & 0x7F) << 8;
+		if (nDataBytes == 2)
+			OutEvent.nMessage |= (pData[1] & 0x7F) << 16;
+
+		pData += nDataBytes;
+	}
+
+	// Delta time to the next event
+	u32 nDelta;
+	if (pData >= pEnd || !ReadVLQ(pData, pEnd, nDelta))
+		Track.bEnded = true;
+	else
+		Track.nTick += nDelta;
+
+	return true;
+}
+
+// Brings the synth up to the state it would be in after playing events [0, nEndEvent)
+void CSMFPlayer::Chase(size_t nEndEvent, CSynthBase& Synth)
+{
+	constexpr size_t ChannelCount = 16;
+	constexpr size_t ControllerCount = 120; // Channel mode messages (120-127) are not chased
+
+	struct TChannelState
+	{
+		s16 nProgram;
+		s16 nChannelPressure;
+		s32 nPitchBend;
+		bool bNRPNSelected;
+		s16 Controllers[ControllerCount];
+	};
+
+	// Controllers affected by Reset All Controllers
+	static constexpr u8 ResetControllers[] = {0x01, 0x0B, 0x40, 0x41, 0x42, 0x43, 0x62, 0x63, 0x64, 0x65};
+
+	TChannelState State[ChannelCount];
+	auto ClearState = [&State]()
+	{
+		for (TChannelState& Channel : State)
+		{
+			Channel.nProgram = -1;
+			Channel.nChannelPressure = -1;
+			Channel.nPitchBend = -1;
+			Channel.bNRPNSelected = false;
+			for (s16& nController : Channel.Controllers)
+				nController = -1;
+		}
+	};
+
+	// Sends the chased state; bank select before program change, and parameter numbers before data entry
+	auto SendState = [&State, &Synth]()
+	{
+		u32 Messages[ControllerCount + 4];
+
+		for (u8 nChannel = 0; nChannel < ChannelCount; ++nChannel)
+		{
+			const TChannelState& Channel = State[nChannel];
+			size_t nMessages = 0;
+
+			auto AddController = [&](u8 nController)
+			{
+				if (Channel.Controllers[nController] >= 0)
+					Messages[nMessages++] = (0xB0 | nChannel) | nController << 8 | Channel.Controllers[nController] << 16;
+			};
+
+			AddController(0x00);
+			AddController(0x20);
+
+			if (Channel.nProgram >= 0)
+				Messages[nMessages++] = (0xC0 | nChannel) | Channel.nProgram << 8;
+
+			for (u8 nController = 0x01; nController < ControllerCount; ++nController)
+			{
+				if (nController != 0x06 && nController != 0x20 && nController != 0x26 && (nController < 0x62 || nController > 0x65))
+					AddController(nController);
+			}
+
+			if (Channel.bNRPNSelected)
+			{
+				AddController(0x63);
+				AddController(0x62);
+			}
+			else
+			{
+				AddController(0x65);
+				AddController(0x64);
+			}
+
+			AddController(0x06);
+			AddController(0x26);
+
+			if (Channel.nPitchBend >= 0)
+				Messages[nMessages++] = (0xE0 | nChannel) | (Channel.nPitchBend & 0x7F) << 8 | (Channel.nPitchBend >> 7) << 16;
+
+			if (Channel.nChannelPressure >= 0)
+				Messages[nMessages++] = (0xD0 | nChannel) | Channel.nChannelPressure << 8;
+
+			if (nMessages)
+				Synth.HandleMIDIShortMessages(Messages, nMessages);
+		}
+	};
+
+	// Start from a known state for the controllers that aren't always chased (e.g. sustain left on)
+	u32 ResetMessages[ChannelCount];
+	for (u8 nChannel = 0; nChannel < ChannelCount; ++nChannel)
+		ResetMessages[nChannel] = (0xB0 | nChannel) | 0x79 << 8;
+	Synth.HandleMIDIShortMessages(ResetMessages, ChannelCount);
+
+	ClearState();
+
+	for (size_t i = 0; i < nEndEvent; ++i)
+	{
+		const TTimelineEvent& Event = m_pEvents[i];
+
+		// Keep ordering with SysEx, which may reset or depend on the state so far
+		if (Event.nSysExSize)
+		{
+			SendState();
+			ClearState();
+			DispatchEvent(Event, Synth);
+			continue;
+		}
+
+		TChannelState& Channel = State[Event.nMessage & 0x0F];
+		const u8 nData1 = (Event.nMessage >> 8) & 0x7F;
+		const u8 nData2 = (Event.nMessage >> 16) & 0x7F;
+
+		switch (Event.nMessage & 0xF0)
+		{
+			case 0xB0:
+				if (nData1 < ControllerCount)
+				{
+					Channel.Controllers[nData1] = nData2;
+					if (nData1 == 0x62 || nData1 == 0x63)
+						Channel.bNRPNSelected = true;
+					else if (nData1 == 0x64 || nData1 == 0x65)
+						Channel.bNRPNSelected = false;
+				}
+
+				// Reset All Controllers; forget the controllers it resets, which the initial reset has taken care of
+				else if (nData1 == 0x79)
+				{
+					for (u8 nController : ResetControllers)
+						Channel.Controllers[nController] = -1;
+					Channel.nPitchBend = -1;
+					Channel.nChannelPressure = -1;
+				}
+				break;
+
+			case 0xC0:
+				Channel.nProgram = nData1;
+				break;
+
+			case 0xD0:
+				Channel.nChannelPressure = nData1;
+				break;
+
+			case 0xE0:
+				Channel.nPitchBend = nData2 << 7 | nData1;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	SendState();
+}
+
+void CSMFPlayer::DispatchEvent(const TTimelineEvent& Event, CSynthBase& Synth) const
+{
+	if (Event.nSysExSize)
+		Synth.HandleMIDISysExMessage(m_pSysExData + Event.nSysExOffset, Event.nSysExSize);
+	else
+		Synth.HandleMIDIShortMessage(Event.nMessage);
+}
+
+bool CSMFPlayer::FileListComparator(const CString& PathA, const CString& PathB)
+{
+	return strcasecmp(PathA, PathB) < 0;
+}
@@ -33,6 +33,7 @@
 LOGMODULE("soundfontmanager");
 const char* const Disks[] = { "SD", "USB" };
 const char SoundFontDirectory[] = "soundfonts";
+const char IndexFilePath[] = "SD:soundfonts/.sfindex";
 
 // Four-character codes used throughout SoundFont RIFF structure
 constexpr u32 FourCC(const char pFourCC[4])
@@ -53,8 +54,96 @@ struct TSoundFontChunk
 }
 PACKED;
 
+// Persistent index file format
+constexpr u32 IndexMagic   = FourCC("SFIX");
+constexpr u32 IndexVersion = 1;
+
+constexpr u8 IndexFlagSoundFont       = 1 << 0;
+constexpr u8 IndexFlagFXProfileCached = 1 << 1;
+
+struct TIndexHeader
+{
+	u32 nMagic;
+	u32 nVersion;
+	u32 nEntries;
+}
+PACKED;
+
+// Followed by the serialized effects profile, then the path and name (not null-terminated)
+struct TIndexRecord
+{
+	u32 nSize;
+	u32 nTimestamp;
+	u32 nFXProfileSize;
+	u32 nFXProfileTimestamp;
+	u8 nFlags;
+	u16 nPathLength;
+	u16 nNameLength;
+}
+PACKED;
+
+// Effects profile members in serialization order
+#define FX_PROFILE_MEMBERS(X) \
+	X(nGain)              \
+	X(bReverbActive)      \
+	X(nReverbDamping)     \
+	X(nReverbLevel)       \
+	X(nReverbRoomSize)    \
+	X(nReverbWidth)       \
+	X(bChorusActive)      \
+	X(nChorusDepth)       \
+	X(nChorusLevel)       \
+	X(nChorusVoices)      \
+	X(nChorusSpeed)
+
+template <class T>
+constexpr size_t SerializedOptionalSize(const TOptional<T>*) { return 1 + sizeof(T); }
+
+#define FX_PROFILE_MEMBER_SIZE(MEMBER) + SerializedOptionalSize(static_cast<const decltype(TFXProfile::MEMBER)*>(nullptr))
+constexpr size_t SerializedFXProfileSize = 0 FX_PROFILE_MEMBERS(FX_PROFILE_MEMBER_SIZE);
+#undef FX_PROFILE_MEMBER_SIZE
+
+template <class T>
+void WriteOptional(u8*& pData, const TOptional<T>& Optional)
+{
+	const T Value = Optional.ValueOr(T());
+	*pData++ = static_cast<bool>(Optional);
+	memcpy(pData, &Value, sizeof(T));
+	pData += sizeof(T);
+}
+
+template <class T>
+void ReadOptional(const u8*& pData, TOptional<T>& Optional)
+{
+	const bool bSet = *pData++;
+	T Value;
+	memcpy(&Value, pData, sizeof(T));
+	pData += sizeof(T);
+
+	if (bSet)
+		Optional = Value;
+}
+
+// FAT date and time packed into a single value
+static u32 GetTimestamp(const FILINFO& FileInfo)
+{
+	return FileInfo.fdate << 16 | FileInfo.ftime;
+}
+
+// An entry from the index file, pointing into the loaded file data
+struct CSoundFontManager::TIndexCacheEntry
+{
+	u32 nPathHash;
+	const TIndexRecord* pRecord;
+	const u8* pFXProfile;
+	const char* pPath;
+	const char* pName;
+	bool bUsed;
+};
+
 CSoundFontManager::CSoundFontManager()
-	: m_nSoundFonts(0)
+	: m_nSoundFonts(0),
+	  m_nNonSoundFonts(0)
 {
 }
 
@@ -66,11 +155,23 @@ bool CSoundFontManager::ScanSoundFonts()
 
 	m_nSoundFonts = 0;
 
+	for (size_t i = 0; i < m_nNonSoundFonts; ++i)
+		m_NonSoundFontList[i] = TNonSoundFontListEntry();
+
+	m_nNonSoundFonts = 0;
+
 	DIR Dir;
 	FILINFO FileInfo;
 	FRESULT Result;
 	CString DirectoryPath;
 
+	// Load index of previously-scanned files so that only new/changed files need to be probed
+	u8* pIndexData = nullptr;
+	size_t nIndexEntries = 0;
+	TIndexCacheEntry* pIndex = LoadIndex(pIndexData, nIndexEntries);
+	size_t nIndexHits = 0;
+	bool bIndexDirty = false;
+
 	// Loop over each disk
 	for (auto pDisk : Disks)
 	{
@@ -87,13 +188,72 @@ bool CSoundFontManager::ScanSoundFonts()
 				CString SoundFontPath;
 				SoundFontPath.Format("%s/%s", static_cast<const char*>(DirectoryPath), FileInfo.fname);
 
-				CheckSoundFont(SoundFontPath, FileInfo.fname);
+				const u32 nTimestamp = GetTimestamp(FileInfo);
+				const u32 nPathHash = Utility::HashString(SoundFontPath);
+				TIndexCacheEntry* pCachedEntry = nullptr;
+
+				for (size_t i = 0; i < nIndexEntries; ++i)
+				{
+					TIndexCacheEntry& Entry = pIndex[i];
+					if (!Entry.bUsed && Entry.nPathHash == nPathHash && !strcmp(Entry.pPath, SoundFontPath))
+					{
+						pCachedEntry = &Entry;
+						break;
+					}
+				}
+
+				if (!strcmp(SoundFontPath, IndexFilePath))
+				{
+					// Skip the index itself
+				}
+				else if (pCachedEntry && pCachedEntry->pRecord->nSize == FileInfo.fsize && pCachedEntry->pRecord->nTimestamp == nTimestamp)
+				{
+					const TIndexRecord* pRecord = pCachedEntry->pRecord;
+					pCachedEntry->bUsed = true;
+					++nIndexHits;
+
+					if (!(pRecord->nFlags & IndexFlagSoundFont))
+						AddNonSoundFont(SoundFontPath, pRecord->nSize, pRecord->nTimestamp);
+					else
+					{
+						TSoundFontListEntry& Entry = m_SoundFontList[m_nSoundFonts++];
+						Entry.Path                = SoundFontPath;
+						Entry.Name                = pCachedEntry->pName;
+						Entry.nSize               = pRecord->nSize;
+						Entry.nTimestamp          = pRecord->nTimestamp;
+						Entry.bFXProfileCached    = pRecord->nFlags & IndexFlagFXProfileCached;
+						Entry.nFXProfileSize      = pRecord->nFXProfileSize;
+						Entry.nFXProfileTimestamp = pRecord->nFXProfileTimestamp;
+
+						const u8* pFXProfileData = pCachedEntry->pFXProfile;
+						#define READ_MEMBER(MEMBER) ReadOptional(pFXProfileData, Entry.FXProfile.MEMBER);
+						FX_PROFILE_MEMBERS(READ_MEMBER)
+						#undef READ_MEMBER
+					}
+				}
+				else
+				{
+					CheckSoundFont(SoundFontPath, FileInfo.fname, FileInfo.fsize, nTimestamp);
+					bIndexDirty = true;
+				}
 			}
 
 			Result = f_findnext(&Dir, &FileInfo);
 		}
 	}
 
+	// Rewrite index if anything was probed or removed
+	if (bIndexDirty || nIndexHits != nIndexEntries)
+		SaveIndex();
+
+	LOGNOTE("%d files indexed, %d probed", nIndexHits, m_nSoundFonts + m_nNonSoundFonts - nIndexHits);
+
+	if (pIndex)
+	{
+		delete[] pIndex;
+		delete[] pIndexData;
+	}
+
 	if (m_nSoundFonts > 0)
 	{
 		// Sort into lexicographical order
@@ -128,7 +288,7 @@ const char* CSoundFontManager::GetSoundFontName(size_t nIndex) const
 	return static_cast<const char*>(m_SoundFontList[nIndex].Name);
 }
 
-TFXProfile CSoundFontManager::GetSoundFontFXProfile(size_t nIndex) const
+TFXProfile CSoundFontManager::GetSoundFontFXProfile(size_t nIndex)
 {
 	TFXProfile FXProfile;
 
@@ -148,10 +308,38 @@ TFXProfile CSoundFontManager::GetSoundFontFXProfile(size_t nIndex) const
 	else
 		strcat(PathBuffer, ".cfg");
 
-	FIL File;
-	if (f_open(&File, PathBuffer, FA_READ) != FR_OK)
+	// Size and timestamp are zero if there is no effects profile
+	FILINFO FileInfo;
+	u32 nSize = 0, nTimestamp = 0;
+	if (f_stat(PathBuffer, &FileInfo) == FR_OK)
+	{
+		nSize      = FileInfo.fsize;
+		nTimestamp = GetTimestamp(FileInfo);
+	}
+
+	// Use cached profile if the .cfg file is unchanged
+	TSoundFontListEntry& Entry = m_SoundFontList[nIndex];
+	if (Entry.bFXProfileCached && Entry.nFXProfileSize == nSize && Entry.nFXProfileTimestamp == nTimestamp)
+		return Entry.FXProfile;
+
+	if (nSize && !ParseFXProfile(PathBuffer, FXProfile))
 		return FXProfile;
 
+	Entry.bFXProfileCached    = true;
+	Entry.nFXProfileSize      = nSize;
+	Entry.nFXProfileTimestamp = nTimestamp;
+	Entry.FXProfile           = FXProfile;
+	SaveIndex();
+
+	return FXProfile;
+}
+
+bool CSoundFontManager::ParseFXProfile(const char* pPath, TFXProfile& FXProfile)
+{
+	FIL File;
+	if (f_open(&File, pPath, FA_READ) != FR_OK)
+		return false;
+
 	// +1 byte for null terminator
 	const UINT nSize = f_size(&File);
 	char Buffer[nSize + 1];
@@ -161,7 +349,7 @@ TFXProfile CSoundFontManager::GetSoundFontFXProfile(size_t nIndex) const
 	{
 		LOGERR("Error reading effects profile");
 		f_close(&File);
-		return FXProfile;
+		return false;
 	}
 
 	// Ensure null-terminated
@@ -172,7 +360,7 @@ TFXProfile CSoundFontManager::GetSoundFontFXProfile(size_t nIndex) const
 		LOGWARN("Effects profile parse error on line %d", nResult);
 
 	f_close(&File);
-	return FXProfile;
+	return true;
 }
 
 const char* CSoundFontManager::GetFirstValidSoundFontPath() const
@@ -180,34 +368,56 @@ const char* CSoundFontManager::GetFirstValidSoundFontPath() const
 	return m_nSoundFonts > 0 ? static_cast<const char*>(m_SoundFontList[0].Path) : nullptr;
 }
 
-void CSoundFontManager::CheckSoundFont(const char* pFullPath, const char* pFileName)
+void CSoundFontManager::CheckSoundFont(const char* pFullPath, const char* pFileName, u32 nSize, u32 nTimestamp)
+{
+	char Name[MaxSoundFontNameLength];
+
+	if (!ProbeSoundFont(pFullPath, Name))
+	{
+		AddNonSoundFont(pFullPath, nSize, nTimestamp);
+		return;
+	}
+
+	TSoundFontListEntry& Entry = m_SoundFontList[m_nSoundFonts++];
+	Entry.Path             = pFullPath;
+	Entry.nSize            = nSize;
+	Entry.nTimestamp       = nTimestamp;
+	Entry.bFXProfileCached = false;
+
+	// If we got a name, use it, otherwise fall back on filename
+	if (Name[0] != '\0')
+		Entry.Name = Name;
+	else
+		Entry.Name = pFileName;
+}
+
+bool CSoundFontManager::ProbeSoundFont(const char* pFullPath, char* pName)
 {
 	FIL File;
 	UINT nBytesRead;
 	TSoundFontChunk Chunk;
 	u32 nFourCC;
 	u32 nInfoListChunkSize;
-	char Name[MaxSoundFontNameLength];
 
 	// Init with null terminator
-	Name[0] = '\0';
+	pName[0] = '\0';
 
 	// Try to open file
 	if (f_open(&File, pFullPath, FA_READ) != FR_OK)
-		return;
+		return false;
 
 #define CHECK_CHUNK_ID(EXPECTED_CHUNK_ID)                                                                \
 	if (f_read(&File, &Chunk, sizeof(Chunk), &nBytesRead) != FR_OK || Chunk.FourCC != EXPECTED_CHUNK_ID) \
 	{                                                                                                    \
 		f_close(&File);                                                                                  \
-		return;                                                                                          \
+		return false;                                                                                    \
 	}
 
 #define CHECK_FORM_ID(EXPECTED_FORM_ID)                                                                \
 	if (f_read(&File, &nFourCC, sizeof(nFourCC), &nBytesRead) != FR_OK || nFourCC != EXPECTED_FORM_ID) \
 	{                                                                                                  \
 		f_close(&File);                                                                                \
-		return;                                                                                        \
+		return false;                                                                                  \
 	}
 
 	CHECK_CHUNK_ID(FourCCRIFF);
@@ -229,8 +439,8 @@ void CSoundFontManager::CheckSoundFont(const char* pFullPath, const char* pFileN
 		// Extract name
 		if (Chunk.FourCC == FourCCINAM)
 		{
-			if (Chunk.Size <= sizeof(Name))
-				f_read(&File, Name, Chunk.Size, &nBytesRead);
+			if (Chunk.Size <= MaxSoundFontNameLength)
+				f_read(&File, pName, Chunk.Size, &nBytesRead);
 
 			break;
 		}
@@ -245,14 +455,155 @@ void CSoundFontManager::CheckSoundFont(const char* pFullPath, const char* pFileN
 	// Clean up
 	f_close(&File);
 
-	TSoundFontListEntry& Entry = m_SoundFontList[m_nSoundFonts++];
-	Entry.Path = pFullPath;
+	return true;
+}
 
-	// If we got a name, use it, otherwise fall back on filename
-	if (Name[0] != '\0')
-		Entry.Name = Name;
+void CSoundFontManager::AddNonSoundFont(const char* pFullPath, u32 nSize, u32 nTimestamp)
+{
+	if (m_nNonSoundFonts >= MaxNonSoundFonts)
+		return;
+
+	TNonSoundFontListEntry& Entry = m_NonSoundFontList[m_nNonSoundFonts++];
+	Entry.Path       = pFullPath;
+	Entry.nSize      = nSize;
+	Entry.nTimestamp = nTimestamp;
+}
+
+CSoundFontManager::TIndexCacheEntry* CSoundFontManager::LoadIndex(u8*& pIndexData, size_t& nEntries)
+{
+	FIL File;
+	UINT nRead;
+
+	nEntries = 0;
+
+	if (f_open(&File, IndexFilePath, FA_READ) != FR_OK)
+		return nullptr;
+
+	// Read the whole index in one go
+	const size_t nSize = f_size(&File);
+	pIndexData = new u8[nSize];
+	const bool bReadOK = pIndexData && f_read(&File, pIndexData, nSize, &nRead) == FR_OK && nRead == nSize;
+	f_close(&File);
+
+	const TIndexHeader* pHeader = reinterpret_cast<const TIndexHeader*>(pIndexData);
+	if (!bReadOK || nSize < sizeof(TIndexHeader) || pHeader->nMagic != IndexMagic || pHeader->nVersion != IndexVersion || pHeader->nEntries > MaxSoundFonts + MaxNonSoundFonts)
+	{
+		LOGWARN("SoundFont index invalid; rebuilding");
+		delete[] pIndexData;
+		pIndexData = nullptr;
+		return nullptr;
+	}
+
+	TIndexCacheEntry* pEntries = new TIndexCacheEntry[pHeader->nEntries];
+	const u8* pData = pIndexData + sizeof(TIndexHeader);
+	const u8* const pEnd = pIndexData + nSize;
+
+	for (size_t i = 0; i < pHeader->nEntries; ++i)
+	{
+		const TIndexRecord* pRecord = reinterpret_cast<const TIndexRecord*>(pData);
+		if (pData + sizeof(TIndexRecord) > pEnd || pData + sizeof(TIndexRecord) + SerializedFXProfileSize + pRecord->nPathLength + 1 + pRecord->nNameLength + 1 > pEnd)
+		{
+			LOGWARN("SoundFont index truncated");
+			break;
+		}
+
+		const u8* pFXProfile = pData + sizeof(TIndexRecord);
+		const char* pPath = reinterpret_cast<const char*>(pFXProfile + SerializedFXProfileSize);
+		const char* pName = pPath + pRecord->nPathLength + 1;
+
+		if (pPath[pRecord->nPathLength] != '\0' || pName[pRecord->nNameLength] != '\0')
+		{
+			LOGWARN("SoundFont index corrupt");
+			break;
+		}
+
+		TIndexCacheEntry& Entry = pEntries[nEntries++];
+		Entry.pRecord    = pRecord;
+		Entry.pFXProfile = pFXProfile;
+		Entry.pPath      = pPath;
+		Entry.pName      = pName;
+		Entry.nPathHash  = Utility::HashString(pPath);
+		Entry.bUsed      = false;
+
+		pData = reinterpret_cast<const u8*>(Entry.pName) + pRecord->nNameLength + 1;
+	}
+
+	return pEntries;
+}
+
+void CSoundFontManager::SaveIndex()
+{
+	// Compute total size
+	size_t nSize = sizeof(TIndexHeader);
+	for (size_t i = 0; i < m_nSoundFonts; ++i)
+		nSize += sizeof(TIndexRecord) + SerializedFXProfileSize + m_SoundFontList[i].Path.GetLength() + 1 + m_SoundFontList[i].Name.GetLength() + 1;
+	for (size_t i = 0; i < m_nNonSoundFonts; ++i)
+		nSize += sizeof(TIndexRecord) + SerializedFXProfileSize + m_NonSoundFontList[i].Path.GetLength() + 1 + 1;
+
+	u8* const pIndexData = new u8[nSize];
+	if (!pIndexData)
+		return;
+
+	u8* pData = pIndexData;
+
+	const TIndexHeader Header = { IndexMagic, IndexVersion, static_cast<u32>(m_nSoundFonts + m_nNonSoundFonts) };
+	memcpy(pData, &Header, sizeof(Header));
+	pData += sizeof(Header);
+
+	auto WriteRecord = [&pData](const TIndexRecord& Record, const TFXProfile& FXProfile, const char* pPath, const char* pName)
+	{
+		memcpy(pData, &Record, sizeof(Record));
+		pData += sizeof(Record);
+
+		#define WRITE_MEMBER(MEMBER) WriteOptional(pData, FXProfile.MEMBER);
+		FX_PROFILE_MEMBERS(WRITE_MEMBER)
+		#undef WRITE_MEMBER
+
+		// Strings are null-terminated in the file so that they can be used in-place when loaded
+		memcpy(pData, pPath, Record.nPathLength + 1);
+		pData += Record.nPathLength + 1;
+		memcpy(pData, pName, Record.nNameLength + 1);
+		pData += Record.nNameLength + 1;
+	};
+
+	for (size_t i = 0; i < m_nSoundFonts; ++i)
+	{
+		const TSoundFontListEntry& Entry = m_SoundFontList[i];
+		const TIndexRecord Record =
+		{
+			Entry.nSize,
+			Entry.nTimestamp,
+			Entry.nFXProfileSize,
+			Entry.nFXProfileTimestamp,
+			static_cast<u8>(IndexFlagSoundFont | (Entry.bFXProfileCached ? IndexFlagFXProfileCached : 0)),
+			static_cast<u16>(Entry.Path.GetLength()),
+			static_cast<u16>(Entry.Name.GetLength())
+		};
+
+		WriteRecord(Record, Entry.FXProfile, Entry.Path, Entry.Name);
+	}
+
+	const TFXProfile EmptyFXProfile;
+	for (size_t i = 0; i < m_nNonSoundFonts; ++i)
+	{
+		const TNonSoundFontListEntry& Entry = m_NonSoundFontList[i];
+		const TIndexRecord Record = { Entry.nSize, Entry.nTimestamp, 0, 0, 0, static_cast<u16>(Entry.Path.GetLength()), 0 };
+		WriteRecord(Record, EmptyFXProfile, Entry.Path, "");
+	}
+
+	FIL File;
+	UINT nWritten;
+	if (f_open(&File, IndexFilePath, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK)
+	{
+		if (f_write(&File, pIndexData, nSize, &nWritten) != FR_OK || nWritten != nSize)
+			LOGWARN("Couldn't write SoundFont index");
+
+		f_close(&File);
+	}
 	else
-		Entry.Name = pFileName;
+		LOGWARN("Couldn't create SoundFont index");
+
+	delete[] pIndexData;
 }
 
 inline bool CSoundFontManager::SoundFontListComparator(const TSoundFontListEntry& EntryA, const TSoundFontListEntry& EntryB)
@@ -0,0 +1,388 @@
+//
+// layeredsynth.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LAYEREDSYNTH_NEON
+#endif
+
+#include <circle/logger.h>
+
+#include "lcd/ui.h"
+#include "synth/layeredsynth.h"
+#include "synth/rolandsysex.h"
+#include "utility.h"
+
+LOGMODULE("layeredsynth");
+
+CLayeredSynth::CLayeredSynth(unsigned nSampleRate, size_t nMaxFrames, size_t nMaxEvents, CMT32Synth* pMT32Synth, CSoundFontSynth* pSoundFontSynth)
+	: CSynthBase(nSampleRate),
+	  m_pMT32Synth(pMT32Synth),
+	  m_pSoundFontSynth(pSoundFontSynth),
+
+	  // MT-32 parts respond on channels 2-10 by default
+	  m_nMT32ChannelMask(0x03FE),
+	  m_nMT32CableMask(0),
+	  m_nSoundFontCableMask(0),
+
+	  m_nMT32Gain(1.0f),
+	  m_nSoundFontGain(1.0f),
+	  m_nMaxFrames(nMaxFrames),
+	  m_pMT32Bus(nullptr),
+
+	  m_nMaxEvents(nMaxEvents),
+	  m_pMT32Events(nullptr),
+	  m_pSoundFontEvents(nullptr),
+
+	  m_bParallelRendering(false),
+	  m_pMT32RenderEvents(nullptr),
+	  m_nMT32RenderEvents(0),
+	  m_nMT32RenderFrames(0)
+{
+}
+
+CLayeredSynth::~CLayeredSynth()
+{
+	delete[] m_pMT32Bus;
+	delete[] m_pMT32Events;
+	delete[] m_pSoundFontEvents;
+}
+
+bool CLayeredSynth::Initialize()
+{
+	if (!m_pMT32Synth || !m_pSoundFontSynth)
+	{
+		LOGERR("Layered mode needs both the MT-32 and SoundFont synths");
+		return false;
+	}
+
+	m_pMT32Bus         = new float[m_nMaxFrames * 2];
+	m_pMT32Events      = new TMIDIEvent[m_nMaxEvents];
+	m_pSoundFontEvents = new TMIDIEvent[m_nMaxEvents];
+
+	return m_pMT32Bus && m_pMT32Events && m_pSoundFontEvents;
+}
+
+void CLayeredSynth::HandleMIDIShortMessage(u32 nMessage)
+{
+	const TRoute Route = RouteShortMessage(nMessage, 0);
+
+	if (Route != TRoute::SoundFont)
+		m_pMT32Synth->HandleMIDIShortMessage(nMessage);
+	if (Route != TRoute::MT32)
+		m_pSoundFontSynth->HandleMIDIShortMessage(nMessage);
+
+	// Update MIDI monitor
+	CSynthBase::HandleMIDIShortMessage(nMessage);
+}
+
+void CLayeredSynth::HandleMIDIShortMessages(const u32* pMessages, size_t nCount)
+{
+	RouteShortMessages(nCount, [pMessages](size_t nIndex) { return TMIDIEvent{0, pMessages[nIndex], 0}; });
+}
+
+void CLayeredSynth::HandleMIDIEvents(const TMIDIEvent* pEvents, size_t nCount)
+{
+	RouteShortMessages(nCount, [pEvents](size_t nIndex) { return pEvents[nIndex]; });
+}
+
+void CLayeredSynth::HandleMIDISysExMessage(const u8* pData, size_t nSize)
+{
+	if (nSize < 4)
+		return;
+
+	const TRoute Route = RouteSysExMessage(pData, nSize);
+	if (Route != TRoute::SoundFont)
+		m_pMT32Synth->HandleMIDISysExMessage(pData, nSize);
+	if (Route != TRoute::MT32)
+		m_pSoundFontSynth->HandleMIDISysExMessage(pData, nSize);
+}
+
+void CLayeredSynth::ApplyMIDISysExMessage(const u8* pData, size_t nSize)
+{
+	if (nSize < 4)
+		return;
+
+	// The render core has finished with the MT-32 synth for now, so this is its only producer
+	const TRoute Route = RouteSysExMessage(pData, nSize);
+	if (Route != TRoute::SoundFont)
+		m_pMT32Synth->ApplyMIDISysExMessage(pData, nSize);
+	if (Route != TRoute::MT32)
+		m_pSoundFontSynth->ApplyMIDISysExMessage(pData, nSize);
+}
+
+bool CLayeredSynth::IsActive()
+{
+	return m_pMT32Synth->IsActive() || m_pSoundFontSynth->IsActive();
+}
+
+void CLayeredSynth::AllSoundOff()
+{
+	m_pMT32Synth->AllSoundOff();
+	m_pSoundFontSynth->AllSoundOff();
+
+	// Reset MIDI monitor
+	CSynthBase::AllSoundOff();
+}
+
+void CLayeredSynth::SetMasterVolume(u8 nVolume)
+{
+	m_pMT32Synth->SetMasterVolume(nVolume);
+	m_pSoundFontSynth->SetMasterVolume(nVolume);
+}
+
+size_t CLayeredSynth::Render(s16* pOutBuffer, size_t nFrames)
+{
+	// Integer path is only used for non-realtime rendering; render in slices and convert
+	constexpr size_t SliceFrames = 256;
+	float Buffer[SliceFrames * 2];
+	size_t nOffset = 0;
+
+	while (nOffset < nFrames)
+	{
+		const size_t nSliceFrames = Utility::Min(Utility::Min(nFrames - nOffset, SliceFrames), m_nMaxFrames);
+		s16* const pSlice = pOutBuffer + nOffset * 2;
+
+		Render(Buffer, nSliceFrames);
+		for (size_t i = 0; i < nSliceFrames * 2; ++i)
+			pSlice[i] = Utility::Clamp(Buffer[i], -1.0f, 1.0f) * 32767.0f;
+
+		nOffset += nSliceFrames;
+	}
+
+	return nFrames;
+}
+
+size_t CLayeredSynth::Render(float* pOutBuffer, size_t nFrames)
+{
+	return RenderWithMIDIEvents(pOutBuffer, nFrames, nullptr, 0);
+}
+
+size_t CLayeredSynth::RenderWithMIDIEvents(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents)
+{
+	assert(nFrames <= m_nMaxFrames);
+	assert(nEvents <= m_nMaxEvents);
+
+	// Nothing to render; apply the events straight away
+	if (!nFrames)
+	{
+		HandleMIDIEvents(pEvents, nEvents);
+		return 0;
+	}
+
+	size_t nMT32Events = 0;
+	size_t nSoundFontEvents = 0;
+
+	for (size_t i = 0; i < nEvents; ++i)
+	{
+		const TRoute Route = RouteShortMessage(pEvents[i].nMessage, pEvents[i].nCable);
+
+		if (Route != TRoute::SoundFont)
+			m_pMT32Events[nMT32Events++] = pEvents[i];
+		if (Route != TRoute::MT32)
+			m_pSoundFontEvents[nSoundFontEvents++] = pEvents[i];
+
+		// Update MIDI monitor
+		CSynthBase::HandleMIDIShortMessage(pEvents[i].nMessage);
+	}
+
+	// Hand the MT-32 synth over to the render core and render the SoundFont synth in the meantime. The render core
+	// serves one synth at a time; waiting for it to render FluidSynth's secondary instance after the MT-32 would leave
+	// both cores rendering in turn, so that instance is rendered here too.
+	RenderMT32(m_pMT32Bus, nFrames, m_pMT32Events, nMT32Events);
+	m_pSoundFontSynth->SetRenderCoreAvailable(!m_bParallelRendering);
+
+	if (nSoundFontEvents)
+		m_pSoundFontSynth->RenderWithMIDIEvents(pOutBuffer, nFrames, m_pSoundFontEvents, nSoundFontEvents);
+	else
+		m_pSoundFontSynth->Render(pOutBuffer, nFrames);
+
+	m_pSoundFontSynth->SetRenderCoreAvailable(true);
+
+	// Wait for the render core to finish, then mix
+	while (__atomic_load_n(&m_nMT32RenderFrames, __ATOMIC_ACQUIRE))
+		;
+
+	MixBuses(pOutBuffer, nFrames);
+
+	return nFrames;
+}
+
+bool CLayeredSynth::CanRenderWithMIDIMessage(u32 nMessage) const
+{
+	// The MT-32 synth can always take messages from the audio core
+	return m_pSoundFontSynth->CanRenderWithMIDIMessage(nMessage);
+}
+
+bool CLayeredSynth::CanApplyMIDISysExMessage(const u8* pData, size_t nSize) const
+{
+	// Messages too short to route are dropped either way
+	if (nSize < 4 || RouteSysExMessage(pData, nSize) == TRoute::MT32)
+		return true;
+
+	return m_pSoundFontSynth->CanApplyMIDISysExMessage(pData, nSize);
+}
+
+void CLayeredSynth::ReportStatus() const
+{
+	if (m_pUI)
+		m_pUI->ShowSystemMessage("MT-32 + SoundFont");
+}
+
+void CLayeredSynth::UpdateLCD(CLCD& LCD, unsigned int nTicks)
+{
+	const u8 nBarHeight = LCD.Height();
+	float ChannelLevels[16], PeakLevels[16];
+	m_MIDIMonitor.GetChannelLevels(nTicks, ChannelLevels, PeakLevels);
+	CUserInterface::DrawChannelLevels(LCD, nBarHeight, ChannelLevels, PeakLevels, 16, true);
+}
+
+void CLayeredSynth::SetCables(u16 nMT32CableMask, u16 nSoundFontCableMask)
+{
+	// A cable can only be given to one synth
+	m_nMT32CableMask      = nMT32CableMask;
+	m_nSoundFontCableMask = nSoundFontCableMask & ~nMT32CableMask;
+}
+
+void CLayeredSynth::SetGains(float nMT32Gain, float nSoundFontGain)
+{
+	m_nMT32Gain      = nMT32Gain;
+	m_nSoundFontGain = nSoundFontGain;
+}
+
+void CLayeredSynth::RenderSecondary()
+{
+	// The audio core waits for the request to complete, so the request can be read safely
+	const size_t nFrames = __atomic_load_n(&m_nMT32RenderFrames, __ATOMIC_ACQUIRE);
+	if (!nFrames)
+		return;
+
+	if (m_nMT32RenderEvents)
+		m_pMT32Synth->RenderWithMIDIEvents(m_pMT32Bus, nFrames, m_pMT32RenderEvents, m_nMT32RenderEvents);
+	else
+		m_pMT32Synth->Render(m_pMT32Bus, nFrames);
+
+	__atomic_store_n(&m_nMT32RenderFrames, 0, __ATOMIC_RELEASE);
+}
+
+CLayeredSynth::TRoute CLayeredSynth::RouteShortMessage(u32 nMessage, u8 nCable) const
+{
+	const u8 nStatus = nMessage & 0xFF;
+	const u16 nCableBit = 1 << (nCable & 0x0F);
+
+	if (m_nMT32CableMask & nCableBit)
+		return TRoute::MT32;
+
+	if (m_nSoundFontCableMask & nCableBit)
+		return TRoute::SoundFont;
+
+	// System messages (e.g. reset) go to both synths
+	if (nStatus >= 0xF0)
+		return TRoute::Both;
+
+	return m_nMT32ChannelMask & (1 << (nStatus & 0x0F)) ? TRoute::MT32 : TRoute::SoundFont;
+}
+
+CLayeredSynth::TRoute CLayeredSynth::RouteSysExMessage(const u8* pData, size_t nSize)
+{
+	const auto* pHeader = reinterpret_cast<const TRolandSysExHeader*>(pData + 1);
+	const bool bUniversal = pHeader->ManufacturerID == TManufacturerID::UniversalNonRealTime || pHeader->ManufacturerID == TManufacturerID::UniversalRealTime;
+	const bool bMT32 = pHeader->ManufacturerID == TManufacturerID::Roland && pHeader->ModelID == TRolandModelID::MT32;
+
+	// MT-32 messages go to the MT-32 synth, universal messages (e.g. GM System On) to both,
+	// and everything else (e.g. GS/XG) to the SoundFont synth
+	if (bMT32)
+		return TRoute::MT32;
+
+	return bUniversal ? TRoute::Both : TRoute::SoundFont;
+}
+
+template <class TGetEvent>
+void CLayeredSynth::RouteShortMessages(size_t nCount, TGetEvent GetEvent)
+{
+	u32 MT32Messages[MessageBatchSize];
+	u32 SoundFontMessages[MessageBatchSize];
+
+	for (size_t nOffset = 0; nOffset < nCount; nOffset += MessageBatchSize)
+	{
+		const size_t nBatchSize = Utility::Min(nCount - nOffset, MessageBatchSize);
+		size_t nMT32Messages = 0;
+		size_t nSoundFontMessages = 0;
+
+		for (size_t i = 0; i < nBatchSize; ++i)
+		{
+			const TMIDIEvent Event = GetEvent(nOffset + i);
+			const TRoute Route = RouteShortMessage(Event.nMessage, Event.nCable);
+
+			if (Route != TRoute::SoundFont)
+				MT32Messages[nMT32Messages++] = Event.nMessage;
+			if (Route != TRoute::MT32)
+				SoundFontMessages[nSoundFontMessages++] = Event.nMessage;
+
+			// Update MIDI monitor
+			CSynthBase::HandleMIDIShortMessage(Event.nMessage);
+		}
+
+		if (nMT32Messages)
+			m_pMT32Synth->HandleMIDIShortMessages(MT32Messages, nMT32Messages);
+		if (nSoundFontMessages)
+			m_pSoundFontSynth->HandleMIDIShortMessages(SoundFontMessages, nSoundFontMessages);
+	}
+}
+
+void CLayeredSynth::RenderMT32(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents)
+{
+	if (m_bParallelRendering)
+	{
+		m_pMT32RenderEvents = pEvents;
+		m_nMT32RenderEvents = nEvents;
+		__atomic_store_n(&m_nMT32RenderFrames, nFrames, __ATOMIC_RELEASE);
+	}
+	else if (nEvents)
+		m_pMT32Synth->RenderWithMIDIEvents(pOutBuffer, nFrames, pEvents, nEvents);
+	else
+		m_pMT32Synth->Render(pOutBuffer, nFrames);
+}
+
+void CLayeredSynth::MixBuses(float* pOutBuffer, size_t nFrames) const
+{
+	const size_t nSamples = nFrames * 2;
+	size_t i = 0;
+
+#ifdef LAYEREDSYNTH_NEON
+	constexpr size_t nSamplesPerIteration = 8;
+	const size_t nVectorSamples = nSamples & ~(nSamplesPerIteration - 1);
+
+	for (; i < nVectorSamples; i += nSamplesPerIteration)
+	{
+		const float32x4_t vLow  = vmulq_n_f32(vld1q_f32(pOutBuffer + i), m_nSoundFontGain);
+		const float32x4_t vHigh = vmulq_n_f32(vld1q_f32(pOutBuffer + i + 4), m_nSoundFontGain);
+		vst1q_f32(pOutBuffer + i, vmlaq_n_f32(vLow, vld1q_f32(m_pMT32Bus + i), m_nMT32Gain));
+		vst1q_f32(pOutBuffer + i + 4, vmlaq_n_f32(vHigh, vld1q_f32(m_pMT32Bus + i + 4), m_nMT32Gain));
+	}
+#endif
+
+	// Remaining samples
+	for (; i < nSamples; ++i)
+		pOutBuffer[i] = pOutBuffer[i] * m_nSoundFontGain + m_pMT32Bus[i] * m_nMT32Gain;
+}
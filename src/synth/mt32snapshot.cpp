@@ -0,0 +1,183 @@
+//
+// mt32snapshot.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <circle/logger.h>
+#include <circle/string.h>
+#include <circle/util.h>
+#include <fatfs/ff.h>
+
+#include "synth/mt32snapshot.h"
+
+LOGMODULE("mt32snapshot");
+
+const char SnapshotDirectory[] = "SD:snapshots";
+
+constexpr char SnapshotMagic[4] = { 'M', 'T', 'S', 'S' };
+constexpr u8 SnapshotVersion    = 1;
+
+// Followed by the data of each region, prefixed with its address
+struct TSnapshotHeader
+{
+	char Magic[4];
+	u8 nVersion;
+	u8 ROMSet;
+	u16 nReserved;
+	u32 nDataSize;
+}
+PACKED;
+
+// Restored in this order; a part's timbre is reloaded from timbre memory when its temporary patch is written, so the
+// temporary timbres must come after both
+const CMT32Snapshot::TRegion CMT32Snapshot::Regions[RegionCount] =
+{
+	{ 0x100000, 0x17     }, // System area
+	{ 0x080000, 64 * 256 }, // Timbre memory
+	{ 0x050000, 128 * 8  }, // Patch memory
+	{ 0x030110, 85 * 4   }, // Rhythm setup
+	{ 0x030000, 9 * 16   }, // Patch temp
+	{ 0x040000, 8 * 246  }, // Timbre temp
+};
+
+static void GetFilePath(u8 nSlot, CString& FilePath)
+{
+	FilePath.Format("%s/mt32_%03d.bin", SnapshotDirectory, nSlot);
+}
+
+CMT32Snapshot::CMT32Snapshot()
+	: m_bValid(false),
+	  m_ROMSet(TMT32ROMSet::Any)
+{
+}
+
+void CMT32Snapshot::Capture(MT32Emu::Synth& Synth, TMT32ROMSet ROMSet)
+{
+	u8* pRecord = m_Data;
+
+	for (const TRegion& Region : Regions)
+	{
+		pRecord[0] = Region.nAddress >> 16 & 0x7F;
+		pRecord[1] = Region.nAddress >> 8 & 0x7F;
+		pRecord[2] = Region.nAddress & 0x7F;
+
+		// mt32emu addresses its memory with the 7-bit address bytes packed together
+		const u32 nLinearAddress = pRecord[0] << 14 | pRecord[1] << 7 | pRecord[2];
+		Synth.readMemory(nLinearAddress, Region.nSize, pRecord + 3);
+
+		pRecord += 3 + Region.nSize;
+	}
+
+	m_ROMSet = ROMSet;
+	m_bValid = true;
+}
+
+void CMT32Snapshot::Restore(MT32Emu::Synth& Synth) const
+{
+	const u8* pRecord = m_Data;
+
+	for (const TRegion& Region : Regions)
+	{
+		Synth.writeSysex(0x10, pRecord, 3 + Region.nSize);
+		pRecord += 3 + Region.nSize;
+	}
+}
+
+bool CMT32Snapshot::Save(u8 nSlot) const
+{
+	if (!m_bValid)
+		return false;
+
+	const FRESULT Result = f_mkdir(SnapshotDirectory);
+	if (Result != FR_OK && Result != FR_EXIST)
+	{
+		LOGERR("Couldn't create '%s' (error %d)", SnapshotDirectory, Result);
+		return false;
+	}
+
+	CString FilePath;
+	GetFilePath(nSlot, FilePath);
+
+	FIL File;
+	if (f_open(&File, FilePath, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+	{
+		LOGERR("Couldn't create '%s'", static_cast<const char*>(FilePath));
+		return false;
+	}
+
+	TSnapshotHeader Header;
+	memcpy(Header.Magic, SnapshotMagic, sizeof(Header.Magic));
+	Header.nVersion  = SnapshotVersion;
+	Header.ROMSet    = static_cast<u8>(m_ROMSet);
+	Header.nReserved = 0;
+	Header.nDataSize = DataSize;
+
+	UINT nHeaderBytesWritten, nDataBytesWritten;
+	const bool bSuccess = f_write(&File, &Header, sizeof(Header), &nHeaderBytesWritten) == FR_OK &&
+			      f_write(&File, m_Data, DataSize, &nDataBytesWritten) == FR_OK &&
+			      nHeaderBytesWritten == sizeof(Header) && nDataBytesWritten == DataSize;
+
+	if (f_close(&File) != FR_OK || !bSuccess)
+	{
+		LOGERR("Couldn't write '%s'", static_cast<const char*>(FilePath));
+		return false;
+	}
+
+	LOGNOTE("Saved '%s'", static_cast<const char*>(FilePath));
+	return true;
+}
+
+bool CMT32Snapshot::Load(u8 nSlot)
+{
+	CString FilePath;
+	GetFilePath(nSlot, FilePath);
+
+	FIL File;
+	if (f_open(&File, FilePath, FA_READ) != FR_OK)
+	{
+		LOGERR("Couldn't open '%s'", static_cast<const char*>(FilePath));
+		return false;
+	}
+
+	// The buffer is overwritten below, so it's only valid again if everything is read
+	m_bValid = false;
+
+	TSnapshotHeader Header;
+	UINT nBytesRead;
+	bool bSuccess = f_read(&File, &Header, sizeof(Header), &nBytesRead) == FR_OK && nBytesRead == sizeof(Header) &&
+			!memcmp(Header.Magic, SnapshotMagic, sizeof(Header.Magic)) && Header.nVersion == SnapshotVersion &&
+			Header.ROMSet < static_cast<u8>(TMT32ROMSet::Any) && Header.nDataSize == DataSize;
+
+	if (bSuccess)
+		bSuccess = f_read(&File, m_Data, DataSize, &nBytesRead) == FR_OK && nBytesRead == DataSize;
+
+	f_close(&File);
+
+	if (!bSuccess)
+	{
+		LOGERR("'%s' isn't a valid snapshot", static_cast<const char*>(FilePath));
+		return false;
+	}
+
+	m_ROMSet = static_cast<TMT32ROMSet>(Header.ROMSet);
+	m_bValid = true;
+	return true;
+}
@@ -21,7 +21,10 @@
 //
 
 #include <circle/logger.h>
+#include <circle/machineinfo.h>
+#include <circle/memory.h>
 #include <circle/timer.h>
+#include <fatfs/ff.h>
 
 #include "config.h"
 #include "lcd/ui.h"
@@ -36,6 +39,43 @@ constexpr size_t ROMOffsetVersionStringNew  = 0x2206;
 constexpr u32 MemoryAddressMIDIChannels     = 0x4000D;
 constexpr u32 MemoryAddressMasterVolume     = 0x40016;
 
+// Render load measurements for the quality profiles; only valid for the same hardware and audio settings
+const char ProfileCachePath[] = "SD:.mt32emu_profiles";
+constexpr u32 ProfileCacheMagic   = 'M' | 'T' << 8 | 'P' << 16 | 'F' << 24;
+constexpr u32 ProfileCacheVersion = 2;
+
+// Audio rendered by each profile benchmark; notes are struck again periodically to keep every partial busy
+constexpr unsigned int ProfileBenchmarkWarmupMillis    = 50;
+constexpr unsigned int ProfileBenchmarkMillis          = 250;
+constexpr unsigned int ProfileBenchmarkRetriggerMillis = 100;
+
+// Followed by the load of each profile
+struct TProfileCacheHeader
+{
+	u32 nMagic;
+	u32 nVersion;
+	u32 nSampleRate;
+	u32 nChunkFrames;
+	u32 nResamplerQuality;
+	char MachineName[64];
+}
+PACKED;
+
+// Benchmark instances have nothing to report
+class CSilentReportHandler : public MT32Emu::ReportHandler
+{
+	virtual void printDebug(const char* pFmt, va_list pList) override {}
+};
+
+const CMT32Synth::TProfileSettings CMT32Synth::Profiles[ProfileCount] =
+{
+	{ "minimal",  TRendererType::Integer, TAnalogOutputMode::DigitalOnly, TResamplerQuality::Fastest, 24 },
+	{ "low",      TRendererType::Integer, TAnalogOutputMode::DigitalOnly, TResamplerQuality::Fast,    32 },
+	{ "standard", TRendererType::Integer, TAnalogOutputMode::Coarse,      TResamplerQuality::Good,    32 },
+	{ "high",     TRendererType::Float,   TAnalogOutputMode::Accurate,    TResamplerQuality::Good,    32 },
+	{ "best",     TRendererType::Float,   TAnalogOutputMode::Oversampled, TResamplerQuality::Best,    32 },
+};
+
 // SysEx commands for setting MIDI channel assignment (no SysEx framing, just 3-byte address and 9 channel values)
 const u8 CMT32Synth::StandardMIDIChannelsSysEx[] = { 0x10, 0x00, 0x0D, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09 };
 const u8 CMT32Synth::AlternateMIDIChannelsSysEx[] = { 0x10, 0x00, 0x0D, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x09 };
@@ -47,25 +87,44 @@ CMT32Synth::CMT32Synth(unsigned nSampleRate, float nGain, float nReverbGain, TRe
 
 	  m_nGain(nGain),
 	  m_nReverbGain(nReverbGain),
+	  m_bReversedStereo(false),
 
 	  m_ResamplerQuality(ResamplerQuality),
+	  m_AnalogOutputMode(TAnalogOutputMode::Coarse),
+	  m_RendererType(TRendererType::Integer),
+	  m_nPartials(MT32Emu::DEFAULT_MAX_PARTIALS),
 	  m_pSampleRateConverter(nullptr),
 
 	  m_CurrentROMSet(TMT32ROMSet::Any),
 	  m_pControlROMImage(nullptr),
 	  m_pPCMROMImage(nullptr),
 
+	  m_nPreloadROMSetMask(0),
+	  m_Instances{},
+
+	  m_bSkipRedundantSysEx(false),
+
+	  m_MIDIQueueLock(TASK_LEVEL),
+	  m_nMIDIQueueSize(MT32Emu::DEFAULT_MIDI_EVENT_QUEUE_SIZE),
+	  m_nMIDIQueueTimeoutMicros(0),
+	  m_bMIDIQueueBlocked(false),
+	  m_nMIDIQueueDepth(0),
+	  m_MIDIQueueStats{},
+
 	  m_LCDTextBuffer{'\0'}
 {
 }
 
 CMT32Synth::~CMT32Synth()
 {
+	if (m_pSampleRateConverter)
+		delete m_pSampleRateConverter;
+
 	if (m_pSynth)
 		delete m_pSynth;
 
-	if (m_pSampleRateConverter)
-		delete m_pSampleRateConverter;
+	for (TROMSetInstance& Instance : m_Instances)
+		CloseInstance(Instance);
 }
 
 bool CMT32Synth::Initialize()
@@ -81,56 +140,143 @@ bool CMT32Synth::Initialize()
 	if (!m_ROMManager.GetROMSet(InitialROMSet, m_CurrentROMSet, m_pControlROMImage, m_pPCMROMImage))
 		return false;
 
-	m_pSynth = new MT32Emu::Synth(this);
+	// Choose renderer settings before any instance is opened; may benchmark them using the ROMs just found
+	ApplyProfile();
 
-	if (!m_pSynth->open(*m_pControlROMImage, *m_pPCMROMImage))
+	TROMSetInstance& Instance = m_Instances[static_cast<size_t>(m_CurrentROMSet)];
+	Instance.pControlROMImage = m_pControlROMImage;
+	Instance.pPCMROMImage     = m_pPCMROMImage;
+
+	if (!OpenInstance(Instance))
 		return false;
 
-	m_pSynth->setOutputGain(m_nGain);
-	m_pSynth->setReverbOutputGain(m_nReverbGain);
+	// The active instance is owned by m_pSynth and m_pSampleRateConverter until it is swapped out
+	m_pSynth               = Instance.pSynth;
+	m_pSampleRateConverter = Instance.pSampleRateConverter;
+	Instance.pSynth               = nullptr;
+	Instance.pSampleRateConverter = nullptr;
 
-	if (m_ResamplerQuality != TResamplerQuality::None)
+	return true;
+}
+
+template <class TPlayFunction>
+bool CMT32Synth::QueueMIDIMessage(TPlayFunction PlayMessage)
+{
+	// Each attempt is made under the producer lock, which is released again while waiting
+	auto TryPlayMessage = [&]
 	{
-		auto quality = MT32Emu::SamplerateConversionQuality_GOOD;
-		switch (m_ResamplerQuality)
-		{
-			case TResamplerQuality::Fastest:
-				quality = MT32Emu::SamplerateConversionQuality_FASTEST;
-				break;
+		m_MIDIQueueLock.Acquire();
+		const bool bResult = PlayMessage();
+		m_MIDIQueueLock.Release();
+		return bResult;
+	};
 
-			case TResamplerQuality::Fast:
-				quality = MT32Emu::SamplerateConversionQuality_FAST;
-				break;
+	bool bQueued = TryPlayMessage();
 
-			case TResamplerQuality::Good:
-				quality = MT32Emu::SamplerateConversionQuality_GOOD;
-				break;
+	// The queue is full; wait for the audio core to drain it. Nothing else is read from the MIDI inputs in the meantime,
+	// so incoming data is held in their receive buffers instead of being lost here.
+	if (!bQueued && !m_bMIDIQueueBlocked && m_nMIDIQueueTimeoutMicros)
+	{
+		const unsigned int nStartTicks = CTimer::GetClockTicks();
+		unsigned int nStallMicros;
 
-			case TResamplerQuality::Best:
-				quality = MT32Emu::SamplerateConversionQuality_BEST;
-				break;
+		do
+		{
+			CTimer::SimpleusDelay(MIDIQueueRetryMicros);
+			bQueued = TryPlayMessage();
+			nStallMicros = CTimer::GetClockTicks() - nStartTicks;
+		} while (!bQueued && nStallMicros < m_nMIDIQueueTimeoutMicros);
+
+		++m_MIDIQueueStats.nStalls;
+		m_MIDIQueueStats.nStallMicros += nStallMicros;
+		m_MIDIQueueStats.nMaxStallMicros = Utility::Max(m_MIDIQueueStats.nMaxStallMicros, nStallMicros);
 
-			default:
-				break;
+		// Don't wait again until there's room, or every following message would hold up MIDI input for the full timeout
+		if (!bQueued)
+		{
+			LOGWARN("MIDI queue stalled for %dms; dropping messages", nStallMicros / 1000);
+			m_bMIDIQueueBlocked = true;
 		}
+	}
 
-		m_pSampleRateConverter = new MT32Emu::SampleRateConverter(*m_pSynth, m_nSampleRate, quality);
+	if (!bQueued)
+	{
+		__atomic_add_fetch(&m_MIDIQueueStats.nDropped, 1, __ATOMIC_RELAXED);
+		return false;
 	}
 
+	m_bMIDIQueueBlocked = false;
+
+	const u32 nDepth = __atomic_add_fetch(&m_nMIDIQueueDepth, 1, __ATOMIC_RELAXED);
+	m_MIDIQueueStats.nPeakDepth = Utility::Max(m_MIDIQueueStats.nPeakDepth, nDepth);
+
 	return true;
 }
 
 void CMT32Synth::HandleMIDIShortMessage(u32 nMessage)
 {
-	m_pSynth->playMsg(nMessage);
+	QueueMIDIMessage([&] { return m_pSynth->playMsg(nMessage); });
 
 	// Update MIDI monitor
 	CSynthBase::HandleMIDIShortMessage(nMessage);
 }
 
+void CMT32Synth::HandleMIDIShortMessages(const u32* pMessages, size_t nCount)
+{
+	for (size_t i = 0; i < nCount; ++i)
+		QueueMIDIMessage([&] { return m_pSynth->playMsg(pMessages[i]); });
+
+	// Update MIDI monitor
+	m_MIDIMonitor.OnShortMessages(pMessages, nCount);
+}
+
 void CMT32Synth::HandleMIDISysExMessage(const u8* pData, size_t nSize)
 {
-	m_pSynth->playSysex(pData, nSize);
+	// The cache is shared with the rendering core, and is only used under the producer lock
+	m_MIDIQueueLock.Acquire();
+	const bool bRedundant = m_bSkipRedundantSysEx && m_SysExCache.IsRedundant(pData, nSize);
+	m_MIDIQueueLock.Release();
+
+	if (bRedundant)
+		return;
+
+	// The cache assumes that everything it has seen reaches the synth
+	if (!QueueMIDIMessage([&] { return m_pSynth->playSysex(pData, nSize); }))
+		ClearSysExCache();
+}
+
+void CMT32Synth::ApplyMIDISysExMessage(const u8* pData, size_t nSize)
+{
+	m_Lock.Acquire();
+	m_MIDIQueueLock.Acquire();
+
+	if (!m_bSkipRedundantSysEx || !m_SysExCache.IsRedundant(pData, nSize))
+	{
+		// Rendering has caught up with this message, so anything still queued is due; apply it to make room rather than
+		// waiting for this core to drain the queue
+		bool bQueued = m_pSynth->playSysex(pData, nSize);
+		if (!bQueued)
+		{
+			m_pSynth->flushMIDIQueue();
+			bQueued = m_pSynth->playSysex(pData, nSize);
+		}
+
+		if (!bQueued)
+		{
+			__atomic_add_fetch(&m_MIDIQueueStats.nDropped, 1, __ATOMIC_RELAXED);
+			m_SysExCache.Clear();
+		}
+	}
+
+	m_MIDIQueueLock.Release();
+	m_Lock.Release();
+}
+
+void CMT32Synth::ClearSysExCache()
+{
+	m_MIDIQueueLock.Acquire();
+	m_SysExCache.Clear();
+	m_MIDIQueueLock.Release();
 }
 
 void CMT32Synth::AllSoundOff()
@@ -152,6 +298,7 @@ void CMT32Synth::SetMasterVolume(u8 nVolume)
 size_t CMT32Synth::Render(s16* pOutBuffer, size_t nFrames)
 {
 	m_Lock.Acquire();
+	__atomic_store_n(&m_nMIDIQueueDepth, 0, __ATOMIC_RELAXED);
 	if (m_pSampleRateConverter)
 		m_pSampleRateConverter->getOutputSamples(pOutBuffer, nFrames);
 	else
@@ -164,10 +311,46 @@ size_t CMT32Synth::Render(s16* pOutBuffer, size_t nFrames)
 size_t CMT32Synth::Render(float* pOutBuffer, size_t nFrames)
 {
 	m_Lock.Acquire();
+	__atomic_store_n(&m_nMIDIQueueDepth, 0, __ATOMIC_RELAXED);
+	if (m_pSampleRateConverter)
+		m_pSampleRateConverter->getOutputSamples(pOutBuffer, nFrames);
+	else
+		m_pSynth->render(pOutBuffer, nFrames);
+	m_Lock.Release();
+
+	return nFrames;
+}
+
+size_t CMT32Synth::RenderWithMIDIEvents(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents)
+{
+	m_Lock.Acquire();
+
+	// Everything queued so far is due, and will be applied by this render
+	__atomic_store_n(&m_nMIDIQueueDepth, 0, __ATOMIC_RELAXED);
+
+	// mt32emu schedules timestamped messages itself; timestamps are in samples at the synth's internal sample rate
+	const MT32Emu::Bit32u nBaseTimestamp = m_pSynth->getInternalRenderedSampleCount();
+	m_MIDIQueueLock.Acquire();
+	for (size_t i = 0; i < nEvents; ++i)
+	{
+		double nOffset = pEvents[i].nTimestamp;
+		if (m_pSampleRateConverter)
+			nOffset = m_pSampleRateConverter->convertOutputToSynthTimestamp(nOffset);
+
+		// Can't wait for room here; only this core drains the queue
+		if (!m_pSynth->playMsg(pEvents[i].nMessage, nBaseTimestamp + static_cast<MT32Emu::Bit32u>(nOffset)))
+			__atomic_add_fetch(&m_MIDIQueueStats.nDropped, 1, __ATOMIC_RELAXED);
+
+		// Update MIDI monitor
+		CSynthBase::HandleMIDIShortMessage(pEvents[i].nMessage);
+	}
+	m_MIDIQueueLock.Release();
+
 	if (m_pSampleRateConverter)
 		m_pSampleRateConverter->getOutputSamples(pOutBuffer, nFrames);
 	else
 		m_pSynth->render(pOutBuffer, nFrames);
+
 	m_Lock.Release();
 
 	return nFrames;
@@ -224,8 +407,78 @@ void CMT32Synth::SetMIDIChannels(TMIDIChannels Channels)
 		m_pSynth->writeSysex(0x10, AlternateMIDIChannelsSysEx, sizeof(AlternateMIDIChannelsSysEx));
 }
 
+void CMT32Synth::SetReversedStereo(bool bEnabled)
+{
+	// Also applied to preloaded instances when they are swapped in
+	m_bReversedStereo = bEnabled;
+	m_pSynth->setReversedStereoEnabled(bEnabled);
+}
+
+void CMT32Synth::SetMIDIQueue(unsigned int nSize, unsigned int nTimeoutMillis)
+{
+	m_nMIDIQueueTimeoutMicros = nTimeoutMillis * 1000;
+
+	// mt32emu rounds the size up to a power of 2; any queued messages are applied before the queue is reallocated
+	m_Lock.Acquire();
+	m_nMIDIQueueSize = m_pSynth->setMIDIEventQueueSize(nSize);
+	m_Lock.Release();
+}
+
+void CMT32Synth::GetMIDIQueueStats(TMIDIQueueStats& Stats) const
+{
+	Stats = m_MIDIQueueStats;
+	Stats.nSize = m_nMIDIQueueSize;
+	Stats.nDropped = __atomic_load_n(&m_MIDIQueueStats.nDropped, __ATOMIC_RELAXED);
+}
+
+void CMT32Synth::SetPreloadROMSets(u8 nMask)
+{
+	m_nPreloadROMSetMask = nMask;
+
+	// Queue available ROM sets for opening by UpdatePreloadedROMSets(); called again after a ROM rescan to pick up new sets
+	for (size_t i = 0; i < ROMSetCount; ++i)
+	{
+		const TMT32ROMSet ROMSet = static_cast<TMT32ROMSet>(i);
+		TROMSetInstance& Instance = m_Instances[i];
+		TMT32ROMSet FoundROMSet;
+
+		if (!(nMask & (1 << i)) || ROMSet == m_CurrentROMSet || __atomic_load_n(&Instance.State, __ATOMIC_ACQUIRE) != TInstanceState::Closed)
+			continue;
+
+		if (!m_ROMManager.GetROMSet(ROMSet, FoundROMSet, Instance.pControlROMImage, Instance.pPCMROMImage))
+			continue;
+
+		__atomic_store_n(&Instance.State, TInstanceState::Pending, __ATOMIC_RELEASE);
+	}
+}
+
+bool CMT32Synth::UpdatePreloadedROMSets()
+{
+	// Instances swapped out by the main task are no longer in use once the LCD has been updated with the current one
+	for (TROMSetInstance& Instance : m_Instances)
+	{
+		if (__atomic_load_n(&Instance.State, __ATOMIC_ACQUIRE) == TInstanceState::Retired)
+			CloseInstance(Instance);
+	}
+
+	// Open one pending instance per call; this takes a while, so it must be called from a core with nothing time-critical to do
+	for (TROMSetInstance& Instance : m_Instances)
+	{
+		TInstanceState Expected = TInstanceState::Pending;
+		if (!__atomic_compare_exchange_n(&Instance.State, &Expected, TInstanceState::Opening, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+
+		const bool bOpened = OpenInstance(Instance);
+		__atomic_store_n(&Instance.State, bOpened ? TInstanceState::Ready : TInstanceState::Closed, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	return false;
+}
+
 bool CMT32Synth::SwitchROMSet(TMT32ROMSet ROMSet)
 {
+	TMT32ROMSet NewROMSet;
 	const MT32Emu::ROMImage* pControlROMImage;
 	const MT32Emu::ROMImage* pPCMROMImage;
 
@@ -238,23 +491,374 @@ bool CMT32Synth::SwitchROMSet(TMT32ROMSet ROMSet)
 	}
 
 	// Get ROM set if available
-	if (!m_ROMManager.GetROMSet(ROMSet, m_CurrentROMSet, pControlROMImage, pPCMROMImage))
+	if (!m_ROMManager.GetROMSet(ROMSet, NewROMSet, pControlROMImage, pPCMROMImage))
 	{
 		if (m_pUI)
 			m_pUI->ShowSystemMessage("ROM set not avail!");
 		return false;
 	}
 
+	if (m_nPreloadROMSetMask)
+		return SwapROMSet(NewROMSet, pControlROMImage, pPCMROMImage);
+
 	// Reopen synth with new ROMs
 	m_Lock.Acquire();
 	m_pSynth->close();
-	assert(m_pSynth->open(*pControlROMImage, *pPCMROMImage));
+	assert(m_pSynth->open(*pControlROMImage, *pPCMROMImage, m_nPartials, static_cast<MT32Emu::AnalogOutputMode>(m_AnalogOutputMode)));
 	m_pSynth->setOutputGain(m_nGain);
 	m_pSynth->setReverbOutputGain(m_nReverbGain);
 	m_Lock.Release();
 
+	m_CurrentROMSet    = NewROMSet;
 	m_pControlROMImage = pControlROMImage;
 	m_pPCMROMImage     = pPCMROMImage;
+	ClearSysExCache();
+
+	return true;
+}
+
+bool CMT32Synth::SwapROMSet(TMT32ROMSet ROMSet, const MT32Emu::ROMImage* pControlROMImage, const MT32Emu::ROMImage* pPCMROMImage)
+{
+	TROMSetInstance& Instance = m_Instances[static_cast<size_t>(ROMSet)];
+
+	// Use the preloaded instance, or open it here if the UI core has nothing to do with it; the current ROM set keeps
+	// playing until the swap
+	while (true)
+	{
+		TInstanceState State = __atomic_load_n(&Instance.State, __ATOMIC_ACQUIRE);
+		if (State == TInstanceState::Ready)
+			break;
+
+		// A pending or retired instance may still be drawn on the LCD; rather than hold up MIDI processing until the UI
+		// core has finished with it, the switch can be retried
+		if (State != TInstanceState::Closed)
+		{
+			if (m_pUI)
+				m_pUI->ShowSystemMessage("ROM set loading...");
+			return false;
+		}
+
+		if (!__atomic_compare_exchange_n(&Instance.State, &State, TInstanceState::Opening, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+
+		Instance.pControlROMImage = pControlROMImage;
+		Instance.pPCMROMImage     = pPCMROMImage;
+
+		if (!OpenInstance(Instance))
+		{
+			__atomic_store_n(&Instance.State, TInstanceState::Closed, __ATOMIC_RELEASE);
+			if (m_pUI)
+				m_pUI->ShowSystemMessage("ROM set not avail!");
+			return false;
+		}
+
+		break;
+	}
+
+	Instance.pSynth->setOutputGain(m_nGain);
+	Instance.pSynth->setReverbOutputGain(m_nReverbGain);
+	Instance.pSynth->setReversedStereoEnabled(m_bReversedStereo);
+
+	// Swap at a block boundary
+	m_Lock.Acquire();
+	MT32Emu::Synth* pPreviousSynth = m_pSynth;
+	MT32Emu::SampleRateConverter* pPreviousSampleRateConverter = m_pSampleRateConverter;
+	m_pSynth = Instance.pSynth;
+	m_pSampleRateConverter = Instance.pSampleRateConverter;
+	m_Lock.Release();
+
+	Instance.pSynth               = nullptr;
+	Instance.pSampleRateConverter = nullptr;
+	__atomic_store_n(&Instance.State, TInstanceState::Closed, __ATOMIC_RELEASE);
+
+	// Hand the previous instance back to its slot; if it's kept preloaded, reopen it in the background so that it starts afresh next time
+	TROMSetInstance& PreviousInstance = m_Instances[static_cast<size_t>(m_CurrentROMSet)];
+	PreviousInstance.pSynth               = pPreviousSynth;
+	PreviousInstance.pSampleRateConverter = pPreviousSampleRateConverter;
+	PreviousInstance.pControlROMImage     = m_pControlROMImage;
+	PreviousInstance.pPCMROMImage         = m_pPCMROMImage;
+
+	// Otherwise it is deleted by the UI core, which may still be drawing its display state
+	if (m_nPreloadROMSetMask & (1 << static_cast<u8>(m_CurrentROMSet)))
+		__atomic_store_n(&PreviousInstance.State, TInstanceState::Pending, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&PreviousInstance.State, TInstanceState::Retired, __ATOMIC_RELEASE);
+
+	m_CurrentROMSet    = ROMSet;
+	m_pControlROMImage = pControlROMImage;
+	m_pPCMROMImage     = pPCMROMImage;
+	ClearSysExCache();
+
+	return true;
+}
+
+bool CMT32Synth::OpenInstance(TROMSetInstance& Instance)
+{
+	const size_t nFreeBefore = CMemorySystem::Get()->GetHeapFreeSpace(HEAP_ANY);
+
+	// An instance that has been played is reopened rather than recreated, reusing its memory
+	if (Instance.pSynth)
+		Instance.pSynth->close();
+	else
+		Instance.pSynth = new MT32Emu::Synth(this);
+
+	Instance.pSynth->setMIDIEventQueueSize(m_nMIDIQueueSize);
+	Instance.pSynth->setSelectedRendererType(static_cast<MT32Emu::RendererType>(m_RendererType));
+
+	if (!Instance.pSynth->open(*Instance.pControlROMImage, *Instance.pPCMROMImage, m_nPartials, static_cast<MT32Emu::AnalogOutputMode>(m_AnalogOutputMode)))
+	{
+		LOGERR("Failed to open %s", GetControlROMName(Instance.pControlROMImage));
+		CloseInstance(Instance);
+		return false;
+	}
+
+	Instance.pSynth->setOutputGain(m_nGain);
+	Instance.pSynth->setReverbOutputGain(m_nReverbGain);
+	Instance.pSynth->setReversedStereoEnabled(m_bReversedStereo);
+
+	if (!Instance.pSampleRateConverter)
+		Instance.pSampleRateConverter = CreateSampleRateConverter(*Instance.pSynth, m_ResamplerQuality);
+
+	// Approximate, as other cores may allocate at the same time; only meaningful for a newly created instance
+	if (!Instance.nMemoryBytes)
+	{
+		const size_t nFreeAfter = CMemorySystem::Get()->GetHeapFreeSpace(HEAP_ANY);
+		Instance.nMemoryBytes = nFreeBefore > nFreeAfter ? nFreeBefore - nFreeAfter : 0;
+		LOGNOTE("Opened %s (%d KB)", GetControlROMName(Instance.pControlROMImage), Instance.nMemoryBytes / KILOBYTE);
+	}
+
+	return true;
+}
+
+void CMT32Synth::CloseInstance(TROMSetInstance& Instance)
+{
+	// The converter refers to the synth, so it must go first
+	if (Instance.pSampleRateConverter)
+	{
+		delete Instance.pSampleRateConverter;
+		Instance.pSampleRateConverter = nullptr;
+	}
+
+	if (Instance.pSynth)
+	{
+		delete Instance.pSynth;
+		Instance.pSynth = nullptr;
+	}
+
+	__atomic_store_n(&Instance.State, TInstanceState::Closed, __ATOMIC_RELEASE);
+}
+
+MT32Emu::SampleRateConverter* CMT32Synth::CreateSampleRateConverter(MT32Emu::Synth& Synth, TResamplerQuality ResamplerQuality) const
+{
+	auto quality = MT32Emu::SamplerateConversionQuality_GOOD;
+	switch (ResamplerQuality)
+	{
+		case TResamplerQuality::None:
+			return nullptr;
+
+		case TResamplerQuality::Fastest:
+			quality = MT32Emu::SamplerateConversionQuality_FASTEST;
+			break;
+
+		case TResamplerQuality::Fast:
+			quality = MT32Emu::SamplerateConversionQuality_FAST;
+			break;
+
+		case TResamplerQuality::Good:
+			quality = MT32Emu::SamplerateConversionQuality_GOOD;
+			break;
+
+		case TResamplerQuality::Best:
+			quality = MT32Emu::SamplerateConversionQuality_BEST;
+			break;
+
+		default:
+			break;
+	}
+
+	return new MT32Emu::SampleRateConverter(Synth, m_nSampleRate, quality);
+}
+
+void CMT32Synth::ApplyProfile()
+{
+	const CConfig* const pConfig = CConfig::Get();
+	const TProfile Profile = pConfig->MT32EmuProfile;
+
+	// A resampler quality given to the constructor is kept; auto leaves it to the profile
+	if (Profile == TProfile::Manual)
+	{
+		if (m_ResamplerQuality == TResamplerQuality::Auto)
+			m_ResamplerQuality = TResamplerQuality::Good;
+
+		m_AnalogOutputMode = pConfig->MT32EmuAnalogOutputMode;
+		m_RendererType     = pConfig->MT32EmuRendererType;
+		m_nPartials        = Utility::Clamp(pConfig->MT32EmuPartials, 8, 256);
+		return;
+	}
+
+	const size_t nProfile = Profile == TProfile::Auto ? SelectAutoProfile() : static_cast<size_t>(Profile) - static_cast<size_t>(TProfile::Minimal);
+	const TProfileSettings& Settings = Profiles[nProfile];
+
+	m_AnalogOutputMode = Settings.AnalogOutputMode;
+	m_RendererType     = Settings.RendererType;
+	m_ResamplerQuality = GetProfileResamplerQuality(Settings);
+	m_nPartials        = Settings.nPartials;
+
+	LOGNOTE("Using '%s' profile", Settings.pName);
+}
+
+size_t CMT32Synth::SelectAutoProfile()
+{
+	TProfileLoads Loads;
+
+	if (!LoadProfileCache(Loads))
+	{
+		LOGNOTE("Benchmarking profiles");
+
+		for (size_t i = 0; i < ProfileCount; ++i)
+		{
+			// More expensive profiles won't fare any better once one can't keep up
+			if (i > 0 && Loads[i - 1] > 1000)
+			{
+				Loads[i] = ProfileLoadNotMeasured;
+				continue;
+			}
+
+			Loads[i] = BenchmarkProfile(Profiles[i]);
+			if (Loads[i] == ProfileLoadNotMeasured)
+				LOGWARN("Couldn't benchmark '%s' profile", Profiles[i].pName);
+			else
+				LOGNOTE("'%s' profile: %d.%d%% load", Profiles[i].pName, Loads[i] / 10, Loads[i] % 10);
+		}
+
+		SaveProfileCache(Loads);
+	}
+
+	// Pick the best profile that leaves enough headroom, falling back on the cheapest
+	const unsigned int nMaxLoad = (100 - Utility::Clamp(CConfig::Get()->MT32EmuProfileHeadroom, 0, 90)) * 10;
+	size_t nProfile = 0;
+
+	for (size_t i = 1; i < ProfileCount; ++i)
+	{
+		if (Loads[i] <= nMaxLoad)
+			nProfile = i;
+	}
+
+	return nProfile;
+}
+
+CMT32Synth::TResamplerQuality CMT32Synth::GetProfileResamplerQuality(const TProfileSettings& Profile) const
+{
+	return m_ResamplerQuality == TResamplerQuality::Auto ? Profile.ResamplerQuality : m_ResamplerQuality;
+}
+
+u16 CMT32Synth::BenchmarkProfile(const TProfileSettings& Profile)
+{
+	// Chunk size is in samples, 2 per frame
+	const unsigned int nChunkFrames      = Utility::Max(CConfig::Get()->AudioChunkSize / 2, 1);
+	const unsigned int nWarmupFrames     = m_nSampleRate * ProfileBenchmarkWarmupMillis / 1000;
+	const unsigned int nMeasureFrames    = m_nSampleRate * ProfileBenchmarkMillis / 1000;
+	const unsigned int nRetriggerFrames  = m_nSampleRate * ProfileBenchmarkRetriggerMillis / 1000;
+
+	CSilentReportHandler ReportHandler;
+	MT32Emu::Synth Synth(&ReportHandler);
+	Synth.setSelectedRendererType(static_cast<MT32Emu::RendererType>(Profile.RendererType));
+
+	if (!Synth.open(*m_pControlROMImage, *m_pPCMROMImage, Profile.nPartials, static_cast<MT32Emu::AnalogOutputMode>(Profile.AnalogOutputMode)))
+		return ProfileLoadNotMeasured;
+
+	MT32Emu::SampleRateConverter* pSampleRateConverter = CreateSampleRateConverter(Synth, GetProfileResamplerQuality(Profile));
+	float Buffer[nChunkFrames * 2];
+
+	unsigned int nFrames = 0;
+	unsigned int nMeasuredFrames = 0;
+	unsigned int nMeasuredMicros = 0;
+
+	while (nMeasuredFrames < nMeasureFrames)
+	{
+		// Eight notes on each of the melodic parts and the rhythm part; more than enough to use every partial
+		if (nFrames % nRetriggerFrames < nChunkFrames)
+		{
+			for (u8 nPart = 0; nPart < MT32ChannelCount; ++nPart)
+			{
+				for (u8 nNote = 0; nNote < 8; ++nNote)
+					Synth.playMsgOnPart(nPart, 0x09, nPart == 8 ? 35 + nNote * 2 : 48 + nNote * 3, 100);
+			}
+		}
+
+		const unsigned int nStartTicks = CTimer::GetClockTicks();
+
+		if (pSampleRateConverter)
+			pSampleRateConverter->getOutputSamples(Buffer, nChunkFrames);
+		else
+			Synth.render(Buffer, nChunkFrames);
+
+		if (nFrames >= nWarmupFrames)
+		{
+			nMeasuredMicros += CTimer::GetClockTicks() - nStartTicks;
+			nMeasuredFrames += nChunkFrames;
+		}
+
+		nFrames += nChunkFrames;
+	}
+
+	if (pSampleRateConverter)
+		delete pSampleRateConverter;
+
+	Synth.close();
+
+	// Render time as a proportion of the time taken to play the audio, in tenths of a percent
+	const u64 nLoad = static_cast<u64>(nMeasuredMicros) * m_nSampleRate / nMeasuredFrames / 1000;
+	return static_cast<u16>(Utility::Min<u64>(nLoad, ProfileLoadNotMeasured - 1));
+}
+
+bool CMT32Synth::LoadProfileCache(TProfileLoads& Loads) const
+{
+	FIL File;
+	if (f_open(&File, ProfileCachePath, FA_READ) != FR_OK)
+		return false;
+
+	TProfileCacheHeader Header;
+	UINT nHeaderRead, nLoadsRead;
+	const bool bReadOK = f_read(&File, &Header, sizeof(Header), &nHeaderRead) == FR_OK && nHeaderRead == sizeof(Header) &&
+			     f_read(&File, Loads, sizeof(Loads), &nLoadsRead) == FR_OK && nLoadsRead == sizeof(Loads);
+	f_close(&File);
+
+	if (!bReadOK || Header.nMagic != ProfileCacheMagic || Header.nVersion != ProfileCacheVersion)
+	{
+		LOGWARN("Profile cache invalid; benchmarking again");
+		return false;
+	}
+
+	// Results from other hardware or audio settings don't apply
+	Header.MachineName[sizeof(Header.MachineName) - 1] = '\0';
+	return Header.nSampleRate == m_nSampleRate &&
+	       Header.nChunkFrames == static_cast<u32>(CConfig::Get()->AudioChunkSize / 2) &&
+	       Header.nResamplerQuality == static_cast<u32>(m_ResamplerQuality) &&
+	       !strcmp(Header.MachineName, CMachineInfo::Get()->GetMachineName());
+}
+
+bool CMT32Synth::SaveProfileCache(const TProfileLoads& Loads) const
+{
+	TProfileCacheHeader Header = { ProfileCacheMagic, ProfileCacheVersion, m_nSampleRate, static_cast<u32>(CConfig::Get()->AudioChunkSize / 2), static_cast<u32>(m_ResamplerQuality), {'\0'} };
+	strncpy(Header.MachineName, CMachineInfo::Get()->GetMachineName(), sizeof(Header.MachineName) - 1);
+
+	FIL File;
+	if (f_open(&File, ProfileCachePath, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+	{
+		LOGWARN("Couldn't create profile cache");
+		return false;
+	}
+
+	UINT nHeaderWritten, nLoadsWritten;
+	const bool bWriteOK = f_write(&File, &Header, sizeof(Header), &nHeaderWritten) == FR_OK && nHeaderWritten == sizeof(Header) &&
+			      f_write(&File, Loads, sizeof(Loads), &nLoadsWritten) == FR_OK && nLoadsWritten == sizeof(Loads);
+
+	if (f_close(&File) != FR_OK || !bWriteOK)
+	{
+		LOGWARN("Couldn't write profile cache");
+		return false;
+	}
 
 	return true;
 }
@@ -283,11 +887,45 @@ bool CMT32Synth::NextROMSet()
 	return SwitchROMSet(static_cast<TMT32ROMSet>(nNextROMSetIndex));
 }
 
+void CMT32Synth::CaptureSnapshot(CMT32Snapshot& Snapshot)
+{
+	m_Lock.Acquire();
+
+	// Apply any SysEx that is still queued so that the snapshot includes everything received so far
+	m_pSynth->flushMIDIQueue();
+	Snapshot.Capture(*m_pSynth, m_CurrentROMSet);
+
+	m_Lock.Release();
+}
+
+unsigned CMT32Synth::RestoreSnapshot(const CMT32Snapshot& Snapshot)
+{
+	m_Lock.Acquire();
+	const unsigned nStartTicks = CTimer::GetClockTicks();
+
+	// Queued messages were sent before the restore was requested; apply them now so that they can't land on top of it
+	m_pSynth->flushMIDIQueue();
+	Snapshot.Restore(*m_pSynth);
+
+	const unsigned nMicros = CTimer::GetClockTicks() - nStartTicks;
+	m_Lock.Release();
+
+	// Memory no longer matches what was sent
+	ClearSysExCache();
+
+	return nMicros;
+}
+
 const char* CMT32Synth::GetControlROMName() const
+{
+	return GetControlROMName(m_pControlROMImage);
+}
+
+const char* CMT32Synth::GetControlROMName(const MT32Emu::ROMImage* pControlROMImage)
 {
 	// +5 to skip 'ctrl_'
-	const char* pShortName = m_pControlROMImage->getROMInfo()->shortName + 5;
-	const MT32Emu::Bit8u* pROMData = m_pControlROMImage->getFile()->getData();
+	const char* pShortName = pControlROMImage->getROMInfo()->shortName + 5;
+	const MT32Emu::Bit8u* pROMData = pControlROMImage->getFile()->getData();
 	size_t nOffset;
 
 	// Find version strings from ROMs
@@ -331,7 +969,7 @@ void CMT32Synth::GetPartLevels(unsigned int nTicks, float PartLevels[9], float P
 
 bool CMT32Synth::onMIDIQueueOverflow()
 {
-	LOGERR("MIDI queue overflow");
+	// Retrying would spin forever if the queue filled up on the audio core; QueueMIDIMessage() does the waiting instead
 	return false;
 }
 
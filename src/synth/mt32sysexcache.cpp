@@ -0,0 +1,153 @@
+//
+// mt32sysexcache.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/util.h>
+
+#include "synth/mt32sysexcache.h"
+#include "synth/rolandsysex.h"
+#include "utility.h"
+
+// The MT-32's default device ID; lower IDs address a single part, and mt32emu ignores higher ones
+constexpr u8 MT32DeviceID = 0x10;
+
+// Linear addresses of other areas that affect the tracked ones
+constexpr u32 TimbreTempAddress = 0x10000;  // 04 00 00
+constexpr u32 TimbreTempSize    = 8 * 246;
+constexpr u32 ResetAddress      = 0x1FC000; // 7F 00 00
+
+const CMT32SysExCache::TRegion CMT32SysExCache::Regions[RegionCount] =
+{
+	{ 0x0C090, 85 * 4,   0                  }, // 03 01 10: rhythm setup
+	{ 0x14000, 128 * 8,  85 * 4             }, // 05 00 00: patch memory
+	{ 0x20000, 64 * 256, 85 * 4 + 128 * 8   }, // 08 00 00: timbre memory
+};
+
+CMT32SysExCache::CMT32SysExCache()
+	: m_nHits(0),
+	  m_nMisses(0),
+	  m_nSkippedBytes(0)
+{
+	Clear();
+}
+
+bool CMT32SysExCache::IsRedundant(const u8* pData, size_t nSize)
+{
+	// Must be at least size of header plus a data byte, a checksum byte, and Start/End of Exclusive bytes
+	if (nSize < sizeof(TRolandSysExHeader) + 4)
+		return false;
+
+	const auto& Header = reinterpret_cast<const TRolandSysExHeader&>(pData[1]);
+	const u8* pRolandData = pData + sizeof(TRolandSysExHeader) + 1;
+	const size_t nRolandDataSize = nSize - sizeof(TRolandSysExHeader) - 3;
+	const u8 nChecksum = pData[nSize - 2];
+
+	if (Header.ManufacturerID != TManufacturerID::Roland || Header.DeviceID > MT32DeviceID || Header.ModelID != TRolandModelID::MT32 || Header.CommandID != TRolandCommandID::DT1)
+		return false;
+
+	// Channel-addressed messages write the patch temp and timbre temp of the part receiving on that channel; treat them
+	// like direct timbre temp writes
+	if (Header.DeviceID < MT32DeviceID)
+	{
+		InvalidateTimbres();
+		++m_nMisses;
+		return false;
+	}
+
+	// mt32emu ignores messages with a bad checksum, so there's nothing to remember
+	if (Utility::RolandChecksum(Header.Address, sizeof(Header.Address) + nRolandDataSize) != nChecksum)
+		return false;
+
+	const u32 nAddress = Header.Address[0] << 14 | Header.Address[1] << 7 | Header.Address[2];
+	const u32 nEndAddress = nAddress + nRolandDataSize;
+
+	bool bRedundant = false;
+
+	// A reset restores the defaults from the control ROM
+	if (nAddress >= ResetAddress)
+		Clear();
+
+	// mt32emu reloads a part's timbre temp from timbre memory when that timbre is written, so a write that leaves timbre
+	// memory unchanged still matters after timbre temp has been edited directly
+	else if (nAddress < TimbreTempAddress + TimbreTempSize && nEndAddress > TimbreTempAddress)
+		InvalidateTimbres();
+	else
+		bRedundant = Update(nAddress, pRolandData, nRolandDataSize);
+
+	if (bRedundant)
+	{
+		++m_nHits;
+		m_nSkippedBytes += nSize;
+	}
+	else
+		++m_nMisses;
+
+	return bRedundant;
+}
+
+bool CMT32SysExCache::Update(u32 nAddress, const u8* pData, size_t nSize)
+{
+	const u32 nEndAddress = nAddress + nSize;
+	size_t nTrackedBytes = 0;
+	bool bChanged = false;
+
+	// A message may span more than one area; remember what it writes to each tracked one
+	for (const TRegion& Region : Regions)
+	{
+		const u32 nFirst = Utility::Max(nAddress, Region.nAddress);
+		const u32 nLast = Utility::Min(nEndAddress, Region.nAddress + Region.nSize);
+		if (nFirst >= nLast)
+			continue;
+
+		const u8* pNewData = pData + (nFirst - nAddress);
+		u8* pCachedData = m_Data + Region.nOffset + (nFirst - Region.nAddress);
+		const size_t nBytes = nLast - nFirst;
+
+		if (memcmp(pCachedData, pNewData, nBytes))
+		{
+			memcpy(pCachedData, pNewData, nBytes);
+			bChanged = true;
+		}
+
+		nTrackedBytes += nBytes;
+	}
+
+	// Only redundant if everything it writes is tracked and unchanged
+	return !bChanged && nTrackedBytes == nSize;
+}
+
+void CMT32SysExCache::InvalidateTimbres()
+{
+	const TRegion& Timbres = Regions[RegionCount - 1];
+	memset(m_Data + Timbres.nOffset, 0xFF, Timbres.nSize);
+}
+
+void CMT32SysExCache::Clear()
+{
+	memset(m_Data, 0xFF, sizeof(m_Data));
+}
+
+void CMT32SysExCache::ResetStats()
+{
+	m_nHits         = 0;
+	m_nMisses       = 0;
+	m_nSkippedBytes = 0;
+}
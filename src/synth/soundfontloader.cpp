@@ -0,0 +1,132 @@
+//
+// synth/soundfontloader.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/sched/scheduler.h>
+#include <circle/timer.h>
+
+#include "synth/soundfontloader.h"
+
+LOGMODULE("soundfontloader");
+
+CSoundFontLoader* CSoundFontLoader::s_pThis = nullptr;
+
+CSoundFontLoader::CSoundFontLoader()
+	: CTask(StackSize),
+	  m_State(TState::Idle),
+	  m_pSynth(nullptr),
+	  m_nSoundFontID(FLUID_FAILED),
+	  m_nFileSize(0),
+	  m_nBytesRead(0)
+{
+	s_pThis = this;
+	SetName("soundfontloader");
+}
+
+bool CSoundFontLoader::Load(fluid_synth_t* pSynth, const char* pSoundFontPath)
+{
+	if (m_State != TState::Idle)
+		return false;
+
+	m_pSynth        = pSynth;
+	m_SoundFontPath = pSoundFontPath;
+	m_nSoundFontID  = FLUID_FAILED;
+	m_nFileSize     = 0;
+	m_nBytesRead    = 0;
+	m_State         = TState::Loading;
+
+	m_Event.Set();
+
+	return true;
+}
+
+void CSoundFontLoader::Reset()
+{
+	// Acknowledge the result of a finished load
+	if (m_State == TState::Succeeded || m_State == TState::Failed)
+	{
+		m_pSynth = nullptr;
+		m_State  = TState::Idle;
+	}
+}
+
+u8 CSoundFontLoader::GetProgress() const
+{
+	const size_t nFileSize = m_nFileSize;
+	if (!nFileSize)
+		return 0;
+
+	return static_cast<u64>(m_nBytesRead) * 100 / nFileSize;
+}
+
+void CSoundFontLoader::Run()
+{
+	while (true)
+	{
+		m_Event.Wait();
+		m_Event.Clear();
+
+		if (m_State != TState::Loading)
+			continue;
+
+		const unsigned int nLoadStart = CTimer::GetClockTicks();
+
+		m_nSoundFontID = fluid_synth_sfload(m_pSynth, m_SoundFontPath, true);
+		if (m_nSoundFontID == FLUID_FAILED)
+		{
+			LOGERR("Failed to load SoundFont");
+			m_State = TState::Failed;
+			continue;
+		}
+
+		const float nLoadTime = (CTimer::GetClockTicks() - nLoadStart) / 1000000.0f;
+		LOGNOTE("\"%s\" loaded in background in %0.2f seconds", static_cast<const char*>(m_SoundFontPath), nLoadTime);
+
+		m_State = TState::Succeeded;
+	}
+}
+
+bool CSoundFontLoader::IsLoaderTask()
+{
+	// The file hooks are shared by every FluidSynth file access (e.g. dynamic sample loading on the main task)
+	return s_pThis && s_pThis->m_State == TState::Loading && CScheduler::Get()->GetCurrentTask() == s_pThis;
+}
+
+void CSoundFontLoader::OnFileOpened(size_t nFileSize)
+{
+	if (IsLoaderTask())
+	{
+		s_pThis->m_nFileSize  = nFileSize;
+		s_pThis->m_nBytesRead = 0;
+	}
+}
+
+void CSoundFontLoader::OnFileRead(size_t nBytes)
+{
+	if (IsLoaderTask())
+	{
+		s_pThis->m_nBytesRead = s_pThis->m_nBytesRead + nBytes;
+
+		// Let the main task process MIDI, UI events, etc.
+		CScheduler::Get()->Yield();
+	}
+}
@@ -0,0 +1,175 @@
+//
+// synth/soundfontpagecache.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+
+#include "synth/soundfontloader.h"
+#include "synth/soundfontpagecache.h"
+#include "utility.h"
+
+LOGMODULE("soundfontpagecache");
+
+CSoundFontPageCache* CSoundFontPageCache::s_pThis = nullptr;
+
+CSoundFontPageCache::CSoundFontPageCache()
+	: m_pData(nullptr),
+	  m_Pages{},
+	  m_nUseCounter(0),
+	  m_Stats{}
+{
+}
+
+CSoundFontPageCache::~CSoundFontPageCache()
+{
+	if (m_pData)
+		delete[] m_pData;
+
+	if (s_pThis == this)
+		s_pThis = nullptr;
+}
+
+bool CSoundFontPageCache::Initialize()
+{
+	m_pData = new u8[CacheSize];
+	if (!m_pData)
+	{
+		LOGERR("Couldn't allocate page cache");
+		return false;
+	}
+
+	LOGNOTE("Allocated %d kilobyte sample page cache", CacheSize / KILOBYTE);
+	s_pThis = this;
+
+	return true;
+}
+
+bool CSoundFontPageCache::Read(FIL* pFile, u32 nFileID, u32 nOffset, void* pBuffer, size_t nSize)
+{
+	u8* pOut = static_cast<u8*>(pBuffer);
+	const size_t nTotalSize = nSize;
+
+	while (nSize)
+	{
+		const u32 nPageIndex  = nOffset / PageSize;
+		const u32 nPageOffset = nOffset % PageSize;
+
+		TPage* pPage = FindPage(nFileID, nPageIndex);
+		if (pPage)
+			++m_Stats.nHits;
+		else
+		{
+			++m_Stats.nMisses;
+			if (!(pPage = FillPages(pFile, nFileID, nPageIndex)))
+				return false;
+		}
+
+		// Past end of file
+		if (nPageOffset >= pPage->nValidBytes)
+			return false;
+
+		const size_t nCopySize = Utility::Min<size_t>(nSize, pPage->nValidBytes - nPageOffset);
+		memcpy(pOut, GetPageData(pPage) + nPageOffset, nCopySize);
+		pPage->nLastUsed = ++m_nUseCounter;
+
+		pOut += nCopySize;
+		nOffset += nCopySize;
+		nSize -= nCopySize;
+	}
+
+	// May yield to other tasks, which may also use the cache; no page pointers may be held past this point
+	CSoundFontLoader::OnFileRead(nTotalSize);
+
+	return true;
+}
+
+void CSoundFontPageCache::GetStats(TStats& Stats) const
+{
+	Stats = m_Stats;
+}
+
+void CSoundFontPageCache::DumpStats() const
+{
+	const u32 nRequests = m_Stats.nHits + m_Stats.nMisses;
+	const u32 nHitRate = nRequests ? static_cast<u64>(m_Stats.nHits) * 100 / nRequests : 0;
+	LOGNOTE("Page cache: %d hits, %d misses (%d%% hit rate), %d pages read, %d ms stalled", m_Stats.nHits, m_Stats.nMisses, nHitRate, m_Stats.nPagesRead, m_Stats.nStallMicros / 1000);
+}
+
+CSoundFontPageCache::TPage* CSoundFontPageCache::FindPage(u32 nFileID, u32 nPageIndex)
+{
+	for (TPage& Page : m_Pages)
+	{
+		if (Page.nLastUsed && Page.nFileID == nFileID && Page.nPageIndex == nPageIndex)
+			return &Page;
+	}
+
+	return nullptr;
+}
+
+CSoundFontPageCache::TPage* CSoundFontPageCache::FillPages(FIL* pFile, u32 nFileID, u32 nPageIndex)
+{
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
+	TPage* pFirstPage = nullptr;
+
+	if (f_lseek(pFile, nPageIndex * PageSize) != FR_OK)
+		return nullptr;
+
+	// Read the requested page and some following pages; sample data is read sequentially, so this saves on seeks
+	for (size_t i = 0; i < ReadAheadPages; ++i)
+	{
+		if (i > 0 && FindPage(nFileID, nPageIndex + i))
+			break;
+
+		// Evict least recently used page
+		TPage* pVictim = &m_Pages[0];
+		for (TPage& Page : m_Pages)
+		{
+			if (Page.nLastUsed < pVictim->nLastUsed)
+				pVictim = &Page;
+		}
+
+		UINT nRead;
+		if (f_read(pFile, GetPageData(pVictim), PageSize, &nRead) != FR_OK)
+		{
+			pVictim->nLastUsed = 0;
+			return pFirstPage;
+		}
+
+		pVictim->nFileID     = nFileID;
+		pVictim->nPageIndex  = nPageIndex + i;
+		pVictim->nValidBytes = nRead;
+		pVictim->nLastUsed   = ++m_nUseCounter;
+		++m_Stats.nPagesRead;
+
+		if (!pFirstPage)
+			pFirstPage = pVictim;
+
+		// End of file
+		if (nRead < PageSize)
+			break;
+	}
+
+	m_Stats.nStallMicros += CTimer::GetClockTicks() - nStartTicks;
+
+	return pFirstPage;
+}
@@ -28,6 +28,7 @@
 #include "lcd/ui.h"
 #include "synth/gmsysex.h"
 #include "synth/rolandsysex.h"
+#include "synth/soundfontpagecache.h"
 #include "synth/soundfontsynth.h"
 #include "synth/yamahasysex.h"
 #include "utility.h"
@@ -36,6 +37,16 @@
 LOGMODULE("soundfontsynth");
 const char SoundFontPath[] = "soundfonts";
 
+constexpr size_t SoundFontReadChunkSize = 256 * KILOBYTE;
+
+// File handle for FluidSynth's SoundFont loader
+struct TSoundFontFile
+{
+	FIL File;
+	u32 nFileID;
+	u32 nPosition;
+};
+
 extern "C"
 {
 	// Replacements for fluid_sys.c functions
@@ -71,21 +82,28 @@ extern "C"
 	// These were found to be much faster than FluidSynth's default approach of going through libc
 	void* default_fopen(const char* path)
 	{
-		FIL* pFile = new FIL;
-		if (f_open(pFile, path, FA_READ) != FR_OK)
+		TSoundFontFile* pFile = new TSoundFontFile;
+		if (f_open(&pFile->File, path, FA_READ) != FR_OK)
 		{
 			delete pFile;
-			pFile = nullptr;
+			return nullptr;
 		}
 
+		// Identifies the file for page cache lookups; size is included to catch files replaced under the same name
+		const u32 nFileSize = f_size(&pFile->File);
+		pFile->nFileID   = Utility::HashString(path) ^ nFileSize;
+		pFile->nPosition = 0;
+
+		CSoundFontLoader::OnFileOpened(nFileSize);
+
 		return pFile;
 	}
 
 	int default_fclose(void* handle)
 	{
-		FIL* pFile = static_cast<FIL*>(handle);
+		TSoundFontFile* pFile = static_cast<TSoundFontFile*>(handle);
 
-		if (f_close(pFile) == FR_OK)
+		if (f_close(&pFile->File) == FR_OK)
 		{
 			delete pFile;
 			return FLUID_OK;
@@ -96,36 +114,72 @@ extern "C"
 
 	fluid_long_long_t default_ftell(void* handle)
 	{
-		FIL* pFile = static_cast<FIL*>(handle);
-		return f_tell(pFile);
+		TSoundFontFile* pFile = static_cast<TSoundFontFile*>(handle);
+		return pFile->nPosition;
 	}
 
 	int safe_fread(void* buf, fluid_long_long_t count, void* fd)
 	{
-		FIL* pFile = static_cast<FIL*>(fd);
-		UINT nRead;
-		return f_read(pFile, buf, count, &nRead) == FR_OK ? FLUID_OK : FLUID_FAILED;
+		TSoundFontFile* pFile = static_cast<TSoundFontFile*>(fd);
+		u8* pBuffer = static_cast<u8*>(buf);
+
+		// Small reads (e.g. dynamically-loaded sample data) go through the page cache if enabled
+		CSoundFontPageCache* const pPageCache = CSoundFontPageCache::Get();
+		if (pPageCache && count <= static_cast<fluid_long_long_t>(CSoundFontPageCache::MaxCachedReadSize))
+		{
+			if (!pPageCache->Read(&pFile->File, pFile->nFileID, pFile->nPosition, pBuffer, count))
+				return FLUID_FAILED;
+
+			pFile->nPosition += count;
+			return FLUID_OK;
+		}
+
+		if (f_tell(&pFile->File) != pFile->nPosition && f_lseek(&pFile->File, pFile->nPosition) != FR_OK)
+			return FLUID_FAILED;
+
+		// Sample data is read in one go; split it up so that background loads can report progress and yield
+		while (count > 0)
+		{
+			const UINT nChunkSize = Utility::Min<fluid_long_long_t>(count, SoundFontReadChunkSize);
+			UINT nRead;
+
+			if (f_read(&pFile->File, pBuffer, nChunkSize, &nRead) != FR_OK)
+				return FLUID_FAILED;
+
+			pFile->nPosition += nRead;
+			CSoundFontLoader::OnFileRead(nRead);
+
+			pBuffer += nChunkSize;
+			count -= nChunkSize;
+		}
+
+		return FLUID_OK;
 	}
 
 	int safe_fseek(void* fd, fluid_long_long_t ofs, int whence)
 	{
-		FIL* pFile = static_cast<FIL*>(fd);
+		TSoundFontFile* pFile = static_cast<TSoundFontFile*>(fd);
 
 		switch (whence)
 		{
 		case SEEK_CUR:
-			ofs += f_tell(pFile);
+			ofs += pFile->nPosition;
 			break;
 
 		case SEEK_END:
-			ofs += f_size(pFile);
+			ofs += f_size(&pFile->File);
 			break;
 
 		default:
 			break;
 		}
 
-		return f_lseek(pFile, ofs) == FR_OK ? FLUID_OK : FLUID_FAILED;
+		if (ofs < 0)
+			return FLUID_FAILED;
+
+		// Seek is deferred until the next uncached read
+		pFile->nPosition = ofs;
+		return FLUID_OK;
 	}
 }
 
@@ -135,7 +189,37 @@ CSoundFontSynth::CSoundFontSynth(unsigned nSampleRate)
 	  m_pSettings(nullptr),
 	  m_pSynth(nullptr),
 
+	  m_nCommandsQueued(0),
+	  m_nCommandsApplied(0),
+	  m_bCommandWaitTimedOut(false),
+	  m_nCommandsAppliedAtTimeout(0),
+	  m_SysExData{},
+	  m_bActive(false),
+	  m_bDynamicSampleLoading(false),
+
+	  m_bParallelRendering(false),
+	  m_bRenderCoreAvailable(true),
+	  m_pSecondarySynth(nullptr),
+	  m_nSecondaryRenderFrames(0),
+	  m_nPrimaryVoices(0),
+	  m_nSecondaryVoices(0),
+	  m_nMonoModeMask(0),
+
+	  m_pPagerSynth(nullptr),
+
+	  m_pPendingSynth(nullptr),
+	  m_pPendingSecondarySynth(nullptr),
+	  m_nPendingSoundFontIndex(0),
+	  m_nPendingInitialGain(0.2f),
+	  m_nLastLoadProgress(0),
+
+	  m_pFadingSynth(nullptr),
+	  m_pFadingSecondarySynth(nullptr),
+	  m_nCrossfadeFrames(nSampleRate * CrossfadeMillis / 1000),
+	  m_nCrossfadeFramesRemaining(0),
+
 	  m_nVolume(100),
+	  m_nAppliedVolume(100),
 	  m_nInitialGain(0.2f),
 
 	  m_nPercussionMask(1 << 9),
@@ -145,8 +229,14 @@ CSoundFontSynth::CSoundFontSynth(unsigned nSampleRate)
 
 CSoundFontSynth::~CSoundFontSynth()
 {
-	if (m_pSynth)
-		delete_fluid_synth(m_pSynth);
+	if (m_pPagerSynth)
+	{
+		SetPagerSoundFont(nullptr);
+		delete_fluid_synth(m_pPagerSynth);
+	}
+
+	DeleteSynths(m_pFadingSynth, m_pFadingSecondarySynth);
+	DeleteSynths(m_pSynth, m_pSecondarySynth);
 
 	if (m_pSettings)
 		delete_fluid_settings(m_pSettings);
@@ -200,10 +290,265 @@ bool CSoundFontSynth::Initialize()
 	fluid_settings_setnum(m_pSettings, "synth.sample-rate", static_cast<double>(m_nSampleRate));
 	fluid_settings_setint(m_pSettings, "synth.threadsafe-api", false);
 
+	// Only load samples for presets that are in use, so that SoundFonts larger than the heap can be used
+	if (pConfig->FluidSynthDynamicSampleLoading)
+	{
+		fluid_settings_setint(m_pSettings, "synth.dynamic-sample-loading", true);
+		m_PageCache.Initialize();
+		m_bDynamicSampleLoading = true;
+
+		// The pager never plays a note; don't allocate voices for it
+		int nPolyphony;
+		fluid_settings_getint(m_pSettings, "synth.polyphony", &nPolyphony);
+		fluid_settings_setint(m_pSettings, "synth.polyphony", 1);
+		m_pPagerSynth = new_fluid_synth(m_pSettings);
+		fluid_settings_setint(m_pSettings, "synth.polyphony", nPolyphony);
+
+		if (!m_pPagerSynth)
+		{
+			LOGERR("Failed to create pager synth");
+			return false;
+		}
+
+		LOGNOTE("Dynamic sample loading enabled");
+	}
+
+	m_bParallelRendering = pConfig->FluidSynthParallelRendering;
+	if (m_bParallelRendering)
+		LOGNOTE("Parallel rendering enabled");
+
 	return Reinitialize(pSoundFontPath, &FXProfile);
 }
 
 void CSoundFontSynth::HandleMIDIShortMessage(u32 nMessage)
+{
+	if (CanRenderWithMIDIMessage(nMessage))
+		QueueCommand(TCommand{TCommandType::ShortMessage, nMessage});
+	else
+	{
+		PageInMIDIShortMessage(nMessage);
+		ApplyCommandNow(TCommand{TCommandType::ShortMessage, nMessage});
+	}
+
+	// Update MIDI monitor
+	CSynthBase::HandleMIDIShortMessage(nMessage);
+}
+
+void CSoundFontSynth::HandleMIDIShortMessages(const u32* pMessages, size_t nCount)
+{
+	TCommand Commands[64];
+	size_t i = 0;
+
+	while (i < nCount)
+	{
+		// Queue runs of messages for the audio core in bulk
+		size_t nCommands = 0;
+		while (i < nCount && nCommands < Utility::ArraySize(Commands) && CanRenderWithMIDIMessage(pMessages[i]))
+			Commands[nCommands++] = TCommand{TCommandType::ShortMessage, pMessages[i++]};
+
+		QueueCommands(Commands, nCommands);
+
+		// Message that must be applied here; load its samples before taking the lock
+		if (i < nCount && !CanRenderWithMIDIMessage(pMessages[i]))
+		{
+			PageInMIDIShortMessage(pMessages[i]);
+			ApplyCommandNow(TCommand{TCommandType::ShortMessage, pMessages[i++]});
+		}
+	}
+
+	// Update MIDI monitor
+	m_MIDIMonitor.OnShortMessages(pMessages, nCount);
+}
+
+bool CSoundFontSynth::CanRenderWithMIDIMessage(u32 nMessage) const
+{
+	// With dynamic sample loading, program changes and resets may read from disk; keep file access on the main core,
+	// where the pager loads their samples before they're applied. Bank selects go the same way so that the pager sees
+	// them in order. The same goes for SysEx (e.g. GS/XG resets); see CanApplyMIDISysExMessage().
+	if (m_bDynamicSampleLoading)
+	{
+		const u8 nStatus = nMessage & 0xFF;
+		const u8 nController = (nMessage >> 8) & 0xFF;
+		const bool bBankSelect = (nStatus & 0xF0) == 0xB0 && (nController == 0 || nController == 32);
+		return (nStatus & 0xF0) != 0xC0 && nStatus != 0xFF && !bBankSelect;
+	}
+
+	return true;
+}
+
+void CSoundFontSynth::HandleMIDISysExMessage(const u8* pData, size_t nSize)
+{
+	// Return early if it wasn't a GM Mode On/Off message and was consumed as a text/display dots message
+	if (!ParseGMSysEx(pData, nSize) && (ParseRolandSysEx(pData, nSize) || ParseYamahaSysEx(pData, nSize)))
+		return;
+
+	// No special handling; forward to FluidSynth SysEx parser, excluding leading 0xF0 and trailing 0xF7
+	if (m_pPagerSynth)
+		fluid_synth_sysex(m_pPagerSynth, reinterpret_cast<const char*>(pData + 1), nSize - 2, nullptr, nullptr, nullptr, false);
+
+	// A reset may select new presets; with dynamic sample loading, apply it here while the pager holds their samples
+	if (m_bDynamicSampleLoading)
+	{
+		WaitForCommands(0);
+		m_Lock.Acquire();
+		ApplySysEx(pData, nSize);
+		m_Lock.Release();
+		return;
+	}
+
+	// Nothing larger is acted on by FluidSynth
+	if (nSize > MaxSysExSize)
+		return;
+
+	// The data goes in before the command that refers to it; make sure both fit first
+	const bool bRoom = m_SysExQueue.GetCount() + nSize < SysExQueueSize && m_CommandQueue.GetCount() + 1 < CommandQueueSize;
+	if (!bRoom && !WaitForCommands(0))
+		return;
+
+	m_SysExQueue.Enqueue(pData, nSize);
+	QueueCommand(TCommand{TCommandType::SysEx, static_cast<u32>(nSize)});
+}
+
+void CSoundFontSynth::ApplyMIDISysExMessage(const u8* pData, size_t nSize)
+{
+	// Return early if it wasn't a GM Mode On/Off message and was consumed as a text/display dots message
+	if (!ParseGMSysEx(pData, nSize) && (ParseRolandSysEx(pData, nSize) || ParseYamahaSysEx(pData, nSize)))
+		return;
+
+	// Called by the audio core between renders; apply straight away, after any commands queued before it
+	m_Lock.Acquire();
+	ApplyQueuedCommands();
+	ApplySysEx(pData, nSize);
+	m_Lock.Release();
+}
+
+void CSoundFontSynth::AllSoundOff()
+{
+	QueueCommand(TCommand{TCommandType::AllSoundOff, 0});
+
+	// Reset MIDI monitor
+	CSynthBase::AllSoundOff();
+}
+
+void CSoundFontSynth::SetMasterVolume(u8 nVolume)
+{
+	__atomic_store_n(&m_nVolume, nVolume, __ATOMIC_RELAXED);
+}
+
+void CSoundFontSynth::QueueCommand(const TCommand& Command)
+{
+	QueueCommands(&Command, 1);
+}
+
+size_t CSoundFontSynth::QueueCommands(const TCommand* pCommands, size_t nCount)
+{
+	size_t nQueued = m_CommandQueue.Enqueue(pCommands, nCount);
+
+	// Queue full; wait for the audio core to make room rather than applying the rest out of order, and drop them if
+	// it doesn't
+	while (nQueued < nCount && WaitForCommands(CommandQueueSize / 2))
+		nQueued += m_CommandQueue.Enqueue(pCommands + nQueued, nCount - nQueued);
+
+	m_nCommandsQueued += nQueued;
+	return nQueued;
+}
+
+bool CSoundFontSynth::WaitForCommands(u32 nMaxPending)
+{
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
+
+	// Only the main core adds to the queued count
+	u32 nApplied;
+	while (m_nCommandsQueued - (nApplied = __atomic_load_n(&m_nCommandsApplied, __ATOMIC_ACQUIRE)) > nMaxPending)
+	{
+		// The audio core hasn't applied anything since the last wait timed out; don't hold up every message for the
+		// full timeout while it isn't rendering this synth
+		if (m_bCommandWaitTimedOut && nApplied == m_nCommandsAppliedAtTimeout)
+			return false;
+
+		if (CTimer::GetClockTicks() - nStartTicks >= CommandQueueTimeoutMicros)
+		{
+			LOGWARN("Command queue stalled for %dms", CommandQueueTimeoutMicros / 1000);
+			m_bCommandWaitTimedOut = true;
+			m_nCommandsAppliedAtTimeout = nApplied;
+			return false;
+		}
+
+		CTimer::SimpleusDelay(CommandQueueRetryMicros);
+	}
+
+	return true;
+}
+
+void CSoundFontSynth::ApplyCommandNow(const TCommand& Command)
+{
+	// Everything queued before it must be applied first; the audio core applies commands under the lock
+	WaitForCommands(0);
+
+	m_Lock.Acquire();
+	ApplyCommand(Command);
+	m_Lock.Release();
+}
+
+void CSoundFontSynth::ApplyQueuedCommands()
+{
+	TCommand Commands[64];
+	size_t nCommands;
+
+	while ((nCommands = m_CommandQueue.Dequeue(Commands, Utility::ArraySize(Commands))))
+	{
+		for (size_t i = 0; i < nCommands; ++i)
+			ApplyCommand(Commands[i]);
+
+		// Let the main core know that the commands it queued have reached the synths
+		__atomic_add_fetch(&m_nCommandsApplied, nCommands, __ATOMIC_RELEASE);
+	}
+
+	// Only the latest volume matters
+	const u8 nVolume = __atomic_load_n(&m_nVolume, __ATOMIC_RELAXED);
+	if (nVolume != m_nAppliedVolume)
+	{
+		fluid_synth_set_gain(m_pSynth, nVolume / 100.0f * m_nInitialGain);
+		if (m_pSecondarySynth)
+			fluid_synth_set_gain(m_pSecondarySynth, nVolume / 100.0f * m_nInitialGain);
+		m_nAppliedVolume = nVolume;
+	}
+}
+
+void CSoundFontSynth::ApplyCommand(const TCommand& Command)
+{
+	switch (Command.Type)
+	{
+		case TCommandType::ShortMessage:
+			ApplyMIDIShortMessage(Command.nValue);
+			break;
+
+		case TCommandType::AllSoundOff:
+			fluid_synth_all_sounds_off(m_pSynth, -1);
+			if (m_pSecondarySynth)
+				fluid_synth_all_sounds_off(m_pSecondarySynth, -1);
+			m_nCrossfadeFramesRemaining = 0;
+			break;
+
+		case TCommandType::SysEx:
+		{
+			// The data was queued before the command
+			const size_t nSize = Command.nValue;
+			if (nSize <= MaxSysExSize && m_SysExQueue.Dequeue(m_SysExData, nSize) == nSize)
+				ApplySysEx(m_SysExData, nSize);
+			break;
+		}
+	}
+}
+
+void CSoundFontSynth::ApplySysEx(const u8* pData, size_t nSize)
+{
+	fluid_synth_sysex(m_pSynth, reinterpret_cast<const char*>(pData + 1), nSize - 2, nullptr, nullptr, nullptr, false);
+	if (m_pSecondarySynth)
+		fluid_synth_sysex(m_pSecondarySynth, reinterpret_cast<const char*>(pData + 1), nSize - 2, nullptr, nullptr, nullptr, false);
+}
+
+void CSoundFontSynth::ApplyMIDIShortMessage(u32 nMessage)
 {
 	const u8 nStatus  = nMessage & 0xFF;
 	const u8 nChannel = nMessage & 0x0F;
@@ -213,114 +558,287 @@ void CSoundFontSynth::HandleMIDIShortMessage(u32 nMessage)
 	// Handle system real-time messages
 	if (nStatus == 0xFF)
 	{
-		m_Lock.Acquire();
 		fluid_synth_system_reset(m_pSynth);
-		m_Lock.Release();
+		if (m_pSecondarySynth)
+			fluid_synth_system_reset(m_pSecondarySynth);
+		m_nMonoModeMask = 0;
 		return;
 	}
 
-	m_Lock.Acquire();
+	// Notes are started on one synth only
+	if ((nStatus & 0xF0) == 0x90 && nData2)
+	{
+		fluid_synth_noteon(SelectNoteSynth(nChannel), nChannel, nData1, nData2);
+		return;
+	}
+
+	// Mono mode on/poly mode on
+	if ((nStatus & 0xF0) == 0xB0 && (nData1 == 126 || nData1 == 127))
+		m_nMonoModeMask ^= (-(nData1 == 126) ^ m_nMonoModeMask) & (1 << nChannel);
+
+	// Everything else keeps the channel state of both synths the same; note offs and key pressure only affect the
+	// synth playing the note
+	ApplyChannelMessage(m_pSynth, nStatus, nData1, nData2);
+	if (m_pSecondarySynth)
+		ApplyChannelMessage(m_pSecondarySynth, nStatus, nData1, nData2);
+}
+
+void CSoundFontSynth::ApplyChannelMessage(fluid_synth_t* pSynth, u8 nStatus, u8 nData1, u8 nData2)
+{
+	const u8 nChannel = nStatus & 0x0F;
 
 	// Handle channel messages
 	switch (nStatus & 0xF0)
 	{
 		// Note off
 		case 0x80:
-			fluid_synth_noteoff(m_pSynth, nChannel, nData1);
+			fluid_synth_noteoff(pSynth, nChannel, nData1);
 			break;
 
-		// Note on
+		// Note on (with zero velocity)
 		case 0x90:
-			fluid_synth_noteon(m_pSynth, nChannel, nData1, nData2);
+			fluid_synth_noteon(pSynth, nChannel, nData1, nData2);
 			break;
 
 		// Polyphonic key pressure/aftertouch
 		case 0xA0:
-			fluid_synth_key_pressure(m_pSynth, nChannel, nData1, nData2);
+			fluid_synth_key_pressure(pSynth, nChannel, nData1, nData2);
 			break;
 
 		// Control change
 		case 0xB0:
-			fluid_synth_cc(m_pSynth, nChannel, nData1, nData2);
+			fluid_synth_cc(pSynth, nChannel, nData1, nData2);
 			break;
 
 		// Program change
 		case 0xC0:
-			fluid_synth_program_change(m_pSynth, nChannel, nData1);
+			fluid_synth_program_change(pSynth, nChannel, nData1);
 			break;
 
 		// Channel pressure/aftertouch
 		case 0xD0:
-			fluid_synth_channel_pressure(m_pSynth, nChannel, nData1);
+			fluid_synth_channel_pressure(pSynth, nChannel, nData1);
 			break;
 
 		// Pitch bend
 		case 0xE0:
-			fluid_synth_pitch_bend(m_pSynth, nChannel, (nData2 << 7) | nData1);
+			fluid_synth_pitch_bend(pSynth, nChannel, (nData2 << 7) | nData1);
 			break;
 	}
-
-	m_Lock.Release();
-
-	// Update MIDI monitor
-	CSynthBase::HandleMIDIShortMessage(nMessage);
 }
 
-void CSoundFontSynth::HandleMIDISysExMessage(const u8* pData, size_t nSize)
+void CSoundFontSynth::PageInMIDIShortMessage(u32 nMessage)
 {
-	// Return early if it wasn't a GM Mode On/Off message and was consumed as a text/display dots message
-	if (!ParseGMSysEx(pData, nSize) && (ParseRolandSysEx(pData, nSize) || ParseYamahaSysEx(pData, nSize)))
+	if (!m_pPagerSynth)
 		return;
 
-	// No special handling; forward to FluidSynth SysEx parser, excluding leading 0xF0 and trailing 0xF7
-	m_Lock.Acquire();
-	fluid_synth_sysex(m_pSynth, reinterpret_cast<const char*>(pData + 1), nSize - 2, nullptr, nullptr, nullptr, false);
-	m_Lock.Release();
+	const u8 nStatus = nMessage & 0xFF;
+	if (nStatus == 0xFF)
+		fluid_synth_system_reset(m_pPagerSynth);
+	else
+		ApplyChannelMessage(m_pPagerSynth, nStatus, (nMessage >> 8) & 0xFF, (nMessage >> 16) & 0xFF);
 }
 
-bool CSoundFontSynth::IsActive()
+fluid_synth_t* CSoundFontSynth::SelectNoteSynth(u8 nChannel)
 {
-	m_Lock.Acquire();
-	int nVoices = fluid_synth_get_active_voice_count(m_pSynth);
-	m_Lock.Release();
+	if (!m_pSecondarySynth)
+		return m_pSynth;
+
+	// Keep the notes of a channel on one synth where they interact: drum exclusive classes (e.g. open/closed hi-hat)
+	// cut each other off, and portamento, legato and mono mode depend on the previous note
+	int nPortamento = 0, nLegato = 0;
+	fluid_synth_get_cc(m_pSynth, nChannel, 65, &nPortamento);
+	fluid_synth_get_cc(m_pSynth, nChannel, 68, &nLegato);
+	const bool bPinned = ((m_nPercussionMask | m_nMonoModeMask) & (1 << nChannel)) || nPortamento >= 64 || nLegato >= 64;
 
-	return nVoices > 0;
+	if (bPinned || m_nPrimaryVoices <= m_nSecondaryVoices)
+	{
+		++m_nPrimaryVoices;
+		return m_pSynth;
+	}
+
+	++m_nSecondaryVoices;
+	return m_pSecondarySynth;
 }
 
-void CSoundFontSynth::AllSoundOff()
+void CSoundFontSynth::UpdateActiveState()
 {
-	m_Lock.Acquire();
-	fluid_synth_all_sounds_off(m_pSynth, -1);
-	m_Lock.Release();
+	m_nPrimaryVoices   = fluid_synth_get_active_voice_count(m_pSynth);
+	m_nSecondaryVoices = m_pSecondarySynth ? fluid_synth_get_active_voice_count(m_pSecondarySynth) : 0;
 
-	// Reset MIDI monitor
-	CSynthBase::AllSoundOff();
+	// Published for the main core's power management, which would otherwise need the lock
+	__atomic_store_n(&m_bActive, m_nPrimaryVoices + m_nSecondaryVoices > 0, __ATOMIC_RELAXED);
 }
 
-void CSoundFontSynth::SetMasterVolume(u8 nVolume)
+size_t CSoundFontSynth::Render(float* pOutBuffer, size_t nFrames)
 {
-	m_nVolume = nVolume;
+	// The main core only takes the lock for what can't go through the queue: presets selected with dynamic sample
+	// loading, and SoundFont switches
 	m_Lock.Acquire();
-	fluid_synth_set_gain(m_pSynth, m_nVolume / 100.0f * m_nInitialGain);
+	ApplyQueuedCommands();
+	RenderBlock(pOutBuffer, nFrames);
+	UpdateActiveState();
 	m_Lock.Release();
+
+	return nFrames;
 }
 
-size_t CSoundFontSynth::Render(float* pOutBuffer, size_t nFrames)
+size_t CSoundFontSynth::RenderWithMIDIEvents(float* pOutBuffer, size_t nFrames, const TMIDIEvent* pEvents, size_t nEvents)
 {
 	m_Lock.Acquire();
-	assert(fluid_synth_write_float(m_pSynth, nFrames, pOutBuffer, 0, 2, pOutBuffer, 1, 2) == FLUID_OK);
+	ApplyQueuedCommands();
+
+	// Split the block at each event's frame offset so that it takes effect at the right time
+	size_t nFramesRendered = 0;
+	for (size_t i = 0; i < nEvents; ++i)
+	{
+		const size_t nOffset = pEvents[i].nTimestamp;
+		if (nOffset > nFramesRendered)
+		{
+			RenderBlock(pOutBuffer + nFramesRendered * 2, nOffset - nFramesRendered);
+			nFramesRendered = nOffset;
+		}
+
+		ApplyMIDIShortMessage(pEvents[i].nMessage);
+
+		// Update MIDI monitor
+		CSynthBase::HandleMIDIShortMessage(pEvents[i].nMessage);
+	}
+
+	if (nFrames > nFramesRendered)
+		RenderBlock(pOutBuffer + nFramesRendered * 2, nFrames - nFramesRendered);
+
+	UpdateActiveState();
 	m_Lock.Release();
+
 	return nFrames;
 }
 
+void CSoundFontSynth::RenderBlock(float* pOutBuffer, size_t nFrames)
+{
+	if (m_pSecondarySynth)
+		RenderParallel(pOutBuffer, nFrames);
+	else
+		assert(fluid_synth_write_float(m_pSynth, nFrames, pOutBuffer, 0, 2, pOutBuffer, 1, 2) == FLUID_OK);
+
+	if (m_nCrossfadeFramesRemaining)
+		RenderCrossfade(pOutBuffer, nFrames);
+}
+
 size_t CSoundFontSynth::Render(s16* pOutBuffer, size_t nFrames)
 {
 	m_Lock.Acquire();
+	ApplyQueuedCommands();
 	assert(fluid_synth_write_s16(m_pSynth, nFrames, pOutBuffer, 0, 2, pOutBuffer, 1, 2) == FLUID_OK);
+
+	// Integer path is only used for non-realtime rendering; mix the secondary synth in sequentially
+	if (m_pSecondarySynth)
+	{
+		s16 SecondaryBuffer[SecondaryBufferFrames * 2];
+		size_t nOffset = 0;
+
+		while (nOffset < nFrames)
+		{
+			const size_t nSliceFrames = Utility::Min(nFrames - nOffset, SecondaryBufferFrames);
+			s16* const pSlice = pOutBuffer + nOffset * 2;
+
+			fluid_synth_write_s16(m_pSecondarySynth, nSliceFrames, SecondaryBuffer, 0, 2, SecondaryBuffer, 1, 2);
+			for (size_t i = 0; i < nSliceFrames * 2; ++i)
+				pSlice[i] = Utility::Clamp(pSlice[i] + SecondaryBuffer[i], -32768, 32767);
+
+			nOffset += nSliceFrames;
+		}
+	}
+
+	// No crossfade for the integer path; drop the previous synths immediately
+	m_nCrossfadeFramesRemaining = 0;
+
+	UpdateActiveState();
 	m_Lock.Release();
 	return nFrames;
 }
 
+void CSoundFontSynth::RenderParallel(float* pOutBuffer, size_t nFrames)
+{
+	size_t nOffset = 0;
+
+	while (nOffset < nFrames)
+	{
+		const size_t nSliceFrames = Utility::Min(nFrames - nOffset, SecondaryBufferFrames);
+		float* const pSlice = pOutBuffer + nOffset * 2;
+
+		if (m_bRenderCoreAvailable)
+		{
+			// Hand the secondary synth over to the render core and render the primary synth in the meantime
+			__atomic_store_n(&m_nSecondaryRenderFrames, nSliceFrames, __ATOMIC_RELEASE);
+			fluid_synth_write_float(m_pSynth, nSliceFrames, pSlice, 0, 2, pSlice, 1, 2);
+
+			// Wait for the render core to finish, then mix
+			while (__atomic_load_n(&m_nSecondaryRenderFrames, __ATOMIC_ACQUIRE))
+				;
+		}
+		else
+		{
+			fluid_synth_write_float(m_pSynth, nSliceFrames, pSlice, 0, 2, pSlice, 1, 2);
+			fluid_synth_write_float(m_pSecondarySynth, nSliceFrames, m_SecondaryBuffer, 0, 2, m_SecondaryBuffer, 1, 2);
+		}
+
+		for (size_t i = 0; i < nSliceFrames * 2; ++i)
+			pSlice[i] += m_SecondaryBuffer[i];
+
+		nOffset += nSliceFrames;
+	}
+}
+
+void CSoundFontSynth::RenderCrossfade(float* pOutBuffer, size_t nFrames)
+{
+	float FadingBuffer[SecondaryBufferFrames * 2];
+	float FadingSecondaryBuffer[SecondaryBufferFrames * 2];
+
+	const float nStep = 1.0f / m_nCrossfadeFrames;
+	size_t nRemaining = m_nCrossfadeFramesRemaining;
+	size_t nOffset = 0;
+
+	while (nOffset < nFrames && nRemaining)
+	{
+		const size_t nSliceFrames = Utility::Min(Utility::Min(nFrames - nOffset, SecondaryBufferFrames), nRemaining);
+		float* const pSlice = pOutBuffer + nOffset * 2;
+
+		fluid_synth_write_float(m_pFadingSynth, nSliceFrames, FadingBuffer, 0, 2, FadingBuffer, 1, 2);
+		if (m_pFadingSecondarySynth)
+		{
+			fluid_synth_write_float(m_pFadingSecondarySynth, nSliceFrames, FadingSecondaryBuffer, 0, 2, FadingSecondaryBuffer, 1, 2);
+			for (size_t i = 0; i < nSliceFrames * 2; ++i)
+				FadingBuffer[i] += FadingSecondaryBuffer[i];
+		}
+
+		// Linear crossfade from the previous synths to the new ones
+		for (size_t i = 0; i < nSliceFrames; ++i)
+		{
+			const float nFadeOut = (nRemaining - i) * nStep;
+			const float nFadeIn  = 1.0f - nFadeOut;
+			pSlice[i * 2]     = pSlice[i * 2] * nFadeIn + FadingBuffer[i * 2] * nFadeOut;
+			pSlice[i * 2 + 1] = pSlice[i * 2 + 1] * nFadeIn + FadingBuffer[i * 2 + 1] * nFadeOut;
+		}
+
+		nRemaining -= nSliceFrames;
+		nOffset += nSliceFrames;
+	}
+
+	m_nCrossfadeFramesRemaining = nRemaining;
+}
+
+void CSoundFontSynth::RenderSecondary()
+{
+	// Lock is held by the audio core for the duration of the request, so the synth can be accessed safely
+	const size_t nFrames = __atomic_load_n(&m_nSecondaryRenderFrames, __ATOMIC_ACQUIRE);
+	if (!nFrames)
+		return;
+
+	fluid_synth_write_float(m_pSecondarySynth, nFrames, m_SecondaryBuffer, 0, 2, m_SecondaryBuffer, 1, 2);
+	__atomic_store_n(&m_nSecondaryRenderFrames, 0, __ATOMIC_RELEASE);
+}
+
 void CSoundFontSynth::ReportStatus() const
 {
 	if (m_pUI)
@@ -345,6 +863,14 @@ bool CSoundFontSynth::SwitchSoundFont(size_t nIndex)
 		return false;
 	}
 
+	// Only one SoundFont can be loaded in the background at a time
+	if (m_pPendingSynth)
+	{
+		if (m_pUI)
+			m_pUI->ShowSystemMessage("SF still loading!");
+		return false;
+	}
+
 	// Get SoundFont if available
 	const char* pSoundFontPath = m_SoundFontManager.GetSoundFontPath(nIndex);
 	if (!pSoundFontPath)
@@ -354,23 +880,120 @@ bool CSoundFontSynth::SwitchSoundFont(size_t nIndex)
 		return false;
 	}
 
-	if (m_pUI)
-		m_pUI->ShowSystemMessage("Loading SoundFont", true);
-
 	TFXProfile FXProfile = m_SoundFontManager.GetSoundFontFXProfile(nIndex);
+	m_nPendingInitialGain = FXProfile.nGain.ValueOr(CConfig::Get()->FluidSynthDefaultGain);
 
-	// We can't use fluid_synth_sfunload() as we don't support the lazy SoundFont unload timer, so trash the entire synth and create a new one
-	if (!Reinitialize(pSoundFontPath, &FXProfile))
+	// Load into a new set of synths while the current ones keep playing; switched over in UpdateSoundFontSwitch()
+	if (!CreateSynths(m_pPendingSynth, m_pPendingSecondarySynth, &FXProfile, m_nPendingInitialGain) || !m_Loader.Load(m_pPendingSynth, pSoundFontPath))
 	{
+		DeleteSynths(m_pPendingSynth, m_pPendingSecondarySynth);
+
 		if (m_pUI)
 			m_pUI->ShowSystemMessage("SF switch failed!");
 
 		return false;
 	}
 
-	m_nCurrentSoundFontIndex = nIndex;
+	m_nPendingSoundFontIndex = nIndex;
+	m_nLastLoadProgress = 0;
+
+	if (m_pUI)
+		m_pUI->ShowSystemMessage("Loading", true);
+
+	return true;
+}
+
+bool CSoundFontSynth::UpdateSoundFontSwitch()
+{
+	// Free the previous synths once they have been faded out
+	if (m_pFadingSynth && !m_nCrossfadeFramesRemaining)
+	{
+		m_Lock.Acquire();
+		fluid_synth_t* pFadingSynth = m_pFadingSynth;
+		fluid_synth_t* pFadingSecondarySynth = m_pFadingSecondarySynth;
+		m_pFadingSynth = nullptr;
+		m_pFadingSecondarySynth = nullptr;
+		m_Lock.Release();
+
+		DeleteSynths(pFadingSynth, pFadingSecondarySynth);
+	}
+
+	if (!m_pPendingSynth)
+		return false;
+
+	switch (m_Loader.GetState())
+	{
+		case CSoundFontLoader::TState::Loading:
+		{
+			const u8 nProgress = m_Loader.GetProgress();
+			if (m_pUI && nProgress != m_nLastLoadProgress)
+				m_pUI->SetSpinnerProgress(nProgress);
+			m_nLastLoadProgress = nProgress;
+			return false;
+		}
+
+		case CSoundFontLoader::TState::Failed:
+			m_Loader.Reset();
+			DeleteSynths(m_pPendingSynth, m_pPendingSecondarySynth);
+
+			if (m_pUI)
+				m_pUI->ShowSystemMessage("SF switch failed!");
+
+			return false;
+
+		case CSoundFontLoader::TState::Succeeded:
+			// Wait for any previous crossfade to finish
+			if (m_pFadingSynth)
+				return false;
+			break;
+
+		default:
+			return false;
+	}
+
+	ShareSoundFont(m_pPendingSynth, m_pPendingSecondarySynth, m_Loader.GetSoundFontID());
+	m_Loader.Reset();
+
+	// Select the current programs before taking the lock so that their samples are loaded by now; only this core
+	// changes programs when samples are loaded dynamically, and the new synths aren't playing yet
+	if (m_bDynamicSampleLoading)
+	{
+		CopyPrograms(m_pPendingSynth);
+		if (m_pPendingSecondarySynth)
+			CopyPrograms(m_pPendingSecondarySynth);
+	}
+
+	// Carry over channel state so that playback continues seamlessly, once the audio core has applied everything
+	// queued so far
+	WaitForCommands(0);
+	m_Lock.Acquire();
+	CopyChannelState(m_pPendingSynth, m_pPendingSecondarySynth);
+
+	m_nInitialGain = m_nPendingInitialGain;
+	m_nAppliedVolume = m_nVolume;
+	fluid_synth_set_gain(m_pPendingSynth, m_nAppliedVolume / 100.0f * m_nInitialGain);
+	if (m_pPendingSecondarySynth)
+		fluid_synth_set_gain(m_pPendingSecondarySynth, m_nAppliedVolume / 100.0f * m_nInitialGain);
+
+	// Swap in the new synths; the previous ones are faded out by the render path
+	m_pFadingSynth = m_pSynth;
+	m_pFadingSecondarySynth = m_pSecondarySynth;
+	m_pSynth = m_pPendingSynth;
+	m_pSecondarySynth = m_pPendingSecondarySynth;
+	m_pPendingSynth = nullptr;
+	m_pPendingSecondarySynth = nullptr;
+	m_nCrossfadeFramesRemaining = m_nCrossfadeFrames;
+
+	m_nCurrentSoundFontIndex = m_nPendingSoundFontIndex;
+
+	m_Lock.Release();
+
+	SetPagerSoundFont(fluid_synth_get_sfont(m_pSynth, 0));
+
+	LOGNOTE("Loaded \"%s\"", m_SoundFontManager.GetSoundFontName(m_nCurrentSoundFontIndex));
+	if (CSoundFontPageCache::Get())
+		CSoundFontPageCache::Get()->DumpStats();
 
-	LOGNOTE("Loaded \"%s\"", m_SoundFontManager.GetSoundFontName(nIndex));
 	if (m_pUI)
 		m_pUI->ClearSpinnerMessage();
 
@@ -381,38 +1004,20 @@ bool CSoundFontSynth::Reinitialize(const char* pSoundFontPath, const TFXProfile*
 {
 	const CConfig* const pConfig = CConfig::Get();
 
+	SetPagerSoundFont(nullptr);
+
 	m_Lock.Acquire();
 
-	if (m_pSynth)
-		delete_fluid_synth(m_pSynth);
+	DeleteSynths(m_pSynth, m_pSecondarySynth);
 
-	m_pSynth = new_fluid_synth(m_pSettings);
+	m_nInitialGain = pFXProfile->nGain.ValueOr(pConfig->FluidSynthDefaultGain);
 
-	if (!m_pSynth)
+	if (!CreateSynths(m_pSynth, m_pSecondarySynth, pFXProfile, m_nInitialGain))
 	{
 		m_Lock.Release();
-		LOGERR("Failed to create synth");
 		return false;
 	}
 
-	fluid_synth_set_polyphony(m_pSynth, pConfig->FluidSynthPolyphony);
-
-	m_nInitialGain = pFXProfile->nGain.ValueOr(pConfig->FluidSynthDefaultGain);
-	fluid_synth_set_gain(m_pSynth, m_nVolume / 100.0f * m_nInitialGain);
-
-	// Use values from effects profile if set, otherwise use defaults
-	fluid_synth_reverb_on(m_pSynth, -1, pFXProfile->bReverbActive.ValueOr(pConfig->FluidSynthDefaultReverbActive));
-	fluid_synth_set_reverb_group_damp(m_pSynth, -1, pFXProfile->nReverbDamping.ValueOr(pConfig->FluidSynthDefaultReverbDamping));
-	fluid_synth_set_reverb_group_level(m_pSynth, -1, pFXProfile->nReverbLevel.ValueOr(pConfig->FluidSynthDefaultReverbLevel));
-	fluid_synth_set_reverb_group_roomsize(m_pSynth, -1, pFXProfile->nReverbRoomSize.ValueOr(pConfig->FluidSynthDefaultReverbRoomSize));
-	fluid_synth_set_reverb_group_width(m_pSynth, -1, pFXProfile->nReverbWidth.ValueOr(pConfig->FluidSynthDefaultReverbWidth));
-
-	fluid_synth_chorus_on(m_pSynth, -1, pFXProfile->bChorusActive.ValueOr(pConfig->FluidSynthDefaultChorusActive));
-	fluid_synth_set_chorus_group_depth(m_pSynth, -1, pFXProfile->nChorusDepth.ValueOr(pConfig->FluidSynthDefaultChorusDepth));
-	fluid_synth_set_chorus_group_level(m_pSynth, -1, pFXProfile->nChorusLevel.ValueOr(pConfig->FluidSynthDefaultChorusLevel));
-	fluid_synth_set_chorus_group_nr(m_pSynth, -1, pFXProfile->nChorusVoices.ValueOr(pConfig->FluidSynthDefaultChorusVoices));
-	fluid_synth_set_chorus_group_speed(m_pSynth, -1, pFXProfile->nChorusSpeed.ValueOr(pConfig->FluidSynthDefaultChorusSpeed));
-
 #ifndef NDEBUG
 	DumpFXSettings();
 #endif
@@ -423,18 +1028,163 @@ bool CSoundFontSynth::Reinitialize(const char* pSoundFontPath, const TFXProfile*
 
 	const unsigned int nLoadStart = CTimer::GetClockTicks();
 
-	if (fluid_synth_sfload(m_pSynth, pSoundFontPath, true) == FLUID_FAILED)
+	const int nSoundFontID = fluid_synth_sfload(m_pSynth, pSoundFontPath, true);
+	if (nSoundFontID == FLUID_FAILED)
 	{
 		LOGERR("Failed to load SoundFont");
 		return false;
 	}
 
+	m_Lock.Acquire();
+	ShareSoundFont(m_pSynth, m_pSecondarySynth, nSoundFontID);
+	m_Lock.Release();
+
+	SetPagerSoundFont(fluid_synth_get_sfont_by_id(m_pSynth, nSoundFontID));
+
 	const float nLoadTime = (CTimer::GetClockTicks() - nLoadStart) / 1000000.0f;
 	LOGNOTE("\"%s\" loaded in %0.2f seconds", pSoundFontPath, nLoadTime);
 
 	return true;
 }
 
+bool CSoundFontSynth::CreateSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pSecondarySynth, const TFXProfile* pFXProfile, float nInitialGain)
+{
+	pSynth = new_fluid_synth(m_pSettings);
+	if (m_bParallelRendering)
+		pSecondarySynth = new_fluid_synth(m_pSettings);
+
+	if (!pSynth || (m_bParallelRendering && !pSecondarySynth))
+	{
+		DeleteSynths(pSynth, pSecondarySynth);
+		LOGERR("Failed to create synth");
+		return false;
+	}
+
+	// Both synths get identical effects settings; reverb and chorus are linear, so summing their outputs is equivalent to a single synth
+	ApplyFXProfile(pSynth, pFXProfile, nInitialGain);
+	if (pSecondarySynth)
+		ApplyFXProfile(pSecondarySynth, pFXProfile, nInitialGain);
+
+	return true;
+}
+
+void CSoundFontSynth::ApplyFXProfile(fluid_synth_t* pSynth, const TFXProfile* pFXProfile, float nInitialGain)
+{
+	const CConfig* const pConfig = CConfig::Get();
+
+	fluid_synth_set_polyphony(pSynth, pConfig->FluidSynthPolyphony);
+	fluid_synth_set_gain(pSynth, m_nVolume / 100.0f * nInitialGain);
+
+	// Use values from effects profile if set, otherwise use defaults
+	fluid_synth_reverb_on(pSynth, -1, pFXProfile->bReverbActive.ValueOr(pConfig->FluidSynthDefaultReverbActive));
+	fluid_synth_set_reverb_group_damp(pSynth, -1, pFXProfile->nReverbDamping.ValueOr(pConfig->FluidSynthDefaultReverbDamping));
+	fluid_synth_set_reverb_group_level(pSynth, -1, pFXProfile->nReverbLevel.ValueOr(pConfig->FluidSynthDefaultReverbLevel));
+	fluid_synth_set_reverb_group_roomsize(pSynth, -1, pFXProfile->nReverbRoomSize.ValueOr(pConfig->FluidSynthDefaultReverbRoomSize));
+	fluid_synth_set_reverb_group_width(pSynth, -1, pFXProfile->nReverbWidth.ValueOr(pConfig->FluidSynthDefaultReverbWidth));
+
+	fluid_synth_chorus_on(pSynth, -1, pFXProfile->bChorusActive.ValueOr(pConfig->FluidSynthDefaultChorusActive));
+	fluid_synth_set_chorus_group_depth(pSynth, -1, pFXProfile->nChorusDepth.ValueOr(pConfig->FluidSynthDefaultChorusDepth));
+	fluid_synth_set_chorus_group_level(pSynth, -1, pFXProfile->nChorusLevel.ValueOr(pConfig->FluidSynthDefaultChorusLevel));
+	fluid_synth_set_chorus_group_nr(pSynth, -1, pFXProfile->nChorusVoices.ValueOr(pConfig->FluidSynthDefaultChorusVoices));
+	fluid_synth_set_chorus_group_speed(pSynth, -1, pFXProfile->nChorusSpeed.ValueOr(pConfig->FluidSynthDefaultChorusSpeed));
+}
+
+void CSoundFontSynth::ShareSoundFont(fluid_synth_t* pSynth, fluid_synth_t* pSecondarySynth, int nSoundFontID)
+{
+	if (!pSecondarySynth)
+		return;
+
+	// Share the SoundFont with the secondary synth rather than loading it twice
+	fluid_synth_add_sfont(pSecondarySynth, fluid_synth_get_sfont_by_id(pSynth, nSoundFontID));
+	fluid_synth_program_reset(pSecondarySynth);
+}
+
+void CSoundFontSynth::CopyChannelState(fluid_synth_t* pSynth, fluid_synth_t* pSecondarySynth)
+{
+	// Both current synths hold the same channel state
+	fluid_synth_t* const DestSynths[] = { pSynth, pSecondarySynth };
+	for (fluid_synth_t* pDest : DestSynths)
+	{
+		if (!pDest)
+			continue;
+
+		CopyPrograms(pDest);
+
+		for (u8 nChannel = 0; nChannel < 16; ++nChannel)
+		{
+			for (int nController = 0; nController < 120; ++nController)
+			{
+				// Skip bank select and data entry/(N)RPN; their effects are carried over directly
+				if (nController == 0 || nController == 6 || nController == 32 || nController == 38 || (nController >= 96 && nController <= 101))
+					continue;
+
+				int nValue;
+				if (fluid_synth_get_cc(m_pSynth, nChannel, nController, &nValue) == FLUID_OK)
+					fluid_synth_cc(pDest, nChannel, nController, nValue);
+			}
+
+			int nPitchBendRange, nPitchBend;
+			if (fluid_synth_get_pitch_wheel_sens(m_pSynth, nChannel, &nPitchBendRange) == FLUID_OK)
+				fluid_synth_pitch_wheel_sens(pDest, nChannel, nPitchBendRange);
+			if (fluid_synth_get_pitch_bend(m_pSynth, nChannel, &nPitchBend) == FLUID_OK)
+				fluid_synth_pitch_bend(pDest, nChannel, nPitchBend);
+		}
+	}
+}
+
+void CSoundFontSynth::CopyPrograms(fluid_synth_t* pDest)
+{
+	for (u8 nChannel = 0; nChannel < 16; ++nChannel)
+	{
+		const bool bPercussion = m_nPercussionMask & (1 << nChannel);
+		fluid_synth_set_channel_type(pDest, nChannel, bPercussion ? CHANNEL_TYPE_DRUM : CHANNEL_TYPE_MELODIC);
+
+		int nSoundFontID, nBank, nProgram;
+		if (fluid_synth_get_program(m_pSynth, nChannel, &nSoundFontID, &nBank, &nProgram) == FLUID_OK)
+		{
+			fluid_synth_bank_select(pDest, nChannel, nBank);
+			fluid_synth_program_change(pDest, nChannel, nProgram);
+		}
+	}
+}
+
+void CSoundFontSynth::SetPagerSoundFont(fluid_sfont_t* pSoundFont)
+{
+	if (!m_pPagerSynth)
+		return;
+
+	// The SoundFont is owned by the primary synth, which still holds the samples it uses
+	fluid_sfont_t* pPrevious = fluid_synth_get_sfont(m_pPagerSynth, 0);
+	if (pPrevious)
+		fluid_synth_remove_sfont(m_pPagerSynth, pPrevious);
+
+	if (!pSoundFont)
+		return;
+
+	fluid_synth_add_sfont(m_pPagerSynth, pSoundFont);
+	CopyPrograms(m_pPagerSynth);
+}
+
+void CSoundFontSynth::DeleteSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pSecondarySynth)
+{
+	if (pSecondarySynth)
+	{
+		// The SoundFont is owned by the primary synth; detach it first so that it isn't freed twice
+		fluid_sfont_t* pSoundFont = fluid_synth_get_sfont(pSecondarySynth, 0);
+		if (pSoundFont)
+			fluid_synth_remove_sfont(pSecondarySynth, pSoundFont);
+
+		delete_fluid_synth(pSecondarySynth);
+		pSecondarySynth = nullptr;
+	}
+
+	if (pSynth)
+	{
+		delete_fluid_synth(pSynth);
+		pSynth = nullptr;
+	}
+}
+
 void CSoundFontSynth::ResetMIDIMonitor()
 {
 	m_MIDIMonitor.AllNotesOff();
@@ -40,7 +40,16 @@ CZoneAllocator::CZoneAllocator()
 	: m_pHeap(nullptr),
 	  m_nHeapSize(0),
 	  m_pCurrentBlock(nullptr),
-	  m_nAllocCount(0)
+	  m_pSlabArena(nullptr),
+	  m_SlabPages(nullptr),
+	  m_nSlabPageCount(0),
+	  m_pPartialSlabPages{nullptr},
+	  m_pFreeSlabPages(nullptr),
+	  m_nAllocCount(0),
+	  m_nBytesInUse(0),
+	  m_nPeakBytes(0),
+	  m_TagStats{},
+	  m_Histogram{}
 {
 	assert(s_pThis == nullptr);
 	s_pThis = this;
@@ -50,9 +59,10 @@ CZoneAllocator::~CZoneAllocator()
 {
 	// Release the entire heap
 	CMemorySystem::Get()->HeapFree(m_pHeap);
+	s_pThis = nullptr;
 }
 
-bool CZoneAllocator::Initialize()
+bool CZoneAllocator::Initialize(size_t nSlabArenaSize)
 {
 	CMemorySystem* pMemorySystem = CMemorySystem::Get();
 
@@ -95,8 +105,20 @@ bool CZoneAllocator::Initialize()
 		LOGDEBUG("Heap is NOT 16-byte aligned");
 
 	LOGDEBUG("Size of block header: %d", sizeof(TBlock));
+	LOGDEBUG("Size of small allocation header: %d", sizeof(TSlabObject));
 #endif
 
+	// Small allocations are served from an arena at the start of the heap, followed by the page bookkeeping; leave at
+	// least half of the heap to the zone
+	m_nSlabPageCount = Utility::Min(nSlabArenaSize, m_nHeapSize / 2) / SlabPageSize;
+	m_pSlabArena     = static_cast<u8*>(m_pHeap);
+	m_SlabPages      = reinterpret_cast<TSlabPage*>(m_pSlabArena + m_nSlabPageCount * SlabPageSize);
+
+	if (m_nSlabPageCount)
+		LOGNOTE("Small allocation arena: %d KB", m_nSlabPageCount * SlabPageSize / KILOBYTE);
+	else
+		LOGNOTE("Small allocation arena disabled");
+
 	// Initialize the heap with an empty block
 	Clear();
 
@@ -114,6 +136,31 @@ void* CZoneAllocator::Alloc(size_t nSize, TZoneTag Tag)
 		return nullptr;
 	}
 
+	// Bucket n counts requests of up to 16 << n bytes; the last bucket also counts anything larger
+	size_t nBucket = 0;
+	while (nBucket < HistogramBuckets - 1 && nSize > (static_cast<size_t>(16) << nBucket))
+		++nBucket;
+	++m_Histogram[nBucket];
+
+	void* pPtr = Allocate(nSize, Tag);
+	if (pPtr)
+		++m_TagStats[GetTagIndex(Tag)].nAllocs;
+
+	return pPtr;
+}
+
+void* CZoneAllocator::Allocate(size_t nSize, TZoneTag Tag)
+{
+	// Try a size-class page first; fall back to the zone if the arena is exhausted
+	void* pPtr = nSize <= SlabMaxSize ? SlabAlloc(nSize, Tag) : nullptr;
+	if (!pPtr)
+		pPtr = ZoneAlloc(nSize, Tag);
+
+	return pPtr;
+}
+
+void* CZoneAllocator::ZoneAlloc(size_t nSize, TZoneTag Tag)
+{
 	// Account for size of block header and magic number at end of zone (for corruption detection), padded to 16 bytes
 	nSize = (nSize + sizeof(TBlock) + sizeof(BlockMagic) + 0xF) & ~0xF;
 
@@ -163,6 +210,7 @@ void* CZoneAllocator::Alloc(size_t nSize, TZoneTag Tag)
 
 	// Mark end of memory with magic number
 	GetEndMagic(pCandidateBlock) = BlockMagic;
+	AddUsage(Tag, pCandidateBlock->nSize);
 
 	// Next allocation will start looking at this block
 	m_pCurrentBlock = pCandidateBlock->pNext;
@@ -177,6 +225,56 @@ void* CZoneAllocator::Alloc(size_t nSize, TZoneTag Tag)
 	return pCandidateBlock + 1;
 }
 
+void* CZoneAllocator::SlabAlloc(size_t nSize, TZoneTag Tag)
+{
+	u8 nClass = 0;
+	while (SlabClassSizes[nClass] < nSize)
+		++nClass;
+
+	TSlabPage* pPage = m_pPartialSlabPages[nClass];
+	if (!pPage)
+	{
+		// Take an empty page from the pool and assign it to this size class
+		pPage = m_pFreeSlabPages;
+		if (!pPage)
+			return nullptr;
+
+		m_pFreeSlabPages  = pPage->pNext;
+		pPage->pFreeList  = nullptr;
+		pPage->nUsed      = 0;
+		pPage->nBumpIndex = 0;
+		pPage->nClass     = nClass;
+		LinkPartialSlabPage(pPage);
+	}
+
+	// Reuse a freed object, or carve a new one from the untouched part of the page
+	TSlabObject* pObject = pPage->pFreeList;
+	if (pObject)
+		pPage->pFreeList = pObject->pNextFree;
+	else
+		pObject = reinterpret_cast<TSlabObject*>(GetSlabPageBase(pPage) + pPage->nBumpIndex++ * GetSlabObjectSize(nClass));
+
+	++pPage->nUsed;
+	if (IsSlabPageFull(pPage))
+		UnlinkPartialSlabPage(pPage);
+
+	pObject->pNextFree = nullptr;
+	pObject->Tag       = Tag;
+	pObject->nMagic    = SlabMagic;
+#if AARCH == 32
+	pObject->Padding = 0xEBEBEBEB;
+#endif
+	AddUsage(Tag, GetSlabObjectSize(nClass));
+
+#ifdef ZONE_ALLOCATOR_TRACE
+	LOGDBG("Allocated %d bytes from size class %d for tag %x", nSize, SlabClassSizes[nClass], Tag);
+#endif
+
+	++m_nAllocCount;
+
+	return pObject + 1;
+}
+
 void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 {
 	// If passed a null pointer, perform a new allocation
@@ -186,16 +284,49 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 	if (!nSize)
 		return nullptr;
 
-	// Account for size of block header and magic number at end of zone (for corruption detection), padded to 16 bytes
-	const size_t nNewSize = (nSize + sizeof(TBlock) + sizeof(BlockMagic) + 0xF) & ~0xF;
-	TBlock* pBlock        = reinterpret_cast<TBlock*>(pPtr) - 1;
-
 	if (Tag == TZoneTag::Free)
 	{
 		LOGERR("Zone reallocation failed: tag value of 0 was used");
 		return nullptr;
 	}
 
+	if (IsSlabObject(pPtr))
+	{
+		TSlabObject* pObject = static_cast<TSlabObject*>(pPtr) - 1;
+
+		if (pObject->Tag == TZoneTag::Free)
+		{
+			LOGERR("Attempted to reallocate a freed block");
+			return nullptr;
+		}
+
+		// Still fits in the same size class, just update tag
+		const size_t nCurrentSize = SlabClassSizes[GetSlabPage(pObject)->nClass];
+		if (nSize <= nCurrentSize)
+		{
+			RemoveUsage(pObject->Tag, sizeof(TSlabObject) + nCurrentSize);
+			AddUsage(Tag, sizeof(TSlabObject) + nCurrentSize);
+			pObject->Tag = Tag;
+			return pPtr;
+		}
+
+		void* pDest = Allocate(nSize, Tag);
+		if (!pDest)
+		{
+			LOGERR("Zone reallocation failed");
+			return nullptr;
+		}
+
+		memcpy(pDest, pPtr, nCurrentSize);
+		SlabFree(pObject);
+
+		return pDest;
+	}
+
+	// Account for size of block header and magic number at end of zone (for corruption detection), padded to 16 bytes
+	const size_t nNewSize = (nSize + sizeof(TBlock) + sizeof(BlockMagic) + 0xF) & ~0xF;
+	TBlock* pBlock        = reinterpret_cast<TBlock*>(pPtr) - 1;
+
 	if (pBlock->Tag == TZoneTag::Free)
 	{
 		LOGERR("Attempted to reallocate a freed block");
@@ -208,7 +339,7 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 		const size_t nSizeDiff = nNewSize - pBlock->nSize;
 
 		// Expand in-place if next block is free and large enough
-		if (pBlock->pNext->Tag == TZoneTag::Free && pBlock->pNext->nSize >= nSizeDiff)
+		if (pBlock->pNext->Tag == TZoneTag::Free && pBlock->pNext->nSize > nSizeDiff + MinFragmentSize)
 		{
 			TBlock* pNewBlock = reinterpret_cast<TBlock*>(reinterpret_cast<u8*>(pBlock) + nNewSize);
 
@@ -227,6 +358,9 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 			if (pBlock->pNext == m_pCurrentBlock)
 				m_pCurrentBlock = pNewBlock;
 
+			RemoveUsage(pBlock->Tag, pBlock->nSize);
+			AddUsage(Tag, nNewSize);
+
 			pBlock->nSize       = nNewSize;
 			pBlock->pNext       = pNewBlock;
 			pBlock->Tag         = Tag;
@@ -243,7 +377,7 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 		else
 		{
 			const size_t nSrcSize = pBlock->nSize - sizeof(TBlock) - sizeof(BlockMagic);
-			void* pDest           = Alloc(nSize, Tag);
+			void* pDest           = Allocate(nSize, Tag);
 
 			if (!pDest)
 			{
@@ -252,7 +386,7 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 			}
 
 			memcpy(pDest, pPtr, nSrcSize);
-			Free(pPtr);
+			Release(pPtr);
 
 #ifdef ZONE_ALLOCATOR_TRACE
 			LOGDBG("Expanded block at %p by allocating new block", pPtr);
@@ -306,6 +440,9 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 			pBlock->pNext = pNewBlock;
 		}
 
+		RemoveUsage(pBlock->Tag, pBlock->nSize);
+		AddUsage(Tag, nNewSize);
+
 		pBlock->nSize = nNewSize;
 		pBlock->Tag   = Tag;
 
@@ -316,6 +453,8 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 	}
 
 	// Size is the same, just update tag
+	RemoveUsage(pBlock->Tag, pBlock->nSize);
+	AddUsage(Tag, pBlock->nSize);
 	pBlock->Tag = Tag;
 	return pPtr;
 }
@@ -325,20 +464,51 @@ void CZoneAllocator::Free(void* pPtr)
 	if (!pPtr)
 		return;
 
+	const TZoneTag Tag = Release(pPtr);
+	if (Tag != TZoneTag::Free)
+		++m_TagStats[GetTagIndex(Tag)].nFrees;
+}
+
+TZoneTag CZoneAllocator::Release(void* pPtr)
+{
+	if (IsSlabObject(pPtr))
+	{
+		TSlabObject* pObject = static_cast<TSlabObject*>(pPtr) - 1;
+
+		if (pObject->Tag == TZoneTag::Free)
+		{
+			LOGERR("Attempted to free an already-freed block");
+			return TZoneTag::Free;
+		}
+
+		if (pObject->nMagic != SlabMagic)
+		{
+			LOGERR("Attempted to free a block with a bad magic number (heap corruption?)");
+			return TZoneTag::Free;
+		}
+
+		const TZoneTag Tag = pObject->Tag;
+		SlabFree(pObject);
+		return Tag;
+	}
+
 	TBlock* pBlock = reinterpret_cast<TBlock*>(pPtr) - 1;
 
 	if (pBlock->Tag == TZoneTag::Free)
 	{
 		LOGERR("Attempted to free an already-freed block");
-		return;
+		return TZoneTag::Free;
 	}
 
 	if (pBlock->nMagic != BlockMagic)
 	{
 		LOGERR("Attempted to free a block with a bad magic number (heap corruption?)");
-		return;
+		return TZoneTag::Free;
 	}
 
+	const TZoneTag Tag = pBlock->Tag;
+	RemoveUsage(Tag, pBlock->nSize);
+
 	// Mark this block as free
 	pBlock->Tag = TZoneTag::Free;
 
@@ -374,11 +544,108 @@ void CZoneAllocator::Free(void* pPtr)
 
 	// Decrement allocation counter
 	--m_nAllocCount;
+
+	return Tag;
+}
+
+void CZoneAllocator::SlabFree(TSlabObject* pObject)
+{
+	TSlabPage* pPage    = GetSlabPage(pObject);
+	const bool bWasFull = IsSlabPageFull(pPage);
+
+	RemoveUsage(pObject->Tag, GetSlabObjectSize(pPage->nClass));
+
+	pObject->Tag       = TZoneTag::Free;
+	pObject->pNextFree = pPage->pFreeList;
+	pPage->pFreeList   = pObject;
+	--pPage->nUsed;
+
+	if (!pPage->nUsed)
+	{
+		// Return empty pages to the pool so that other size classes can use them
+		if (!bWasFull)
+			UnlinkPartialSlabPage(pPage);
+		pPage->pNext     = m_pFreeSlabPages;
+		m_pFreeSlabPages = pPage;
+	}
+	else if (bWasFull)
+		LinkPartialSlabPage(pPage);
+
+#ifdef ZONE_ALLOCATOR_TRACE
+	LOGDBG("Freed object at %p from size class %d", pObject + 1, SlabClassSizes[pPage->nClass]);
+#endif
+
+	--m_nAllocCount;
+}
+
+void CZoneAllocator::AddUsage(TZoneTag Tag, size_t nBytes)
+{
+	TTagStats& TagStats = m_TagStats[GetTagIndex(Tag)];
+
+	TagStats.nBytesInUse += nBytes;
+	if (TagStats.nBytesInUse > TagStats.nPeakBytes)
+		TagStats.nPeakBytes = TagStats.nBytesInUse;
+
+	m_nBytesInUse += nBytes;
+	if (m_nBytesInUse > m_nPeakBytes)
+		m_nPeakBytes = m_nBytesInUse;
+}
+
+void CZoneAllocator::RemoveUsage(TZoneTag Tag, size_t nBytes)
+{
+	m_TagStats[GetTagIndex(Tag)].nBytesInUse -= nBytes;
+	m_nBytesInUse -= nBytes;
+}
+
+void CZoneAllocator::LinkPartialSlabPage(TSlabPage* pPage)
+{
+	TSlabPage*& pHead = m_pPartialSlabPages[pPage->nClass];
+
+	pPage->pPrevious = nullptr;
+	pPage->pNext     = pHead;
+	if (pHead)
+		pHead->pPrevious = pPage;
+	pHead = pPage;
+}
+
+void CZoneAllocator::UnlinkPartialSlabPage(TSlabPage* pPage)
+{
+	if (pPage->pPrevious)
+		pPage->pPrevious->pNext = pPage->pNext;
+	else
+		m_pPartialSlabPages[pPage->nClass] = pPage->pNext;
+
+	if (pPage->pNext)
+		pPage->pNext->pPrevious = pPage->pPrevious;
+
+	pPage->pNext     = nullptr;
+	pPage->pPrevious = nullptr;
 }
 
 void CZoneAllocator::Clear()
 {
-	TBlock* pFirstBlock = static_cast<TBlock*>(m_pHeap);
+	m_nBytesInUse = 0;
+	for (TTagStats& TagStats : m_TagStats)
+		TagStats.nBytesInUse = 0;
+
+	// Return all small allocation pages to the pool
+	m_pFreeSlabPages = nullptr;
+	for (size_t i = 0; i < SlabClassCount; ++i)
+		m_pPartialSlabPages[i] = nullptr;
+
+	for (size_t i = m_nSlabPageCount; i-- > 0;)
+	{
+		TSlabPage* pPage = &m_SlabPages[i];
+		pPage->pFreeList = nullptr;
+		pPage->pPrevious = nullptr;
+		pPage->pNext     = m_pFreeSlabPages;
+		pPage->nUsed     = 0;
+		m_pFreeSlabPages = pPage;
+	}
+
+	// The zone occupies the rest of the heap after the small allocation arena and its bookkeeping, 16-byte aligned
+	const size_t nSlabSize = (m_nSlabPageCount * (SlabPageSize + sizeof(TSlabPage)) + 0xF) & ~0xF;
+	TBlock* pFirstBlock    = reinterpret_cast<TBlock*>(m_pSlabArena + nSlabSize);
 
 	// The main block is a special block which acts as an end marker for the linked list of blocks
 	m_MainBlock.nSize     = 0;
@@ -391,7 +658,7 @@ void CZoneAllocator::Clear()
 	memset(m_MainBlock.Padding, 0xEB, Utility::ArraySize(m_MainBlock.Padding));
 #endif
 
-	pFirstBlock->nSize     = m_nHeapSize;
+	pFirstBlock->nSize     = m_nHeapSize - nSlabSize;
 	pFirstBlock->pNext     = &m_MainBlock;
 	pFirstBlock->pPrevious = &m_MainBlock;
 	pFirstBlock->Tag       = TZoneTag::Free;
@@ -422,6 +689,24 @@ void CZoneAllocator::FreeTag(u32 Tag)
 			Free(reinterpret_cast<u8*>(pBlock) + sizeof(TBlock));
 		pBlock = pNextBlock;
 	} while (pBlock != &m_MainBlock);
+
+	for (size_t nPage = 0; nPage < m_nSlabPageCount; ++nPage)
+	{
+		TSlabPage& Page = m_SlabPages[nPage];
+		if (!Page.nUsed)
+			continue;
+
+		u8* pBase                = GetSlabPageBase(&Page);
+		const size_t nObjectSize = GetSlabObjectSize(Page.nClass);
+
+		// Stop early if the page was emptied and returned to the pool
+		for (size_t i = 0; i < Page.nBumpIndex && Page.nUsed; ++i)
+		{
+			TSlabObject* pObject = reinterpret_cast<TSlabObject*>(pBase + i * nObjectSize);
+			if (pObject->Tag == Tag)
+				Free(pObject + 1);
+		}
+	}
 }
 
 void CZoneAllocator::Dump() const
@@ -444,4 +729,80 @@ void CZoneAllocator::Dump() const
 		LOGNOTE("\tMagic: %s", bMagicOK ? "OK" : "BAD");
 		pBlock = pBlock->pNext;
 	} while (pBlock != &m_MainBlock);
+
+	size_t nFreePages = 0;
+	for (const TSlabPage* pPage = m_pFreeSlabPages; pPage; pPage = pPage->pNext)
+		++nFreePages;
+
+	LOGNOTE("Small allocation arena: %d/%d pages free", nFreePages, m_nSlabPageCount);
+
+	for (u8 nClass = 0; nClass < SlabClassCount; ++nClass)
+	{
+		size_t nPages = 0, nObjects = 0;
+		for (size_t nPage = 0; nPage < m_nSlabPageCount; ++nPage)
+		{
+			const TSlabPage& Page = m_SlabPages[nPage];
+			if (Page.nUsed && Page.nClass == nClass)
+			{
+				++nPages;
+				nObjects += Page.nUsed;
+			}
+		}
+
+		if (nPages)
+			LOGNOTE("\tSize class %3d: %d objects in %d pages", SlabClassSizes[nClass], nObjects, nPages);
+	}
+}
+
+void CZoneAllocator::GetStats(TStats& Stats) const
+{
+	Stats.nHeapSize   = m_nHeapSize;
+	Stats.nBytesInUse = m_nBytesInUse;
+	Stats.nPeakBytes  = m_nPeakBytes;
+	memcpy(Stats.Tags, m_TagStats, sizeof(m_TagStats));
+	memcpy(Stats.Histogram, m_Histogram, sizeof(m_Histogram));
+
+	// The free list isn't kept sorted, so finding the largest free block needs a walk of the zone
+	size_t nZoneFree         = 0;
+	Stats.nLargestFreeBlock = 0;
+
+	const TBlock* pBlock = m_MainBlock.pNext;
+	do
+	{
+		if (pBlock->Tag == TZoneTag::Free)
+		{
+			nZoneFree += pBlock->nSize;
+			Stats.nLargestFreeBlock = Utility::Max(Stats.nLargestFreeBlock, pBlock->nSize);
+		}
+		pBlock = pBlock->pNext;
+	} while (pBlock != &m_MainBlock);
+
+	Stats.nBytesFree     = m_nHeapSize - m_nBytesInUse;
+	Stats.nFragmentation = nZoneFree ? 100 - static_cast<u64>(Stats.nLargestFreeBlock) * 100 / nZoneFree : 0;
+}
+
+void CZoneAllocator::DumpStats() const
+{
+	static const char* const TagNames[TagCount] = {"Free", "Uncategorized", "FluidSynth", "SMF player"};
+
+	TStats Stats;
+	GetStats(Stats);
+
+	LOGNOTE("Heap: %d/%d KB in use, peak %d KB", Stats.nBytesInUse / KILOBYTE, Stats.nHeapSize / KILOBYTE, Stats.nPeakBytes / KILOBYTE);
+	LOGNOTE("Largest free block: %d KB, fragmentation: %d%%", Stats.nLargestFreeBlock / KILOBYTE, Stats.nFragmentation);
+
+	for (size_t i = TZoneTag::Uncategorized; i < TagCount; ++i)
+	{
+		const TTagStats& TagStats = Stats.Tags[i];
+		LOGNOTE("\t%-13s: %d KB in use, peak %d KB, %d allocs, %d frees", TagNames[i], TagStats.nBytesInUse / KILOBYTE, TagStats.nPeakBytes / KILOBYTE, TagStats.nAllocs, TagStats.nFrees);
+	}
+
+	for (size_t i = 0; i < HistogramBuckets - 1; ++i)
+	{
+		if (Stats.Histogram[i])
+			LOGNOTE("\tUp to %7d bytes: %d allocs", 16 << i, Stats.Histogram[i]);
+	}
+
+	if (Stats.Histogram[HistogramBuckets - 1])
+		LOGNOTE("\tOver  %7d bytes: %d allocs", 16 << (HistogramBuckets - 2), Stats.Histogram[HistogramBuckets - 1]);
 }